@@ -0,0 +1,125 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include "engine/rdma/endpoint_info.h"
+#include "engine/rdma/rdma_config.h"
+#include "engine/rdma/rdma_context.h"
+#include "engine/rdma/verbs_provider.h"
+#include "utils/json.hpp"
+#include "utils/logging.h"
+
+using json = nlohmann::json;
+using namespace slime;
+
+DEFINE_string(verbs_provider, "", "ibverbs or mock, default from SLIME_VERBS_PROVIDER");
+
+DEFINE_string(device_name, "", "device name, the first available device by default");
+DEFINE_uint32(ib_port, 1, "device name");
+DEFINE_string(link_type, "RoCE", "IB or RoCE");
+
+DEFINE_uint64(qp_num, 8, "QPs of the endpoint");
+DEFINE_uint64(mr_num, 10000, "MRs of the endpoint");
+DEFINE_uint64(mr_size, 4096, "size of every MR, all carved out of one buffer");
+DEFINE_uint64(iterations, 100, "repetitions of every step");
+
+double time_us(const std::function<void()>& step)
+{
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < FLAGS_iterations; ++i)
+        step();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::micro>(end - start).count() / FLAGS_iterations;
+}
+
+void report(const std::string& step, double json_us, double binary_us)
+{
+    std::cout << step << ": json " << json_us << " us, binary " << binary_us << " us, " << json_us / binary_us
+              << "x" << std::endl;
+}
+
+/*
+  Connection setup cost of one endpoint with mr_num MRs, JSON versus binary endpoint info:
+  building it on the sender, reading every field back on the receiver, and registering the
+  remote MRs from it. QPs are never connected, so any device (or the mock) will do.
+*/
+int main(int argc, char** argv)
+{
+    gflags::ParseCommandLineFlags(&argc, &argv, false);
+    if (FLAGS_verbs_provider == "mock")
+        set_default_verbs_provider(mock_verbs_provider());
+    else if (FLAGS_verbs_provider == "ibverbs")
+        set_default_verbs_provider(ibverbs_provider());
+
+    std::string dev_name = FLAGS_device_name;
+    if (dev_name.empty()) {
+        std::vector<std::string> dev_names = default_verbs_provider()->device_names();
+        SLIME_ASSERT(!dev_names.empty(), "no RDMA device");
+        dev_name = dev_names[0];
+    }
+
+    RDMAContextConfig config;
+    config.qp_num = FLAGS_qp_num;
+
+    RDMAContext sender, receiver;
+    SLIME_ASSERT(sender.init(dev_name, FLAGS_ib_port, FLAGS_link_type, config) == 0, "init " << dev_name);
+    SLIME_ASSERT(receiver.init(dev_name, FLAGS_ib_port, FLAGS_link_type, config) == 0, "init " << dev_name);
+
+    // One buffer registered once, the keys are slices of it served by the registration cache
+    char* buffer = (char*)malloc(FLAGS_mr_num * FLAGS_mr_size);
+    memset(buffer, 0, FLAGS_mr_num * FLAGS_mr_size);
+    for (uint64_t i = 0; i < FLAGS_mr_num; ++i)
+        sender.register_memory_region(
+            "kv_cache_layer_block_" + std::to_string(i), (uintptr_t)buffer + i * FLAGS_mr_size, FLAGS_mr_size);
+
+    std::string json_info, binary_info;
+    double      json_build_us   = time_us([&]() { json_info = sender.endpoint_info().dump(); });
+    double      binary_build_us = time_us([&]() { binary_info = sender.endpoint_info_binary(); });
+
+    // Every field is read back, as connect does
+    uint64_t checksum        = 0;
+    double   json_read_us    = time_us([&]() {
+        json info = json::parse(json_info);
+        for (const json& rdma_info : info["rdma_info"])
+            checksum += rdma_info_t(rdma_info).qpn;
+        for (auto& item : info["mr_info"].items())
+            checksum += item.key().size() + item.value()["addr"].get<uintptr_t>()
+                        + item.value()["length"].get<size_t>() + item.value()["rkey"].get<uint32_t>();
+    });
+    double   binary_read_us  = time_us([&]() {
+        EndpointInfoView info(binary_info.data(), binary_info.size());
+        for (uint32_t qpi = 0; qpi < info.qp_num(); ++qpi)
+            checksum += info.rdma_info(qpi).qpn;
+        for (uint32_t i = 0; i < info.mr_num(); ++i) {
+            remote_mr_t remote_mr = info.mr(i);
+            checksum += info.mr_key(i).size() + remote_mr.addr + remote_mr.length + remote_mr.rkey;
+        }
+    });
+
+    double json_register_us = time_us([&]() {
+        json info = json::parse(json_info);
+        for (auto& item : info["mr_info"].items())
+            receiver.register_remote_memory_region(item.key(), item.value());
+    });
+    double binary_register_us = time_us([&]() {
+        receiver.register_remote_memory_regions(EndpointInfoView(binary_info.data(), binary_info.size()));
+    });
+
+    std::cout << "Device: " << dev_name << ", QPs: " << FLAGS_qp_num << ", MRs: " << FLAGS_mr_num
+              << ", checksum: " << checksum << std::endl;
+    std::cout << "size: json " << json_info.size() << " bytes, binary " << binary_info.size() << " bytes"
+              << std::endl;
+    report("build", json_build_us, binary_build_us);
+    report("read", json_read_us, binary_read_us);
+    report("register remote MRs", json_register_us, binary_register_us);
+
+    free(buffer);
+    return 0;
+}
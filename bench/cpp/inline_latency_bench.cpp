@@ -0,0 +1,193 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <gflags/gflags.h>
+
+#include "engine/assignment.h"
+#include "engine/rdma/rdma_assignment.h"
+#include "engine/rdma/rdma_config.h"
+#include "engine/rdma/rdma_context.h"
+#include "engine/rdma/verbs_provider.h"
+#include "utils/logging.h"
+
+using namespace slime;
+
+DEFINE_string(verbs_provider, "", "ibverbs or mock, default from SLIME_VERBS_PROVIDER");
+
+DEFINE_string(device_name, "", "device name, the first available device by default");
+DEFINE_uint32(ib_port, 1, "device name");
+DEFINE_string(link_type, "RoCE", "IB or RoCE");
+
+DEFINE_string(opcode, "write", "write or send");
+DEFINE_string(sizes, "8,32,64,128,256,512,1024", "comma separated message sizes (bytes)");
+DEFINE_uint64(iterations, 10000, "messages per size and mode");
+DEFINE_uint64(warmup, 1000, "messages per size and mode before measuring");
+DEFINE_int32(max_inline_data, 256, "inline data requested at QP creation");
+
+DEFINE_string(completion_mode, "busy_poll", "event, busy_poll or hybrid");
+DEFINE_uint64(poll_spin_us, 50, "hybrid mode: spin time before arming the CQ (us)");
+
+typedef struct latency {
+    double avg_us{0};
+    double p50_us{0};
+    double p99_us{0};
+} latency_t;
+
+/* Two contexts on the same device connected to each other, one message in flight at a time */
+typedef struct loopback {
+    RDMAContext sender;
+    RDMAContext receiver;
+    char*       send_buffer{nullptr};
+    char*       recv_buffer{nullptr};
+} loopback_t;
+
+void init_loopback(loopback_t& loopback, const std::string& dev_name, int max_inline_data, uint64_t buffer_size)
+{
+    RDMAContextConfig config;
+    config.qp_num          = 1;
+    config.max_inline_data = max_inline_data;
+    SLIME_ASSERT(loopback.sender.init(dev_name, FLAGS_ib_port, FLAGS_link_type, config) == 0, "init " << dev_name);
+    SLIME_ASSERT(loopback.receiver.init(dev_name, FLAGS_ib_port, FLAGS_link_type, config) == 0, "init " << dev_name);
+
+    loopback.send_buffer = (char*)malloc(buffer_size);
+    loopback.recv_buffer = (char*)malloc(buffer_size);
+    memset(loopback.send_buffer, 1, buffer_size);
+    memset(loopback.recv_buffer, 0, buffer_size);
+    loopback.sender.register_memory_region("buffer", (uintptr_t)loopback.send_buffer, buffer_size);
+    loopback.receiver.register_memory_region("buffer", (uintptr_t)loopback.recv_buffer, buffer_size);
+
+    loopback.sender.connect(loopback.receiver.endpoint_info());
+    loopback.receiver.connect(loopback.sender.endpoint_info());
+    for (RDMAContext* context : {&loopback.sender, &loopback.receiver}) {
+        if (FLAGS_completion_mode == "busy_poll")
+            context->set_completion_mode(CompletionMode::BUSY_POLL);
+        else if (FLAGS_completion_mode == "hybrid")
+            context->set_completion_mode(CompletionMode::HYBRID, FLAGS_poll_spin_us);
+        else
+            SLIME_ASSERT(FLAGS_completion_mode == "event", "unknown completion mode " << FLAGS_completion_mode);
+    }
+    loopback.sender.launch_future();
+    loopback.receiver.launch_future();
+}
+
+void stop_loopback(loopback_t& loopback)
+{
+    loopback.sender.stop_future();
+    loopback.receiver.stop_future();
+    free(loopback.send_buffer);
+    free(loopback.recv_buffer);
+}
+
+/* Submit to completion of one message on the sender, a SEND waits for its RECV as well */
+template<typename SubmitFn>
+latency_t measure(loopback_t& loopback, OpCode opcode, uint64_t size, SubmitFn&& submit)
+{
+    std::vector<double> samples;
+    samples.reserve(FLAGS_iterations);
+    for (uint64_t i = 0; i < FLAGS_warmup + FLAGS_iterations; ++i) {
+        RDMAAssignmentSharedPtr recv;
+        if (opcode == OpCode::SEND) {
+            AssignmentBatch batch{Assignment("buffer", 0, 0, size)};
+            recv = loopback.receiver.submit(OpCode::RECV, batch);
+        }
+        auto                    start = std::chrono::steady_clock::now();
+        RDMAAssignmentSharedPtr send  = submit();
+        send->wait();
+        auto end = std::chrono::steady_clock::now();
+        if (recv)
+            recv->wait();
+        if (i >= FLAGS_warmup)
+            samples.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+    }
+    std::sort(samples.begin(), samples.end());
+
+    latency_t result;
+    for (double sample : samples)
+        result.avg_us += sample;
+    result.avg_us /= samples.size();
+    result.p50_us = samples[samples.size() / 2];
+    result.p99_us = samples[samples.size() * 99 / 100];
+    return result;
+}
+
+std::string format(const latency_t& latency)
+{
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(2) << latency.avg_us << " / " << latency.p50_us << " / " << latency.p99_us;
+    return out.str();
+}
+
+/*
+  Small-message latency of SEND or WRITE, submit to completion, over three paths:
+    registered:   from a registered buffer with inline sends disabled, the NIC DMA-reads it.
+    inline:       the same buffer, posted inline by the context as it fits max_inline_data.
+    unregistered: submit_inline straight from memory that was never registered.
+  Sizes above the granted max_inline_data only run the registered paths.
+*/
+int main(int argc, char** argv)
+{
+    gflags::ParseCommandLineFlags(&argc, &argv, false);
+    if (FLAGS_verbs_provider == "mock")
+        set_default_verbs_provider(mock_verbs_provider());
+    else if (FLAGS_verbs_provider == "ibverbs")
+        set_default_verbs_provider(ibverbs_provider());
+
+    std::string dev_name = FLAGS_device_name;
+    if (dev_name.empty()) {
+        std::vector<std::string> dev_names = default_verbs_provider()->device_names();
+        SLIME_ASSERT(!dev_names.empty(), "no RDMA device");
+        dev_name = dev_names[0];
+    }
+
+    SLIME_ASSERT(FLAGS_opcode == "write" || FLAGS_opcode == "send", "unknown opcode " << FLAGS_opcode);
+    OpCode opcode = FLAGS_opcode == "write" ? OpCode::WRITE : OpCode::SEND;
+
+    std::vector<uint64_t> sizes;
+    std::stringstream     sizes_flag(FLAGS_sizes);
+    for (std::string size; std::getline(sizes_flag, size, ',');)
+        sizes.push_back(std::stoull(size));
+    uint64_t max_size = *std::max_element(sizes.begin(), sizes.end());
+
+    loopback_t registered, with_inline;
+    init_loopback(registered, dev_name, 0, max_size);
+    init_loopback(with_inline, dev_name, FLAGS_max_inline_data, max_size);
+    uint64_t max_inline_data = with_inline.sender.max_inline_data();
+
+    // Caller memory that is never registered
+    std::vector<char> payload(max_size, 1);
+
+    std::cout << "Device: " << dev_name << ", opcode: " << FLAGS_opcode << ", max_inline_data: " << max_inline_data
+              << ", latency avg / p50 / p99 (us)" << std::endl;
+    for (uint64_t size : sizes) {
+        auto submit_registered = [&](loopback_t& loopback) {
+            return [&loopback, opcode, size]() {
+                AssignmentBatch batch{Assignment("buffer", 0, 0, size)};
+                return loopback.sender.submit(opcode, batch);
+            };
+        };
+        latency_t registered_latency = measure(registered, opcode, size, submit_registered(registered));
+        latency_t inline_latency     = measure(with_inline, opcode, size, submit_registered(with_inline));
+
+        std::cout << std::setw(8) << size << " B  registered " << format(registered_latency) << "  inline "
+                  << format(inline_latency);
+        if (size > 0 && size <= max_inline_data) {
+            latency_t unregistered_latency = measure(with_inline, opcode, size, [&]() {
+                return with_inline.sender.submit_inline(opcode, payload.data(), size, "buffer");
+            });
+            std::cout << "  unregistered " << format(unregistered_latency);
+        }
+        std::cout << std::endl;
+    }
+
+    stop_loopback(registered);
+    stop_loopback(with_inline);
+    return 0;
+}
@@ -1,4 +1,6 @@
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <condition_variable>
@@ -13,6 +15,8 @@
 #include <thread>
 #include <unistd.h>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 #include <gflags/gflags.h>
 #include <zmq.h>
@@ -23,6 +27,7 @@
 #include "engine/rdma/rdma_config.h"
 #include "engine/rdma/rdma_context.h"
 #include "engine/rdma/rdma_scheduler.h"
+#include "engine/rdma/verbs_provider.h"
 #include "utils/json.hpp"
 #include "utils/logging.h"
 #include "utils/utils.h"
@@ -30,7 +35,8 @@
 using json = nlohmann::json;
 using namespace slime;
 
-DEFINE_string(mode, "", "initiator or target");
+DEFINE_string(mode, "", "initiator, target or loopback");
+DEFINE_string(verbs_provider, "", "ibverbs or mock, default from SLIME_VERBS_PROVIDER");
 
 DEFINE_string(device_name, "", "device name");
 DEFINE_uint32(ib_port, 1, "device name");
@@ -45,6 +51,14 @@ DEFINE_uint64(block_size, 204800, "block size");
 DEFINE_uint64(batch_size, 160, "batch size");
 
 DEFINE_uint64(concurrent_num, 20, "max concurrent rdma scheduler assignment");
+DEFINE_uint32(submit_thread, 1, "threads submitting the concurrent assignments");
+
+DEFINE_uint64(coalesce_bytes, 0, "merge contiguous blocks into WRs up to this size, 0 to disable");
+DEFINE_uint64(split_bytes, 8ull << 20, "stripe batches larger than this across all devices");
+DEFINE_string(selection_policy, "round_robin", "round_robin, least_outstanding, power_of_two or sticky");
+
+DEFINE_bool(parallel_registration, true, "register the buffer on all devices concurrently");
+DEFINE_uint64(registration_chunk_bytes, 0, "fault the buffer in by chunks of this size before registering, 0 to skip");
 
 DEFINE_uint64(duration, 10, "duration (s)");
 
@@ -162,87 +176,45 @@ bool checkInitiatorCopied(void* data)
     return true;
 }
 
-int target()
+std::vector<std::string> bench_devices()
 {
-
-    init_tcp(FLAGS_initiator_endpoint, FLAGS_target_endpoint);
-
-    std::vector<std::string> nic_devices;
     if (FLAGS_device_name.empty())
-        nic_devices = available_nic();
-    else
-        nic_devices = split_device_name(',');
+        return default_verbs_provider()->device_names();
+    return split_device_name(',');
+}
 
-    size_t ndevices = nic_devices.size();
+size_t bench_sockets(size_t ndevices)
+{
     size_t nsockets = FLAGS_numa_affinity ? NR_SOCKETS : 1;
-    nsockets        = ndevices > nsockets ? nsockets : ndevices;
-
-    size_t nsplit = ndevices / nsockets;
-
-    std::vector<void*> data(nsockets, nullptr);
-    for (int socket_id = 0; socket_id < nsockets; ++socket_id) {
-        data[socket_id] = memory_allocate_target(socket_id);
-    }
-    size_t         nschedulers = nsockets * FLAGS_num_thread;
-    RDMAScheduler* rdma_schs[nschedulers];
-
-    int sch_device_begin_id = 0;
-
-    for (int socket_id = 0; socket_id < nsockets; ++socket_id) {
-        std::vector<std::string> sch_devices =
-            std::vector<std::string>(nic_devices.begin() + sch_device_begin_id,
-                                     nic_devices.begin() + std::min(sch_device_begin_id + nsplit, ndevices));
-        sch_device_begin_id += nsplit;
-
-        for (int qpi = 0; qpi < FLAGS_num_thread; qpi++) {
-            RDMAScheduler* rdma_sch = new RDMAScheduler(sch_devices);
-            rdma_sch->register_memory_region(
-                "buffer_" + std::to_string(socket_id), (uintptr_t)data[socket_id], FLAGS_buffer_size);
-            std::cout << "Target registered MR: "
-                      << "buffer_" << socket_id << std::endl;
-
-            rdma_schs[socket_id * FLAGS_num_thread + qpi] = rdma_sch;
-        }
-    }
-    for (int sch_id = 0; sch_id < nschedulers; ++sch_id) {
-        init_connection(rdma_schs[sch_id], FLAGS_initiator_endpoint, FLAGS_target_endpoint);
-        std::cout << "Target connected remote" << std::endl;
-    }
-
-    waitRemoteTeriminate();
-
-    for (int sch_id = 0; sch_id < nschedulers; ++sch_id)
-        delete rdma_schs[sch_id];
-
-    return 0;
+    return ndevices > nsockets ? nsockets : ndevices;
 }
 
-int initiator()
+/* FLAGS_num_thread schedulers per socket, each over the devices assigned to that socket */
+SelectionPolicy parse_selection_policy(const std::string& name)
 {
-    init_tcp(FLAGS_target_endpoint, FLAGS_initiator_endpoint);
-
-    std::vector<std::string> nic_devices;
-    if (FLAGS_device_name.empty())
-        nic_devices = available_nic();
-    else
-        nic_devices = split_device_name(',');
+    if (name == "least_outstanding")
+        return SelectionPolicy::LEAST_OUTSTANDING;
+    if (name == "power_of_two")
+        return SelectionPolicy::POWER_OF_TWO;
+    if (name == "sticky")
+        return SelectionPolicy::STICKY;
+    SLIME_ASSERT(name == "round_robin", "unknown selection policy ", name);
+    return SelectionPolicy::ROUND_ROBIN;
+}
 
+std::vector<RDMAScheduler*> create_schedulers(const std::vector<std::string>& nic_devices,
+                                              const std::vector<void*>&       data,
+                                              const std::string&              role)
+{
     size_t ndevices = nic_devices.size();
-    size_t nsockets = FLAGS_numa_affinity ? NR_SOCKETS : 1;
-    nsockets        = ndevices > nsockets ? nsockets : ndevices;
+    size_t nsockets = data.size();
+    size_t nsplit   = ndevices / nsockets;
 
-    std::vector<void*> data(nsockets, nullptr);
-    for (int socket_id = 0; socket_id < nsockets; ++socket_id) {
-        data[socket_id] = memory_allocate_initiator(socket_id);
-    }
-    size_t nsplit      = ndevices / nsockets;
-    size_t nschedulers = nsockets * FLAGS_num_thread;
-
-    RDMAScheduler* rdma_schs[nschedulers];
+    std::vector<RDMAScheduler*> rdma_schs;
 
     int sch_device_begin_id = 0;
 
-    for (int socket_id = 0; socket_id < nsockets; ++socket_id) {
+    for (size_t socket_id = 0; socket_id < nsockets; ++socket_id) {
         std::vector<std::string> sch_devices =
             std::vector<std::string>(nic_devices.begin() + sch_device_begin_id,
                                      nic_devices.begin() + std::min(sch_device_begin_id + nsplit, ndevices));
@@ -250,29 +222,41 @@ int initiator()
 
         for (int qpi = 0; qpi < FLAGS_num_thread; ++qpi) {
             RDMAScheduler* rdma_sch = new RDMAScheduler(sch_devices);
+            rdma_sch->set_max_coalesce_bytes(FLAGS_coalesce_bytes);
+            rdma_sch->set_split_assignment_bytes(FLAGS_split_bytes);
+            rdma_sch->set_selection_policy(parse_selection_policy(FLAGS_selection_policy));
+            rdma_sch->set_parallel_registration(FLAGS_parallel_registration);
+            rdma_sch->set_registration_chunk_bytes(FLAGS_registration_chunk_bytes);
             rdma_sch->register_memory_region(
                 "buffer_" + std::to_string(socket_id), (uintptr_t)data[socket_id], FLAGS_buffer_size);
-            std::cout << "Initiator registered MR: "
-                      << "buffer_" << socket_id << std::endl;
-            rdma_schs[socket_id * FLAGS_num_thread + qpi] = rdma_sch;
+            std::cout << role << " registered MR: "
+                      << "buffer_" << socket_id << ", " << rdma_sch->registration_stats().dump() << std::endl;
+            rdma_schs.push_back(rdma_sch);
         }
     }
+    return rdma_schs;
+}
 
-    for (int rdma_sch_id = 0; rdma_sch_id < nschedulers; ++rdma_sch_id) {
-        init_connection(rdma_schs[rdma_sch_id], FLAGS_target_endpoint, FLAGS_initiator_endpoint);
-        std::cout << "Initiator connected remote" << std::endl;
-    }
-
-    uint64_t total_bytes = 0;
-    uint64_t total_trips = 0;
-    size_t   step        = 0;
-    auto     start_time  = std::chrono::steady_clock::now();
-    auto     deadline    = start_time + std::chrono::seconds(FLAGS_duration);
-
-    while (std::chrono::steady_clock::now() < deadline) {
-        RDMASchedulerAssignmentSharedPtrBatch rdma_scheduler_assignment_batch;
-        for (int concurrent_id = 0; concurrent_id < FLAGS_concurrent_num; ++concurrent_id) {
-            for (int socket_id = 0; socket_id < nsockets; ++socket_id) {
+void run_initiator(std::vector<RDMAScheduler*>& rdma_schs, size_t nsockets)
+{
+    uint64_t              total_bytes = 0;
+    uint64_t              total_trips = 0;
+    std::atomic<uint64_t> submit_ns{0};
+    size_t                step       = 0;
+    auto                  start_time = std::chrono::steady_clock::now();
+    auto                  deadline   = start_time + std::chrono::seconds(FLAGS_duration);
+
+    uint32_t submit_thread = std::max<uint32_t>(FLAGS_submit_thread, 1);
+
+    using clock   = std::chrono::steady_clock;
+    using pending = std::vector<std::pair<RDMASchedulerAssignmentSharedPtr, clock::time_point>>;
+    std::vector<double> latency_us;
+
+    // Each submitter takes every submit_thread-th concurrent slot, all of them share the schedulers
+    auto submitter = [&](uint32_t tid, pending& submitted) {
+        auto submit_start = std::chrono::steady_clock::now();
+        for (int concurrent_id = tid; concurrent_id < FLAGS_concurrent_num; concurrent_id += submit_thread) {
+            for (size_t socket_id = 0; socket_id < nsockets; ++socket_id) {
                 for (int qpi = 0; qpi < FLAGS_num_thread; ++qpi) {
                     AssignmentBatch batch{};
                     for (int batch_id = 0; batch_id < FLAGS_batch_size; ++batch_id) {
@@ -282,16 +266,48 @@ int initiator()
                                                        FLAGS_block_size);
                         batch.emplace_back(assign);
                     }
+                    auto                             submit_time = clock::now();
                     RDMASchedulerAssignmentSharedPtr sch_assignment =
                         rdma_schs[socket_id * FLAGS_num_thread + qpi]->submitAssignment(OpCode::READ, batch);
-                    rdma_scheduler_assignment_batch.emplace_back(sch_assignment);
-                    total_bytes += FLAGS_batch_size * FLAGS_block_size;
-                    total_trips += 1;
+                    submitted.emplace_back(sch_assignment, submit_time);
                 }
             }
         }
-        for (RDMASchedulerAssignmentSharedPtr sch_assignment : rdma_scheduler_assignment_batch) {
-            sch_assignment->wait();
+        submit_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()
+                                                                         - submit_start)
+                         .count();
+    };
+
+    while (std::chrono::steady_clock::now() < deadline) {
+        std::vector<pending>     submitted(submit_thread);
+        std::vector<std::thread> submitters;
+        for (uint32_t tid = 1; tid < submit_thread; ++tid)
+            submitters.emplace_back(submitter, tid, std::ref(submitted[tid]));
+        submitter(0, submitted[0]);
+        for (std::thread& t : submitters)
+            t.join();
+
+        // Reap in completion order, so an assignment is not charged for a slower one ahead of it
+        pending inflight;
+        for (pending& thread_submitted : submitted)
+            inflight.insert(inflight.end(), thread_submitted.begin(), thread_submitted.end());
+        while (!inflight.empty()) {
+            bool reaped = false;
+            for (size_t i = 0; i < inflight.size();) {
+                if (!inflight[i].first->query()) {
+                    ++i;
+                    continue;
+                }
+                auto latency = clock::now() - inflight[i].second;
+                latency_us.push_back(std::chrono::duration<double, std::micro>(latency).count());
+                total_bytes += FLAGS_batch_size * FLAGS_block_size;
+                total_trips += 1;
+                inflight[i] = std::move(inflight.back());
+                inflight.pop_back();
+                reaped = true;
+            }
+            if (!reaped)
+                std::this_thread::yield();
         }
     }
 
@@ -307,15 +323,113 @@ int initiator()
     std::cout << "Duration          : " << duration << " seconds" << std::endl;
     std::cout << "Average Latency   : " << duration / total_trips * 1000 << " ms/trip" << std::endl;
     std::cout << "Throughput        : " << throughput << " MiB/s" << std::endl;
+    if (!latency_us.empty()) {
+        std::sort(latency_us.begin(), latency_us.end());
+        auto percentile = [&](double p) {
+            return latency_us[std::min<size_t>(latency_us.size() * p, latency_us.size() - 1)];
+        };
+        std::cout << "Latency p50/p99   : " << percentile(0.5) << " / " << percentile(0.99) << " us (max "
+                  << latency_us.back() << " us)" << std::endl;
+    }
+    // Submissions per second of submitter time, summed over the submitting threads
+    std::cout << "Submit rate       : " << total_trips / (submit_ns / 1e9 / submit_thread) << " assignments/s"
+              << std::endl;
+}
+
+int target()
+{
+
+    init_tcp(FLAGS_initiator_endpoint, FLAGS_target_endpoint);
+
+    std::vector<std::string> nic_devices = bench_devices();
+    size_t                   nsockets    = bench_sockets(nic_devices.size());
+
+    std::vector<void*> data(nsockets, nullptr);
+    for (size_t socket_id = 0; socket_id < nsockets; ++socket_id) {
+        data[socket_id] = memory_allocate_target(socket_id);
+    }
+
+    std::vector<RDMAScheduler*> rdma_schs = create_schedulers(nic_devices, data, "Target");
+
+    for (RDMAScheduler* rdma_sch : rdma_schs) {
+        init_connection(rdma_sch, FLAGS_initiator_endpoint, FLAGS_target_endpoint);
+        std::cout << "Target connected remote" << std::endl;
+    }
+
+    waitRemoteTeriminate();
+
+    for (RDMAScheduler* rdma_sch : rdma_schs)
+        delete rdma_sch;
+
+    return 0;
+}
+
+int initiator()
+{
+    init_tcp(FLAGS_target_endpoint, FLAGS_initiator_endpoint);
+
+    std::vector<std::string> nic_devices = bench_devices();
+    size_t                   nsockets    = bench_sockets(nic_devices.size());
+
+    std::vector<void*> data(nsockets, nullptr);
+    for (size_t socket_id = 0; socket_id < nsockets; ++socket_id) {
+        data[socket_id] = memory_allocate_initiator(socket_id);
+    }
+
+    std::vector<RDMAScheduler*> rdma_schs = create_schedulers(nic_devices, data, "Initiator");
+
+    for (RDMAScheduler* rdma_sch : rdma_schs) {
+        init_connection(rdma_sch, FLAGS_target_endpoint, FLAGS_initiator_endpoint);
+        std::cout << "Initiator connected remote" << std::endl;
+    }
+
+    run_initiator(rdma_schs, nsockets);
 
     teriminate();
 
-    for (int sch_id = 0; sch_id < nschedulers; ++sch_id) {
+    for (size_t sch_id = 0; sch_id < rdma_schs.size(); ++sch_id) {
         SLIME_ASSERT(checkInitiatorCopied(data[sch_id / FLAGS_num_thread]), "Transferred data not equal!");
     }
 
-    for (int sch_id = 0; sch_id < nschedulers; ++sch_id)
-        delete rdma_schs[sch_id];
+    for (RDMAScheduler* rdma_sch : rdma_schs)
+        delete rdma_sch;
+
+    return 0;
+}
+
+int loopback()
+{
+    // Initiator and target schedulers live in this process and exchange scheduler info directly
+    std::vector<std::string> nic_devices = bench_devices();
+    size_t                   nsockets    = bench_sockets(nic_devices.size());
+
+    std::vector<void*> target_data(nsockets, nullptr);
+    std::vector<void*> initiator_data(nsockets, nullptr);
+    for (size_t socket_id = 0; socket_id < nsockets; ++socket_id) {
+        target_data[socket_id]    = memory_allocate_target(socket_id);
+        initiator_data[socket_id] = memory_allocate_initiator(socket_id);
+    }
+
+    std::vector<RDMAScheduler*> target_schs    = create_schedulers(nic_devices, target_data, "Target");
+    std::vector<RDMAScheduler*> initiator_schs = create_schedulers(nic_devices, initiator_data, "Initiator");
+
+    for (size_t sch_id = 0; sch_id < initiator_schs.size(); ++sch_id) {
+        json target_info    = target_schs[sch_id]->scheduler_info();
+        json initiator_info = initiator_schs[sch_id]->scheduler_info();
+        target_schs[sch_id]->connect(initiator_info);
+        initiator_schs[sch_id]->connect(target_info);
+    }
+
+    run_initiator(initiator_schs, nsockets);
+
+    for (size_t sch_id = 0; sch_id < initiator_schs.size(); ++sch_id) {
+        SLIME_ASSERT(checkInitiatorCopied(initiator_data[sch_id / FLAGS_num_thread]), "Transferred data not equal!");
+    }
+
+    for (RDMAScheduler* rdma_sch : initiator_schs)
+        delete rdma_sch;
+    for (RDMAScheduler* rdma_sch : target_schs)
+        delete rdma_sch;
 
     return 0;
 }
@@ -323,11 +437,19 @@ int initiator()
 int main(int argc, char** argv)
 {
     gflags::ParseCommandLineFlags(&argc, &argv, false);
+    if (FLAGS_verbs_provider == "mock")
+        set_default_verbs_provider(mock_verbs_provider());
+    else if (FLAGS_verbs_provider == "ibverbs")
+        set_default_verbs_provider(ibverbs_provider());
+
     if (FLAGS_mode == "initiator") {
         return initiator();
     }
     else if (FLAGS_mode == "target") {
         return target();
     }
-    SLIME_ABORT("Unsupported mode: must be 'initiator' or 'target'");
+    else if (FLAGS_mode == "loopback") {
+        return loopback();
+    }
+    SLIME_ABORT("Unsupported mode: must be 'initiator', 'target' or 'loopback'");
 }
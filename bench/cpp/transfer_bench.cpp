@@ -2,9 +2,11 @@
 #include "engine/rdma/rdma_assignment.h"
 #include "engine/rdma/rdma_config.h"
 #include "engine/rdma/rdma_context.h"
+#include "engine/rdma/verbs_provider.h"
 #include "utils/json.hpp"
 #include "utils/logging.h"
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <condition_variable>
@@ -12,10 +14,14 @@
 #include <gflags/gflags.h>
 #include <mutex>
 #include <stdexcept>
+#include <sstream>
 #include <string>
 #include <sys/time.h>
+#include <thread>
 #include <unistd.h>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 #include <zmq.h>
 #include <zmq.hpp>
 
@@ -24,7 +30,8 @@
 using json = nlohmann::json;
 using namespace slime;
 
-DEFINE_string(mode, "target", "initiator or target");
+DEFINE_string(mode, "target", "initiator, target or loopback");
+DEFINE_string(verbs_provider, "", "ibverbs or mock, default from SLIME_VERBS_PROVIDER");
 
 DEFINE_string(device_name, "mlx5_bond_0", "device name");
 DEFINE_uint32(ib_port, 1, "device name");
@@ -41,6 +48,26 @@ DEFINE_uint64(duration, 10, "duration (s)");
 
 DEFINE_uint64(concurrent_num, 20, "max concurrent rdma assignment");
 
+DEFINE_uint64(coalesce_bytes, 0, "merge contiguous blocks into WRs up to this size, 0 to disable");
+
+DEFINE_string(completion_mode, "event", "event, busy_poll or hybrid");
+DEFINE_uint64(poll_spin_us, 50, "hybrid mode: spin time before arming the CQ (us)");
+
+DEFINE_int32(qp_num, 4, "QPs per RDMA context");
+DEFINE_int32(max_send_wr, MAX_SEND_WR, "send queue depth per QP");
+DEFINE_int32(max_recv_wr, MAX_RECV_WR, "receive queue depth per QP");
+DEFINE_int32(cq_num, 1, "completion queues, each with its own poller");
+DEFINE_int32(cq_size, 0, "entries per CQ, 0 to size for the QPs it serves");
+DEFINE_int32(callback_threads, 0, "callback executor threads, 0 runs callbacks on the pollers");
+DEFINE_int32(poll_count, POLL_COUNT, "completions reaped per poll");
+
+DEFINE_bool(pin_workers, true, "pin RDMA worker threads to the cores local to the NIC");
+DEFINE_string(worker_cpus, "", "comma separated CPUs for the RDMA worker threads, overrides the NIC local cores");
+
+DEFINE_string(selection_policy, "round_robin", "round_robin, least_outstanding, power_of_two or sticky");
+DEFINE_uint64(large_every, 0, "every Nth assignment is large_factor times the batch, 0 to disable");
+DEFINE_uint64(large_factor, 16, "batch multiplier of the large assignments");
+
 json mr_info;
 
 void* memory_allocate_initiator()
@@ -74,6 +101,153 @@ bool checkInitiatorCopied(void* data)
     return true;
 }
 
+RDMAContextConfig context_config()
+{
+    RDMAContextConfig config;
+    config.qp_num           = FLAGS_qp_num;
+    config.max_send_wr      = FLAGS_max_send_wr;
+    config.max_recv_wr      = FLAGS_max_recv_wr;
+    config.cq_num           = FLAGS_cq_num;
+    config.cq_size          = FLAGS_cq_size;
+    config.callback_threads = FLAGS_callback_threads;
+    config.poll_count       = FLAGS_poll_count;
+    return config;
+}
+
+void apply_worker_placement(RDMAContext& rdma_context)
+{
+    if (!FLAGS_pin_workers) {
+        rdma_context.set_worker_cpus({});
+    }
+    else if (!FLAGS_worker_cpus.empty()) {
+        std::vector<int>   cpus;
+        std::string        cpu;
+        std::istringstream cpu_stream(FLAGS_worker_cpus);
+        while (std::getline(cpu_stream, cpu, ','))
+            cpus.push_back(std::stoi(cpu));
+        rdma_context.set_worker_cpus(cpus);
+    }
+    std::cout << "Worker placement  : NUMA node " << rdma_context.numa_node() << ", "
+              << rdma_context.worker_cpus().size() << " CPUs" << std::endl;
+}
+
+SelectionPolicy parse_selection_policy(const std::string& name)
+{
+    if (name == "least_outstanding")
+        return SelectionPolicy::LEAST_OUTSTANDING;
+    if (name == "power_of_two")
+        return SelectionPolicy::POWER_OF_TWO;
+    if (name == "sticky")
+        return SelectionPolicy::STICKY;
+    SLIME_ASSERT(name == "round_robin", "unknown selection policy ", name);
+    return SelectionPolicy::ROUND_ROBIN;
+}
+
+/* Completion latency of the regular sized assignments, in us */
+void print_latency(std::vector<double>& latency_us)
+{
+    if (latency_us.empty())
+        return;
+    std::sort(latency_us.begin(), latency_us.end());
+    auto percentile = [&](double p) {
+        return latency_us[std::min<size_t>(latency_us.size() * p, latency_us.size() - 1)];
+    };
+    std::cout << "Latency p50/p99   : " << percentile(0.5) << " / " << percentile(0.99) << " us (max "
+              << latency_us.back() << " us)" << std::endl;
+}
+
+void run_transfer(RDMAContext& rdma_context)
+{
+    uint64_t total_bytes = 0;
+    uint64_t total_trips = 0;
+    size_t   step        = 0;
+    auto     start_time  = std::chrono::steady_clock::now();
+    auto     deadline    = start_time + std::chrono::seconds(FLAGS_duration);
+
+    mr_handle_t buffer_handle = rdma_context.get_mr_handle("buffer");
+    rdma_context.set_max_coalesce_bytes(FLAGS_coalesce_bytes);
+
+    if (FLAGS_completion_mode == "busy_poll")
+        rdma_context.set_completion_mode(CompletionMode::BUSY_POLL);
+    else if (FLAGS_completion_mode == "hybrid")
+        rdma_context.set_completion_mode(CompletionMode::HYBRID, FLAGS_poll_spin_us);
+    else
+        SLIME_ASSERT(FLAGS_completion_mode == "event", "unknown completion mode ", FLAGS_completion_mode);
+
+    rdma_context.set_selection_policy(parse_selection_policy(FLAGS_selection_policy));
+
+    using clock = std::chrono::steady_clock;
+    std::vector<double> latency_us;
+
+    while (std::chrono::steady_clock::now() < deadline) {
+
+        std::vector<uintptr_t> target_offsets, source_offsets;
+
+        for (int i = 0; i < FLAGS_batch_size; ++i) {
+            source_offsets.emplace_back(i * FLAGS_block_size);
+            target_offsets.emplace_back(i * FLAGS_block_size);
+        }
+
+        int done = false;
+
+        // (assignment, submit time), large ones carry no timestamp
+        std::vector<std::pair<RDMAAssignmentSharedPtr, clock::time_point>> pending;
+        for (int concurrent_id = 0; concurrent_id < FLAGS_concurrent_num; ++concurrent_id) {
+            bool   large  = FLAGS_large_every > 0 && total_trips % FLAGS_large_every == 0;
+            size_t repeat = large ? FLAGS_large_factor : 1;
+
+            AssignmentBatch batch;
+            for (size_t r = 0; r < repeat; ++r) {
+                for (int i = 0; i < FLAGS_batch_size; ++i) {
+                    batch.push_back(
+                        Assignment(buffer_handle, i * FLAGS_block_size, i * FLAGS_block_size, FLAGS_block_size));
+                }
+            }
+            auto                    submit_time     = large ? clock::time_point() : clock::now();
+            RDMAAssignmentSharedPtr rdma_assignment = rdma_context.submit(OpCode::READ, batch);
+            pending.emplace_back(rdma_assignment, submit_time);
+            total_bytes += repeat * FLAGS_batch_size * FLAGS_block_size;
+            total_trips += 1;
+        }
+
+        // Reap in completion order, so an assignment is not charged for a slower one ahead of it
+        while (!pending.empty()) {
+            bool reaped = false;
+            for (size_t i = 0; i < pending.size();) {
+                if (!pending[i].first->query()) {
+                    ++i;
+                    continue;
+                }
+                if (pending[i].second != clock::time_point()) {
+                    auto latency = clock::now() - pending[i].second;
+                    latency_us.push_back(std::chrono::duration<double, std::micro>(latency).count());
+                }
+                pending[i] = std::move(pending.back());
+                pending.pop_back();
+                reaped = true;
+            }
+            if (!reaped)
+                std::this_thread::yield();
+        }
+    }
+
+    auto   end_time   = std::chrono::steady_clock::now();
+    double duration   = std::chrono::duration<double>(end_time - start_time).count();
+    double throughput = total_bytes / duration / (1 << 20);  // MB/s
+
+    std::cout << "Batch size        : " << FLAGS_batch_size << std::endl;
+    std::cout << "Block size        : " << FLAGS_block_size << std::endl;
+
+    std::cout << "Total trips       : " << total_trips << std::endl;
+    std::cout << "Total transferred : " << total_bytes / (1 << 20) << " MiB" << std::endl;
+    std::cout << "Duration          : " << duration << " seconds" << std::endl;
+    std::cout << "Average Latency   : " << duration / total_trips * 1000 << " ms/trip" << std::endl;
+    std::cout << "Throughput        : " << throughput << " MiB/s" << std::endl;
+    print_latency(latency_us);
+    std::cout << "Completion stats  : " << rdma_context.completion_stats().dump() << std::endl;
+    std::cout << "Flow control stats: " << rdma_context.flow_control_stats().dump() << std::endl;
+}
+
 int connect(RDMAContext& rdma_context, zmq::socket_t& send, zmq::socket_t& recv)
 {
     json local_info = rdma_context.endpoint_info();
@@ -99,7 +273,7 @@ int target(RDMAContext& rdma_context)
     send.connect("tcp://" + FLAGS_initiator_endpoint);
     recv.bind("tcp://" + FLAGS_target_endpoint);
 
-    rdma_context.init(FLAGS_device_name, FLAGS_ib_port, FLAGS_link_type);
+    rdma_context.init(FLAGS_device_name, FLAGS_ib_port, FLAGS_link_type, context_config());
 
     void* data = memory_allocate_target();
     rdma_context.register_memory_region("buffer", (uintptr_t)data, FLAGS_buffer_size);
@@ -123,75 +297,73 @@ int initiator(RDMAContext& rdma_context)
     send.connect("tcp://" + FLAGS_target_endpoint);
     recv.bind("tcp://" + FLAGS_initiator_endpoint);
 
-    rdma_context.init(FLAGS_device_name, FLAGS_ib_port, FLAGS_link_type);
+    rdma_context.init(FLAGS_device_name, FLAGS_ib_port, FLAGS_link_type, context_config());
 
     void* data = memory_allocate_initiator();
     rdma_context.register_memory_region("buffer", (uintptr_t)data, FLAGS_buffer_size);
 
     SLIME_ASSERT_EQ(connect(rdma_context, send, recv), 0, "Connect Error");
 
+    apply_worker_placement(rdma_context);
     rdma_context.launch_future();
 
-    uint64_t total_bytes = 0;
-    uint64_t total_trips = 0;
-    size_t   step        = 0;
-    auto     start_time  = std::chrono::steady_clock::now();
-    auto     deadline    = start_time + std::chrono::seconds(FLAGS_duration);
+    run_transfer(rdma_context);
 
-    while (std::chrono::steady_clock::now() < deadline) {
+    zmq::message_t term_msg("TERMINATE");
+    send.send(term_msg, zmq::send_flags::none);
 
-        std::vector<uintptr_t> target_offsets, source_offsets;
+    rdma_context.stop_future();
 
-        for (int i = 0; i < FLAGS_batch_size; ++i) {
-            source_offsets.emplace_back(i * FLAGS_block_size);
-            target_offsets.emplace_back(i * FLAGS_block_size);
-        }
+    SLIME_ASSERT(checkInitiatorCopied(data), "Transferred data not equal!");
 
-        int done = false;
+    return 0;
+}
 
-        std::vector<RDMAAssignmentSharedPtr> rdma_assignment_batch;
-        for (int concurrent_id = 0; concurrent_id < FLAGS_concurrent_num; ++concurrent_id) {
-            AssignmentBatch batch;
-            for (int i = 0; i < FLAGS_batch_size; ++i) {
-                batch.push_back(Assignment("buffer", i * FLAGS_block_size, i * FLAGS_block_size, FLAGS_block_size));
-            }
-            RDMAAssignmentSharedPtr rdma_assignment = rdma_context.submit(OpCode::READ, batch);
-            rdma_assignment_batch.emplace_back(rdma_assignment);
-            total_bytes += FLAGS_batch_size * FLAGS_block_size;
-            total_trips += 1;
-        }
-        for (RDMAAssignmentSharedPtr& rdma_assignment : rdma_assignment_batch) {
-            rdma_assignment->wait();
-        }
-    }
+int loopback()
+{
+    // Both ends live in this process and exchange endpoint info directly
+    RDMAContext initiator_context;
+    RDMAContext target_context;
 
-    auto   end_time   = std::chrono::steady_clock::now();
-    double duration   = std::chrono::duration<double>(end_time - start_time).count();
-    double throughput = total_bytes / duration / (1 << 20);  // MB/s
+    target_context.init(FLAGS_device_name, FLAGS_ib_port, FLAGS_link_type, context_config());
+    initiator_context.init(FLAGS_device_name, FLAGS_ib_port, FLAGS_link_type, context_config());
 
-    std::cout << "Batch size        : " << FLAGS_batch_size << std::endl;
-    std::cout << "Block size        : " << FLAGS_block_size << std::endl;
+    void* target_data    = memory_allocate_target();
+    void* initiator_data = memory_allocate_initiator();
+    target_context.register_memory_region("buffer", (uintptr_t)target_data, FLAGS_buffer_size);
+    initiator_context.register_memory_region("buffer", (uintptr_t)initiator_data, FLAGS_buffer_size);
 
-    std::cout << "Total trips       : " << total_trips << std::endl;
-    std::cout << "Total transferred : " << total_bytes / (1 << 20) << " MiB" << std::endl;
-    std::cout << "Duration          : " << duration << " seconds" << std::endl;
-    std::cout << "Average Latency   : " << duration / total_trips * 1000 << " ms/trip" << std::endl;
-    std::cout << "Throughput        : " << throughput << " MiB/s" << std::endl;
+    json target_info    = target_context.endpoint_info();
+    json initiator_info = initiator_context.endpoint_info();
+    SLIME_ASSERT_EQ(target_context.connect(initiator_info), 0, "Connect Error");
+    SLIME_ASSERT_EQ(initiator_context.connect(target_info), 0, "Connect Error");
 
-    zmq::message_t term_msg("TERMINATE");
-    send.send(term_msg, zmq::send_flags::none);
+    apply_worker_placement(initiator_context);
+    initiator_context.launch_future();
 
-    rdma_context.stop_future();
+    run_transfer(initiator_context);
 
-    SLIME_ASSERT(checkInitiatorCopied(data), "Transferred data not equal!");
+    initiator_context.stop_future();
 
+    SLIME_ASSERT(checkInitiatorCopied(initiator_data), "Transferred data not equal!");
+
+    free(target_data);
+    free(initiator_data);
     return 0;
 }
 
 int main(int argc, char** argv)
 {
     gflags::ParseCommandLineFlags(&argc, &argv, false);
+    if (FLAGS_verbs_provider == "mock")
+        set_default_verbs_provider(mock_verbs_provider());
+    else if (FLAGS_verbs_provider == "ibverbs")
+        set_default_verbs_provider(ibverbs_provider());
+
     std::cout << "benchmark begin" << std::endl;
+    if (FLAGS_mode == "loopback") {
+        return loopback();
+    }
     RDMAContext context;
     if (FLAGS_mode == "initiator") {
         return initiator(context);
@@ -199,5 +371,5 @@ int main(int argc, char** argv)
     else if (FLAGS_mode == "target") {
         return target(context);
     }
-    SLIME_ABORT("Unsupported mode: must be 'initiator' or 'target'");
+    SLIME_ABORT("Unsupported mode: must be 'initiator', 'target' or 'loopback'");
 }
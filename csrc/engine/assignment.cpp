@@ -1,5 +1,7 @@
+#include <algorithm>
 #include <cstdint>
 #include <functional>
+#include <tuple>
 #include <vector>
 
 #include "utils/logging.h"
@@ -7,13 +9,46 @@
 #include "assignment.h"
 
 namespace slime {
-std::string Assignment::dump()
+std::string Assignment::dump() const
 {
-    return "Assignment (mr_key: " + mr_key + ", target_offset: " + std::to_string(target_offset) + ", source_offset: "
-            + std::to_string(source_offset) + ", length: " + std::to_string(length) + ")";
+    return "Assignment (mr_key: " + mr_key + ", mr_handle: " + std::to_string(mr_handle)
+            + ", target_offset: " + std::to_string(target_offset) + ", source_offset: " + std::to_string(source_offset)
+            + ", length: " + std::to_string(length) + ")";
 }
 
 void Assignment::print() {
     std::cout << dump() << std::endl;
 }
+
+AssignmentBatch coalesce_assignments(const AssignmentBatch& batch, uint64_t max_message_bytes)
+{
+    if (batch.size() < 2)
+        return batch;
+
+    std::vector<const Assignment*> sorted;
+    sorted.reserve(batch.size());
+    for (const Assignment& assign : batch)
+        sorted.push_back(&assign);
+    std::sort(sorted.begin(), sorted.end(), [](const Assignment* a, const Assignment* b) {
+        return std::tie(a->mr_handle, a->mr_key, a->source_offset)
+               < std::tie(b->mr_handle, b->mr_key, b->source_offset);
+    });
+
+    AssignmentBatch coalesced;
+    coalesced.reserve(batch.size());
+    coalesced.push_back(*sorted[0]);
+    for (size_t i = 1; i < sorted.size(); ++i) {
+        Assignment&       last = coalesced.back();
+        const Assignment& next = *sorted[i];
+        bool mergeable = last.mr_handle == next.mr_handle && last.mr_key == next.mr_key
+                         && last.source_offset + last.length == next.source_offset
+                         && last.target_offset + last.length == next.target_offset
+                         && last.length + next.length <= max_message_bytes;
+        if (mergeable)
+            last.length += next.length;
+        else
+            coalesced.push_back(next);
+    }
+    return coalesced;
+}
 }  // namespace slime
@@ -12,29 +12,48 @@ struct Assignment;
 
 using AssignmentBatch = std::vector<Assignment>;
 
+/* Compact handle of a registered MR, returned by register_memory_region */
+using mr_handle_t = int32_t;
+
+const static mr_handle_t INVALID_MR_HANDLE = -1;
+
 enum class OpCode : uint8_t {
     READ,
     SEND,
-    RECV
+    RECV,
+    WRITE,
+    WRITE_WITH_IMM
 };
 
 typedef struct Assignment {
     Assignment() = default;
     Assignment(std::string mr_key, uint64_t target_offset, uint64_t source_offset, uint64_t length):
-        mr_key(mr_key), target_offset(target_offset), source_offset(source_offset), length(length)
+        mr_key(mr_key), source_offset(source_offset), target_offset(target_offset), length(length)
+    {
+    }
+    Assignment(mr_handle_t mr_handle, uint64_t target_offset, uint64_t source_offset, uint64_t length):
+        mr_handle(mr_handle), source_offset(source_offset), target_offset(target_offset), length(length)
     {
     }
 
     /* dump */
-    std::string dump();
+    std::string dump() const;
 
     /* print */
     void print();
 
     std::string mr_key{};
+    mr_handle_t mr_handle{INVALID_MR_HANDLE};
     uint64_t    source_offset{};
     uint64_t    target_offset{};
     uint64_t    length{};
 } assignment_t;
 
+/*
+  Merge assignments on the same MR whose source and target ranges are both contiguous,
+  up to max_message_bytes each. The result is sorted by MR and source offset and covers
+  exactly the same bytes, so it is only valid for one-sided READ/WRITE batches.
+*/
+AssignmentBatch coalesce_assignments(const AssignmentBatch& batch, uint64_t max_message_bytes);
+
 }  // namespace slime
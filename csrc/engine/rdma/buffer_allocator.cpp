@@ -0,0 +1,238 @@
+#include "engine/rdma/buffer_allocator.h"
+
+#include "utils/logging.h"
+#include "utils/utils.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace slime {
+
+namespace {
+
+/* Arena bytes faulted in per madvise, rounded up to the page size */
+const uint64_t POPULATE_CHUNK_BYTES = 64ull << 20;
+
+const char* page_size_name(HugePageSize page_size)
+{
+    switch (page_size) {
+        case HugePageSize::HUGE_1GB:
+            return "1GB";
+        case HugePageSize::HUGE_2MB:
+            return "2MB";
+        default:
+            return "none";
+    }
+}
+
+uint64_t page_bytes(HugePageSize page_size)
+{
+    switch (page_size) {
+        case HugePageSize::HUGE_1GB:
+            return 1ull << 30;
+        case HugePageSize::HUGE_2MB:
+            return 2ull << 20;
+        default:
+            return sysconf(_SC_PAGESIZE);
+    }
+}
+
+}  // namespace
+
+RDMABufferAllocator::RDMABufferAllocator(RDMAContext& rdma_context, const RDMABufferAllocatorConfig& config):
+    rdma_context_(rdma_context), mr_key_(config.mr_key), min_block_bytes_(config.min_block_bytes)
+{
+    SLIME_ASSERT(min_block_bytes_ && !(min_block_bytes_ & (min_block_bytes_ - 1)),
+                 "min_block_bytes must be a power of two");
+
+    // The buddy allocator needs a power of two number of blocks, the largest one still fits 64 bits
+    SLIME_ASSERT(config.arena_bytes <= (1ull << 63), "arena_bytes of " << config.arena_bytes << " is too large");
+    max_order_ = 0;
+    while ((min_block_bytes_ << max_order_) < config.arena_bytes)
+        ++max_order_;
+
+    map_arena(min_block_bytes_ << max_order_, config.page_size);
+    bind_arena(config.numa_node >= 0 ? config.numa_node : rdma_context.numa_node());
+
+    // Fault the whole arena in now, on the bound node, so the registration pins it in one go. Large
+    // chunks, a madvise per page would cost more than the faults themselves
+    uint64_t page          = page_bytes(page_size_);
+    uint64_t populate_step = (POPULATE_CHUNK_BYTES + page - 1) / page * page;
+    populate_memory((uintptr_t)arena_, arena_bytes_, populate_step, std::thread::hardware_concurrency());
+
+    mr_handle_ = rdma_context_.register_memory_region(mr_key_, (uintptr_t)arena_, arena_bytes_);
+
+    free_blocks_.resize(max_order_ + 1);
+    free_blocks_[max_order_].insert(0);
+
+    SLIME_LOG_INFO("Buffer arena ", mr_key_, ": ", arena_bytes_, " bytes, page size ", page_size_name(page_size_),
+                   ", NUMA node ", numa_node_);
+}
+
+RDMABufferAllocator::~RDMABufferAllocator()
+{
+    if (!allocated_.empty())
+        SLIME_LOG_WARN("Buffer arena ", mr_key_, " released with ", allocated_.size(), " buffers in use");
+    rdma_context_.unregister_memory_region(mr_key_);
+
+    // Work in flight still reads and writes the arena, and the MR must not outlive the mapping
+    auto start  = std::chrono::steady_clock::now();
+    bool warned = false;
+    while (!rdma_context_.memory_region_released(mr_key_)) {
+        if (!warned && std::chrono::steady_clock::now() - start > std::chrono::seconds(1)) {
+            SLIME_LOG_WARN("Buffer arena ", mr_key_, " waits for the work submitted on it to finish");
+            warned = true;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    rdma_context_.invalidate_registration_cache((uintptr_t)arena_, arena_bytes_);
+    munmap(arena_, arena_bytes_);
+}
+
+void RDMABufferAllocator::map_arena(uint64_t arena_bytes, HugePageSize page_size)
+{
+    // hugetlbfs pages first, largest size requested (and not larger than the arena) down to 2MB
+    for (HugePageSize size : {HugePageSize::HUGE_1GB, HugePageSize::HUGE_2MB}) {
+        if (size > page_size || page_bytes(size) > arena_bytes)
+            continue;
+        uint64_t bytes = (arena_bytes + page_bytes(size) - 1) & ~(page_bytes(size) - 1);
+        int      shift = size == HugePageSize::HUGE_1GB ? 30 : 21;
+        void*    addr  = mmap(nullptr,
+                          bytes,
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | (shift << MAP_HUGE_SHIFT),
+                          -1,
+                          0);
+        if (addr != MAP_FAILED) {
+            arena_       = addr;
+            arena_bytes_ = bytes;
+            page_size_   = size;
+            return;
+        }
+        SLIME_LOG_DEBUG("No ", page_size_name(size), " hugepages for the buffer arena");
+    }
+
+    arena_ = mmap(nullptr, arena_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    SLIME_ASSERT(arena_ != MAP_FAILED, "Failed to map a buffer arena of " << arena_bytes << " bytes");
+    arena_bytes_ = arena_bytes;
+    page_size_   = HugePageSize::NONE;
+    if (page_size != HugePageSize::NONE)
+        madvise(arena_, arena_bytes_, MADV_HUGEPAGE);
+}
+
+void RDMABufferAllocator::bind_arena(int numa_node)
+{
+    if (numa_node < 0)
+        return;
+
+    const int     bits_per_mask = sizeof(unsigned long) * 8;
+    unsigned long nodemask[4]   = {0};
+    if (numa_node >= bits_per_mask * 4)
+        return;
+    nodemask[numa_node / bits_per_mask] = 1ul << (numa_node % bits_per_mask);
+
+    if (syscall(SYS_mbind, arena_, arena_bytes_, MPOL_BIND, nodemask, bits_per_mask * 4, 0) != 0) {
+        SLIME_LOG_WARN("Failed to bind the buffer arena to NUMA node ", numa_node);
+        return;
+    }
+    numa_node_ = numa_node;
+}
+
+int RDMABufferAllocator::order_of(uint64_t length) const
+{
+    int order = 0;
+    while ((min_block_bytes_ << order) < length)
+        ++order;
+    return order;
+}
+
+registered_buffer_t RDMABufferAllocator::allocate(uint64_t length)
+{
+    registered_buffer_t buffer;
+    // Larger than any block, and order_of would shift past 64 bits
+    if (length > arena_bytes_)
+        return buffer;
+    int order = order_of(std::max<uint64_t>(length, 1));
+    if (order > max_order_)
+        return buffer;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // Smallest free block that fits, split down to the order asked for
+    int block_order = order;
+    while (block_order <= max_order_ && free_blocks_[block_order].empty())
+        ++block_order;
+    if (block_order > max_order_)
+        return buffer;
+
+    uint64_t offset = *free_blocks_[block_order].begin();
+    free_blocks_[block_order].erase(free_blocks_[block_order].begin());
+    while (block_order > order) {
+        --block_order;
+        free_blocks_[block_order].insert(offset + (min_block_bytes_ << block_order));
+    }
+
+    allocated_[offset] = order;
+    allocated_bytes_ += min_block_bytes_ << order;
+
+    buffer.mr_handle = mr_handle_;
+    buffer.offset    = offset;
+    buffer.length    = length;
+    buffer.ptr       = (char*)arena_ + offset;
+    return buffer;
+}
+
+void RDMABufferAllocator::free(const registered_buffer_t& buffer)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = allocated_.find(buffer.offset);
+    SLIME_ASSERT(buffer.mr_handle == mr_handle_ && it != allocated_.end(), "buffer not allocated from this arena");
+    uint64_t offset = it->first;
+    int      order  = it->second;
+    allocated_.erase(it);
+    allocated_bytes_ -= min_block_bytes_ << order;
+
+    // Merge with the buddy as long as it is free too
+    while (order < max_order_) {
+        uint64_t buddy = offset ^ (min_block_bytes_ << order);
+        auto     free  = free_blocks_[order].find(buddy);
+        if (free == free_blocks_[order].end())
+            break;
+        free_blocks_[order].erase(free);
+        offset = std::min(offset, buddy);
+        ++order;
+    }
+    free_blocks_[order].insert(offset);
+}
+
+json RDMABufferAllocator::stats()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    uint64_t largest_free = 0;
+    for (int order = max_order_; order >= 0; --order) {
+        if (!free_blocks_[order].empty()) {
+            largest_free = min_block_bytes_ << order;
+            break;
+        }
+    }
+    return json{{"mr_key", mr_key_},
+                {"mr_handle", mr_handle_},
+                {"arena_bytes", arena_bytes_},
+                {"page_size", page_size_name(page_size_)},
+                {"numa_node", numa_node_},
+                {"buffers", allocated_.size()},
+                {"allocated_bytes", allocated_bytes_},
+                {"largest_free_bytes", largest_free}};
+}
+
+}  // namespace slime
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "engine/assignment.h"
+#include "engine/rdma/rdma_context.h"
+
+#include "utils/json.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace slime {
+
+using json = nlohmann::json;
+
+enum class HugePageSize : uint8_t {
+    NONE,
+    HUGE_2MB,
+    HUGE_1GB
+};
+
+typedef struct RDMABufferAllocatorConfig {
+    /* Key of the arena MR, peers find the remote arena under the same key */
+    std::string mr_key = "buffer_arena";
+
+    /* Rounded up to a power of two multiple of min_block_bytes */
+    uint64_t arena_bytes = 1ull << 30;
+
+    /* Largest page size tried first, then the smaller ones, then transparent huge pages */
+    HugePageSize page_size = HugePageSize::HUGE_2MB;
+
+    /* NUMA node the arena is bound to, -1 for the node of the NIC */
+    int numa_node = -1;
+
+    /* Smallest buddy block, every allocation is rounded up to a power of two multiple of it */
+    uint64_t min_block_bytes = 4096;
+} rdma_buffer_allocator_config_t;
+
+/* A sub-buffer of the arena, mr_handle and offset go straight into an Assignment */
+typedef struct registered_buffer {
+    mr_handle_t mr_handle{INVALID_MR_HANDLE};
+    uint64_t    offset{0};
+    uint64_t    length{0};
+    void*       ptr{nullptr};
+} registered_buffer_t;
+
+/*
+  Registered buffer allocator of an RDMAContext.
+
+  Reserves one arena backed by hugepages on a NUMA node and registers it once, so every
+  buffer carved out of it shares one MR with few MTT entries. Sub-buffers come from a
+  buddy allocator. Without hugepages (none reserved, or no permission) the arena falls back
+  to regular pages with transparent hugepages requested, page_size() tells what was used.
+*/
+class RDMABufferAllocator {
+public:
+    RDMABufferAllocator(RDMAContext&                     rdma_context,
+                        const RDMABufferAllocatorConfig& config = RDMABufferAllocatorConfig());
+    ~RDMABufferAllocator();
+
+    RDMABufferAllocator(const RDMABufferAllocator&)            = delete;
+    RDMABufferAllocator& operator=(const RDMABufferAllocator&) = delete;
+
+    /* mr_handle is INVALID_MR_HANDLE when the arena has no block of that size left */
+    registered_buffer_t allocate(uint64_t length);
+    void                free(const registered_buffer_t& buffer);
+
+    mr_handle_t mr_handle() const
+    {
+        return mr_handle_;
+    }
+
+    HugePageSize page_size() const
+    {
+        return page_size_;
+    }
+
+    json stats();
+
+private:
+    void map_arena(uint64_t arena_bytes, HugePageSize page_size);
+    void bind_arena(int numa_node);
+
+    /* Order of the smallest block holding length bytes */
+    int order_of(uint64_t length) const;
+
+    RDMAContext& rdma_context_;
+
+    std::string  mr_key_;
+    mr_handle_t  mr_handle_{INVALID_MR_HANDLE};
+    void*        arena_{nullptr};
+    uint64_t     arena_bytes_{0};
+    HugePageSize page_size_{HugePageSize::NONE};
+    int          numa_node_{-1};
+
+    uint64_t min_block_bytes_;
+    int      max_order_;
+
+    std::mutex mutex_;
+
+    /* Free block offsets per order, block size is min_block_bytes_ << order */
+    std::vector<std::set<uint64_t>> free_blocks_;
+
+    /* Order of every allocated block by offset */
+    std::unordered_map<uint64_t, int> allocated_;
+    uint64_t                          allocated_bytes_{0};
+};
+
+}  // namespace slime
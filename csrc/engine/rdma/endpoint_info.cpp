@@ -0,0 +1,167 @@
+#include "engine/rdma/endpoint_info.h"
+
+#include "utils/logging.h"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+namespace slime {
+
+void EndpointInfoBuilder::add_qp(const rdma_info_t& rdma_info)
+{
+    endpoint_qp_record_t record{};
+    record.subnet_prefix = rdma_info.gid.global.subnet_prefix;
+    record.interface_id  = rdma_info.gid.global.interface_id;
+    record.gidx          = rdma_info.gidx;
+    record.psn           = rdma_info.psn;
+    record.mtu           = rdma_info.mtu;
+    record.qpn           = rdma_info.qpn;
+    record.lid           = rdma_info.lid;
+    qps_.push_back(record);
+}
+
+void EndpointInfoBuilder::add_mr(const std::string& mr_key, uintptr_t addr, uint64_t length, uint32_t rkey)
+{
+    endpoint_mr_record_t record{};
+    record.addr       = addr;
+    record.length     = length;
+    record.rkey       = rkey;
+    record.key_length = mr_key.size();
+    record.key_offset = keys_.size();
+    mrs_.push_back(record);
+    keys_ += mr_key;
+}
+
+void EndpointInfoBuilder::set_srq_recv_bytes(uint32_t srq_recv_bytes)
+{
+    srq_recv_bytes_ = srq_recv_bytes;
+}
+
+std::string EndpointInfoBuilder::build() const
+{
+    endpoint_info_header_t header{};
+    header.magic          = ENDPOINT_INFO_MAGIC;
+    header.version        = ENDPOINT_INFO_VERSION;
+    header.header_bytes   = sizeof(endpoint_info_header_t);
+    header.qp_num         = qps_.size();
+    header.mr_num         = mrs_.size();
+    header.key_bytes      = keys_.size();
+    header.srq_recv_bytes = srq_recv_bytes_;
+
+    size_t qp_bytes = qps_.size() * sizeof(endpoint_qp_record_t);
+    size_t mr_bytes = mrs_.size() * sizeof(endpoint_mr_record_t);
+
+    std::string info(sizeof(header) + qp_bytes + mr_bytes + keys_.size(), '\0');
+    char*       ptr = &info[0];
+    memcpy(ptr, &header, sizeof(header));
+    ptr += sizeof(header);
+    memcpy(ptr, qps_.data(), qp_bytes);
+    ptr += qp_bytes;
+    memcpy(ptr, mrs_.data(), mr_bytes);
+    ptr += mr_bytes;
+    memcpy(ptr, keys_.data(), keys_.size());
+    return info;
+}
+
+EndpointInfoView::EndpointInfoView(const void* data, size_t size): data_((const char*)data), size_(size)
+{
+    if (size_ < sizeof(endpoint_info_header_t)) {
+        SLIME_LOG_ERROR("Endpoint info truncated: ", size_, " bytes");
+        return;
+    }
+    memcpy(&header_, data_, sizeof(header_));
+    if (header_.magic != ENDPOINT_INFO_MAGIC) {
+        SLIME_LOG_ERROR("Not an endpoint info, or from a host of the other byte order");
+        return;
+    }
+    if (header_.version != ENDPOINT_INFO_VERSION || header_.header_bytes < sizeof(endpoint_info_header_t)) {
+        SLIME_LOG_ERROR("Endpoint info version ", header_.version, " not supported");
+        return;
+    }
+
+    uint64_t expected = header_.header_bytes + (uint64_t)header_.qp_num * sizeof(endpoint_qp_record_t)
+                        + (uint64_t)header_.mr_num * sizeof(endpoint_mr_record_t) + header_.key_bytes;
+    if (header_.key_bytes > size_ || expected > size_) {
+        SLIME_LOG_ERROR("Endpoint info truncated: ", size_, " bytes, expected ", expected);
+        return;
+    }
+
+    // Keys are checked once here so mr_key needs no bounds check
+    for (uint32_t i = 0; i < header_.mr_num; ++i) {
+        endpoint_mr_record_t record = mr_record(i);
+        if (record.key_offset > header_.key_bytes || record.key_length > header_.key_bytes - record.key_offset) {
+            SLIME_LOG_ERROR("Endpoint info MR ", i, " key out of bounds");
+            return;
+        }
+    }
+    valid_ = true;
+}
+
+endpoint_qp_record_t EndpointInfoView::qp_record(uint32_t qpi) const
+{
+    // memcpy, the received buffer need not be aligned
+    endpoint_qp_record_t record;
+    memcpy(&record, data_ + header_.header_bytes + qpi * sizeof(endpoint_qp_record_t), sizeof(record));
+    return record;
+}
+
+endpoint_mr_record_t EndpointInfoView::mr_record(uint32_t i) const
+{
+    const char* mrs = data_ + header_.header_bytes + header_.qp_num * sizeof(endpoint_qp_record_t);
+
+    endpoint_mr_record_t record;
+    memcpy(&record, mrs + i * sizeof(endpoint_mr_record_t), sizeof(record));
+    return record;
+}
+
+rdma_info_t EndpointInfoView::rdma_info(uint32_t qpi) const
+{
+    SLIME_ASSERT(valid_ && qpi < header_.qp_num, "QP " << qpi << " out of range");
+    endpoint_qp_record_t record = qp_record(qpi);
+
+    union ibv_gid gid;
+    gid.global.subnet_prefix = record.subnet_prefix;
+    gid.global.interface_id  = record.interface_id;
+    return rdma_info_t(record.qpn, gid, record.gidx, record.lid, record.psn, record.mtu);
+}
+
+std::string_view EndpointInfoView::mr_key(uint32_t i) const
+{
+    SLIME_ASSERT(valid_ && i < header_.mr_num, "MR " << i << " out of range");
+    endpoint_mr_record_t record = mr_record(i);
+
+    const char* keys = data_ + header_.header_bytes + header_.qp_num * sizeof(endpoint_qp_record_t)
+                       + header_.mr_num * sizeof(endpoint_mr_record_t);
+    return std::string_view(keys + record.key_offset, record.key_length);
+}
+
+remote_mr_t EndpointInfoView::mr(uint32_t i) const
+{
+    SLIME_ASSERT(valid_ && i < header_.mr_num, "MR " << i << " out of range");
+    endpoint_mr_record_t record = mr_record(i);
+    return remote_mr_t(record.addr, record.length, record.rkey);
+}
+
+json EndpointInfoView::to_json() const
+{
+    if (!valid_)
+        return json();
+
+    json rdma_info_json = json::array();
+    for (uint32_t qpi = 0; qpi < qp_num(); ++qpi)
+        rdma_info_json.push_back(rdma_info(qpi).to_json());
+
+    json mr_info_json;
+    for (uint32_t i = 0; i < mr_num(); ++i) {
+        remote_mr_t remote_mr                = mr(i);
+        mr_info_json[std::string(mr_key(i))] = {
+            {"addr", remote_mr.addr},
+            {"rkey", remote_mr.rkey},
+            {"length", remote_mr.length},
+        };
+    }
+    return json{{"rdma_info", rdma_info_json}, {"mr_info", mr_info_json}, {"srq_recv_bytes", srq_recv_bytes()}};
+}
+
+}  // namespace slime
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "engine/rdma/memory_pool.h"
+#include "engine/rdma/rdma_config.h"
+
+#include "utils/json.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace slime {
+
+using json = nlohmann::json;
+
+/*
+  Binary endpoint info, the compact alternative to the JSON endpoint_info.
+
+  Fixed layout in host byte order, every record naturally aligned:
+
+      header      endpoint_info_header_t
+      qp_num      endpoint_qp_record_t, one per QP (none for an MR table alone)
+      mr_num      endpoint_mr_record_t, one per MR
+      key_bytes   the MR keys back to back, each record holds its offset and length
+
+  The header also carries the receive size of the sender's SRQ, 0 when it has none (or
+  for an MR table alone): a SEND larger than that cannot land at the peer.
+
+  A peer of the other byte order sees a swapped magic and rejects the buffer. A version
+  bump is needed for any layout change; header_bytes lets later versions append fields to
+  the header without moving the records.
+*/
+
+const uint32_t ENDPOINT_INFO_MAGIC   = 0x49454c53;  // "SLEI"
+const uint16_t ENDPOINT_INFO_VERSION = 1;
+
+typedef struct endpoint_info_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t header_bytes;
+    uint32_t qp_num;
+    uint32_t mr_num;
+    uint64_t key_bytes;
+    uint32_t srq_recv_bytes;
+    uint32_t reserved;
+} endpoint_info_header_t;
+
+typedef struct endpoint_qp_record {
+    uint64_t subnet_prefix;
+    uint64_t interface_id;
+    int64_t  gidx;
+    uint64_t psn;
+    uint64_t mtu;
+    uint32_t qpn;
+    uint16_t lid;
+    uint16_t reserved;
+} endpoint_qp_record_t;
+
+typedef struct endpoint_mr_record {
+    uint64_t addr;
+    uint64_t length;
+    uint32_t rkey;
+    uint32_t key_length;
+    uint64_t key_offset;
+} endpoint_mr_record_t;
+
+static_assert(sizeof(endpoint_info_header_t) == 32, "endpoint info header layout changed");
+static_assert(sizeof(endpoint_qp_record_t) == 48, "endpoint QP record layout changed");
+static_assert(sizeof(endpoint_mr_record_t) == 32, "endpoint MR record layout changed");
+
+class EndpointInfoBuilder {
+public:
+    void add_qp(const rdma_info_t& rdma_info);
+    void add_mr(const std::string& mr_key, uintptr_t addr, uint64_t length, uint32_t rkey);
+    void set_srq_recv_bytes(uint32_t srq_recv_bytes);
+
+    std::string build() const;
+
+private:
+    uint32_t                          srq_recv_bytes_{0};
+    std::vector<endpoint_qp_record_t> qps_;
+    std::vector<endpoint_mr_record_t> mrs_;
+    std::string                       keys_;
+};
+
+/*
+  Read-only view over a binary endpoint info, e.g. straight over the received bytes.
+
+  The constructor only checks the header and the bounds, records are read in place on
+  access. The buffer must outlive the view.
+*/
+class EndpointInfoView {
+public:
+    EndpointInfoView(const void* data, size_t size);
+
+    /* False for a truncated buffer, another version or another byte order */
+    bool valid() const
+    {
+        return valid_;
+    }
+
+    uint32_t qp_num() const
+    {
+        return header_.qp_num;
+    }
+
+    uint32_t mr_num() const
+    {
+        return header_.mr_num;
+    }
+
+    /* Largest SEND the peer SRQ takes, 0 when the peer has no SRQ */
+    uint32_t srq_recv_bytes() const
+    {
+        return header_.srq_recv_bytes;
+    }
+
+    rdma_info_t      rdma_info(uint32_t qpi) const;
+    std::string_view mr_key(uint32_t i) const;
+    remote_mr_t      mr(uint32_t i) const;
+
+    /* Same shape as RDMAContext::endpoint_info, for debugging */
+    json to_json() const;
+
+private:
+    endpoint_qp_record_t qp_record(uint32_t qpi) const;
+    endpoint_mr_record_t mr_record(uint32_t i) const;
+
+    const char*            data_;
+    size_t                 size_;
+    endpoint_info_header_t header_{};
+    bool                   valid_{false};
+};
+
+}  // namespace slime
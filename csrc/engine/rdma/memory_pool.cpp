@@ -1,7 +1,9 @@
 #include "engine/rdma/memory_pool.h"
+#include "engine/rdma/endpoint_info.h"
 
 #include "utils/logging.h"
 
+#include <algorithm>
 #include <cstdint>
 #include <cstdlib>
 #include <infiniband/verbs.h>
@@ -9,61 +11,214 @@
 #include <unordered_map>
 
 namespace slime {
-int RDMAMemoryPool::register_memory_region(const std::string& mr_key, uintptr_t data_ptr, uint64_t length)
+
+/* MemoryRegion Access Right = 777 */
+const static int MR_ACCESS_RIGHTS = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ;
+
+RDMAMemoryPool::RDMAMemoryPool(ibv_pd* pd, VerbsProvider* verbs, uint64_t mr_cache_bytes, int max_peers):
+    pd_(pd),
+    verbs_(verbs),
+    tables_(new handle_tables_t(max_peers)),
+    registration_cache_(new RegistrationCache(pd, verbs, MR_ACCESS_RIGHTS, mr_cache_bytes)),
+    registrations_(new registrations_t())
+{
+}
+
+RDMAMemoryPool::handle_tables::handle_tables(int max_peers)
+{
+    for (int peer = 0; peer < std::max(max_peers, 1); ++peer)
+        remote_mrs.emplace_back(new SegmentedTable<remote_mr_slot_t>());
+}
+
+int RDMAMemoryPool::add_peer()
+{
+    std::unique_lock<std::shared_mutex> lock(tables_->mutex);
+    if ((size_t)tables_->peers == tables_->remote_mrs.size())
+        return -1;
+    return tables_->peers++;
+}
+
+RDMAMemoryPool::~RDMAMemoryPool()
+{
+    if (!registration_cache_)
+        return;
+    for (mr_registration_t* registration : registrations_->live) {
+        registration_cache_->release(registration->mr.mr);
+        delete registration;
+    }
+}
+
+mr_handle_t RDMAMemoryPool::get_or_create_handle(const std::string& mr_key)
+{
+    std::unique_lock<std::shared_mutex> lock(tables_->mutex);
+    auto                                it = tables_->handles.find(mr_key);
+    if (it != tables_->handles.end())
+        return it->second;
+
+    // Every table gets the entry before the handle is handed out, the remote ones of later peers too
+    size_t mr_handle = tables_->keys.append();
+    tables_->keys[mr_handle] = mr_key;
+    tables_->states.append();
+    for (std::unique_ptr<SegmentedTable<remote_mr_slot_t>>& remote_mrs : tables_->remote_mrs)
+        remote_mrs->publish(remote_mrs->append());
+    tables_->states.publish(mr_handle);
+    tables_->keys.publish(mr_handle);
+    tables_->handles.emplace(mr_key, mr_handle);
+    return mr_handle;
+}
+
+mr_handle_t RDMAMemoryPool::register_memory_region(const std::string& mr_key, uintptr_t data_ptr, uint64_t length)
 {
-    /* MemoryRegion Access Right = 777 */
-    const static int access_rights = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ;
-    ibv_mr*          mr            = ibv_reg_mr(pd_, (void*)data_ptr, length, access_rights);
+    ibv_mr* mr = registration_cache_->acquire(data_ptr, length);
 
     SLIME_ASSERT(mr, " Failed to register memory " << data_ptr);
 
     SLIME_LOG_INFO("Memory region: " << (void*)data_ptr << " -- " << (void*)(data_ptr + length)
                                      << ", Device name: " << pd_->context->device->dev_name << ", Length: " << length
                                      << " (" << length / 1024 / 1024 << " MB)"
-                                     << ", Permission: " << access_rights << ", LKey: " << mr->lkey
-                                     << ", RKey: " << mr->rkey);
+                                     << ", Permission: " << MR_ACCESS_RIGHTS << ", LKey: " << mr->lkey
+                                     << ", RKey: " << mr->rkey << ", MR: " << mr->addr << " -- "
+                                     << (void*)((uintptr_t)mr->addr + mr->length));
 
-    mrs_[mr_key] = mr;
-    return 0;
+    // Re-registering a key retires its previous MR only after taking the new one, so the cache can reuse it
+    mr_handle_t        mr_handle    = get_or_create_handle(mr_key);
+    mr_registration_t* registration = new mr_registration_t(local_mr_t(mr, data_ptr, length), mr_handle);
+    {
+        std::lock_guard<std::mutex> lock(registrations_->mutex);
+        registrations_->live.insert(registration);
+    }
+    tables_->states[mr_handle].registrations += 1;
+    replace_registration(mr_handle, registration);
+    return mr_handle;
 }
 
 int RDMAMemoryPool::unregister_memory_region(const std::string& mr_key)
 {
-    mrs_.erase(mr_key);
+    // The handle stays reserved for the key
+    mr_handle_t mr_handle = get_mr_handle(mr_key);
+    if (!has_mr(mr_handle))
+        return -1;
+    replace_registration(mr_handle, nullptr);
     return 0;
 }
 
-int RDMAMemoryPool::register_remote_memory_region(const std::string& mr_key, const json& mr_info)
+void RDMAMemoryPool::replace_registration(mr_handle_t mr_handle, mr_registration_t* registration)
 {
-    remote_mrs_[mr_key] =
-        remote_mr_t(mr_info["addr"].get<uintptr_t>(), mr_info["length"].get<size_t>(), mr_info["rkey"].get<uint32_t>());
-    return 0;
+    mr_state_t&        state = tables_->states[mr_handle];
+    mr_registration_t* previous;
+    {
+        // Readers of current hold the lock, so previous outlives any of them
+        std::lock_guard<std::mutex> lock(state.mutex);
+        previous = state.current.exchange(registration);
+    }
+    if (previous)
+        release_lease(previous);
 }
 
-int RDMAMemoryPool::unregister_remote_memory_region(const std::string& mr_key)
+mr_registration_t* RDMAMemoryPool::acquire_lease(mr_handle_t mr_handle)
 {
-    remote_mrs_.erase(mr_key);
+    if (mr_handle < 0 || (size_t)mr_handle >= tables_->states.size())
+        return nullptr;
+    mr_state_t&                 state = tables_->states[mr_handle];
+    std::lock_guard<std::mutex> lock(state.mutex);
+    mr_registration_t*          registration = state.current;
+    if (registration)
+        registration->refs += 1;
+    return registration;
+}
+
+void RDMAMemoryPool::release_lease(mr_registration_t* registration)
+{
+    if (registration->refs.fetch_sub(1) != 1)
+        return;
+
+    // Neither current nor leased, nothing can reach it any more
+    SLIME_LOG_DEBUG("Releasing MR of ", tables_->keys[registration->mr_handle]);
+    registration_cache_->release(registration->mr.mr);
+    {
+        std::lock_guard<std::mutex> lock(registrations_->mutex);
+        registrations_->live.erase(registration);
+    }
+    tables_->states[registration->mr_handle].registrations -= 1;
+    delete registration;
+}
+
+bool RDMAMemoryPool::current_mr(mr_handle_t mr_handle, local_mr_t& mr) const
+{
+    const mr_state_t&           state = tables_->states[mr_handle];
+    std::lock_guard<std::mutex> lock(state.mutex);
+    if (!state.current)
+        return false;
+    mr = state.current.load()->mr;
+    return true;
+}
+
+bool RDMAMemoryPool::memory_region_released(const std::string& mr_key) const
+{
+    mr_handle_t mr_handle = get_mr_handle(mr_key);
+    return mr_handle == INVALID_MR_HANDLE || tables_->states[mr_handle].registrations == 0;
+}
+
+mr_handle_t RDMAMemoryPool::register_remote_memory_region(const std::string& mr_key, const json& mr_info, int peer)
+{
+    remote_mr_t remote_mr(
+        mr_info["addr"].get<uintptr_t>(), mr_info["length"].get<size_t>(), mr_info["rkey"].get<uint32_t>());
+    return register_remote_memory_region(mr_key, remote_mr, peer);
+}
+
+mr_handle_t
+RDMAMemoryPool::register_remote_memory_region(const std::string& mr_key, const remote_mr_t& remote_mr, int peer)
+{
+    mr_handle_t                 mr_handle = get_or_create_handle(mr_key);
+    std::lock_guard<std::mutex> lock(tables_->remote_mutex);
+    (*tables_->remote_mrs[peer])[mr_handle].store(remote_mr);
+    return mr_handle;
+}
+
+int RDMAMemoryPool::unregister_remote_memory_region(const std::string& mr_key, int peer)
+{
+    // Work on the key is refused from now on, what is already posted is up to the peer
+    mr_handle_t mr_handle = get_mr_handle(mr_key);
+    if (mr_handle == INVALID_MR_HANDLE)
+        return -1;
+    std::lock_guard<std::mutex> lock(tables_->remote_mutex);
+    (*tables_->remote_mrs[peer])[mr_handle].store(remote_mr_t());
     return 0;
 }
 
 json RDMAMemoryPool::mr_info() const
 {
     json mr_info;
-    for (auto& mr : mrs_) {
-        mr_info[mr.first] = {
-            {"addr", (uintptr_t)mr.second->addr},
-            {"rkey", mr.second->rkey},
-            {"length", mr.second->length},
+    for (size_t mr_handle = 0; mr_handle < tables_->states.size(); ++mr_handle) {
+        local_mr_t mr;
+        if (!current_mr(mr_handle, mr))
+            continue;
+        mr_info[tables_->keys[mr_handle]] = {
+            {"addr", mr.addr},
+            {"rkey", mr.mr->rkey},
+            {"length", mr.length},
         };
     }
     return mr_info;
 }
 
-json RDMAMemoryPool::remote_mr_info() const
+void RDMAMemoryPool::append_mr_info(EndpointInfoBuilder& builder) const
+{
+    for (size_t mr_handle = 0; mr_handle < tables_->states.size(); ++mr_handle) {
+        local_mr_t mr;
+        if (current_mr(mr_handle, mr))
+            builder.add_mr(tables_->keys[mr_handle], mr.addr, mr.length, mr.mr->rkey);
+    }
+}
+
+json RDMAMemoryPool::remote_mr_info(int peer) const
 {
     json mr_info;
-    for (auto& mr : remote_mrs_) {
-        mr_info[mr.first] = {{"addr", mr.second.addr}, {"rkey", mr.second.rkey}, {"length", mr.second.length}};
+    for (size_t mr_handle = 0; mr_handle < tables_->states.size(); ++mr_handle) {
+        remote_mr_t mr = get_remote_mr(mr_handle, peer);
+        if (!mr.addr && !mr.length)
+            continue;
+        mr_info[tables_->keys[mr_handle]] = {{"addr", mr.addr}, {"rkey", mr.rkey}, {"length", mr.length}};
     }
     return mr_info;
 }
@@ -1,22 +1,34 @@
 #pragma once
 
+#include "engine/assignment.h"
 #include "engine/rdma/rdma_config.h"
+#include "engine/rdma/registration_cache.h"
+#include "engine/rdma/verbs_provider.h"
 
 #include "utils/json.hpp"
 #include "utils/logging.h"
+#include "utils/segmented_table.h"
 
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <infiniband/verbs.h>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <sys/types.h>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 namespace slime {
 
 using json = nlohmann::json;
 
+class EndpointInfoBuilder;
+
 typedef struct remote_mr {
     remote_mr() = default;
     remote_mr(uintptr_t addr, size_t length, uint32_t rkey): addr(addr), length(length), rkey(rkey) {}
@@ -26,38 +38,232 @@ typedef struct remote_mr {
     uint32_t  rkey{};
 } remote_mr_t;
 
+/*
+  A remote MR as the WQ dispatchers read it, without a lock while the peer re-registers or
+  invalidates the key. A seqlock: load retries until it got all fields of one store, never the
+  addr of one registration with the rkey of another (or of an invalidation). One writer at a
+  time, the memory pool serializes store.
+*/
+typedef struct remote_mr_slot {
+    std::atomic<uint32_t>  seq{0};
+    std::atomic<uintptr_t> addr{0};
+    std::atomic<size_t>    length{0};
+    std::atomic<uint32_t>  rkey{0};
+
+    remote_mr_t load() const
+    {
+        for (;;) {
+            uint32_t begin = seq.load(std::memory_order_acquire);
+            if (begin & 1)
+                continue;
+            remote_mr_t mr(addr.load(std::memory_order_relaxed),
+                           length.load(std::memory_order_relaxed),
+                           rkey.load(std::memory_order_relaxed));
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (seq.load(std::memory_order_relaxed) == begin)
+                return mr;
+        }
+    }
+
+    void store(const remote_mr_t& mr)
+    {
+        uint32_t begin = seq.load(std::memory_order_relaxed);
+        seq.store(begin + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        addr.store(mr.addr, std::memory_order_relaxed);
+        length.store(mr.length, std::memory_order_relaxed);
+        rkey.store(mr.rkey, std::memory_order_relaxed);
+        seq.store(begin + 2, std::memory_order_release);
+    }
+} remote_mr_slot_t;
+
+/* A registered key: its own range inside a possibly larger, shared MR from the cache */
+typedef struct local_mr {
+    local_mr() = default;
+    local_mr(struct ibv_mr* mr, uintptr_t addr, size_t length): mr(mr), addr(addr), length(length) {}
+
+    struct ibv_mr* mr{nullptr};
+    uintptr_t      addr{(uintptr_t) nullptr};
+    size_t         length{};
+} local_mr_t;
+
+/*
+  One registration of a key. Work takes a lease on the registration current at submit and
+  posts with its MR, so re-registering or unregistering the key meanwhile changes nothing for
+  it. Goes back to the cache once the key has moved on and the last lease is dropped.
+*/
+typedef struct mr_registration {
+    explicit mr_registration(const local_mr_t& local_mr, mr_handle_t mr_handle): mr(local_mr), mr_handle(mr_handle) {}
+
+    local_mr_t  mr;
+    mr_handle_t mr_handle;
+
+    /* Leases, plus one while it is the current registration of its key */
+    std::atomic<int64_t> refs{1};
+} mr_registration_t;
+
+/*
+  Local and remote MRs are addressed by an mr_handle_t, assigned the first time a key is
+  seen (locally or from the peer) and stable from then on. Both sides of a key share the
+  handle, so the posting path resolves an assignment with two vector lookups.
+
+  Local keys take their MR from a RegistrationCache, so keys over the same or overlapping
+  buffers share one registration.
+
+  Every peer has its own remote MR table over the same handles, peer 0 unless told otherwise.
+  The tables for max_peers are there from the start and never move, so the WQ dispatchers
+  index them without a lock while keys and peers are added. Each remote entry is a seqlock,
+  a dispatcher reads one consistent copy of it while the peer re-registers the key.
+
+  Work in flight holds a lease on the registrations it was submitted against. Unregistering
+  (or re-registering) a key retires its registration at once, new work on the key is refused
+  (or gets the new one), but the MR goes back to the cache only when the last lease on it is
+  dropped. With the cache off that deregisters it.
+*/
 class RDMAMemoryPool {
 public:
     RDMAMemoryPool() = default;
-    RDMAMemoryPool(ibv_pd* pd): pd_(pd) {}
+    RDMAMemoryPool(ibv_pd* pd, VerbsProvider* verbs, uint64_t mr_cache_bytes = 0, int max_peers = 1);
+    ~RDMAMemoryPool();
+
+    RDMAMemoryPool(RDMAMemoryPool&&)            = default;
+    RDMAMemoryPool& operator=(RDMAMemoryPool&&) = default;
 
-    int register_memory_region(const std::string& mr_key, uintptr_t data_ptr, uint64_t length);
+    /* Return the handle of the registered MR */
+    mr_handle_t register_memory_region(const std::string& mr_key, uintptr_t data_ptr, uint64_t length);
+
+    /* -1 if the key is not registered */
     int unregister_memory_region(const std::string& mr_key);
 
-    int register_remote_memory_region(const std::string& mr_key, const json& mr_info);
-    int unregister_remote_memory_region(const std::string& mr_key);
+    mr_handle_t register_remote_memory_region(const std::string& mr_key, const json& mr_info, int peer = 0);
+    mr_handle_t register_remote_memory_region(const std::string& mr_key, const remote_mr_t& remote_mr, int peer = 0);
+    int         unregister_remote_memory_region(const std::string& mr_key, int peer = 0);
+
+    /* A remote MR table for one more peer, returns its index. At most max_peers of them */
+    int add_peer();
 
-    inline struct ibv_mr* get_mr(const std::string& mr_key)
+    /* INVALID_MR_HANDLE if the key has never been registered */
+    inline mr_handle_t get_mr_handle(const std::string& mr_key) const
     {
-        if (mrs_.find(mr_key) != mrs_.end())
-            return mrs_[mr_key];
-        SLIME_LOG_ERROR("mr_key: ", mr_key, "not found in mrs_");
-        return nullptr;
+        std::shared_lock<std::shared_mutex> lock(tables_->mutex);
+        auto                                it = tables_->handles.find(mr_key);
+        return it != tables_->handles.end() ? it->second : INVALID_MR_HANDLE;
     }
-    inline remote_mr_t get_remote_mr(const std::string& mr_key)
+
+    /*
+      Unchecked, the handle comes from get_mr_handle or register_memory_region. A consistent
+      copy, length 0 once the peer has unregistered or invalidated the key.
+    */
+    inline remote_mr_t get_remote_mr(mr_handle_t mr_handle, int peer = 0) const
+    {
+        return (*tables_->remote_mrs[peer])[mr_handle].load();
+    }
+
+    inline bool has_mr(mr_handle_t mr_handle) const
+    {
+        return mr_handle >= 0 && (size_t)mr_handle < tables_->states.size()
+               && tables_->states[mr_handle].current.load();
+    }
+
+    /* The peer registered the key and has not invalidated it */
+    inline bool has_remote_mr(mr_handle_t mr_handle, int peer = 0) const
     {
-        if (remote_mrs_.find(mr_key) != remote_mrs_.end())
-            return remote_mrs_[mr_key];
+        return mr_handle >= 0 && (size_t)mr_handle < tables_->states.size()
+               && (*tables_->remote_mrs[peer])[mr_handle].length.load(std::memory_order_acquire);
+    }
+
+    /*
+      The current registration of the handle, kept registered until release_lease. nullptr if
+      the handle is not registered.
+    */
+    mr_registration_t* acquire_lease(mr_handle_t mr_handle);
+    void               release_lease(mr_registration_t* registration);
+
+    /* No registration of the key is left, its MRs have all gone back to the cache */
+    bool memory_region_released(const std::string& mr_key) const;
+
+    inline local_mr_t get_local_mr(const std::string& mr_key) const
+    {
+        local_mr_t  local_mr;
+        mr_handle_t mr_handle = get_mr_handle(mr_key);
+        if (mr_handle == INVALID_MR_HANDLE || !current_mr(mr_handle, local_mr))
+            SLIME_LOG_ERROR("mr_key: ", mr_key, " not found in mrs_");
+        return local_mr;
+    }
+    inline remote_mr_t get_remote_mr(const std::string& mr_key, int peer = 0) const
+    {
+        mr_handle_t mr_handle = get_mr_handle(mr_key);
+        if (mr_handle != INVALID_MR_HANDLE)
+            return get_remote_mr(mr_handle, peer);
         SLIME_LOG_ERROR("mr_key: ", mr_key, " not found in remote_mrs_");
         return remote_mr_t();
     }
 
     json mr_info() const;
-    json remote_mr_info() const;
+    json remote_mr_info(int peer = 0) const;
+
+    /* The MRs of mr_info, as records of a binary endpoint info */
+    void append_mr_info(EndpointInfoBuilder& builder) const;
+
+    json registration_cache_stats() const
+    {
+        return registration_cache_ ? registration_cache_->stats() : json();
+    }
+
+    /* See RegistrationCache::invalidate */
+    size_t invalidate_registrations(uintptr_t addr, uint64_t length)
+    {
+        return registration_cache_ ? registration_cache_->invalidate(addr, length) : 0;
+    }
 
 private:
-    ibv_pd*                                         pd_;
-    std::unordered_map<std::string, struct ibv_mr*> mrs_;
-    std::unordered_map<std::string, remote_mr_t>    remote_mrs_;
+    typedef struct mr_state {
+        /* Taken to lease current, and to replace it */
+        mutable std::mutex              mutex;
+        std::atomic<mr_registration_t*> current{nullptr};
+
+        /* Registrations of the key not released yet, current included */
+        std::atomic<int> registrations{0};
+    } mr_state_t;
+
+    /* Every registration not released yet, freed with the pool whatever their leases */
+    typedef struct registrations {
+        std::mutex                             mutex;
+        std::unordered_set<mr_registration_t*> live;
+    } registrations_t;
+
+    /*
+      Handle tables. Lookups by key take the shared lock, adding a key the exclusive one; the
+      tables indexed by handle are read without any.
+    */
+    typedef struct handle_tables {
+        explicit handle_tables(int max_peers);
+
+        mutable std::shared_mutex                    mutex;
+        std::unordered_map<std::string, mr_handle_t> handles;
+
+        SegmentedTable<std::string> keys;
+        SegmentedTable<mr_state_t>  states;
+
+        /* Indexed by peer, all max_peers of them up front. Stores under remote_mutex */
+        std::vector<std::unique_ptr<SegmentedTable<remote_mr_slot_t>>> remote_mrs;
+        std::mutex                                                     remote_mutex;
+        int                                                            peers{1};
+    } handle_tables_t;
+
+    mr_handle_t get_or_create_handle(const std::string& mr_key);
+
+    /* Copy of the current registration of the handle, false if there is none */
+    bool current_mr(mr_handle_t mr_handle, local_mr_t& mr) const;
+
+    /* Make registration (nullptr to unregister) the current one of the handle and retire the previous */
+    void replace_registration(mr_handle_t mr_handle, mr_registration_t* registration);
+
+    ibv_pd*        pd_;
+    VerbsProvider* verbs_{nullptr};
+
+    std::unique_ptr<handle_tables_t>   tables_{new handle_tables_t(1)};
+    std::unique_ptr<RegistrationCache> registration_cache_;
+    std::unique_ptr<registrations_t>   registrations_;
 };
 }  // namespace slime
@@ -0,0 +1,917 @@
+#include "engine/rdma/mock_verbs.h"
+
+#include "utils/logging.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <shared_mutex>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <infiniband/verbs.h>
+
+namespace slime {
+
+namespace {
+
+const static int MOCK_MAX_QP_WR  = 32768;
+const static int MOCK_MAX_SGE    = 30;
+const static int MOCK_MAX_CQE    = 4194303;
+const static int MOCK_MAX_INLINE = 256;
+
+struct MockCQ;
+struct MockQP;
+
+/* Each mock object embeds the public verbs struct as its first member */
+struct MockDevice {
+    struct ibv_device device;
+    int               index;
+};
+
+struct MockChannel {
+    struct ibv_comp_channel channel;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::deque<MockCQ*>     events;
+};
+
+struct MockCQ {
+    struct ibv_cq cq;
+
+    std::mutex                mutex;
+    std::deque<struct ibv_wc> entries;
+    bool                      armed{false};
+};
+
+struct MockMR {
+    struct ibv_mr mr;
+    int           access;
+};
+
+struct MockRecv {
+    uint64_t                    wr_id;
+    std::vector<struct ibv_sge> sg_list;
+};
+
+/* A SEND or WRITE_WITH_IMM which has to consume a receive on the target QP */
+struct MockMessage {
+    MockQP*           sender;
+    uint64_t          wr_id;
+    bool              signaled;
+    bool              is_send;
+    uint32_t          byte_len;
+    bool              with_imm;
+    uint32_t          imm_data;
+    std::vector<char> payload;
+};
+
+struct MockQP {
+    struct ibv_qp qp;
+
+    std::mutex mutex;
+    uint32_t   dest_qpn{0};
+    uint32_t   max_send_sge{0};
+    uint32_t   max_recv_sge{0};
+    uint32_t   max_inline_data{0};
+    bool       sq_sig_all{false};
+
+    std::deque<MockRecv>    recv_queue;
+    std::deque<MockMessage> inbound;
+
+    /* Fault injection: the next inject_errors send WRs fail with inject_status */
+    int                inject_errors{0};
+    enum ibv_wc_status inject_status{IBV_WC_RETRY_EXC_ERR};
+};
+
+/* Receives shared by the QPs created on it, messages of any of them wait here when it runs dry */
+struct MockSRQ {
+    struct ibv_srq srq;
+
+    std::mutex                                  mutex;
+    uint32_t                                    max_sge{0};
+    std::deque<MockRecv>                        recv_queue;
+    std::deque<std::pair<MockQP*, MockMessage>> inbound;
+};
+
+inline MockQP* to_mock(struct ibv_qp* qp)
+{
+    return reinterpret_cast<MockQP*>(qp);
+}
+
+inline MockCQ* to_mock(struct ibv_cq* cq)
+{
+    return reinterpret_cast<MockCQ*>(cq);
+}
+
+inline MockChannel* to_mock(struct ibv_comp_channel* channel)
+{
+    return reinterpret_cast<MockChannel*>(channel);
+}
+
+inline MockSRQ* to_mock(struct ibv_srq* srq)
+{
+    return reinterpret_cast<MockSRQ*>(srq);
+}
+
+/* Process-wide registry which plays the role of the wire */
+class MockFabric {
+public:
+    static MockFabric& instance()
+    {
+        static MockFabric fabric;
+        return fabric;
+    }
+
+    uint32_t add_qp(MockQP* qp)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        uint32_t                            qpn = next_qpn_++;
+        qps_[qpn]                               = qp;
+        return qpn;
+    }
+
+    void remove_qp(uint32_t qpn)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        qps_.erase(qpn);
+    }
+
+    MockQP* find_qp(uint32_t qpn)
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        auto                                it = qps_.find(qpn);
+        return it == qps_.end() ? nullptr : it->second;
+    }
+
+    uint32_t add_mr(MockMR* mr)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        uint32_t                            key = next_key_++;
+        mrs_[key]                               = mr;
+        return key;
+    }
+
+    void remove_mr(uint32_t key)
+    {
+        std::unique_lock<std::shared_mutex> lock(mutex_);
+        mrs_.erase(key);
+    }
+
+    MockMR* find_mr(uint32_t key)
+    {
+        std::shared_lock<std::shared_mutex> lock(mutex_);
+        auto                                it = mrs_.find(key);
+        return it == mrs_.end() ? nullptr : it->second;
+    }
+
+private:
+    std::shared_mutex                     mutex_;
+    uint32_t                              next_qpn_{0x100};
+    uint32_t                              next_key_{0x1000};
+    std::unordered_map<uint32_t, MockQP*> qps_;
+    std::unordered_map<uint32_t, MockMR*> mrs_;
+};
+
+/* [addr, addr + length) must lie inside a registered region with the given rights */
+bool check_access(MockMR* mr, uint64_t addr, uint64_t length, int access)
+{
+    if (!mr)
+        return false;
+    uint64_t begin = (uint64_t)mr->mr.addr;
+    if (addr < begin || addr + length > begin + mr->mr.length)
+        return false;
+    return (mr->access & access) == access;
+}
+
+void push_completion(MockCQ* cq, const struct ibv_wc& wc)
+{
+    MockChannel* channel = nullptr;
+    {
+        std::unique_lock<std::mutex> lock(cq->mutex);
+        cq->entries.push_back(wc);
+        if (cq->armed && cq->cq.channel) {
+            cq->armed = false;
+            channel   = to_mock(cq->cq.channel);
+        }
+    }
+    if (channel) {
+        std::unique_lock<std::mutex> lock(channel->mutex);
+        channel->events.push_back(cq);
+        channel->cv.notify_one();
+    }
+}
+
+void complete(MockQP*            qp,
+              bool               is_recv,
+              uint64_t           wr_id,
+              enum ibv_wc_status status,
+              enum ibv_wc_opcode opcode,
+              uint32_t           byte_len = 0,
+              bool               with_imm = false,
+              uint32_t           imm_data = 0)
+{
+    struct ibv_wc wc;
+    memset(&wc, 0, sizeof(wc));
+    wc.wr_id    = wr_id;
+    wc.status   = status;
+    wc.opcode   = opcode;
+    wc.byte_len = byte_len;
+    wc.qp_num   = qp->qp.qp_num;
+    if (with_imm) {
+        wc.wc_flags = IBV_WC_WITH_IMM;
+        wc.imm_data = imm_data;
+    }
+    push_completion(to_mock(is_recv ? qp->qp.recv_cq : qp->qp.send_cq), wc);
+}
+
+enum ibv_wc_opcode send_wc_opcode(enum ibv_wr_opcode opcode)
+{
+    switch (opcode) {
+        case IBV_WR_RDMA_READ:
+            return IBV_WC_RDMA_READ;
+        case IBV_WR_RDMA_WRITE:
+        case IBV_WR_RDMA_WRITE_WITH_IMM:
+            return IBV_WC_RDMA_WRITE;
+        default:
+            return IBV_WC_SEND;
+    }
+}
+
+/* Scatter a matched message into a posted receive and complete it, returns the status seen by the sender */
+enum ibv_wc_status consume(MockQP* receiver, MockRecv& recv, MockMessage& message)
+{
+    enum ibv_wc_status status = IBV_WC_SUCCESS;
+    if (message.is_send) {
+        size_t copied = 0;
+        for (struct ibv_sge& sge : recv.sg_list) {
+            if (copied == message.payload.size())
+                break;
+            size_t length = std::min<size_t>(sge.length, message.payload.size() - copied);
+            if (!check_access(MockFabric::instance().find_mr(sge.lkey), sge.addr, length, IBV_ACCESS_LOCAL_WRITE)) {
+                status = IBV_WC_LOC_PROT_ERR;
+                break;
+            }
+            memcpy((void*)sge.addr, message.payload.data() + copied, length);
+            copied += length;
+        }
+        if (status == IBV_WC_SUCCESS && copied < message.payload.size())
+            status = IBV_WC_LOC_LEN_ERR;
+    }
+
+    complete(receiver,
+             true,
+             recv.wr_id,
+             status,
+             message.is_send ? IBV_WC_RECV : IBV_WC_RECV_RDMA_WITH_IMM,
+             message.byte_len,
+             message.with_imm,
+             message.imm_data);
+
+    return status == IBV_WC_SUCCESS ? IBV_WC_SUCCESS : IBV_WC_REM_INV_REQ_ERR;
+}
+
+void move_to_error(MockQP* qp);
+
+/* Completion of a message which had to wait for the peer to post a receive */
+void complete_deferred(MockMessage& message, enum ibv_wc_status status)
+{
+    if (!message.signaled && status == IBV_WC_SUCCESS)
+        return;
+    if (status != IBV_WC_SUCCESS)
+        move_to_error(message.sender);
+    complete(message.sender,
+             false,
+             message.wr_id,
+             status,
+             message.is_send ? IBV_WC_SEND : IBV_WC_RDMA_WRITE,
+             message.byte_len);
+}
+
+/*
+  Error state, like a real HCA: posted receives and own messages still waiting for a receive of
+  the peer complete with a flush error, messages of the peer waiting here are never answered.
+*/
+void move_to_error(MockQP* qp)
+{
+    std::deque<MockRecv>    recvs;
+    std::deque<MockMessage> inbound;
+    uint32_t                dest_qpn;
+    {
+        std::unique_lock<std::mutex> lock(qp->mutex);
+        qp->qp.state = IBV_QPS_ERR;
+        recvs.swap(qp->recv_queue);
+        inbound.swap(qp->inbound);
+        dest_qpn = qp->dest_qpn;
+    }
+    for (MockRecv& recv : recvs)
+        complete(qp, true, recv.wr_id, IBV_WC_WR_FLUSH_ERR, IBV_WC_RECV);
+    for (MockMessage& message : inbound)
+        complete_deferred(message, IBV_WC_RETRY_EXC_ERR);
+
+    std::vector<MockMessage> outbound;
+    MockQP*                  peer = MockFabric::instance().find_qp(dest_qpn);
+    if (peer && peer->qp.srq) {
+        MockSRQ*                     srq = to_mock(peer->qp.srq);
+        std::unique_lock<std::mutex> lock(srq->mutex);
+        for (auto it = srq->inbound.begin(); it != srq->inbound.end();) {
+            if (it->second.sender != qp) {
+                ++it;
+                continue;
+            }
+            outbound.push_back(std::move(it->second));
+            it = srq->inbound.erase(it);
+        }
+    }
+    else if (peer) {
+        std::unique_lock<std::mutex> lock(peer->mutex);
+        for (auto it = peer->inbound.begin(); it != peer->inbound.end();) {
+            if (it->sender != qp) {
+                ++it;
+                continue;
+            }
+            outbound.push_back(std::move(*it));
+            it = peer->inbound.erase(it);
+        }
+    }
+    for (MockMessage& message : outbound)
+        complete(qp, false, message.wr_id, IBV_WC_WR_FLUSH_ERR, message.is_send ? IBV_WC_SEND : IBV_WC_RDMA_WRITE);
+}
+
+/* Returns false when the message has to wait for a receive to be posted */
+bool deliver(MockQP* receiver, MockMessage& message, enum ibv_wc_status& status)
+{
+    MockRecv recv;
+    if (receiver->qp.srq) {
+        MockSRQ*                     srq = to_mock(receiver->qp.srq);
+        std::unique_lock<std::mutex> lock(srq->mutex);
+        if (srq->recv_queue.empty()) {
+            srq->inbound.emplace_back(receiver, std::move(message));
+            return false;
+        }
+        recv = std::move(srq->recv_queue.front());
+        srq->recv_queue.pop_front();
+    }
+    else {
+        std::unique_lock<std::mutex> lock(receiver->mutex);
+        if (receiver->recv_queue.empty()) {
+            receiver->inbound.push_back(std::move(message));
+            return false;
+        }
+        recv = std::move(receiver->recv_queue.front());
+        receiver->recv_queue.pop_front();
+    }
+    status = consume(receiver, recv, message);
+    return true;
+}
+
+enum ibv_wc_status execute(MockQP* qp, uint32_t dest_qpn, struct ibv_send_wr* wr, bool signaled, bool& deferred)
+{
+    MockFabric& fabric = MockFabric::instance();
+    bool        inline_data = wr->send_flags & IBV_SEND_INLINE;
+
+    uint64_t total_length = 0;
+    for (int i = 0; i < wr->num_sge; ++i)
+        total_length += wr->sg_list[i].length;
+
+    if (inline_data && total_length > qp->max_inline_data)
+        return IBV_WC_LOC_LEN_ERR;
+
+    // A peer QP that cannot receive never acknowledges, the requester runs out of retries
+    MockQP* peer = fabric.find_qp(dest_qpn);
+    if (!peer)
+        return IBV_WC_RETRY_EXC_ERR;
+    {
+        std::unique_lock<std::mutex> lock(peer->mutex);
+        if (peer->qp.state != IBV_QPS_RTR && peer->qp.state != IBV_QPS_RTS)
+            return IBV_WC_RETRY_EXC_ERR;
+    }
+
+    switch (wr->opcode) {
+        case IBV_WR_RDMA_READ: {
+            MockMR* remote_mr = fabric.find_mr(wr->wr.rdma.rkey);
+            if (!check_access(remote_mr, wr->wr.rdma.remote_addr, total_length, IBV_ACCESS_REMOTE_READ))
+                return IBV_WC_REM_ACCESS_ERR;
+            uint64_t remote_addr = wr->wr.rdma.remote_addr;
+            for (int i = 0; i < wr->num_sge; ++i) {
+                struct ibv_sge& sge = wr->sg_list[i];
+                if (!check_access(fabric.find_mr(sge.lkey), sge.addr, sge.length, IBV_ACCESS_LOCAL_WRITE))
+                    return IBV_WC_LOC_PROT_ERR;
+                memcpy((void*)sge.addr, (void*)remote_addr, sge.length);
+                remote_addr += sge.length;
+            }
+            return IBV_WC_SUCCESS;
+        }
+        case IBV_WR_RDMA_WRITE:
+        case IBV_WR_RDMA_WRITE_WITH_IMM: {
+            MockMR* remote_mr = fabric.find_mr(wr->wr.rdma.rkey);
+            if (total_length > 0
+                && !check_access(remote_mr, wr->wr.rdma.remote_addr, total_length, IBV_ACCESS_REMOTE_WRITE))
+                return IBV_WC_REM_ACCESS_ERR;
+            uint64_t remote_addr = wr->wr.rdma.remote_addr;
+            for (int i = 0; i < wr->num_sge; ++i) {
+                struct ibv_sge& sge = wr->sg_list[i];
+                if (!inline_data && !check_access(fabric.find_mr(sge.lkey), sge.addr, sge.length, 0))
+                    return IBV_WC_LOC_PROT_ERR;
+                memcpy((void*)remote_addr, (void*)sge.addr, sge.length);
+                remote_addr += sge.length;
+            }
+            if (wr->opcode == IBV_WR_RDMA_WRITE)
+                return IBV_WC_SUCCESS;
+            MockMessage        message{qp, wr->wr_id, signaled, false, (uint32_t)total_length, true, wr->imm_data, {}};
+            enum ibv_wc_status status = IBV_WC_SUCCESS;
+            deferred                  = !deliver(peer, message, status);
+            return status;
+        }
+        case IBV_WR_SEND:
+        case IBV_WR_SEND_WITH_IMM: {
+            MockMessage message{qp,
+                                wr->wr_id,
+                                signaled,
+                                true,
+                                (uint32_t)total_length,
+                                wr->opcode == IBV_WR_SEND_WITH_IMM,
+                                wr->imm_data,
+                                std::vector<char>(total_length)};
+            size_t copied = 0;
+            for (int i = 0; i < wr->num_sge; ++i) {
+                struct ibv_sge& sge = wr->sg_list[i];
+                if (!inline_data && !check_access(fabric.find_mr(sge.lkey), sge.addr, sge.length, 0))
+                    return IBV_WC_LOC_PROT_ERR;
+                memcpy(message.payload.data() + copied, (void*)sge.addr, sge.length);
+                copied += sge.length;
+            }
+            enum ibv_wc_status status = IBV_WC_SUCCESS;
+            deferred                  = !deliver(peer, message, status);
+            return status;
+        }
+        default:
+            return IBV_WC_LOC_QP_OP_ERR;
+    }
+}
+
+int mock_post_send(struct ibv_qp* ibv_qp, struct ibv_send_wr* wr, struct ibv_send_wr** bad_wr)
+{
+    MockQP*           qp = to_mock(ibv_qp);
+    enum ibv_qp_state state;
+    uint32_t          dest_qpn;
+    {
+        std::unique_lock<std::mutex> lock(qp->mutex);
+        state    = qp->qp.state;
+        dest_qpn = qp->dest_qpn;
+    }
+    if (state != IBV_QPS_RTS && state != IBV_QPS_ERR) {
+        *bad_wr = wr;
+        return EINVAL;
+    }
+
+    for (; wr; wr = wr->next) {
+        if (wr->num_sge > (int)qp->max_send_sge) {
+            *bad_wr = wr;
+            return EINVAL;
+        }
+        bool signaled = qp->sq_sig_all || (wr->send_flags & IBV_SEND_SIGNALED);
+        if (state == IBV_QPS_ERR) {
+            complete(qp, false, wr->wr_id, IBV_WC_WR_FLUSH_ERR, send_wc_opcode(wr->opcode));
+            continue;
+        }
+        bool               deferred = false;
+        enum ibv_wc_status status   = IBV_WC_SUCCESS;
+        {
+            std::unique_lock<std::mutex> lock(qp->mutex);
+            if (qp->inject_errors > 0) {
+                qp->inject_errors -= 1;
+                status = qp->inject_status;
+            }
+        }
+        if (status == IBV_WC_SUCCESS)
+            status = execute(qp, dest_qpn, wr, signaled, deferred);
+        if (status != IBV_WC_SUCCESS) {
+            SLIME_LOG_DEBUG("mock qp ", qp->qp.qp_num, " moved to error: ", ibv_wc_status_str(status));
+            complete(qp, false, wr->wr_id, status, send_wc_opcode(wr->opcode));
+            move_to_error(qp);
+            state = IBV_QPS_ERR;
+            continue;
+        }
+        if (signaled && !deferred) {
+            uint32_t byte_len = 0;
+            for (int i = 0; i < wr->num_sge; ++i)
+                byte_len += wr->sg_list[i].length;
+            complete(qp, false, wr->wr_id, IBV_WC_SUCCESS, send_wc_opcode(wr->opcode), byte_len);
+        }
+    }
+    return 0;
+}
+
+int mock_post_recv(struct ibv_qp* ibv_qp, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr)
+{
+    MockQP* qp = to_mock(ibv_qp);
+
+    std::vector<std::pair<MockRecv, MockMessage>> matched;
+    {
+        std::unique_lock<std::mutex> lock(qp->mutex);
+        // Receives of a QP on an SRQ are posted to the SRQ
+        if (qp->qp.state == IBV_QPS_RESET || qp->qp.srq) {
+            *bad_wr = wr;
+            return EINVAL;
+        }
+        for (; wr; wr = wr->next) {
+            if (wr->num_sge > (int)qp->max_recv_sge) {
+                *bad_wr = wr;
+                return EINVAL;
+            }
+            if (qp->qp.state == IBV_QPS_ERR) {
+                lock.unlock();
+                complete(qp, true, wr->wr_id, IBV_WC_WR_FLUSH_ERR, IBV_WC_RECV);
+                lock.lock();
+                continue;
+            }
+            qp->recv_queue.push_back(
+                MockRecv{wr->wr_id, std::vector<struct ibv_sge>(wr->sg_list, wr->sg_list + wr->num_sge)});
+        }
+        while (!qp->inbound.empty() && !qp->recv_queue.empty()) {
+            matched.emplace_back(std::move(qp->recv_queue.front()), std::move(qp->inbound.front()));
+            qp->recv_queue.pop_front();
+            qp->inbound.pop_front();
+        }
+    }
+
+    for (auto& item : matched)
+        complete_deferred(item.second, consume(qp, item.first, item.second));
+    return 0;
+}
+
+int mock_post_srq_recv(struct ibv_srq* ibv_srq, struct ibv_recv_wr* wr, struct ibv_recv_wr** bad_wr)
+{
+    MockSRQ* srq = to_mock(ibv_srq);
+
+    std::vector<std::tuple<MockQP*, MockRecv, MockMessage>> matched;
+    {
+        std::unique_lock<std::mutex> lock(srq->mutex);
+        for (; wr; wr = wr->next) {
+            if (wr->num_sge > (int)srq->max_sge) {
+                *bad_wr = wr;
+                return EINVAL;
+            }
+            srq->recv_queue.push_back(
+                MockRecv{wr->wr_id, std::vector<struct ibv_sge>(wr->sg_list, wr->sg_list + wr->num_sge)});
+        }
+        while (!srq->inbound.empty() && !srq->recv_queue.empty()) {
+            matched.emplace_back(srq->inbound.front().first,
+                                 std::move(srq->recv_queue.front()),
+                                 std::move(srq->inbound.front().second));
+            srq->recv_queue.pop_front();
+            srq->inbound.pop_front();
+        }
+    }
+
+    for (auto& item : matched)
+        complete_deferred(std::get<2>(item), consume(std::get<0>(item), std::get<1>(item), std::get<2>(item)));
+    return 0;
+}
+
+int mock_poll_cq(struct ibv_cq* ibv_cq, int num_entries, struct ibv_wc* wc)
+{
+    MockCQ*                      cq = to_mock(ibv_cq);
+    std::unique_lock<std::mutex> lock(cq->mutex);
+    int                          n = 0;
+    while (n < num_entries && !cq->entries.empty()) {
+        wc[n++] = cq->entries.front();
+        cq->entries.pop_front();
+    }
+    return n;
+}
+
+int mock_req_notify_cq(struct ibv_cq* ibv_cq, int /*solicited_only*/)
+{
+    MockCQ*                      cq = to_mock(ibv_cq);
+    std::unique_lock<std::mutex> lock(cq->mutex);
+    cq->armed = true;
+    return 0;
+}
+
+}  // namespace
+
+MockVerbsProvider::MockVerbsProvider(int num_devices)
+{
+    for (int i = 0; i < num_devices; ++i) {
+        MockDevice* dev = new MockDevice();
+        memset(&dev->device, 0, sizeof(dev->device));
+        dev->index                 = i;
+        dev->device.node_type      = IBV_NODE_CA;
+        dev->device.transport_type = IBV_TRANSPORT_IB;
+        snprintf(dev->device.name, sizeof(dev->device.name), "mock_%d", i);
+        snprintf(dev->device.dev_name, sizeof(dev->device.dev_name), "uverbs%d", i);
+        snprintf(dev->device.dev_path, sizeof(dev->device.dev_path), "/sys/class/infiniband_verbs/uverbs%d", i);
+        snprintf(dev->device.ibdev_path, sizeof(dev->device.ibdev_path), "/sys/class/infiniband/mock_%d", i);
+        devices_.push_back(&dev->device);
+    }
+}
+
+MockVerbsProvider::~MockVerbsProvider()
+{
+    for (struct ibv_device* dev : devices_)
+        delete reinterpret_cast<MockDevice*>(dev);
+}
+
+struct ibv_device** MockVerbsProvider::get_device_list(int* num_devices)
+{
+    struct ibv_device** list = new struct ibv_device*[devices_.size() + 1];
+    std::copy(devices_.begin(), devices_.end(), list);
+    list[devices_.size()] = nullptr;
+    *num_devices          = devices_.size();
+    return list;
+}
+
+void MockVerbsProvider::free_device_list(struct ibv_device** list)
+{
+    delete[] list;
+}
+
+struct ibv_context* MockVerbsProvider::open_device(struct ibv_device* device)
+{
+    struct ibv_context* context = new ibv_context();
+    memset(context, 0, sizeof(*context));
+    context->device                = device;
+    context->cmd_fd                = -1;
+    context->async_fd              = -1;
+    context->num_comp_vectors      = 1;
+    context->ops.post_send         = mock_post_send;
+    context->ops.post_recv         = mock_post_recv;
+    context->ops.post_srq_recv     = mock_post_srq_recv;
+    context->ops.poll_cq           = mock_poll_cq;
+    context->ops.req_notify_cq     = mock_req_notify_cq;
+    pthread_mutex_init(&context->mutex, NULL);
+    return context;
+}
+
+int MockVerbsProvider::query_device(struct ibv_context* /*context*/, struct ibv_device_attr* device_attr)
+{
+    memset(device_attr, 0, sizeof(*device_attr));
+    snprintf(device_attr->fw_ver, sizeof(device_attr->fw_ver), "mock");
+    device_attr->max_mr_size         = UINT64_MAX;
+    device_attr->page_size_cap       = 0xfffff000;
+    device_attr->max_qp              = 1 << 17;
+    device_attr->max_qp_wr           = MOCK_MAX_QP_WR;
+    device_attr->max_sge             = MOCK_MAX_SGE;
+    device_attr->max_sge_rd          = MOCK_MAX_SGE;
+    device_attr->max_cq              = 1 << 24;
+    device_attr->max_cqe             = MOCK_MAX_CQE;
+    device_attr->max_mr              = 1 << 24;
+    device_attr->max_pd              = 1 << 24;
+    device_attr->max_qp_rd_atom      = 16;
+    device_attr->max_qp_init_rd_atom = 16;
+    device_attr->max_srq             = 1 << 23;
+    device_attr->max_srq_wr          = MOCK_MAX_QP_WR;
+    device_attr->max_srq_sge         = MOCK_MAX_SGE;
+    device_attr->phys_port_cnt       = 1;
+    return 0;
+}
+
+int MockVerbsProvider::query_port(struct ibv_context* /*context*/, uint8_t port_num, struct ibv_port_attr* port_attr)
+{
+    if (port_num != 1)
+        return EINVAL;
+    memset(port_attr, 0, sizeof(*port_attr));
+    port_attr->state        = IBV_PORT_ACTIVE;
+    port_attr->max_mtu      = IBV_MTU_4096;
+    port_attr->active_mtu   = IBV_MTU_4096;
+    port_attr->gid_tbl_len  = 1;
+    port_attr->max_msg_sz   = 1u << 30;
+    port_attr->lid          = 0;
+    port_attr->active_width = 2;   // 4x
+    port_attr->active_speed = 64;  // HDR
+    port_attr->link_layer   = IBV_LINK_LAYER_ETHERNET;
+    return 0;
+}
+
+int MockVerbsProvider::query_gid(struct ibv_context* context, uint8_t /*port_num*/, int /*index*/, union ibv_gid* gid)
+{
+    int dev_index = reinterpret_cast<MockDevice*>(context->device)->index;
+    memset(gid, 0, sizeof(*gid));
+    // ::ffff:10.0.0.x
+    gid->raw[10] = 0xff;
+    gid->raw[11] = 0xff;
+    gid->raw[12] = 10;
+    gid->raw[15] = dev_index + 1;
+    return 0;
+}
+
+int MockVerbsProvider::find_sgid_index(struct ibv_context* /*context*/, uint8_t /*port_num*/)
+{
+    return 0;
+}
+
+struct ibv_pd* MockVerbsProvider::alloc_pd(struct ibv_context* context)
+{
+    struct ibv_pd* pd = new ibv_pd();
+    pd->context       = context;
+    return pd;
+}
+
+int MockVerbsProvider::dealloc_pd(struct ibv_pd* pd)
+{
+    delete pd;
+    return 0;
+}
+
+struct ibv_mr* MockVerbsProvider::reg_mr(struct ibv_pd* pd, void* addr, size_t length, int access)
+{
+    MockMR* mr     = new MockMR();
+    mr->mr.context = pd->context;
+    mr->mr.pd      = pd;
+    mr->mr.addr    = addr;
+    mr->mr.length  = length;
+    mr->access     = access;
+    mr->mr.lkey = mr->mr.rkey = MockFabric::instance().add_mr(mr);
+    mr->mr.handle             = mr->mr.lkey;
+    return &mr->mr;
+}
+
+int MockVerbsProvider::dereg_mr(struct ibv_mr* ibv_mr)
+{
+    // WRs posted after this see an unknown key and fail the access check, like a real HCA
+    MockFabric::instance().remove_mr(ibv_mr->lkey);
+    delete reinterpret_cast<MockMR*>(ibv_mr);
+    return 0;
+}
+
+struct ibv_comp_channel* MockVerbsProvider::create_comp_channel(struct ibv_context* context)
+{
+    MockChannel* channel     = new MockChannel();
+    channel->channel.context = context;
+    channel->channel.fd      = -1;
+    channel->channel.refcnt  = 0;
+    return &channel->channel;
+}
+
+int MockVerbsProvider::destroy_comp_channel(struct ibv_comp_channel* ibv_channel)
+{
+    // Like libibverbs, not while a CQ still reports to it
+    if (ibv_channel->refcnt)
+        return EBUSY;
+    delete to_mock(ibv_channel);
+    return 0;
+}
+
+struct ibv_cq* MockVerbsProvider::create_cq(
+    struct ibv_context* context, int cqe, void* cq_context, struct ibv_comp_channel* channel, int /*comp_vector*/)
+{
+    if (cqe > MOCK_MAX_CQE)
+        return nullptr;
+    MockCQ* cq        = new MockCQ();
+    cq->cq.context    = context;
+    cq->cq.channel    = channel;
+    cq->cq.cq_context = cq_context;
+    cq->cq.cqe        = cqe;
+    if (channel)
+        ++channel->refcnt;
+    return &cq->cq;
+}
+
+int MockVerbsProvider::destroy_cq(struct ibv_cq* ibv_cq)
+{
+    if (ibv_cq->channel)
+        --ibv_cq->channel->refcnt;
+    delete to_mock(ibv_cq);
+    return 0;
+}
+
+int MockVerbsProvider::get_cq_event(struct ibv_comp_channel* ibv_channel, struct ibv_cq** cq, void** cq_context)
+{
+    MockChannel*                 channel = to_mock(ibv_channel);
+    std::unique_lock<std::mutex> lock(channel->mutex);
+    channel->cv.wait(lock, [channel]() { return !channel->events.empty(); });
+    MockCQ* mock_cq = channel->events.front();
+    channel->events.pop_front();
+    *cq         = &mock_cq->cq;
+    *cq_context = mock_cq->cq.cq_context;
+    return 0;
+}
+
+int MockVerbsProvider::wait_cq_event(struct ibv_comp_channel* ibv_channel, int timeout_ms)
+{
+    MockChannel*                 channel = to_mock(ibv_channel);
+    std::unique_lock<std::mutex> lock(channel->mutex);
+    if (timeout_ms < 0) {
+        channel->cv.wait(lock, [channel]() { return !channel->events.empty(); });
+        return 1;
+    }
+    return channel->cv.wait_for(
+        lock, std::chrono::milliseconds(timeout_ms), [channel]() { return !channel->events.empty(); });
+}
+
+void MockVerbsProvider::ack_cq_events(struct ibv_cq* cq, unsigned int nevents)
+{
+    cq->comp_events_completed += nevents;
+}
+
+struct ibv_qp* MockVerbsProvider::create_qp(struct ibv_pd* pd, struct ibv_qp_init_attr* qp_init_attr)
+{
+    if (qp_init_attr->qp_type != IBV_QPT_RC || qp_init_attr->cap.max_send_wr > MOCK_MAX_QP_WR
+        || qp_init_attr->cap.max_recv_wr > MOCK_MAX_QP_WR || qp_init_attr->cap.max_send_sge > MOCK_MAX_SGE
+        || qp_init_attr->cap.max_recv_sge > MOCK_MAX_SGE || qp_init_attr->cap.max_inline_data > MOCK_MAX_INLINE)
+        return nullptr;
+
+    MockQP* qp          = new MockQP();
+    qp->qp.context      = pd->context;
+    qp->qp.qp_context   = qp_init_attr->qp_context;
+    qp->qp.pd           = pd;
+    qp->qp.send_cq      = qp_init_attr->send_cq;
+    qp->qp.recv_cq      = qp_init_attr->recv_cq;
+    qp->qp.srq          = qp_init_attr->srq;
+    qp->qp.state        = IBV_QPS_RESET;
+    qp->qp.qp_type      = qp_init_attr->qp_type;
+    qp->max_send_sge    = qp_init_attr->cap.max_send_sge;
+    qp->max_recv_sge    = qp_init_attr->cap.max_recv_sge;
+    qp->max_inline_data = qp_init_attr->cap.max_inline_data;
+    qp->sq_sig_all      = qp_init_attr->sq_sig_all;
+    qp->qp.qp_num       = MockFabric::instance().add_qp(qp);
+    qp->qp.handle       = qp->qp.qp_num;
+    return &qp->qp;
+}
+
+int MockVerbsProvider::modify_qp(struct ibv_qp* ibv_qp, struct ibv_qp_attr* attr, int attr_mask)
+{
+    MockQP* qp = to_mock(ibv_qp);
+    if ((attr_mask & IBV_QP_STATE) && attr->qp_state == IBV_QPS_ERR) {
+        move_to_error(qp);
+        return 0;
+    }
+
+    std::unique_lock<std::mutex> lock(qp->mutex);
+    if (!(attr_mask & IBV_QP_STATE))
+        return 0;
+
+    enum ibv_qp_state cur = qp->qp.state;
+    enum ibv_qp_state nxt = attr->qp_state;
+    bool              valid = nxt == IBV_QPS_RESET || nxt == IBV_QPS_ERR;
+    valid |= cur == IBV_QPS_RESET && nxt == IBV_QPS_INIT;
+    valid |= cur == IBV_QPS_INIT && (nxt == IBV_QPS_INIT || nxt == IBV_QPS_RTR);
+    valid |= (cur == IBV_QPS_RTR || cur == IBV_QPS_RTS) && nxt == IBV_QPS_RTS;
+    if (!valid)
+        return EINVAL;
+
+    if (nxt == IBV_QPS_RESET) {
+        qp->recv_queue.clear();
+        qp->inbound.clear();
+        qp->dest_qpn = 0;
+    }
+    if (attr_mask & IBV_QP_DEST_QPN)
+        qp->dest_qpn = attr->dest_qp_num;
+    qp->qp.state = nxt;
+    return 0;
+}
+
+int MockVerbsProvider::destroy_qp(struct ibv_qp* ibv_qp)
+{
+    // Unreachable from the fabric first, a peer posting to it from now on finds no QP
+    MockFabric::instance().remove_qp(ibv_qp->qp_num);
+    delete to_mock(ibv_qp);
+    return 0;
+}
+
+struct ibv_srq* MockVerbsProvider::create_srq(struct ibv_pd* pd, struct ibv_srq_init_attr* srq_init_attr)
+{
+    if (srq_init_attr->attr.max_wr > MOCK_MAX_QP_WR || srq_init_attr->attr.max_sge > MOCK_MAX_SGE)
+        return nullptr;
+
+    MockSRQ* srq         = new MockSRQ();
+    srq->srq.context     = pd->context;
+    srq->srq.srq_context = srq_init_attr->srq_context;
+    srq->srq.pd          = pd;
+    srq->max_sge         = srq_init_attr->attr.max_sge;
+    return &srq->srq;
+}
+
+int MockVerbsProvider::destroy_srq(struct ibv_srq* ibv_srq)
+{
+    delete to_mock(ibv_srq);
+    return 0;
+}
+
+void mock_inject_qp_errors(uint32_t qp_num, int count, enum ibv_wc_status status)
+{
+    MockQP* qp = MockFabric::instance().find_qp(qp_num);
+    SLIME_ASSERT(qp, "no mock QP " << qp_num);
+    std::unique_lock<std::mutex> lock(qp->mutex);
+    qp->inject_errors = count;
+    qp->inject_status = status;
+}
+
+VerbsProvider* mock_verbs_provider()
+{
+    static MockVerbsProvider provider;
+    return &provider;
+}
+
+}  // namespace slime
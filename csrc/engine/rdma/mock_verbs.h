@@ -0,0 +1,78 @@
+#pragma once
+
+#include "engine/rdma/verbs_provider.h"
+
+#include <cstdint>
+#include <vector>
+
+#include <infiniband/verbs.h>
+
+namespace slime {
+
+/*
+  In-process software verbs provider.
+
+  PDs, MRs, CQs and RC QPs are plain heap objects. Work requests are executed at
+  post time: RDMA READ/WRITE are memcpys between registered regions looked up by
+  lkey/rkey, SEND and the immediate variants are matched against the peer's posted
+  receives, from its SRQ if the QP has one (and wait for one, like RNR retries would). Work completions go
+  through the regular ibv_poll_cq / ibv_req_notify_cq / comp_channel path, so the
+  engine above cannot tell the difference.
+
+  QPs are connected through a process-wide fabric keyed by QP number: any two
+  RDMAContexts opened on mock devices in the same process can talk to each other.
+*/
+class MockVerbsProvider: public VerbsProvider {
+public:
+    explicit MockVerbsProvider(int num_devices = 2);
+    ~MockVerbsProvider() override;
+
+    const char* name() const override
+    {
+        return "mock";
+    }
+
+    struct ibv_device** get_device_list(int* num_devices) override;
+    void                free_device_list(struct ibv_device** list) override;
+    struct ibv_context* open_device(struct ibv_device* device) override;
+
+    int query_device(struct ibv_context* context, struct ibv_device_attr* device_attr) override;
+    int query_port(struct ibv_context* context, uint8_t port_num, struct ibv_port_attr* port_attr) override;
+    int query_gid(struct ibv_context* context, uint8_t port_num, int index, union ibv_gid* gid) override;
+    int find_sgid_index(struct ibv_context* context, uint8_t port_num) override;
+
+    struct ibv_pd* alloc_pd(struct ibv_context* context) override;
+    int            dealloc_pd(struct ibv_pd* pd) override;
+    struct ibv_mr* reg_mr(struct ibv_pd* pd, void* addr, size_t length, int access) override;
+    int            dereg_mr(struct ibv_mr* mr) override;
+
+    struct ibv_comp_channel* create_comp_channel(struct ibv_context* context) override;
+    int                      destroy_comp_channel(struct ibv_comp_channel* channel) override;
+    struct ibv_cq*           create_cq(struct ibv_context*      context,
+                                       int                      cqe,
+                                       void*                    cq_context,
+                                       struct ibv_comp_channel* channel,
+                                       int                      comp_vector) override;
+    int                      destroy_cq(struct ibv_cq* cq) override;
+    int  get_cq_event(struct ibv_comp_channel* channel, struct ibv_cq** cq, void** cq_context) override;
+    void ack_cq_events(struct ibv_cq* cq, unsigned int nevents) override;
+    int  wait_cq_event(struct ibv_comp_channel* channel, int timeout_ms) override;
+
+    struct ibv_qp* create_qp(struct ibv_pd* pd, struct ibv_qp_init_attr* qp_init_attr) override;
+    int            modify_qp(struct ibv_qp* qp, struct ibv_qp_attr* attr, int attr_mask) override;
+    int            destroy_qp(struct ibv_qp* qp) override;
+
+    struct ibv_srq* create_srq(struct ibv_pd* pd, struct ibv_srq_init_attr* srq_init_attr) override;
+    int             destroy_srq(struct ibv_srq* srq) override;
+
+private:
+    std::vector<struct ibv_device*> devices_;
+};
+
+/*
+  Fault injection for tests: the next count send WRs posted on the mock QP qp_num fail with
+  status, which moves the QP to the error state and flushes its outstanding work.
+*/
+void mock_inject_qp_errors(uint32_t qp_num, int count = 1, enum ibv_wc_status status = IBV_WC_RETRY_EXC_ERR);
+
+}  // namespace slime
@@ -1,22 +1,34 @@
 #include "rdma_assignment.h"
+
+#include <algorithm>
 #include <stdexcept>
 
 namespace slime {
 
-RDMAAssignment::RDMAAssignment(OpCode opcode, AssignmentBatch& batch, callback_fn_t callback)
+RDMAAssignment::RDMAAssignment(OpCode opcode, AssignmentBatch& batch, callback_fn_t callback, uint32_t imm_data):
+    RDMAAssignment(opcode, batch.data(), batch.size(), callback, imm_data)
+{
+}
+
+RDMAAssignment::RDMAAssignment(
+    OpCode opcode, const Assignment* batch, size_t batch_size, callback_fn_t callback, uint32_t imm_data)
 {
     opcode_     = opcode;
+    imm_data_   = imm_data;
 
-    batch_size_ = batch.size();
+    batch_size_ = batch_size;
     batch_      = new Assignment[batch_size_];
 
-    size_t cnt = 0;
-    for (const Assignment& assignment : batch) {
-        batch_[cnt].mr_key        = assignment.mr_key;
+    for (size_t cnt = 0; cnt < batch_size_; ++cnt) {
+        const Assignment& assignment = batch[cnt];
+        // The key is only needed until the handle has been resolved
+        if (assignment.mr_handle == INVALID_MR_HANDLE)
+            batch_[cnt].mr_key = assignment.mr_key;
+        batch_[cnt].mr_handle     = assignment.mr_handle;
         batch_[cnt].source_offset = assignment.source_offset;
         batch_[cnt].target_offset = assignment.target_offset;
         batch_[cnt].length        = assignment.length;
-        cnt += 1;
+        bytes_ += assignment.length;
     }
     callback_info_ = new callback_info_t(opcode, batch_size_, callback);
 }
@@ -31,10 +43,69 @@ bool RDMAAssignment::query()
     return callback_info_->query();
 }
 
+bool RDMAAssignment::wait_for(std::chrono::milliseconds timeout)
+{
+    return callback_info_->wait_for(timeout);
+}
+
+int RDMAAssignment::status()
+{
+    return callback_info_->status_;
+}
+
+bool RDMAAssignment::mark_posted()
+{
+    int queued = QUEUED;
+    return state_.compare_exchange_strong(queued, POSTED);
+}
+
+bool RDMAAssignment::drop()
+{
+    int queued = QUEUED;
+    return state_.compare_exchange_strong(queued, DROPPED);
+}
+
+bool RDMAAssignment::requeue()
+{
+    int posted = POSTED;
+    return state_.compare_exchange_strong(posted, QUEUED);
+}
+
+bool RDMAAssignment::cancel()
+{
+    bool dropped = false;
+    for (std::weak_ptr<RDMAAssignment>& split : splits_) {
+        RDMAAssignmentSharedPtr assign = split.lock();
+        if (assign && assign->drop()) {
+            assign->callback_info_->notify(callback_info_t::CANCELED);
+            if (assign->on_drop_)
+                assign->on_drop_();
+            dropped = true;
+        }
+    }
+    if (drop()) {
+        if (join_)
+            join_(callback_info_t::CANCELED);
+        else
+            callback_info_->notify(callback_info_t::CANCELED);
+        if (on_drop_)
+            on_drop_();
+        dropped = true;
+    }
+    return dropped;
+}
+
+uint32_t RDMAAssignment::imm_data()
+{
+    if (opcode_ == OpCode::RECV)
+        return callback_info_->imm_data_;
+    return imm_data_;
+}
+
 std::string RDMAAssignment::dump()
 {
     std::string rdma_assignment_dump = "";
-    for (int i = 0; i < batch_size_; ++i) {
+    for (size_t i = 0; i < batch_size_; ++i) {
         rdma_assignment_dump += batch_[i].dump() + "\n";
     }
     return rdma_assignment_dump;
@@ -55,14 +126,36 @@ void RDMASchedulerAssignment::wait()
     return;
 }
 
-void RDMASchedulerAssignment::query()
+bool RDMASchedulerAssignment::wait_for(std::chrono::milliseconds timeout)
+{
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    for (RDMAAssignmentSharedPtr& rdma_assignment : rdma_assignment_batch_) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+        if (!rdma_assignment->wait_for(std::max(left, std::chrono::milliseconds::zero())))
+            return false;
+    }
+    return true;
+}
+
+bool RDMASchedulerAssignment::cancel()
 {
-    throw std::runtime_error("Not Implemented.");
+    bool dropped = false;
+    for (RDMAAssignmentSharedPtr& rdma_assignment : rdma_assignment_batch_)
+        dropped |= rdma_assignment->cancel();
+    return dropped;
+}
+
+bool RDMASchedulerAssignment::query()
+{
+    for (RDMAAssignmentSharedPtr& rdma_assignment : rdma_assignment_batch_) {
+        if (!rdma_assignment->query())
+            return false;
+    }
+    return true;
 }
 
 std::string RDMASchedulerAssignment::dump()
 {
-    size_t      cnt                            = 0;
     std::string rdma_scheduler_assignment_dump = "Scheduler Assignment: {\n";
     for (size_t i = 0; i < rdma_assignment_batch_.size(); ++i) {
         rdma_scheduler_assignment_dump += "RDMAAssignment_" + std::to_string(i) + " (\n";
@@ -3,6 +3,7 @@
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <functional>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
@@ -11,6 +12,7 @@
 #include <string>
 #include <thread>
 #include <unordered_map>
+#include <vector>
 
 #include "engine/assignment.h"
 
@@ -18,36 +20,70 @@ namespace slime {
 
 class RDMAAssignment;
 class RDMASchedulerAssignment;
+struct mr_registration;
 
 using callback_fn_t                = std::function<void(int)>;
 using RDMAAssignmentSharedPtr      = std::shared_ptr<RDMAAssignment>;
 using RDMAAssignmentSharedPtrBatch = std::vector<RDMAAssignmentSharedPtr>;
 
-// TODO (Jimy): add timeout check
+/* Default timeout of submit: no deadline, the assignment waits for its completion however long it takes */
 const std::chrono::milliseconds kNoTimeout = std::chrono::milliseconds::zero();
 
 typedef struct callback_info {
+    typedef enum: int {
+        SUCCESS                   = 0,
+        ASSIGNMENT_BATCH_OVERFLOW = 400,
+        UNKNOWN_OPCODE            = 401,
+        TIME_OUT                  = 402,
+        FAILED                    = 403,
+        CANCELED                  = 404,
+        /* READ or WRITE against a key the peer has not registered, or has unregistered */
+        REMOTE_MR_NOT_REGISTERED = 405,
+    } CALLBACK_STATUS;
+
     callback_info() = default;
-    callback_info(OpCode opcode, size_t batch_size, callback_fn_t callback): opcode_(opcode), batch_size_(batch_size)
+    callback_info(OpCode opcode, size_t batch_size, callback_fn_t callback):
+        opcode_(opcode), batch_size_(batch_size), user_callback_(std::move(callback))
     {
-        if (callback)
-            callback_ = std::move(callback);
     }
 
-    callback_fn_t callback_{[this](int code) {
-        std::unique_lock<std::mutex> lock(mutex_);
-        finished_.fetch_add(1, std::memory_order_relaxed);
-        done_cv_.notify_one();
-    }};
+    /*
+      Run exactly once, when the device is done with the assignment (or it was dropped before
+      being posted). The context wraps it to release the MR leases.
+    */
+    callback_fn_t callback_{[this](int code) { notify(code); }};
 
     OpCode opcode_;
 
     size_t batch_size_;
 
+    callback_fn_t user_callback_;
+
+    /* Immediate data carried by a RECV completion (WRITE_WITH_IMM from the peer) */
+    uint32_t imm_data_{0};
+
+    /* First status reported, a later completion of a timed out WR is not reported again */
+    int               status_{SUCCESS};
+    std::atomic<bool> notified_{false};
+
     std::atomic<int>        finished_{0};
     std::condition_variable done_cv_;
     std::mutex              mutex_;
 
+    /* Hand the status to the user callback, then wake the waiters. False if reported already */
+    bool notify(int code)
+    {
+        if (notified_.exchange(true))
+            return false;
+        status_ = code;
+        if (user_callback_)
+            user_callback_(code);
+        std::unique_lock<std::mutex> lock(mutex_);
+        finished_.fetch_add(1);
+        done_cv_.notify_all();
+        return true;
+    }
+
     void wait()
     {
         std::unique_lock<std::mutex> lock(mutex_);
@@ -55,6 +91,12 @@ typedef struct callback_info {
         return;
     }
 
+    bool wait_for(std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return done_cv_.wait_for(lock, timeout, [this]() { return finished_ > 0; });
+    }
+
     bool query()
     {
         return finished_.load() > 0;
@@ -65,11 +107,17 @@ class RDMAAssignment {
     friend class RDMAContext;
 
 public:
-    RDMAAssignment(OpCode opcode, AssignmentBatch& batch, callback_fn_t callback = nullptr);
+    RDMAAssignment(OpCode opcode, AssignmentBatch& batch, callback_fn_t callback = nullptr, uint32_t imm_data = 0);
+    RDMAAssignment(OpCode           opcode,
+                   const Assignment* batch,
+                   size_t            batch_size,
+                   callback_fn_t     callback = nullptr,
+                   uint32_t          imm_data = 0);
 
     ~RDMAAssignment()
     {
         delete[] batch_;
+        delete[] leases_;
         delete callback_info_;
     }
 
@@ -78,9 +126,34 @@ public:
         return batch_size_;
     };
 
+    /* Total length of the batch */
+    inline uint64_t bytes()
+    {
+        return bytes_;
+    }
+
     void wait();
     bool query();
 
+    /* False if the assignment has not finished within timeout, it keeps running */
+    bool wait_for(std::chrono::milliseconds timeout);
+
+    /* CALLBACK_STATUS the assignment finished with, valid once query() is true */
+    int status();
+
+    /*
+      Drop the assignment (and the earlier splits of its submit) if it has not been posted to
+      the QP yet; its callback then gets CANCELED, once the splits posted already have
+      finished. False if it was already posted or finished, posted WRs cannot be taken back.
+    */
+    bool cancel();
+
+    /*
+      WRITE_WITH_IMM: the tag sent along with the last write.
+      RECV: the tag received, valid once the assignment has completed.
+    */
+    uint32_t imm_data();
+
     std::string dump();
     void        print();
 
@@ -90,6 +163,49 @@ private:
     Assignment* batch_{nullptr};
     size_t      batch_size_;
 
+    /* Registration of each assignment's local MR, leased at submit and posted with */
+    mr_registration** leases_{nullptr};
+    uint64_t    bytes_{0};
+
+    uint32_t imm_data_{0};
+
+    /* Payload of RDMAContext::submit_inline, the batch then holds one assignment without local MR */
+    std::string inline_data_;
+
+    /* Set by submit, time_point::max() without a timeout */
+    std::chrono::steady_clock::time_point deadline_{std::chrono::steady_clock::time_point::max()};
+
+    /* Earlier splits of the same submit, cancelled along with this one */
+    std::vector<std::weak_ptr<RDMAAssignment>> splits_;
+
+    /* Set by the context on the last of several splits: a cancel reports to their join, not the user */
+    callback_fn_t join_;
+
+    /*
+      QUEUED until the WQ dispatcher posts it. A cancel or a deadline passing first moves it to
+      DROPPED instead, the dispatcher then only releases it. A WR failed by a broken QP goes
+      back to QUEUED when it is retried.
+    */
+    enum : int {
+        QUEUED,
+        POSTED,
+        DROPPED
+    };
+    std::atomic<int> state_{QUEUED};
+
+    bool mark_posted();
+    bool drop();
+    bool requeue();
+
+    /* Times posted again after a QP failure, only touched by the CQ poller */
+    int retries_{0};
+
+    /*
+      Set by the context for work no dispatcher looks at again once it is dropped (an SRQ RECV
+      waiting for a message), run by cancel and on timeout to release it right away.
+    */
+    std::function<void()> on_drop_;
+
     callback_info_t* callback_info_;
 };
 
@@ -103,9 +219,16 @@ public:
     }
     ~RDMASchedulerAssignment();
 
-    void query();
+    /* Done once every slice on every device has completed */
+    bool query();
     void wait();
 
+    /* False if some slice has not finished within timeout */
+    bool wait_for(std::chrono::milliseconds timeout);
+
+    /* Cancel every slice not posted yet, true if any was dropped */
+    bool cancel();
+
     std::string dump();
     void        print();
 
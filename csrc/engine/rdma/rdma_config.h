@@ -10,6 +10,7 @@
 #include <string>
 #include <tuple>
 #include <unordered_map>
+#include <vector>
 
 namespace slime {
 
@@ -17,7 +18,110 @@ const static int MAX_SEND_WR = 8192;
 const static int MAX_RECV_WR = 8192;
 const static int POLL_COUNT = 256;
 
+/*
+  Default upper bound of SGEs per WR requested at QP creation, further clamped by the device
+  max_sge / max_sge_rd. Every SGE grows the WQE stride, and MAX_SEND_WR deep send
+  queues must stay within the device max_qp_wr basic blocks.
+*/
+const static int MAX_SGE = 4;
+
+/* Pending assignments per QP (rounded up to a power of two) */
+const static int ASSIGN_QUEUE_DEPTH = 4096;
+
+/* Longest a CQ poller blocked on its channel goes without checking assignment deadlines */
+const static int DEADLINE_CHECK_MS = 10;
+
 using json = nlohmann::json;
+
+/*
+  Runtime sizing of an RDMAContext, the compile-time constants above are the defaults.
+  init clamps every field against ibv_query_device, config() reports what was applied.
+  Both ends of a connection must use the same qp_num.
+*/
+typedef struct RDMAContextConfig {
+    int qp_num      = 4;
+    int max_send_wr = MAX_SEND_WR;
+    int max_recv_wr = MAX_RECV_WR;
+
+    /*
+      Completion queues, each with its own poller thread. qp_to_cq[qpi] picks the CQ of a QP,
+      empty spreads the QPs round robin. cq_size is per CQ, 0 sizes each CQ for the QPs it
+      serves: (max_send_wr + max_recv_wr) per QP. QP i of every peer uses qp_to_cq[i].
+    */
+    int              cq_num  = 1;
+    int              cq_size = 0;
+    std::vector<int> qp_to_cq{};
+
+    /* Threads running completion callbacks, 0 runs them inline on the CQ pollers */
+    int callback_threads = 0;
+
+    int poll_count         = POLL_COUNT;
+    int max_sge            = MAX_SGE;
+    int assign_queue_depth = ASSIGN_QUEUE_DEPTH;
+
+    /*
+      MR registration cache, off with 0: an MR is deregistered once its last key is gone.
+      Otherwise the pinned bytes above which unreferenced cached MRs are deregistered,
+      UINT64_MAX keeps them all. With the cache on, see invalidate_registration_cache before
+      releasing registered memory.
+    */
+    uint64_t mr_cache_bytes = 0;
+
+    /*
+      Shared receive queue of srq_depth buffers of srq_recv_bytes each, pre-posted for all QPs.
+      Incoming SENDs and WRITE_WITH_IMMs land there and are copied into RECV assignments, so
+      the peer never waits for a RECV to be posted. SENDs larger than srq_recv_bytes are
+      refused, both ends must use the same value. 0 posts every RECV on its QP instead.
+    */
+    int srq_depth      = 0;
+    int srq_recv_bytes = 4096;
+
+    /*
+      Inline payload requested at QP creation. SEND / WRITE WRs up to what the device grants
+      are posted with IBV_SEND_INLINE, the CPU copies the payload into the WQE and the NIC
+      skips the DMA read of the buffer. Halved until the device accepts the QPs of init, a
+      peer added later has to get as much or is refused. 0 disables.
+    */
+    int max_inline_data = 256;
+
+    /*
+      A WR failed by a transport error (retries exceeded, link down) or flushed behind one is
+      posted again up to max_retries times on another QP of the peer, the failed QP is reset
+      and takes work again once reconnected (see RDMAContext::qp_recovery_notice). Any other
+      first error of the QP fails its WRs. SEND and WRITE_WITH_IMM may have reached the peer
+      already, they are only retried after an RNR error. With every QP of the peer failed the
+      work waits for one to be reconnected, or for its deadline. 0 reports FAILED right away.
+    */
+    int max_retries = 3;
+
+    /*
+      Peers the context can connect to, each over its own group of qp_num QPs. The group
+      created by init serves connect / submit of the context itself, add_peer hands out the
+      others; all of them share the PD, MRs, CQs and worker threads. cq_size 0 sizes the CQs
+      for all max_peers groups.
+    */
+    int max_peers = 1;
+
+    json to_json() const
+    {
+        return json{{"qp_num", qp_num},
+                    {"max_send_wr", max_send_wr},
+                    {"max_recv_wr", max_recv_wr},
+                    {"cq_num", cq_num},
+                    {"cq_size", cq_size},
+                    {"qp_to_cq", qp_to_cq},
+                    {"callback_threads", callback_threads},
+                    {"poll_count", poll_count},
+                    {"max_sge", max_sge},
+                    {"assign_queue_depth", assign_queue_depth},
+                    {"mr_cache_bytes", mr_cache_bytes},
+                    {"srq_depth", srq_depth},
+                    {"srq_recv_bytes", srq_recv_bytes},
+                    {"max_inline_data", max_inline_data},
+                    {"max_retries", max_retries},
+                    {"max_peers", max_peers}};
+    }
+} rdma_context_config_t;
 typedef struct rdma_info {
     uint32_t      qpn;
     union ibv_gid gid;
@@ -27,7 +131,7 @@ typedef struct rdma_info {
     uint64_t      mtu;
     rdma_info() {}
     rdma_info(uint32_t qpn, union ibv_gid gid, int64_t gidx, uint16_t lid, uint64_t psn, uint64_t mtu):
-        qpn(qpn), gidx(gidx), lid(lid), psn(psn), mtu(mtu), gid(gid)
+        qpn(qpn), gid(gid), gidx(gidx), lid(lid), psn(psn), mtu(mtu)
     {
     }
 
@@ -21,32 +21,27 @@
 #include <unistd.h>
 #include <vector>
 
+#include <arpa/inet.h>
 #include <infiniband/verbs.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdexcept>
 
 namespace slime {
 
-typedef struct callback_info_with_qpi {
-    typedef enum: int {
-        SUCCESS                   = 0,
-        ASSIGNMENT_BATCH_OVERFLOW = 400,
-        UNKNOWN_OPCODE            = 401,
-        TIME_OUT                  = 402,
-        FAILED                    = 403,
-    } CALLBACK_STATUS;
+/* wr_id of an SRQ receive: slot index << 1 with the low bit set, completion records are aligned pointers */
+const static uint64_t SRQ_WR_ID_TAG = 1;
 
-    callback_info_t* callback_info_;
-    int              qpi_;
-} callback_info_with_qpi_t;
-
-int64_t RDMAContext::init(const std::string& dev_name, uint8_t ib_port, const std::string& link_type)
+int64_t RDMAContext::init(const std::string&       dev_name,
+                          uint8_t                  ib_port,
+                          const std::string&       link_type,
+                          const RDMAContextConfig& config)
 {
     device_name_ = dev_name;
     uint16_t      lid;
     enum ibv_mtu  active_mtu;
-    union ibv_gid gid;
+    union ibv_gid gid = {};
     int64_t       gidx;
-    uint32_t      psn;
 
     if (initialized_) {
         SLIME_LOG_ERROR("Already initialized.");
@@ -57,7 +52,7 @@ int64_t RDMAContext::init(const std::string& dev_name, uint8_t ib_port, const st
     struct ibv_device** dev_list;
     struct ibv_device*  ib_dev;
     int                 num_devices;
-    dev_list = ibv_get_device_list(&num_devices);
+    dev_list = verbs_->get_device_list(&num_devices);
     if (!dev_list) {
         SLIME_LOG_ERROR("Failed to get RDMA devices list");
         return -1;
@@ -69,11 +64,11 @@ int64_t RDMAContext::init(const std::string& dev_name, uint8_t ib_port, const st
     }
 
     for (int i = 0; i < num_devices; ++i) {
-        char* dev_name_from_list = (char*)ibv_get_device_name(dev_list[i]);
+        char* dev_name_from_list = dev_list[i]->name;
         if (strcmp(dev_name_from_list, dev_name.c_str()) == 0) {
             SLIME_LOG_INFO("found device " << dev_name_from_list);
             ib_dev  = dev_list[i];
-            ib_ctx_ = ibv_open_device(ib_dev);
+            ib_ctx_ = verbs_->open_device(ib_dev);
             break;
         }
     }
@@ -83,24 +78,26 @@ int64_t RDMAContext::init(const std::string& dev_name, uint8_t ib_port, const st
                        dev_name,
                        ", try to open "
                        "the default device ",
-                       (char*)ibv_get_device_name(dev_list[0]));
-        ib_ctx_ = ibv_open_device(dev_list[0]);
+                       dev_list[0]->name);
+        ib_ctx_ = verbs_->open_device(dev_list[0]);
         if (!ib_ctx_) {
             throw std::runtime_error("Failed to open the default device");
         }
     }
+    verbs_->free_device_list(dev_list);
 
     struct ibv_device_attr device_attr;
-    if (ibv_query_device(ib_ctx_, &device_attr) != 0)
+    if (verbs_->query_device(ib_ctx_, &device_attr) != 0)
         SLIME_LOG_ERROR("Failed to query device");
     SLIME_LOG_DEBUG("Max Memory Region:" << device_attr.max_mr);
     SLIME_LOG_DEBUG("Max Memory Region Size:" << device_attr.max_mr_size);
     SLIME_LOG_DEBUG("Max Memory QP WR:" << device_attr.max_qp_wr);
+    SLIME_LOG_DEBUG("Max SGE:" << device_attr.max_sge << ", Max SGE RD:" << device_attr.max_sge_rd);
     SLIME_LOG_DEBUG("total ib ports:" << (int)device_attr.phys_port_cnt);
 
     struct ibv_port_attr port_attr;
     ib_port_ = ib_port;
-    if (ibv_query_port(ib_ctx_, ib_port, &port_attr)) {
+    if (verbs_->query_port(ib_ctx_, ib_port, &port_attr)) {
         throw std::runtime_error("Unable to query port " + std::to_string(ib_port_) + " attributes\n");
     }
     if ((port_attr.link_layer == IBV_LINK_LAYER_INFINIBAND && link_type == "RoCE")
@@ -112,7 +109,7 @@ int64_t RDMAContext::init(const std::string& dev_name, uint8_t ib_port, const st
         gidx = -1;
     }
     else {
-        gidx = ibv_find_sgid_type(ib_ctx_, ib_port_, ibv_gid_type_custom::IBV_GID_TYPE_ROCE_V2, AF_INET);
+        gidx = verbs_->find_sgid_index(ib_ctx_, ib_port_);
         if (gidx < 0) {
             SLIME_LOG_ERROR("Failed to find GID");
             return -1;
@@ -122,268 +119,928 @@ int64_t RDMAContext::init(const std::string& dev_name, uint8_t ib_port, const st
     lid        = port_attr.lid;
     active_mtu = port_attr.active_mtu;
 
+    port_bandwidth_gbps_ = ibv_port_bandwidth_gbps(port_attr.active_speed, port_attr.active_width);
+    SLIME_LOG_DEBUG("Port bandwidth:" << port_bandwidth_gbps_ << " Gb/s");
+
+    /* Worker placement: cores local to the NIC, within the affinity mask of the process */
+    numa_node_ = ibv_device_numa_node(ib_ctx_->device);
+    worker_cpus_.clear();
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0) {
+        for (int cpu : ibv_device_local_cpus(ib_ctx_->device)) {
+            if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed))
+                worker_cpus_.push_back(cpu);
+        }
+    }
+    SLIME_LOG_INFO("NIC ", dev_name, " NUMA node: ", numa_node_, ", local worker CPUs: ", worker_cpus_.size());
+
+    /* Sizing, clamped to what the device supports */
+    config_             = config;
+    config_.qp_num      = std::max(std::min(config_.qp_num, device_attr.max_qp), 1);
+    config_.max_send_wr = std::max(std::min(config_.max_send_wr, device_attr.max_qp_wr), 1);
+    config_.max_recv_wr = std::max(std::min(config_.max_recv_wr, device_attr.max_qp_wr), 1);
+    config_.cq_num      = std::max(std::min({config_.cq_num, config_.qp_num, device_attr.max_cq}), 1);
+    if (!config_.qp_to_cq.empty() && config_.qp_to_cq.size() != size_t(config_.qp_num)) {
+        SLIME_LOG_WARN("qp_to_cq has ", config_.qp_to_cq.size(), " entries for ", config_.qp_num, " QPs, ignored");
+        config_.qp_to_cq.clear();
+    }
+    for (int cqi : config_.qp_to_cq) {
+        if (cqi < 0 || cqi >= config_.cq_num) {
+            SLIME_LOG_WARN("qp_to_cq entry ", cqi, " out of ", config_.cq_num, " CQs, ignored");
+            config_.qp_to_cq.clear();
+            break;
+        }
+    }
+    if (config_.qp_to_cq.empty()) {
+        for (int qpi = 0; qpi < config_.qp_num; ++qpi)
+            config_.qp_to_cq.push_back(qpi % config_.cq_num);
+    }
+    if (config_.cq_size <= 0) {
+        std::vector<int> qps_per_cq(config_.cq_num, 0);
+        for (int cqi : config_.qp_to_cq)
+            qps_per_cq[cqi] += 1;
+        int64_t qps     = *std::max_element(qps_per_cq.begin(), qps_per_cq.end()) * (int64_t)config_.max_peers;
+        config_.cq_size = std::min<int64_t>(qps * (config_.max_send_wr + config_.max_recv_wr), device_attr.max_cqe);
+    }
+    config_.cq_size            = std::max(std::min(config_.cq_size, device_attr.max_cqe), 1);
+    config_.callback_threads   = std::max(config_.callback_threads, 0);
+    config_.poll_count         = std::max(config_.poll_count, 1);
+    config_.max_sge            = std::max(std::min(config_.max_sge, device_attr.max_sge), 1);
+    config_.assign_queue_depth = std::max(config_.assign_queue_depth, 1);
+    config_.srq_depth          = std::max(std::min(config_.srq_depth, device_attr.max_srq_wr), 0);
+    config_.srq_recv_bytes     = std::max(config_.srq_recv_bytes, 1);
+    config_.max_inline_data    = std::max(config_.max_inline_data, 0);
+    config_.max_retries        = std::max(config_.max_retries, 0);
+    config_.max_peers          = std::max(std::min(config_.max_peers, device_attr.max_qp / config_.qp_num), 1);
+    if (config_.srq_depth && !device_attr.max_srq) {
+        SLIME_LOG_WARN("Device has no SRQ support, RECVs are posted on their QP");
+        config_.srq_depth = 0;
+    }
+    SLIME_LOG_INFO("RDMA context config: ", config_.to_json().dump());
+
+    qp_management_ = new qp_management_t*[config_.max_peers * config_.qp_num]();
+    size_t index_size = 2;
+    while (index_size < size_t(2) * config_.max_peers * config_.qp_num)
+        index_size <<= 1;
+    qpi_index_.reset(new std::atomic<uint64_t>[index_size]());
+    qpi_index_mask_ = index_size - 1;
+    peer_management_.reset(new peer_management_t[config_.max_peers]);
+    for (int dispatcher = 0; dispatcher < config_.qp_num; ++dispatcher)
+        wq_dispatchers_.emplace_back(new wq_dispatcher_t(config_.assign_queue_depth));
+
+    /* SGE and message limits */
+    max_send_sge_ = config_.max_sge;
+    max_recv_sge_ = config_.max_sge;
+    max_rd_sge_   = std::max(std::min(device_attr.max_sge_rd, max_send_sge_), 1);
+    if (port_attr.max_msg_sz)
+        max_msg_size_ = std::min<uint64_t>(port_attr.max_msg_sz, max_msg_size_);
+    max_inline_data_ = config_.max_inline_data;
+
     /* Alloc Protected Domain (PD) */
-    pd_ = ibv_alloc_pd(ib_ctx_);
+    pd_ = verbs_->alloc_pd(ib_ctx_);
     if (!pd_) {
         SLIME_LOG_ERROR("Failed to allocate PD");
         return -1;
     }
-    memory_pool_ = RDMAMemoryPool(pd_);
+    memory_pool_ = RDMAMemoryPool(pd_, verbs_, config_.mr_cache_bytes, config_.max_peers);
 
-    /* Alloc Complete Queue (CQ) */
+    /* Alloc Complete Queues (CQ), each with its own channel so the pollers block independently */
     SLIME_ASSERT(ib_ctx_, "init rdma context first");
-    comp_channel_ = ibv_create_comp_channel(ib_ctx_);
-    cq_           = ibv_create_cq(ib_ctx_, MAX_SEND_WR + MAX_RECV_WR, NULL, comp_channel_, 0);
-    SLIME_ASSERT(cq_, "create CQ failed");
+    cq_management_ = std::vector<cq_management_t>(config_.cq_num);
+    for (int cqi = 0; cqi < config_.cq_num; ++cqi) {
+        cq_management_t& cq_man = cq_management_[cqi];
+        cq_man.comp_channel_    = verbs_->create_comp_channel(ib_ctx_);
+        SLIME_ASSERT(cq_man.comp_channel_, "create completion channel failed");
+        int comp_vector = ib_ctx_->num_comp_vectors > 0 ? cqi % ib_ctx_->num_comp_vectors : 0;
+        cq_man.cq_      = verbs_->create_cq(ib_ctx_, config_.cq_size, NULL, cq_man.comp_channel_, comp_vector);
+        SLIME_ASSERT(cq_man.cq_, "create CQ failed");
+        cq_man.wc_.resize(config_.poll_count);
+    }
+
+    /* Shared Receive Queue, its ring is posted before any QP can receive */
+    if (config_.srq_depth > 0 && init_srq() != 0)
+        return -1;
+
+    /* Get GID */
+    if (gidx != -1 && verbs_->query_gid(ib_ctx_, 1, gidx, &gid)) {
+        SLIME_LOG_ERROR("Failed to get GID");
+    }
+    port_rdma_info_.gidx = gidx;
+    port_rdma_info_.gid  = gid;
+    port_rdma_info_.lid  = lid;
+    port_rdma_info_.mtu  = (uint32_t)active_mtu;
+
+    if (init_peer(0) != 0)
+        return -1;
+
+    initialized_ = true;
+
+    return 0;
+}
+
+int64_t RDMAContext::init_peer(int peer)
+{
+    int first_qpi = peer * config_.qp_num;
+
+    // Not published yet, the next peer takes the same QP slots
+    auto rollback = [this, first_qpi](int last_qpi) {
+        for (int created = first_qpi; created <= last_qpi; ++created) {
+            if (qp_management_[created]->qp_)
+                verbs_->destroy_qp(qp_management_[created]->qp_);
+            delete qp_management_[created];
+            qp_management_[created] = nullptr;
+        }
+    };
+
+    for (int i = 0; i < config_.qp_num; ++i) {
+        int              qpi    = first_qpi + i;
+        qp_management_t* qp_man = new qp_management_t(config_.max_send_wr, config_.assign_queue_depth);
+        qp_man->cqi_            = config_.qp_to_cq[i];
+        qp_management_[qpi]     = qp_man;
 
-    for (int qpi = 0; qpi < qp_list_len_; ++qpi) {
         /* Create Queue Pair (QP) */
         struct ibv_qp_init_attr qp_init_attr = {};
-        qp_init_attr.send_cq                 = cq_;
-        qp_init_attr.recv_cq                 = cq_;
+        qp_init_attr.send_cq                 = cq_management_[qp_man->cqi_].cq_;
+        qp_init_attr.recv_cq                 = cq_management_[qp_man->cqi_].cq_;
+        qp_init_attr.srq                     = srq_;
         qp_init_attr.qp_type                 = IBV_QPT_RC;  // Reliable Connection
-        qp_init_attr.cap.max_send_wr         = MAX_SEND_WR;
-        qp_init_attr.cap.max_recv_wr         = MAX_RECV_WR;
-        qp_init_attr.cap.max_send_sge        = 4;
-        qp_init_attr.cap.max_recv_sge        = 4;
+        qp_init_attr.cap.max_send_wr         = config_.max_send_wr;
+        qp_init_attr.cap.max_recv_wr         = config_.max_recv_wr;
+        qp_init_attr.cap.max_send_sge        = max_send_sge_;
+        qp_init_attr.cap.max_recv_sge        = max_recv_sge_;
+        qp_init_attr.cap.max_inline_data     = max_inline_data_;
         qp_init_attr.sq_sig_all              = false;
-        qp_management_t* qp_man              = qp_management_[qpi];
-        rdma_info_t&     local_rdma_info     = qp_man->local_rdma_info_;
-        qp_man->qp_                          = ibv_create_qp(pd_, &qp_init_attr);
+        qp_man->qp_                          = verbs_->create_qp(pd_, &qp_init_attr);
+        // Inline space grows every WQE, a deep send queue may not fit the device with all of it. Peer 0
+        // settles the limit, inline work may be queued from then on, so later peers get it or fail
+        while (!qp_man->qp_ && peer == 0 && qp_init_attr.cap.max_inline_data > 0) {
+            qp_init_attr.cap.max_inline_data /= 2;
+            qp_man->qp_ = verbs_->create_qp(pd_, &qp_init_attr);
+        }
         if (!qp_man->qp_) {
             SLIME_LOG_ERROR("Failed to create QP");
+            rollback(qpi);
+            return -1;
+        }
+        // The dispatchers of the peers before post with the limits of peer 0, a later peer has
+        // to take as much or is refused
+        if (peer > 0
+            && ((int)qp_init_attr.cap.max_send_sge < max_send_sge_ || (int)qp_init_attr.cap.max_recv_sge < max_recv_sge_
+                || (int)qp_init_attr.cap.max_inline_data < max_inline_data_)) {
+            SLIME_LOG_ERROR("QP of peer " << peer << " takes " << qp_init_attr.cap.max_send_sge << " send / "
+                                          << qp_init_attr.cap.max_recv_sge << " recv SGEs and "
+                                          << qp_init_attr.cap.max_inline_data << " bytes of inline data, "
+                                          << get_dev_ib() << " posts up to " << max_send_sge_ << " / "
+                                          << max_recv_sge_ << " and " << max_inline_data_);
+            rollback(qpi);
             return -1;
         }
+        // The provider reports the capabilities it actually granted, settled by peer 0 before launch
+        if (peer == 0) {
+            max_send_sge_ = std::min<int>(max_send_sge_, qp_init_attr.cap.max_send_sge);
+            max_recv_sge_ = std::min<int>(max_recv_sge_, qp_init_attr.cap.max_recv_sge);
+            max_rd_sge_   = std::min(max_rd_sge_, max_send_sge_);
+            if ((int)qp_init_attr.cap.max_inline_data < max_inline_data_) {
+                SLIME_LOG_INFO(
+                    "Inline data of ", get_dev_ib(), " limited to ", qp_init_attr.cap.max_inline_data, " bytes");
+                max_inline_data_        = qp_init_attr.cap.max_inline_data;
+                config_.max_inline_data = max_inline_data_;
+            }
+        }
 
         /* Modify QP to INIT state */
-        struct ibv_qp_attr attr = {};
-        attr.qp_state           = IBV_QPS_INIT;
-        attr.port_num           = ib_port_;
-        attr.pkey_index         = 0;
-        attr.qp_access_flags =
-            IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_ATOMIC;
-
-        int flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
-
-        int ret = ibv_modify_qp(qp_man->qp_, &attr, flags);
-        if (ret) {
-            SLIME_LOG_ERROR("Failed to modify QP to INIT");
+        if (init_qp(qpi) != 0) {
+            rollback(qpi);
+            return -1;
         }
 
-        /* Set Packet Sequence Number (PSN) */
+        /* Set Local RDMA Info, with a fresh Packet Sequence Number (PSN) */
         srand48(time(NULL));
-        psn = lrand48() & 0xffffff;
-
-        /* Get GID */
-        if (gidx != -1 && ibv_query_gid(ib_ctx_, 1, gidx, &gid)) {
-            SLIME_LOG_ERROR("Failed to get GID");
-        }
-
-        /* Set Local RDMA Info */
-        local_rdma_info.gidx = gidx;
-        local_rdma_info.qpn  = qp_man->qp_->qp_num;
-        local_rdma_info.psn  = psn;
-        local_rdma_info.gid  = gid;
-        local_rdma_info.lid  = lid;
-        local_rdma_info.mtu  = (uint32_t)active_mtu;
+        rdma_info_t& local_rdma_info = qp_man->local_rdma_info_;
+        local_rdma_info              = port_rdma_info_;
+        local_rdma_info.qpn          = qp_man->qp_->qp_num;
+        local_rdma_info.psn          = lrand48() & 0xffffff;
     }
 
-    initialized_ = true;
+    for (int qpi = first_qpi; qpi < first_qpi + config_.qp_num; ++qpi)
+        index_qp(qpi);
 
+    // The WQ dispatchers and CQ pollers see the QPs from here on
+    qp_list_len_.store(first_qpi + config_.qp_num, std::memory_order_release);
+    peer_num_.store(peer + 1, std::memory_order_release);
     return 0;
 }
 
-int64_t RDMAContext::connect(const json& endpoint_info_json)
+std::shared_ptr<RDMAPeer> RDMAContext::add_peer()
+{
+    SLIME_ASSERT(initialized_, "init rdma context first");
+    std::lock_guard<std::mutex> lock(peer_mutex_);
+    if (!peer_management_[0].handed_out_) {
+        peer_management_[0].handed_out_ = true;
+        return std::make_shared<RDMAPeer>(this, 0);
+    }
+
+    int peer = peer_num_.load(std::memory_order_relaxed);
+    if (peer >= config_.max_peers) {
+        SLIME_LOG_WARN("All ", config_.max_peers, " peers of ", get_dev_ib(), " are in use, raise config max_peers");
+        return nullptr;
+    }
+    if (init_peer(peer) != 0)
+        return nullptr;
+    SLIME_ASSERT_EQ(memory_pool_.add_peer(), peer, "remote MR tables out of step with the peers");
+    SLIME_LOG_INFO("Peer ", peer, " added to ", get_dev_ib());
+    return std::make_shared<RDMAPeer>(this, peer);
+}
+
+int64_t RDMAContext::connect(int peer, const json& endpoint_info_json)
 {
+    // Absent for a peer without an SRQ
+    peer_management_[peer].remote_srq_recv_bytes_ = endpoint_info_json.value("srq_recv_bytes", 0u);
+
     // Register Remote Memory Region
     for (auto& item : endpoint_info_json["mr_info"].items()) {
-        register_remote_memory_region(item.key(), item.value());
+        memory_pool_.register_remote_memory_region(item.key(), item.value(), peer);
     }
 
-    // construct RDMAEndpoint connection
-    SLIME_ASSERT(!connected_, "Already connected!");
-    for (int qpi = 0; qpi < qp_list_len_; qpi++) {
-        int                ret;
-        struct ibv_qp_attr attr = {};
-        int                flags;
-        qp_management_t*   qp_man           = qp_management_[qpi];
-        struct ibv_qp*     qp               = qp_man->qp_;
-        rdma_info_t&       local_rdma_info  = qp_man->local_rdma_info_;
-        rdma_info_t&       remote_rdma_info = qp_man->remote_rdma_info_;
-        remote_rdma_info                    = rdma_info_t(endpoint_info_json["rdma_info"][qpi]);
-
-        // Modify QP to Ready to Receive (RTR) state
-        memset(&attr, 0, sizeof(attr));
-        attr.qp_state           = IBV_QPS_RTR;
-        attr.path_mtu           = (enum ibv_mtu)std::min((uint32_t)remote_rdma_info.mtu, (uint32_t)local_rdma_info.mtu);
-        attr.dest_qp_num        = remote_rdma_info.qpn;
-        attr.rq_psn             = remote_rdma_info.psn;
-        attr.max_dest_rd_atomic = 16;
-        attr.min_rnr_timer      = 12;
-        attr.ah_attr.dlid       = 0;
-        attr.ah_attr.sl         = 0;
-        attr.ah_attr.src_path_bits = 0;
-        attr.ah_attr.port_num      = 1;
-
-        if (local_rdma_info.gidx == -1) {
-            // IB
-            attr.ah_attr.dlid      = local_rdma_info.lid;
-            attr.ah_attr.is_global = 0;
-        }
-        else {
-            // RoCE v2
-            attr.ah_attr.is_global      = 1;
-            attr.ah_attr.grh.dgid       = remote_rdma_info.gid;
-            attr.ah_attr.grh.sgid_index = local_rdma_info.gidx;
-            attr.ah_attr.grh.hop_limit  = 1;
-        }
+    std::vector<rdma_info_t> remote_rdma_info;
+    for (const json& rdma_info : endpoint_info_json["rdma_info"])
+        remote_rdma_info.push_back(rdma_info_t(rdma_info));
+    return connect_qps(peer, remote_rdma_info);
+}
 
-        flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC
-                | IBV_QP_MIN_RNR_TIMER;
+int64_t RDMAContext::connect(int peer, const EndpointInfoView& endpoint_info)
+{
+    if (register_remote_memory_regions(peer, endpoint_info) < 0)
+        return -1;
+    peer_management_[peer].remote_srq_recv_bytes_ = endpoint_info.srq_recv_bytes();
 
-        ret = ibv_modify_qp(qp, &attr, flags);
-        if (ret) {
-            SLIME_LOG_ERROR("Failed to modify QP to RTR: reason: " << strerror(ret));
-            return -1;
-        }
+    std::vector<rdma_info_t> remote_rdma_info;
+    for (uint32_t qpi = 0; qpi < endpoint_info.qp_num(); ++qpi)
+        remote_rdma_info.push_back(endpoint_info.rdma_info(qpi));
+    return connect_qps(peer, remote_rdma_info);
+}
+
+int64_t RDMAContext::connect(const std::string& endpoint_info)
+{
+    return connect(EndpointInfoView(endpoint_info.data(), endpoint_info.size()));
+}
+
+json RDMAContext::local_rdma_info(int peer) const
+{
+    json local_info{};
+    for (int i = 0; i < config_.qp_num; i++)
+        local_info[i] = qp_management_[peer * config_.qp_num + i]->local_rdma_info_.to_json();
+    return local_info;
+}
 
-        // Modify QP to RTS state
-        memset(&attr, 0, sizeof(attr));
-        attr.qp_state      = IBV_QPS_RTS;
-        attr.timeout       = 14;
-        attr.retry_cnt     = 7;
-        attr.rnr_retry     = 7;
-        attr.sq_psn        = local_rdma_info.psn;
-        attr.max_rd_atomic = 16;
+json RDMAContext::remote_rdma_info(int peer) const
+{
+    json remote_info{};
+    for (int i = 0; i < config_.qp_num; i++)
+        remote_info[i] = qp_management_[peer * config_.qp_num + i]->remote_rdma_info_.to_json();
+    return remote_info;
+}
 
-        flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN
-                | IBV_QP_MAX_QP_RD_ATOMIC;
+json RDMAContext::endpoint_info(int peer) const
+{
+    return json{{"rdma_info", local_rdma_info(peer)},
+                {"mr_info", memory_pool_.mr_info()},
+                {"srq_recv_bytes", srq_recv_bytes()}};
+}
 
-        ret = ibv_modify_qp(qp, &attr, flags);
-        if (ret) {
-            SLIME_LOG_ERROR("Failed to modify QP to RTS");
+std::string RDMAContext::endpoint_info_binary(int peer) const
+{
+    EndpointInfoBuilder builder;
+    for (int i = 0; i < config_.qp_num; i++)
+        builder.add_qp(qp_management_[peer * config_.qp_num + i]->local_rdma_info_);
+    builder.set_srq_recv_bytes(srq_recv_bytes());
+    memory_pool_.append_mr_info(builder);
+    return builder.build();
+}
+
+std::string RDMAContext::mr_info_binary() const
+{
+    EndpointInfoBuilder builder;
+    memory_pool_.append_mr_info(builder);
+    return builder.build();
+}
+
+int64_t RDMAContext::register_remote_memory_regions(int peer, const EndpointInfoView& endpoint_info)
+{
+    if (!endpoint_info.valid())
+        return -1;
+    for (uint32_t i = 0; i < endpoint_info.mr_num(); ++i)
+        memory_pool_.register_remote_memory_region(std::string(endpoint_info.mr_key(i)), endpoint_info.mr(i), peer);
+    return endpoint_info.mr_num();
+}
+
+int64_t RDMAContext::connect_qps(int peer, const std::vector<rdma_info_t>& remote_rdma_info_list)
+{
+    // construct RDMAEndpoint connection
+    peer_management_t& peer_management = peer_management_[peer];
+    SLIME_ASSERT(!peer_management.connected_, "Already connected!");
+    SLIME_ASSERT_EQ(remote_rdma_info_list.size(), size_t(config_.qp_num), "Both ends must use the same qp_num");
+    if (peer == 0) {
+        // Connected by the context itself, add_peer no longer hands the group out
+        std::lock_guard<std::mutex> lock(peer_mutex_);
+        peer_management.handed_out_ = true;
+    }
+    for (int i = 0; i < config_.qp_num; i++) {
+        int qpi                                = peer * config_.qp_num + i;
+        qp_management_[qpi]->remote_rdma_info_ = remote_rdma_info_list[i];
+        if (connect_qp(qpi) != 0)
             return -1;
-        }
         SLIME_LOG_INFO("RDMA exchange done");
-        connected_ = true;
+    }
+    peer_management.connected_ = true;
+    return 0;
+}
 
-        if (ibv_req_notify_cq(cq_, 0)) {
-            SLIME_LOG_ERROR("Failed to request notify for CQ");
-            return -1;
-        }
+int64_t RDMAContext::init_qp(int qpi)
+{
+    struct ibv_qp_attr attr = {};
+    attr.qp_state           = IBV_QPS_INIT;
+    attr.port_num           = ib_port_;
+    attr.pkey_index         = 0;
+    attr.qp_access_flags =
+        IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ | IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_ATOMIC;
+
+    int flags = IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS;
+
+    int ret = verbs_->modify_qp(qp_management_[qpi]->qp_, &attr, flags);
+    if (ret) {
+        SLIME_LOG_ERROR("Failed to modify QP to INIT");
+        return -1;
+    }
+    return 0;
+}
+
+int64_t RDMAContext::connect_qp(int qpi)
+{
+    int                ret;
+    struct ibv_qp_attr attr = {};
+    int                flags;
+    qp_management_t*   qp_man           = qp_management_[qpi];
+    struct ibv_qp*     qp               = qp_man->qp_;
+    rdma_info_t&       local_rdma_info  = qp_man->local_rdma_info_;
+    rdma_info_t&       remote_rdma_info = qp_man->remote_rdma_info_;
+
+    // Modify QP to Ready to Receive (RTR) state
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state              = IBV_QPS_RTR;
+    attr.path_mtu              = (enum ibv_mtu)std::min((uint32_t)remote_rdma_info.mtu, (uint32_t)local_rdma_info.mtu);
+    attr.dest_qp_num           = remote_rdma_info.qpn;
+    attr.rq_psn                = remote_rdma_info.psn;
+    attr.max_dest_rd_atomic    = 16;
+    attr.min_rnr_timer         = 12;
+    attr.ah_attr.dlid          = 0;
+    attr.ah_attr.sl            = 0;
+    attr.ah_attr.src_path_bits = 0;
+    attr.ah_attr.port_num      = 1;
+
+    if (local_rdma_info.gidx == -1) {
+        // IB
+        attr.ah_attr.dlid      = local_rdma_info.lid;
+        attr.ah_attr.is_global = 0;
+    }
+    else {
+        // RoCE v2
+        attr.ah_attr.is_global      = 1;
+        attr.ah_attr.grh.dgid       = remote_rdma_info.gid;
+        attr.ah_attr.grh.sgid_index = local_rdma_info.gidx;
+        attr.ah_attr.grh.hop_limit  = 1;
+    }
+
+    flags = IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN | IBV_QP_MAX_DEST_RD_ATOMIC
+            | IBV_QP_MIN_RNR_TIMER;
+
+    ret = verbs_->modify_qp(qp, &attr, flags);
+    if (ret) {
+        SLIME_LOG_ERROR("Failed to modify QP to RTR: reason: " << strerror(ret));
+        return -1;
+    }
+
+    // Modify QP to RTS state
+    memset(&attr, 0, sizeof(attr));
+    attr.qp_state      = IBV_QPS_RTS;
+    attr.timeout       = 14;
+    attr.retry_cnt     = 7;
+    attr.rnr_retry     = 7;
+    attr.sq_psn        = local_rdma_info.psn;
+    attr.max_rd_atomic = 16;
+
+    flags = IBV_QP_STATE | IBV_QP_TIMEOUT | IBV_QP_RETRY_CNT | IBV_QP_RNR_RETRY | IBV_QP_SQ_PSN
+            | IBV_QP_MAX_QP_RD_ATOMIC;
+
+    ret = verbs_->modify_qp(qp, &attr, flags);
+    if (ret) {
+        SLIME_LOG_ERROR("Failed to modify QP to RTS");
+        return -1;
     }
     return 0;
 }
 
 void RDMAContext::launch_future()
 {
-    cq_future_ = std::async(std::launch::async, [this]() -> void { cq_poll_handle(); });
-    for (int qpi = 0; qpi < qp_list_len_; qpi++)
-        qp_management_[qpi]->wq_future_ =
-            std::async(std::launch::async, [this, qpi]() -> void { wq_dispatch_handle(qpi); });
+    // Executors first, so the pollers never see a half built executor list
+    // Room for the full send queues of one peer whatever max_peers. With more peers a full ring
+    // holds the poller back in push, and so the send credits its completions would return
+    size_t executor_depth = size_t(config_.qp_num) * config_.max_send_wr;
+    for (int i = 0; i < config_.callback_threads; ++i) {
+        callback_executors_.emplace_back(new callback_executor_t(executor_depth));
+        callback_executors_[i]->future_ = std::async(std::launch::async, [this, i]() -> void { callback_handle(i); });
+    }
+    for (size_t cqi = 0; cqi < cq_management_.size(); ++cqi)
+        cq_management_[cqi].cq_future_ =
+            std::async(std::launch::async, [this, cqi]() -> void { cq_poll_handle(cqi); });
+    for (size_t dispatcher = 0; dispatcher < wq_dispatchers_.size(); ++dispatcher)
+        wq_dispatchers_[dispatcher]->future_ =
+            std::async(std::launch::async, [this, dispatcher]() -> void { wq_dispatch_handle(dispatcher); });
 }
 
 void RDMAContext::stop_future()
 {
     // Stop work queue dispatch
-    for (int qpi = 0; qpi < qp_list_len_; ++qpi) {
-        if (!qp_management_[qpi]->stop_wq_future_ && qp_management_[qpi]->wq_future_.valid()) {
-            qp_management_[qpi]->stop_wq_future_ = true;
-            qp_management_[qpi]->has_runnable_event_.notify_one();
-            qp_management_[qpi]->wq_future_.get();
+    for (std::unique_ptr<wq_dispatcher_t>& wq_dispatcher : wq_dispatchers_) {
+        if (!wq_dispatcher->stop_ && wq_dispatcher->future_.valid()) {
+            wq_dispatcher->stop_ = true;
+            wq_dispatcher->doorbell_.wake();
+            wq_dispatcher->future_.get();
         }
     }
 
-    if (!stop_cq_future_ && cq_future_.valid()) {
+    // A poller blocked on its channel wakes up within DEADLINE_CHECK_MS and sees the flag
+    if (!stop_cq_future_) {
         stop_cq_future_ = true;
+        for (cq_management_t& cq_man : cq_management_) {
+            if (cq_man.cq_future_.valid())
+                cq_man.cq_future_.get();
+        }
+    }
 
-        // create fake wr to wake up cq thread
-        ibv_req_notify_cq(cq_, 0);
-        struct ibv_sge sge;
-        memset(&sge, 0, sizeof(sge));
-        sge.addr   = (uintptr_t)this;
-        sge.length = sizeof(*this);
-        sge.lkey   = 0;
-
-        struct ibv_send_wr send_wr;
-        memset(&send_wr, 0, sizeof(send_wr));
-        // send_wr.wr_id      = (uintptr_t)this;
-        send_wr.wr_id      = 0;
-        send_wr.sg_list    = &sge;
-        send_wr.num_sge    = 1;
-        send_wr.opcode     = IBV_WR_SEND;
-        send_wr.send_flags = IBV_SEND_SIGNALED;
-
-        struct ibv_send_wr* bad_send_wr;
-        {
-            std::unique_lock<std::mutex> lock(qp_management_[0]->rdma_post_send_mutex_);
-            ibv_post_send(qp_management_[0]->qp_, &send_wr, &bad_send_wr);
+    // The pollers are gone, executors drain what they were handed and exit
+    if (!stop_callback_executor_) {
+        stop_callback_executor_ = true;
+        for (std::unique_ptr<callback_executor_t>& executor : callback_executors_) {
+            executor->queue_.wake();
+            if (executor->future_.valid())
+                executor->future_.get();
         }
-        // wait thread done
-        cq_future_.get();
     }
 }
 
-RDMAAssignmentSharedPtr RDMAContext::submit(OpCode opcode, AssignmentBatch& batch, callback_fn_t callback)
+RDMAAssignmentSharedPtr RDMAContext::submit(int                       peer,
+                                            OpCode                    opcode,
+                                            AssignmentBatch&          user_batch,
+                                            callback_fn_t             callback,
+                                            uint32_t                  imm_data,
+                                            std::chrono::milliseconds timeout)
 {
-    std::vector<AssignmentBatch> batch_split;
-
-    auto split = [&]() {
-        int split_step = MAX_SEND_WR / 2;
-        for (int i = 0; i < batch.size(); i += split_step) {
-            batch_split.push_back(
-                AssignmentBatch(batch.begin() + i, std::min(batch.end(), batch.begin() + i + split_step)));
+    if (opcode == OpCode::RECV && srq_)
+        return submit_srq_recv(peer, user_batch, callback, timeout);
+
+    // Merge contiguous one-sided assignments, the returned assignment still covers the whole batch
+    AssignmentBatch coalesced;
+    bool            coalesce = max_coalesce_bytes_ > 0 && opcode != OpCode::SEND && opcode != OpCode::RECV;
+    if (coalesce)
+        coalesced = coalesce_assignments(user_batch, max_coalesce_bytes_);
+    const AssignmentBatch& batch = coalesce ? coalesced : user_batch;
+
+    if (opcode == OpCode::READ || opcode == OpCode::WRITE || opcode == OpCode::WRITE_WITH_IMM) {
+        for (const Assignment& subassign : batch) {
+            mr_handle_t mr_handle = subassign.mr_handle != INVALID_MR_HANDLE ?
+                                        subassign.mr_handle :
+                                        memory_pool_.get_mr_handle(subassign.mr_key);
+            if (memory_pool_.has_remote_mr(mr_handle, peer))
+                continue;
+            // Nothing is queued, a WR with rkey 0 would only fail on the peer
+            SLIME_LOG_ERROR("Remote MR not registered: " << subassign.dump());
+            RDMAAssignmentSharedPtr rejected =
+                std::make_shared<RDMAAssignment>(opcode, batch.data(), batch.size(), callback, imm_data);
+            rejected->callback_info_->callback_(callback_info_t::REMOTE_MR_NOT_REGISTERED);
+            return rejected;
         }
+    }
+
+    const size_t split_step = std::max(config_.max_send_wr / 2, 1);
+
+    // A bare RECV still needs a receive WR to catch the immediate data
+    int split_size = std::max<size_t>((batch.size() + split_step - 1) / split_step, 1);
+    int qpi        = select_qpi(peer);
+
+    std::vector<RDMAAssignmentSharedPtr> splits;
+    for (int i = 0; i < split_size; ++i) {
+        bool last = (i == split_size - 1);
+        // Only the last split carries the immediate data, so the peer sees exactly one tag
+        OpCode split_opcode = (opcode == OpCode::WRITE_WITH_IMM && !last) ? OpCode::WRITE : opcode;
+        size_t split_begin  = std::min(i * split_step, batch.size());
+        size_t split_len    = std::min(split_step, batch.size() - split_begin);
+        splits.push_back(std::make_shared<RDMAAssignment>(
+            split_opcode, batch.data() + split_begin, split_len, last ? callback : nullptr, imm_data));
+    }
+    RDMAAssignmentSharedPtr rdma_assignment = splits.back();
+    if (split_size > 1)
+        join_splits(splits);
+
+    for (RDMAAssignmentSharedPtr& split : splits) {
+        acquire_mr_leases(split.get());
+        if (timeout > kNoTimeout)
+            track_deadline(qpi, split, timeout);
+        if (split != rdma_assignment)
+            rdma_assignment->splits_.push_back(split);
+
+        qp_management_[qpi]->queued_bytes_.fetch_add(split->bytes(), std::memory_order_relaxed);
+        qp_management_[qpi]->assign_queue_.push(split);
+        // Every split, a full queue only drains once the dispatcher knows about it
+        ring_doorbell(qpi);
+    }
+    return rdma_assignment;
+}
+
+RDMAAssignmentSharedPtr RDMAContext::submit_inline(int                peer,
+                                                   OpCode             opcode,
+                                                   const void*        data,
+                                                   size_t             length,
+                                                   const std::string& mr_key,
+                                                   uint64_t           target_offset,
+                                                   callback_fn_t      callback,
+                                                   uint32_t           imm_data)
+{
+    SLIME_ASSERT(opcode == OpCode::SEND || opcode == OpCode::WRITE || opcode == OpCode::WRITE_WITH_IMM,
+                 "only SEND and WRITE are posted inline");
+    SLIME_ASSERT(length > 0 && length <= (size_t)max_inline_data_,
+                 "inline payload of " << length << " bytes, the QPs take up to " << max_inline_data_);
+
+    // No local MR to lease, a WRITE only needs the peer's
+    Assignment assignment(INVALID_MR_HANDLE, target_offset, 0, length);
+    if (opcode != OpCode::SEND)
+        assignment.mr_handle = memory_pool_.get_mr_handle(mr_key);
+
+    RDMAAssignmentSharedPtr rdma_assignment =
+        std::make_shared<RDMAAssignment>(opcode, &assignment, 1, callback, imm_data);
+    if (opcode != OpCode::SEND && !memory_pool_.has_remote_mr(assignment.mr_handle, peer)) {
+        SLIME_LOG_ERROR("Remote MR not registered: " << mr_key);
+        rdma_assignment->callback_info_->callback_(callback_info_t::REMOTE_MR_NOT_REGISTERED);
+        return rdma_assignment;
+    }
+    // Posted later by the WQ dispatcher, which then copies from here into the WQE
+    rdma_assignment->inline_data_.assign((const char*)data, length);
+
+    int qpi = select_qpi(peer);
+    qp_management_[qpi]->queued_bytes_.fetch_add(length, std::memory_order_relaxed);
+    qp_management_[qpi]->assign_queue_.push(rdma_assignment);
+    ring_doorbell(qpi);
+    return rdma_assignment;
+}
+
+void RDMAContext::join_splits(const std::vector<RDMAAssignmentSharedPtr>& splits)
+{
+    // A retried or timed out split may finish after the last one, which reports for them all
+    RDMAAssignmentSharedPtr       last = splits.back();
+    std::shared_ptr<split_join_t> join = std::make_shared<split_join_t>(splits.size(), last->callback_info_);
+    for (size_t i = 0; i + 1 < splits.size(); ++i) {
+        // Called with the first status of the split, finished, cancelled or timed out. Keeps the
+        // last split alive until then, the last split only holds the earlier ones weakly.
+        splits[i]->callback_info_->user_callback_ = [join, last](int code) { join->finish(code); };
+    }
+    last->callback_info_->callback_ = [join](int code) { join->finish_last(code); };
+    last->join_                     = [join](int code) { join->finish_last(code); };
+}
+
+void RDMAContext::track_deadline(int qpi, const RDMAAssignmentSharedPtr& assign, std::chrono::milliseconds timeout)
+{
+    assign->deadline_ = std::chrono::steady_clock::now() + timeout;
+    {
+        std::lock_guard<std::mutex> lock(deadline_mutex_);
+        deadlines_[deadline_key_t(assign->deadline_, assign.get())] = timed_assignment_t{assign, qpi};
+        next_deadline_.store(deadlines_.begin()->first.first.time_since_epoch().count(), std::memory_order_relaxed);
+    }
+
+    // Leaves the deadline list once the device is done with it, before the MR leases go
+    callback_fn_t& finish_callback = assign->callback_info_->callback_;
+    finish_callback                = [this, raw = assign.get(), finish = std::move(finish_callback)](int code) {
+        untrack_deadline(raw);
+        finish(code);
     };
-    split();
+}
 
-    int qpi        = select_qpi();
-    int split_size = batch_split.size();
+void RDMAContext::untrack_deadline(RDMAAssignment* assign)
+{
+    std::lock_guard<std::mutex> lock(deadline_mutex_);
+    deadlines_.erase(deadline_key_t(assign->deadline_, assign));
+}
 
+void RDMAContext::expire_deadlines()
+{
+    int64_t next_deadline = next_deadline_.load(std::memory_order_relaxed);
+    if (next_deadline == INT64_MAX)
+        return;
+    auto now = std::chrono::steady_clock::now();
+    if (now.time_since_epoch().count() < next_deadline)
+        return;
+
+    std::vector<timed_assignment_t> expired;
     {
-        std::unique_lock<std::mutex> lock(qp_management_[qpi]->assign_queue_mutex_);
-        RDMAAssignmentSharedPtr      rdma_assignment;
-        for (int i = 0; i < split_size; ++i) {
-            callback_fn_t split_callback = (i == split_size - 1 ? callback : [](int) { return 0; });
-            rdma_assignment              = std::make_shared<RDMAAssignment>(opcode, batch_split[i], split_callback);
-            qp_management_[qpi]->assign_queue_.push(rdma_assignment);
+        std::lock_guard<std::mutex> lock(deadline_mutex_);
+        auto                        it = deadlines_.begin();
+        for (; it != deadlines_.end() && it->first.first <= now; ++it)
+            expired.push_back(std::move(it->second));
+        deadlines_.erase(deadlines_.begin(), it);
+        int64_t next_deadline = INT64_MAX;
+        if (!deadlines_.empty())
+            next_deadline = deadlines_.begin()->first.first.time_since_epoch().count();
+        next_deadline_.store(next_deadline, std::memory_order_relaxed);
+    }
+
+    for (timed_assignment_t& timed : expired) {
+        RDMAAssignmentSharedPtr assign = timed.assign_.lock();
+        if (!assign || assign->query())
+            continue;
+        // Still queued it is dropped, the dispatcher only releases it. Posted, the WR still
+        // completes or fails on its own and keeps its MRs until then.
+        bool dropped = assign->drop();
+        timed_out_.fetch_add(1, std::memory_order_relaxed);
+        if (dropped && assign->on_drop_)
+            assign->on_drop_();
+        // Held by a broken QP it is released there
+        if (dropped)
+            ring_broken_qps(peer_of(timed.qpi_));
+        dispatch_timeout(timed.qpi_, std::move(assign));
+    }
+}
+
+int RDMAContext::deadline_wait_ms() const
+{
+    int64_t next_deadline = next_deadline_.load(std::memory_order_relaxed);
+    if (next_deadline == INT64_MAX)
+        return DEADLINE_CHECK_MS;
+    auto wait = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(next_deadline))
+                - std::chrono::steady_clock::now();
+    // Rounded up, waking before the deadline would only go back to sleep for 0 ms
+    int64_t wait_ms = (std::chrono::duration_cast<std::chrono::microseconds>(wait).count() + 999) / 1000;
+    return std::max<int64_t>(std::min<int64_t>(wait_ms, DEADLINE_CHECK_MS), 0);
+}
+
+void RDMAContext::acquire_mr_leases(RDMAAssignment* assign)
+{
+    // Resolve keys to registrations once here, the posting path only indexes
+    assign->leases_ = new mr_registration_t*[assign->batch_size_];
+    for (size_t i = 0; i < assign->batch_size_; ++i) {
+        Assignment& subassign = assign->batch_[i];
+        if (subassign.mr_handle == INVALID_MR_HANDLE)
+            subassign.mr_handle = memory_pool_.get_mr_handle(subassign.mr_key);
+        if (i > 0 && subassign.mr_handle == assign->batch_[i - 1].mr_handle) {
+            assign->leases_[i] = assign->leases_[i - 1];
+            continue;
         }
+        assign->leases_[i] = memory_pool_.acquire_lease(subassign.mr_handle);
+        SLIME_ASSERT(assign->leases_[i], "MR not registered: " << subassign.dump());
+    }
 
-        qp_management_[qpi]->has_runnable_event_.notify_one();
-        return rdma_assignment;
+    // The MRs stay registered until the assignment has finished, whichever way it finishes
+    callback_fn_t& finish_callback = assign->callback_info_->callback_;
+    finish_callback                = [this, assign, finish = std::move(finish_callback)](int code) {
+        release_mr_leases(assign);
+        finish(code);
+    };
+}
+
+void RDMAContext::release_mr_leases(RDMAAssignment* assign)
+{
+    for (size_t i = 0; i < assign->batch_size_; ++i) {
+        if (i > 0 && assign->leases_[i] == assign->leases_[i - 1])
+            continue;
+        memory_pool_.release_lease(assign->leases_[i]);
+    }
+}
+
+int64_t RDMAContext::unregister_memory_region(const std::string& mr_key)
+{
+    int ret = memory_pool_.unregister_memory_region(mr_key);
+    if (ret)
+        SLIME_LOG_WARN("MR ", mr_key, " is not registered on ", get_dev_ib());
+    return ret;
+}
+
+int64_t RDMAContext::unregister_remote_memory_region(int peer, const std::string& mr_key)
+{
+    return memory_pool_.unregister_remote_memory_region(mr_key, peer);
+}
+
+int64_t RDMAContext::apply_mr_invalidation(int peer, const json& notice)
+{
+    int64_t invalidated = 0;
+    for (const json& mr_key : notice["invalidated_mrs"]) {
+        if (memory_pool_.unregister_remote_memory_region(mr_key.get<std::string>(), peer) == 0)
+            ++invalidated;
+    }
+    return invalidated;
+}
+
+int RDMAContext::select_qpi(int peer)
+{
+    qp_management_t** qps = qp_management_ + peer * config_.qp_num;
+    int               i   = select_by_policy(selection_policy_.load(std::memory_order_relaxed),
+                                 peer_management_[peer].last_qp_selection_,
+                                 config_.qp_num,
+                                 [qps](size_t i) {
+                                     return qps[i]->queued_bytes_.load(std::memory_order_relaxed)
+                                            + qps[i]->posted_bytes_.load(std::memory_order_relaxed);
+                                 });
+    // A failed QP takes no new work while another one is healthy
+    for (int k = 0; k < config_.qp_num && qps[i]->broken_.load(std::memory_order_relaxed); ++k)
+        i = (i + 1) % config_.qp_num;
+    return peer * config_.qp_num + i;
+}
+
+void RDMAContext::ring_doorbell(int qpi)
+{
+    wq_dispatchers_[qpi % config_.qp_num]->doorbell_.try_push_notify(int(qpi));
+}
+
+void RDMAContext::ring_broken_qps(int peer)
+{
+    for (int qpi = peer * config_.qp_num; qpi < (peer + 1) * config_.qp_num; ++qpi) {
+        if (qp_management_[qpi]->broken_.load(std::memory_order_acquire))
+            ring_doorbell(qpi);
+    }
+}
+
+uint64_t RDMAContext::outstanding_bytes() const
+{
+    uint64_t bytes = 0;
+    for (size_t qpi = 0; qpi < qp_list_len_; ++qpi) {
+        bytes += qp_management_[qpi]->queued_bytes_.load(std::memory_order_relaxed);
+        bytes += qp_management_[qpi]->posted_bytes_.load(std::memory_order_relaxed);
+    }
+    return bytes;
+}
+
+json RDMAContext::selection_stats() const
+{
+    static const char* policy_names[] = {"round_robin", "least_outstanding", "power_of_two", "sticky"};
+
+    json qps = json::array();
+    for (size_t qpi = 0; qpi < qp_list_len_; ++qpi) {
+        qps.push_back(json{
+            {"queued_bytes", qp_management_[qpi]->queued_bytes_.load(std::memory_order_relaxed)},
+            {"posted_bytes", qp_management_[qpi]->posted_bytes_.load(std::memory_order_relaxed)},
+            {"outstanding_wrs", qp_management_[qpi]->outstanding_rdma_reads_.load(std::memory_order_relaxed)},
+        });
+    }
+    return json{{"policy", policy_names[int(selection_policy_.load(std::memory_order_relaxed))]}, {"qps", qps}};
+}
+
+callback_info_with_qpi_t* RDMAContext::acquire_completion_record(int qpi, const RDMAAssignmentSharedPtr& assign)
+{
+    callback_info_with_qpi_t* record = nullptr;
+    if (!qp_management_[qpi]->free_completion_records_.try_pop(record))
+        record = new callback_info_with_qpi_t();
+    record->assign_ = assign;
+    record->qpi_    = qpi;
+    return record;
+}
+
+void RDMAContext::release_completion_record(callback_info_with_qpi_t* record)
+{
+    record->assign_.reset();
+    if (record->pooled_)
+        qp_management_[record->qpi_]->free_completion_records_.try_push(std::move(record));
+    else
+        delete record;
+}
+
+struct ibv_sge* RDMAContext::fill_sge_list(int qpi, const RDMAAssignmentSharedPtr& assign)
+{
+    struct ibv_sge* sge = qp_management_[qpi]->sge_arena_.data();
+    if (!assign->inline_data_.empty()) {
+        // Inline WRs ignore the lkey, the payload is read at post time
+        sge[0].addr   = (uintptr_t)assign->inline_data_.data();
+        sge[0].length = assign->inline_data_.size();
+        sge[0].lkey   = 0;
+        return sge;
+    }
+    for (size_t i = 0; i < assign->batch_size(); ++i) {
+        Assignment&       subassign = assign->batch_[i];
+        const local_mr_t& mr        = assign->leases_[i]->mr;
+        sge[i].addr                 = mr.addr + subassign.source_offset;
+        sge[i].length               = subassign.length;
+        sge[i].lkey                 = mr.mr->lkey;
     }
+    return sge;
+}
+
+bool RDMAContext::acquire_send_credits(int qpi, size_t batch_size)
+{
+    // Only the WQ dispatcher consumes credits, posting adds send_credits to outstanding_rdma_reads_
+    return batch_size + qp_management_[qpi]->outstanding_rdma_reads_.load() <= size_t(config_.max_send_wr);
+}
+
+bool RDMAContext::take_send_credits(int qpi, size_t batch_size)
+{
+    qp_management_t* qp_management = qp_management_[qpi];
+    if (!acquire_send_credits(qpi, batch_size)) {
+        if (!qp_management->stalled_) {
+            qp_management->stalled_     = true;
+            qp_management->stall_start_ = std::chrono::steady_clock::now();
+        }
+        // Publish the demand before checking again, pairs with the seq_cst fetch_sub in return_send_credits
+        qp_management->credits_wanted_.store(batch_size);
+        if (!acquire_send_credits(qpi, batch_size))
+            return false;
+    }
+    if (qp_management->stalled_) {
+        qp_management->stalled_ = false;
+        qp_management->credits_wanted_.store(0, std::memory_order_relaxed);
+        qp_management->stall_count_.fetch_add(1, std::memory_order_relaxed);
+        qp_management->stall_ns_.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                               std::chrono::steady_clock::now() - qp_management->stall_start_)
+                                               .count(),
+                                           std::memory_order_relaxed);
+    }
+    return true;
+}
+
+void RDMAContext::add_posted(int qpi, const RDMAAssignmentSharedPtr& assign)
+{
+    qp_management_[qpi]->outstanding_rdma_reads_.fetch_add(send_credits(assign), std::memory_order_relaxed);
+    qp_management_[qpi]->posted_bytes_.fetch_add(assign->bytes(), std::memory_order_relaxed);
+}
+
+void RDMAContext::return_send_credits(int qpi, const RDMAAssignmentSharedPtr& assign)
+{
+    qp_management_t* qp_management = qp_management_[qpi];
+    int              credits       = send_credits(assign);
+    int              outstanding   = qp_management->outstanding_rdma_reads_.fetch_sub(credits) - credits;
+    qp_management->posted_bytes_.fetch_sub(assign->bytes(), std::memory_order_relaxed);
+
+    // Wake the dispatcher only once what it waits for is actually free
+    int wanted = qp_management->credits_wanted_.load();
+    if (wanted > 0 && wanted + outstanding <= config_.max_send_wr)
+        ring_doorbell(qpi);
+}
+
+json RDMAContext::flow_control_stats() const
+{
+    uint64_t stall_count = 0;
+    uint64_t stall_ns    = 0;
+    for (size_t qpi = 0; qpi < qp_list_len_; ++qpi) {
+        stall_count += qp_management_[qpi]->stall_count_.load(std::memory_order_relaxed);
+        stall_ns += qp_management_[qpi]->stall_ns_.load(std::memory_order_relaxed);
+    }
+    return json{{"stall_count", stall_count}, {"stall_time_us", stall_ns / 1000}};
+}
+
+void RDMAContext::fail_post(int qpi, callback_info_with_qpi_t* record)
+{
+    RDMAAssignmentSharedPtr assign = record->assign_;
+    return_send_credits(qpi, assign);
+    release_completion_record(record);
+    assign->callback_info_->callback_(callback_info_t::FAILED);
 }
 
 int64_t RDMAContext::post_send(int qpi, RDMAAssignmentSharedPtr assign)
 {
     int ret;
 
-    struct ibv_mr* mr        = memory_pool_.get_mr(assign->batch_[0].mr_key);
-    remote_mr_t    remote_mr = memory_pool_.get_remote_mr(assign->batch_[0].mr_key);
-
-    struct ibv_sge sge;
-    memset(&sge, 0, sizeof(sge));
-    sge.addr   = (uintptr_t)mr->addr + assign->batch_[0].source_offset;
-    sge.length = assign->batch_[0].length;
-    sge.lkey   = mr->lkey;
+    // The whole batch is gathered into a single message
+    if (assign->batch_size() > size_t(max_send_sge_)) {
+        SLIME_LOG_ERROR("SEND batch_size(" << assign->batch_size() << ") > max send SGE(" << max_send_sge_ << ")");
+        assign->callback_info_->callback_(callback_info_t::ASSIGNMENT_BATCH_OVERFLOW);
+        return -1;
+    }
+    // It has to fit in a ring buffer of the peer SRQ, whatever our own config
+    uint32_t peer_srq_recv_bytes = peer_management_[peer_of(qpi)].remote_srq_recv_bytes_;
+    if (peer_srq_recv_bytes && assign->bytes() > peer_srq_recv_bytes) {
+        SLIME_LOG_ERROR("SEND of " << assign->bytes() << " bytes > peer SRQ receive size(" << peer_srq_recv_bytes << ")");
+        assign->callback_info_->callback_(callback_info_t::ASSIGNMENT_BATCH_OVERFLOW);
+        return -1;
+    }
+    struct ibv_sge* sge = fill_sge_list(qpi, assign);
 
     struct ibv_send_wr wr, *bad_wr = NULL;
     memset(&wr, 0, sizeof(wr));
 
-    wr.wr_id      = 0;
+    callback_info_with_qpi_t* record = acquire_completion_record(qpi, assign);
+
+    wr.wr_id      = (uintptr_t)record;
     wr.opcode     = IBV_WR_SEND;
-    wr.sg_list    = &sge;
-    wr.num_sge    = 1;
+    wr.sg_list    = sge;
+    wr.num_sge    = assign->batch_size();
     wr.send_flags = IBV_SEND_SIGNALED;
+    if (assign->bytes() <= (uint64_t)max_inline_data_)
+        wr.send_flags |= IBV_SEND_INLINE;
 
     {
         std::unique_lock<std::mutex> lock(qp_management_[qpi]->rdma_post_send_mutex_);
-        qp_management_[qpi]->outstanding_rdma_reads_.fetch_add(assign->batch_size(), std::memory_order_relaxed);
+        add_posted(qpi, assign);
         ret = ibv_post_send(qp_management_[qpi]->qp_, &wr, &bad_wr);
     }
 
     if (ret) {
         SLIME_LOG_ERROR("Failed to post RDMA send : " << strerror(ret));
+        fail_post(qpi, record);
         return -1;
     }
 
@@ -395,197 +1052,905 @@ int64_t RDMAContext::post_recv(int qpi, RDMAAssignmentSharedPtr assign)
 
     int ret;
 
-    struct ibv_mr* mr        = memory_pool_.get_mr(assign->batch_[0].mr_key);
-    remote_mr_t    remote_mr = memory_pool_.get_remote_mr(assign->batch_[0].mr_key);
-
-    struct ibv_sge sge;
-    memset(&sge, 0, sizeof(sge));
-    sge.addr   = (uintptr_t)mr->addr + assign->batch_[0].source_offset;
-    sge.length = assign->batch_[0].length;
-    sge.lkey   = mr->lkey;
+    // The incoming message is scattered over the whole batch
+    if (assign->batch_size() > size_t(max_recv_sge_)) {
+        SLIME_LOG_ERROR("RECV batch_size(" << assign->batch_size() << ") > max recv SGE(" << max_recv_sge_ << ")");
+        assign->callback_info_->callback_(callback_info_t::ASSIGNMENT_BATCH_OVERFLOW);
+        return -1;
+    }
+    struct ibv_sge* sge = fill_sge_list(qpi, assign);
 
     struct ibv_recv_wr wr, *bad_wr = NULL;
     memset(&wr, 0, sizeof(wr));
 
-    wr.wr_id   = 0;
-    wr.sg_list = &sge;
-    wr.num_sge = 1;
+    callback_info_with_qpi_t* record = acquire_completion_record(qpi, assign);
+
+    wr.wr_id   = (uintptr_t)record;
+    wr.sg_list = sge;
+    wr.num_sge = assign->batch_size();
 
     {
         std::unique_lock<std::mutex> lock(qp_management_[qpi]->rdma_post_send_mutex_);
-        qp_management_[qpi]->outstanding_rdma_reads_.fetch_add(assign->batch_size(), std::memory_order_relaxed);
+        add_posted(qpi, assign);
         ret = ibv_post_recv(qp_management_[qpi]->qp_, &wr, &bad_wr);
     }
 
     if (ret) {
-        SLIME_LOG_ERROR("Failed to post RDMA send : " << strerror(ret));
+        SLIME_LOG_ERROR("Failed to post RDMA recv : " << strerror(ret));
+        fail_post(qpi, record);
+        return -1;
+    }
+
+    return 0;
+}
+
+int64_t RDMAContext::init_srq()
+{
+    struct ibv_srq_init_attr srq_init_attr = {};
+    srq_init_attr.attr.max_wr              = config_.srq_depth;
+    srq_init_attr.attr.max_sge             = 1;
+    srq_                                   = verbs_->create_srq(pd_, &srq_init_attr);
+    if (!srq_) {
+        SLIME_LOG_ERROR("Failed to create SRQ");
+        return -1;
+    }
+
+    size_t ring_bytes = (size_t)config_.srq_depth * config_.srq_recv_bytes;
+    srq_ring_         = (char*)aligned_alloc(4096, (ring_bytes + 4095) & ~(size_t)4095);
+    srq_ring_mr_      = verbs_->reg_mr(pd_, srq_ring_, ring_bytes, IBV_ACCESS_LOCAL_WRITE);
+    if (!srq_ring_mr_) {
+        SLIME_LOG_ERROR("Failed to register the SRQ ring");
         return -1;
     }
 
+    srq_refill_batch_ = std::max(config_.srq_depth / 8, 1);
+    srq_wr_arena_.resize(config_.srq_depth);
+    srq_sge_arena_.resize(config_.srq_depth);
+
+    std::lock_guard<std::mutex> lock(srq_mutex_);
+    for (int slot = 0; slot < config_.srq_depth; ++slot)
+        srq_free_slots_.push_back(slot);
+    return post_srq_slots();
+}
+
+int64_t RDMAContext::post_srq_slots()
+{
+    size_t num_wr = srq_free_slots_.size();
+    for (size_t i = 0; i < num_wr; ++i) {
+        uint32_t        slot = srq_free_slots_[i];
+        struct ibv_sge& sge  = srq_sge_arena_[i];
+        sge.addr             = (uintptr_t)srq_ring_ + (uint64_t)slot * config_.srq_recv_bytes;
+        sge.length           = config_.srq_recv_bytes;
+        sge.lkey             = srq_ring_mr_->lkey;
+
+        struct ibv_recv_wr& wr = srq_wr_arena_[i];
+        wr.wr_id               = ((uint64_t)slot << 1) | SRQ_WR_ID_TAG;
+        wr.sg_list             = &sge;
+        wr.num_sge             = 1;
+        wr.next                = i + 1 < num_wr ? &srq_wr_arena_[i + 1] : nullptr;
+    }
+
+    struct ibv_recv_wr* bad_wr = nullptr;
+    int                 ret    = ibv_post_srq_recv(srq_, srq_wr_arena_.data(), &bad_wr);
+    // Slots from bad_wr onwards are still free, the next refill retries them
+    size_t posted = ret ? bad_wr - srq_wr_arena_.data() : num_wr;
+    srq_free_slots_.erase(srq_free_slots_.begin(), srq_free_slots_.begin() + posted);
+    if (ret) {
+        SLIME_LOG_ERROR("Failed to post SRQ receives : " << strerror(ret));
+        return -1;
+    }
     return 0;
 }
 
-int64_t RDMAContext::post_read_batch(int qpi, RDMAAssignmentSharedPtr assign)
+void RDMAContext::release_srq_slot(uint32_t slot)
+{
+    std::lock_guard<std::mutex> lock(srq_mutex_);
+    srq_free_slots_.push_back(slot);
+    if (srq_free_slots_.size() >= srq_refill_batch_) {
+        post_srq_slots();
+        srq_refills_ += 1;
+    }
+}
+
+void RDMAContext::on_srq_completion(const struct ibv_wc& wc, int status)
+{
+    uint32_t slot = wc.wr_id >> 1;
+
+    // Only flushed, no message behind it
+    if (wc.status == IBV_WC_WR_FLUSH_ERR) {
+        release_srq_slot(slot);
+        return;
+    }
+
+    // No peer to hand the message to
+    int qpi = qpi_of(wc.qp_num);
+    if (qpi < 0) {
+        SLIME_LOG_WARN("SRQ message from unknown QP ", wc.qp_num, " dropped");
+        release_srq_slot(slot);
+        return;
+    }
+
+    srq_message_t message;
+    message.slot_        = slot;
+    message.byte_len_    = wc.byte_len;
+    message.imm_data_    = (wc.wc_flags & IBV_WC_WITH_IMM) ? ntohl(wc.imm_data) : 0;
+    message.has_payload_ = wc.opcode == IBV_WC_RECV;
+    message.qpi_         = qpi;
+    message.status_      = status;
+
+    // Only RECVs submitted for the peer that sent it take the message
+    peer_management_t&                   peer_management = peer_management_[peer_of(message.qpi_)];
+    RDMAAssignmentSharedPtr              assign;
+    std::vector<RDMAAssignmentSharedPtr> dropped;
+    {
+        std::lock_guard<std::mutex>          lock(srq_mutex_);
+        std::deque<RDMAAssignmentSharedPtr>& srq_recvs = peer_management.srq_recvs_;
+        srq_received_ += 1;
+        // RECVs cancelled or timed out while waiting take no message
+        while (!srq_recvs.empty() && !srq_recvs.front()->mark_posted()) {
+            dropped.push_back(std::move(srq_recvs.front()));
+            srq_recvs.pop_front();
+        }
+        if (srq_recvs.empty()) {
+            // Keeps its slot until a RECV is submitted
+            srq_unexpected_ += 1;
+            peer_management.srq_messages_.push_back(message);
+        }
+        else {
+            assign = std::move(srq_recvs.front());
+            srq_recvs.pop_front();
+        }
+    }
+    for (RDMAAssignmentSharedPtr& recv : dropped)
+        recv->callback_info_->callback_(recv->status());
+    if (assign)
+        deliver_srq_message(message, std::move(assign));
+}
+
+RDMAAssignmentSharedPtr RDMAContext::submit_srq_recv(int                       peer,
+                                                     AssignmentBatch&          batch,
+                                                     callback_fn_t             callback,
+                                                     std::chrono::milliseconds timeout)
+{
+    RDMAAssignmentSharedPtr assign = std::make_shared<RDMAAssignment>(OpCode::RECV, batch, callback);
+    acquire_mr_leases(assign.get());
+    if (timeout > kNoTimeout)
+        track_deadline(peer * config_.qp_num, assign, timeout);
+    // Only a message would complete it, a cancel or timeout has to give its MRs back itself
+    assign->on_drop_ = [this, peer, raw = assign.get()]() { drop_srq_recv(peer, raw); };
+
+    peer_management_t& peer_management = peer_management_[peer];
+    srq_message_t      message;
+    {
+        std::lock_guard<std::mutex> lock(srq_mutex_);
+        if (peer_management.srq_messages_.empty()) {
+            peer_management.srq_recvs_.push_back(assign);
+            return assign;
+        }
+        message = peer_management.srq_messages_.front();
+        peer_management.srq_messages_.pop_front();
+    }
+    assign->mark_posted();
+    deliver_srq_message(message, assign);
+    return assign;
+}
+
+void RDMAContext::drop_srq_recv(int peer, RDMAAssignment* assign)
+{
+    {
+        std::lock_guard<std::mutex>          lock(srq_mutex_);
+        std::deque<RDMAAssignmentSharedPtr>& srq_recvs = peer_management_[peer].srq_recvs_;
+        auto it = std::find_if(srq_recvs.begin(), srq_recvs.end(), [assign](const RDMAAssignmentSharedPtr& recv) {
+            return recv.get() == assign;
+        });
+        // Taken off by a message meanwhile, which releases it as a dropped RECV
+        if (it == srq_recvs.end())
+            return;
+        srq_recvs.erase(it);
+    }
+    untrack_deadline(assign);
+    release_mr_leases(assign);
+}
+
+void RDMAContext::deliver_srq_message(const srq_message_t& message, RDMAAssignmentSharedPtr assign)
+{
+    int status = message.status_;
+    if (status == callback_info_t::SUCCESS && message.has_payload_) {
+        if (message.byte_len_ > assign->bytes()) {
+            SLIME_LOG_ERROR("Message of " << message.byte_len_ << " bytes > RECV of " << assign->bytes() << " bytes");
+            status = callback_info_t::FAILED;
+        }
+        else {
+            // Scattered over the batch like a RECV posted on the QP would be
+            const char* payload = srq_ring_ + (uint64_t)message.slot_ * config_.srq_recv_bytes;
+            uint64_t    copied  = 0;
+            for (size_t i = 0; i < assign->batch_size() && copied < message.byte_len_; ++i) {
+                Assignment&       subassign = assign->batch_[i];
+                const local_mr_t& mr        = assign->leases_[i]->mr;
+                uint64_t          length    = std::min<uint64_t>(subassign.length, message.byte_len_ - copied);
+                memcpy((void*)(mr.addr + subassign.source_offset), payload + copied, length);
+                copied += length;
+            }
+        }
+    }
+    assign->callback_info_->imm_data_ = message.imm_data_;
+
+    release_srq_slot(message.slot_);
+    dispatch_callback(message.qpi_, std::move(assign), status);
+}
+
+void RDMAContext::index_qp(int qpi)
+{
+    // Only init_peer writes, under peer_mutex_
+    uint32_t qp_num = qp_management_[qpi]->qp_->qp_num;
+    size_t   slot   = (qp_num * 2654435761u) & qpi_index_mask_;
+    while (qpi_index_[slot].load(std::memory_order_relaxed))
+        slot = (slot + 1) & qpi_index_mask_;
+    qpi_index_[slot].store(uint64_t(qp_num) << 32 | uint64_t(qpi + 1), std::memory_order_release);
+}
+
+int RDMAContext::qpi_of(uint32_t qp_num) const
+{
+    for (size_t slot = (qp_num * 2654435761u) & qpi_index_mask_;; slot = (slot + 1) & qpi_index_mask_) {
+        uint64_t entry = qpi_index_[slot].load(std::memory_order_acquire);
+        if (!entry)
+            return -1;
+        if (uint32_t(entry >> 32) == qp_num)
+            return int(entry & 0xffffffff) - 1;
+    }
+}
+
+json RDMAContext::srq_stats()
 {
+    std::lock_guard<std::mutex> lock(srq_mutex_);
+    size_t                      pending_recvs    = 0;
+    size_t                      pending_messages = 0;
+    for (int peer = 0; peer < peer_num(); ++peer) {
+        pending_recvs += peer_management_[peer].srq_recvs_.size();
+        pending_messages += peer_management_[peer].srq_messages_.size();
+    }
+    return json{{"srq_depth", srq_ ? config_.srq_depth : 0},
+                {"received", srq_received_},
+                {"unexpected", srq_unexpected_},
+                {"refills", srq_refills_},
+                {"pending_recvs", pending_recvs},
+                {"pending_messages", pending_messages},
+                {"free_slots", srq_free_slots_.size()}};
+}
+
+int64_t RDMAContext::post_rw_batch(int qpi, RDMAAssignmentSharedPtr assign)
+{
+    bool               with_imm       = assign->opcode_ == OpCode::WRITE_WITH_IMM;
+    enum ibv_wr_opcode wr_opcode      = assign->opcode_ == OpCode::READ ? IBV_WR_RDMA_READ : IBV_WR_RDMA_WRITE;
+    enum ibv_wr_opcode last_wr_opcode = with_imm ? IBV_WR_RDMA_WRITE_WITH_IMM : wr_opcode;
+
     size_t              batch_size = assign->batch_size();
     struct ibv_send_wr* bad_wr     = NULL;
-    struct ibv_send_wr* wr         = new ibv_send_wr[batch_size];
-    struct ibv_sge*     sge        = new ibv_sge[batch_size];
 
+    if (batch_size == 0) {
+        if (!with_imm) {
+            assign->callback_info_->callback_(callback_info_t::SUCCESS);
+            return 0;
+        }
+        // Zero-length write, only the immediate data goes to the peer
+        callback_info_with_qpi_t* record = acquire_completion_record(qpi, assign);
+
+        struct ibv_send_wr imm_wr;
+        memset(&imm_wr, 0, sizeof(imm_wr));
+        imm_wr.wr_id      = (uintptr_t)record;
+        imm_wr.opcode     = IBV_WR_RDMA_WRITE_WITH_IMM;
+        imm_wr.imm_data   = htonl(assign->imm_data_);
+        imm_wr.send_flags = IBV_SEND_SIGNALED;
+
+        int ret;
+        {
+            std::unique_lock<std::mutex> lock(qp_management_[qpi]->rdma_post_send_mutex_);
+            add_posted(qpi, assign);
+            ret = ibv_post_send(qp_management_[qpi]->qp_, &imm_wr, &bad_wr);
+        }
+        if (ret) {
+            SLIME_LOG_ERROR("Failed to post RDMA send : " << strerror(ret));
+            fail_post(qpi, record);
+            return -1;
+        }
+        return 0;
+    }
+
+    // The peer may have unregistered a key since submit, its rkey is gone from the table. One
+    // copy of each entry, checked and posted with, whatever the peer registers meanwhile
+    remote_mr_t* remote_mrs = qp_management_[qpi]->remote_mr_arena_.data();
+    for (size_t i = 0; i < batch_size; ++i) {
+        remote_mrs[i] = memory_pool_.get_remote_mr(assign->batch_[i].mr_handle, peer_of(qpi));
+        if (!remote_mrs[i].length) {
+            SLIME_LOG_ERROR("Remote MR not registered: " << assign->batch_[i].dump());
+            assign->callback_info_->callback_(callback_info_t::REMOTE_MR_NOT_REGISTERED);
+            return -1;
+        }
+    }
+
+    // batch_size <= max_send_wr is checked by the dispatcher, the arenas are always large enough
+    struct ibv_send_wr*       wr     = qp_management_[qpi]->wr_arena_.data();
+    struct ibv_sge*           sge    = fill_sge_list(qpi, assign);
+    callback_info_with_qpi_t* record = acquire_completion_record(qpi, assign);
+
+    int      max_sge  = assign->opcode_ == OpCode::READ ? max_rd_sge_ : max_send_sge_;
+    size_t   num_wr   = 0;
+    uint64_t wr_bytes = 0;
     for (size_t i = 0; i < batch_size; ++i) {
-        Assignment     subassign   = assign->batch_[i];
-        struct ibv_mr* mr          = memory_pool_.get_mr(subassign.mr_key);
-        remote_mr_t    remote_mr   = memory_pool_.get_remote_mr(subassign.mr_key);
-        uint64_t       remote_addr = remote_mr.addr;
-        uint32_t       remote_rkey = remote_mr.rkey;
-        memset(&sge[i], 0, sizeof(ibv_sge));
-        sge[i].addr   = (uint64_t)mr->addr + subassign.source_offset;
-        sge[i].length = subassign.length;
-        sge[i].lkey   = mr->lkey;
-
-        wr[i].wr_id =
-            (i == batch_size - 1) ? (uintptr_t)(new callback_info_with_qpi_t{assign->callback_info_, qpi}) : 0;
-        wr[i].opcode              = IBV_WR_RDMA_READ;
-        wr[i].sg_list             = &sge[i];
-        wr[i].num_sge             = 1;
-        wr[i].send_flags          = (i == batch_size - 1) ? IBV_SEND_SIGNALED : 0;
-        wr[i].wr.rdma.remote_addr = remote_addr + assign->batch_[i].target_offset;
-        wr[i].wr.rdma.rkey        = remote_rkey;
-        wr[i].next                = (i == batch_size - 1) ? NULL : &wr[i + 1];
+        Assignment&        subassign   = assign->batch_[i];
+        const remote_mr_t& remote_mr   = remote_mrs[i];
+        uint64_t           remote_addr = remote_mr.addr + subassign.target_offset;
+
+        // Gather into the previous WR when the remote range simply continues it
+        if (sge_packing_ && num_wr > 0) {
+            struct ibv_send_wr& prev = wr[num_wr - 1];
+            if (prev.num_sge < max_sge && prev.wr.rdma.rkey == remote_mr.rkey
+                && prev.wr.rdma.remote_addr + wr_bytes == remote_addr && wr_bytes + subassign.length <= max_msg_size_) {
+                prev.num_sge += 1;
+                wr_bytes += subassign.length;
+                continue;
+            }
+        }
+
+        struct ibv_send_wr& next = wr[num_wr++];
+        memset(&next, 0, sizeof(ibv_send_wr));
+        next.opcode              = wr_opcode;
+        next.sg_list             = &sge[i];
+        next.num_sge             = 1;
+        next.wr.rdma.remote_addr = remote_addr;
+        next.wr.rdma.rkey        = remote_mr.rkey;
+        wr_bytes                 = subassign.length;
+    }
+
+    for (size_t i = 0; i < num_wr; ++i) {
+        if (i + 1 < num_wr)
+            wr[i].next = &wr[i + 1];
+        // Small writes go inline, the NIC then skips the DMA read of the local buffer
+        if (wr_opcode == IBV_WR_RDMA_WRITE) {
+            uint64_t length = 0;
+            for (int k = 0; k < wr[i].num_sge; ++k)
+                length += wr[i].sg_list[k].length;
+            if (length <= (uint64_t)max_inline_data_)
+                wr[i].send_flags = IBV_SEND_INLINE;
+        }
     }
+    wr[num_wr - 1].wr_id    = (uintptr_t)record;
+    wr[num_wr - 1].opcode   = last_wr_opcode;
+    wr[num_wr - 1].imm_data = htonl(assign->imm_data_);
+    wr[num_wr - 1].send_flags |= IBV_SEND_SIGNALED;
 
     int ret = 0;
     {
         std::unique_lock<std::mutex> lock(qp_management_[qpi]->rdma_post_send_mutex_);
-        qp_management_[qpi]->outstanding_rdma_reads_.fetch_add(assign->batch_size(), std::memory_order_relaxed);
+        add_posted(qpi, assign);
         ret = ibv_post_send(qp_management_[qpi]->qp_, wr, &bad_wr);
     }
 
-    delete[] wr;
-    delete[] sge;
-
     if (ret) {
         SLIME_LOG_ERROR("Failed to post RDMA send : " << strerror(ret));
+        // Nothing from bad_wr onwards reached the QP, the signaled last WR included
+        fail_post(qpi, record);
         return -1;
     }
 
     return 0;
 }
 
-int64_t RDMAContext::cq_poll_handle()
+void RDMAContext::pin_worker_thread()
 {
-    SLIME_LOG_INFO("Polling CQ");
+    if (worker_cpus_.empty())
+        return;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    for (int cpu : worker_cpus_)
+        CPU_SET(cpu, &cpus);
+    int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (ret)
+        SLIME_LOG_WARN("Failed to pin worker thread: ", strerror(ret));
+}
 
-    if (!connected_) {
-        SLIME_LOG_ERROR("Start CQ handle before connected, please construct first");
-        return -1;
+void RDMAContext::dispatch_callback(int qpi, RDMAAssignmentSharedPtr assign, int status)
+{
+    if (callback_executors_.empty()) {
+        assign->callback_info_->callback_(status);
+        return;
+    }
+    completion_task_t task;
+    task.assign_ = std::move(assign);
+    task.status_ = status;
+    callback_executors_[qpi % callback_executors_.size()]->queue_.push(std::move(task));
+}
+
+void RDMAContext::run_completion_task(completion_task_t& task)
+{
+    if (task.notify_only_)
+        task.assign_->callback_info_->notify(task.status_);
+    else
+        task.assign_->callback_info_->callback_(task.status_);
+}
+
+void RDMAContext::dispatch_timeout(int qpi, RDMAAssignmentSharedPtr assign)
+{
+    if (callback_executors_.empty()) {
+        assign->callback_info_->notify(callback_info_t::TIME_OUT);
+        return;
+    }
+    completion_task_t task;
+    task.assign_      = std::move(assign);
+    task.status_      = callback_info_t::TIME_OUT;
+    task.notify_only_ = true;
+    callback_executors_[qpi % callback_executors_.size()]->queue_.push(std::move(task));
+}
+
+int64_t RDMAContext::callback_handle(int executor)
+{
+    SLIME_LOG_INFO("Running callbacks");
+    pin_worker_thread();
+
+    callback_executor_t* callback_executor = callback_executors_[executor].get();
+    completion_task_t    task;
+    while (callback_executor->queue_.pop_wait(task, stop_callback_executor_)) {
+        run_completion_task(task);
+        task.assign_.reset();
+    }
+    // Callbacks handed over before the pollers stopped still run, nobody waits forever
+    while (callback_executor->queue_.try_pop(task)) {
+        run_completion_task(task);
+        task.assign_.reset();
+    }
+    return 0;
+}
+
+int RDMAContext::poll_completions(int cqi)
+{
+    cq_management_t& cq_man = cq_management_[cqi];
+    struct ibv_wc*   wc     = cq_man.wc_.data();
+
+    int nr_poll = ibv_poll_cq(cq_man.cq_, config_.poll_count, wc);
+    if (nr_poll < 0) {
+        SLIME_LOG_WARN("Worker: Failed to poll completion queues");
+        return nr_poll;
+    }
+    for (int i = 0; i < nr_poll; ++i) {
+        callback_info_t::CALLBACK_STATUS status_code = callback_info_t::SUCCESS;
+        if (wc[i].status != IBV_WC_SUCCESS) {
+            status_code = callback_info_t::FAILED;
+            // The WRs flushed behind the one that broke the QP add nothing to the log
+            if (wc[i].status != IBV_WC_WR_FLUSH_ERR)
+                SLIME_LOG_ERROR("WR failed with status: ", ibv_wc_status_str(wc[i].status), std::endl);
+            int qpi = qpi_of(wc[i].qp_num);
+            if (qpi < 0) {
+                SLIME_LOG_WARN("Completion of unknown QP ", wc[i].qp_num, ", no QP marked broken");
+            }
+            else {
+                mark_broken(qpi, wc[i].status);
+            }
+        }
+        if (wc[i].wr_id & SRQ_WR_ID_TAG) {
+            on_srq_completion(wc[i], status_code);
+            continue;
+        }
+        if (wc[i].wr_id != 0) {
+            callback_info_with_qpi_t* callback_with_qpi = reinterpret_cast<callback_info_with_qpi_t*>(wc[i].wr_id);
+            // The record keeps the assignment alive until the callback has returned
+            RDMAAssignmentSharedPtr assign        = std::move(callback_with_qpi->assign_);
+            callback_info_t*        callback_info = assign->callback_info_;
+            int                     qpi           = callback_with_qpi->qpi_;
+            if (wc[i].wc_flags & IBV_WC_WITH_IMM)
+                callback_info->imm_data_ = ntohl(wc[i].imm_data);
+            // Parked for the retry before its credits return, the failover waits for all of them
+            bool retried = status_code != callback_info_t::SUCCESS && retry_failed(qpi, assign, wc[i].status);
+            if (status_code != callback_info_t::SUCCESS && !retried)
+                given_up_.fetch_add(1, std::memory_order_relaxed);
+            return_send_credits(qpi, assign);
+            release_completion_record(callback_with_qpi);
+            if (retried)
+                continue;
+            switch (OpCode wr_type = callback_info->opcode_) {
+                case OpCode::READ:
+                case OpCode::WRITE:
+                case OpCode::WRITE_WITH_IMM:
+                case OpCode::SEND:
+                case OpCode::RECV:
+                    dispatch_callback(qpi, std::move(assign), status_code);
+                    break;
+                default:
+                    SLIME_ABORT("Unimplemented WrType " << int64_t(wr_type));
+            }
+        }
     }
-    if (comp_channel_ == NULL)
+    return nr_poll;
+}
+
+int64_t RDMAContext::cq_poll_handle(int cqi)
+{
+    SLIME_LOG_INFO("Polling CQ ", cqi);
+
+    cq_management_t& cq_man = cq_management_[cqi];
+    if (cq_man.comp_channel_ == NULL)
         SLIME_LOG_ERROR("comp_channel_ should be constructed");
 
+    pin_worker_thread();
+
+    // Armed the first time the CQ is found empty, peers may connect after the poller started
+    bool armed      = false;
+    bool idle       = false;
+    auto idle_since = std::chrono::steady_clock::now();
+
     while (!stop_cq_future_) {
+        int nr_poll = poll_completions(cqi);
+        expire_deadlines();
+        if (nr_poll > 0) {
+            completion_stats_.polled_completions_.fetch_add(nr_poll, std::memory_order_relaxed);
+            idle = false;
+            continue;
+        }
+        completion_stats_.empty_polls_.fetch_add(1, std::memory_order_relaxed);
+
+        CompletionMode mode = completion_mode_.load(std::memory_order_relaxed);
+        if (mode == CompletionMode::BUSY_POLL) {
+            SLIME_CPU_RELAX();
+            continue;
+        }
+        if (mode == CompletionMode::HYBRID) {
+            if (!idle) {
+                idle       = true;
+                idle_since = std::chrono::steady_clock::now();
+            }
+            if (std::chrono::steady_clock::now() - idle_since
+                < std::chrono::microseconds(poll_spin_us_.load(std::memory_order_relaxed))) {
+                SLIME_CPU_RELAX();
+                continue;
+            }
+        }
+
+        // About to sleep: arm first and poll once more, a completion racing the arm is not lost
+        if (!armed) {
+            if (ibv_req_notify_cq(cq_man.cq_, 0) != 0) {
+                SLIME_LOG_ERROR("Failed to request CQ notification");
+                return -1;
+            }
+            armed = true;
+            continue;
+        }
+
+        // Bounded wait, deadlines are checked even when nothing completes
+        int ready = verbs_->wait_cq_event(cq_man.comp_channel_, deadline_wait_ms());
+        if (ready < 0) {
+            SLIME_LOG_ERROR("Failed to wait for CQ event");
+            return -1;
+        }
+        if (ready == 0)
+            continue;
+
         struct ibv_cq* ev_cq;
         void*          cq_context;
-
-        if (ibv_get_cq_event(comp_channel_, &ev_cq, &cq_context) != 0) {
+        if (verbs_->get_cq_event(cq_man.comp_channel_, &ev_cq, &cq_context) != 0) {
             SLIME_LOG_ERROR("Failed to get CQ event");
             return -1;
         }
+        verbs_->ack_cq_events(ev_cq, 1);
+        completion_stats_.event_wakeups_.fetch_add(1, std::memory_order_relaxed);
+        armed = false;
+        idle  = false;
+    }
+    return 0;
+}
 
-        ibv_ack_cq_events(ev_cq, 1);
-        if (ibv_req_notify_cq(ev_cq, 0) != 0) {
-            SLIME_LOG_ERROR("Failed to request CQ notification");
-            return -1;
+json RDMAContext::completion_stats() const
+{
+    static const char* mode_names[] = {"event", "busy_poll", "hybrid"};
+    return json{
+        {"mode", mode_names[int(completion_mode_.load(std::memory_order_relaxed))]},
+        {"poll_spin_us", poll_spin_us_.load(std::memory_order_relaxed)},
+        {"event_wakeups", completion_stats_.event_wakeups_.load(std::memory_order_relaxed)},
+        {"polled_completions", completion_stats_.polled_completions_.load(std::memory_order_relaxed)},
+        {"empty_polls", completion_stats_.empty_polls_.load(std::memory_order_relaxed)},
+        {"timed_out", timed_out_.load(std::memory_order_relaxed)},
+    };
+}
+
+json RDMAContext::recovery_stats() const
+{
+    json failed = json::array();
+    for (size_t qpi = 0; qpi < qp_list_len_; ++qpi) {
+        if (qp_management_[qpi]->broken_.load(std::memory_order_relaxed))
+            failed.push_back(qpi);
+    }
+    return json{
+        {"qp_errors", qp_errors_.load(std::memory_order_relaxed)},
+        {"failed_qps", failed},
+        {"recovered", recovered_.load(std::memory_order_relaxed)},
+        {"retried", retried_.load(std::memory_order_relaxed)},
+        {"given_up", given_up_.load(std::memory_order_relaxed)},
+    };
+}
+
+void RDMAContext::mark_broken(int qpi, enum ibv_wc_status status)
+{
+    qp_management_t* qp_management = qp_management_[qpi];
+    int              no_error      = IBV_WC_SUCCESS;
+    qp_management->first_error_.compare_exchange_strong(no_error, status);
+    if (qp_management->broken_.exchange(true))
+        return;
+    qp_errors_.fetch_add(1, std::memory_order_relaxed);
+    SLIME_LOG_WARN(
+        "QP ", qpi, " of ", get_dev_ib(), " failed (", ibv_wc_status_str(status), "), failing over its work");
+
+    ring_doorbell(qpi);
+}
+
+bool RDMAContext::retry_failed(int qpi, const RDMAAssignmentSharedPtr& assign, enum ibv_wc_status status)
+{
+    // Only a QP lost to the transport (retries exceeded) says nothing about the WRs themselves
+    qp_management_t* qp_management = qp_management_[qpi];
+    int              first_error   = qp_management->first_error_.load();
+    if (first_error != IBV_WC_RETRY_EXC_ERR && first_error != IBV_WC_RNR_RETRY_EXC_ERR)
+        return false;
+    if (status != IBV_WC_WR_FLUSH_ERR && status != IBV_WC_RETRY_EXC_ERR && status != IBV_WC_RNR_RETRY_EXC_ERR)
+        return false;
+    // The peer may have consumed the message already, unless it had no receive for it
+    OpCode opcode = assign->opcode_;
+    if ((opcode == OpCode::SEND || opcode == OpCode::WRITE_WITH_IMM) && status != IBV_WC_RNR_RETRY_EXC_ERR)
+        return false;
+    // A timed out assignment has been reported already, it only finishes
+    if (assign->retries_ >= config_.max_retries || assign->callback_info_->notified_.load() || !assign->requeue())
+        return false;
+
+    assign->retries_ += 1;
+    retried_.fetch_add(1, std::memory_order_relaxed);
+    qp_management->queued_bytes_.fetch_add(assign->bytes(), std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(qp_management->retry_mutex_);
+    qp_management->retry_queue_.push_back(assign);
+    return true;
+}
+
+void RDMAContext::fail_over_qp(int qpi)
+{
+    qp_management_t* qp_management = qp_management_[qpi];
+
+    {
+        std::lock_guard<std::mutex> lock(recovery_mutex_);
+        if (!qp_management->flushed_) {
+            // Every WR still on the QP completes with a flush error
+            struct ibv_qp_attr attr = {};
+            attr.qp_state           = IBV_QPS_ERR;
+            if (verbs_->modify_qp(qp_management->qp_, &attr, IBV_QP_STATE))
+                SLIME_LOG_WARN("Failed to move QP ", qpi, " to ERR");
+            // The CQ poller parks the ones to retry, then returns their credits and rings once all are back
+            qp_management->flushed_ = true;
+            qp_management->credits_wanted_.store(config_.max_send_wr);
         }
+    }
+    if (qp_management->outstanding_rdma_reads_.load() > 0)
+        return;
+    qp_management->credits_wanted_.store(0, std::memory_order_relaxed);
 
-        struct ibv_wc wc[POLL_COUNT];
+    hand_over_work(qpi);
 
-        while (size_t nr_poll = ibv_poll_cq(cq_, POLL_COUNT, wc)) {
-            if (stop_cq_future_)
-                return 0;
-            if (nr_poll < 0) {
-                SLIME_LOG_WARN("Worker: Failed to poll completion queues");
+    // Nothing of the old connection is left on the QP, it can start over. flushed_ is only
+    // raised by this dispatcher, so a QP reconnected meanwhile is not reset again.
+    std::lock_guard<std::mutex> lock(recovery_mutex_);
+    if (qp_management->flushed_ && !qp_management->reset_)
+        reset_qp(qpi);
+}
+
+void RDMAContext::hand_over_work(int qpi)
+{
+    qp_management_t* qp_management = qp_management_[qpi];
+
+    // Oldest first: the flushed WRs, then what the dispatcher held, then the queue
+    std::deque<RDMAAssignmentSharedPtr> requeued;
+    {
+        std::lock_guard<std::mutex> lock(qp_management->retry_mutex_);
+        requeued.swap(qp_management->retry_queue_);
+    }
+    for (RDMAAssignmentSharedPtr& assign : qp_management->pending_)
+        requeued.push_back(std::move(assign));
+    qp_management->pending_.clear();
+    for (RDMAAssignmentSharedPtr assign; qp_management->assign_queue_.try_pop(assign);) {
+        if (assign)
+            requeued.push_back(std::move(assign));
+    }
+    if (requeued.empty())
+        return;
+
+    // All to one healthy QP of the same peer so they keep their order there. RECVs go along, the
+    // peer moves its SENDs off the QP connected to this one the same way.
+    int target = select_qpi(peer_of(qpi));
+    if (!qp_management_[target]->broken_.load(std::memory_order_acquire)) {
+        for (RDMAAssignmentSharedPtr& assign : requeued) {
+            uint64_t bytes = assign->bytes();
+            if (qp_management->pending_.empty()
+                && qp_management_[target]->assign_queue_.try_push(RDMAAssignmentSharedPtr(assign))) {
+                qp_management->queued_bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+                qp_management_[target]->queued_bytes_.fetch_add(bytes, std::memory_order_relaxed);
                 continue;
             }
-            for (size_t i = 0; i < nr_poll; ++i) {
-                callback_info_with_qpi_t::CALLBACK_STATUS status_code = callback_info_with_qpi_t::SUCCESS;
-                if (wc[i].status != IBV_WC_SUCCESS) {
-                    status_code = callback_info_with_qpi_t::FAILED;
-                    SLIME_LOG_ERROR("WR failed with status: ", ibv_wc_status_str(wc[i].status), std::endl);
-                }
-                if (wc[i].wr_id != 0) {
-                    callback_info_with_qpi_t* callback_with_qpi =
-                        reinterpret_cast<callback_info_with_qpi_t*>(wc[i].wr_id);
-                    switch (OpCode wr_type = callback_with_qpi->callback_info_->opcode_) {
-                        case OpCode::READ:
-                        case OpCode::SEND:
-                        case OpCode::RECV:
-                            callback_with_qpi->callback_info_->callback_(status_code);
-                            break;
-                        default:
-                            SLIME_ABORT("Unimplemented WrType " << int64_t(wr_type));
-                    }
-                    size_t batch_size = callback_with_qpi->callback_info_->batch_size_;
-                    qp_management_[callback_with_qpi->qpi_]->outstanding_rdma_reads_.fetch_sub(
-                        batch_size, std::memory_order_relaxed);
-                    delete callback_with_qpi;
-                }
-            }
+            // Handed over on a later round, once the other queue has room
+            qp_management->pending_.push_back(std::move(assign));
         }
+        ring_doorbell(target);
+        if (!qp_management->pending_.empty())
+            ring_doorbell(qpi);
+        return;
+    }
+
+    // Every QP of the peer has failed. Held here until one is reconnected, reconnect_qp rings this
+    // QP again; a deadline bounds the wait, expired work is released on the next round.
+    for (RDMAAssignmentSharedPtr& assign : requeued) {
+        if (assign->state_.load() != RDMAAssignment::DROPPED && config_.max_retries > 0) {
+            qp_management->pending_.push_back(std::move(assign));
+            continue;
+        }
+        qp_management->queued_bytes_.fetch_sub(assign->bytes(), std::memory_order_relaxed);
+        if (assign->state_.load() == RDMAAssignment::DROPPED) {
+            assign->callback_info_->callback_(assign->status());
+            continue;
+        }
+        given_up_.fetch_add(1, std::memory_order_relaxed);
+        dispatch_callback(qpi, std::move(assign), callback_info_t::FAILED);
     }
-    return 0;
 }
 
-int64_t RDMAContext::wq_dispatch_handle(int qpi)
+void RDMAContext::reset_qp(int qpi)
 {
-    SLIME_LOG_INFO("Handling WQ");
+    qp_management_t*   qp_management = qp_management_[qpi];
+    struct ibv_qp_attr attr          = {};
+    attr.qp_state                    = IBV_QPS_RESET;
+    if (verbs_->modify_qp(qp_management->qp_, &attr, IBV_QP_STATE) || init_qp(qpi) != 0) {
+        SLIME_LOG_WARN("Failed to reset QP ", qpi, " of ", get_dev_ib());
+        return;
+    }
 
-    if (!connected_) {
-        SLIME_LOG_ERROR("Start CQ handle before connected, please construct first");
+    // The PSNs of the old connection mean nothing to either end anymore
+    rdma_info_t& local_rdma_info = qp_management->local_rdma_info_;
+    local_rdma_info.psn          = lrand48() & 0xffffff;
+    qp_management->reset_        = true;
+    peer_management_[peer_of(qpi)].recovered_qps_.push_back(
+        json{{"qp", qpi % config_.qp_num}, {"rdma_info", local_rdma_info.to_json()}});
+    SLIME_LOG_INFO("QP ", qpi, " of ", get_dev_ib(), " reset, waiting for the peer to reconnect");
+
+    // The peer reset its end first and told us already
+    if (qp_management->remote_updated_)
+        reconnect_qp(qpi);
+}
+
+int64_t RDMAContext::reconnect_qp(int qpi)
+{
+    qp_management_t* qp_management = qp_management_[qpi];
+    qp_management->remote_updated_ = false;
+    if (connect_qp(qpi) != 0) {
+        SLIME_LOG_WARN("Failed to reconnect QP ", qpi, " of ", get_dev_ib());
         return -1;
     }
 
-    if (comp_channel_ == NULL)
-        SLIME_LOG_ERROR("comp_channel_ should be constructed");
+    qp_management->flushed_ = false;
+    qp_management->reset_   = false;
+    qp_management->first_error_.store(IBV_WC_SUCCESS);
+    qp_management->broken_.store(false, std::memory_order_release);
+    recovered_.fetch_add(1, std::memory_order_relaxed);
+    SLIME_LOG_INFO("QP ", qpi, " of ", get_dev_ib(), " back in service");
+
+    // Work the failover could not hand over yet is posted here again, the other broken QPs of
+    // the peer hand theirs over to this one
+    ring_doorbell(qpi);
+    ring_broken_qps(peer_of(qpi));
+    return 0;
+}
 
-    while (!qp_management_[qpi]->stop_wq_future_) {
-        std::unique_lock<std::mutex> lock(qp_management_[qpi]->assign_queue_mutex_);
-        qp_management_[qpi]->has_runnable_event_.wait(lock, [this, &qpi]() {
-            return !(qp_management_[qpi]->assign_queue_.empty()) || qp_management_[qpi]->stop_wq_future_;
-        });
-        if (qp_management_[qpi]->stop_wq_future_)
-            return 0;
-        while (!(qp_management_[qpi]->assign_queue_.empty())) {
-            RDMAAssignmentSharedPtr front_assign = qp_management_[qpi]->assign_queue_.front();
-            size_t                  batch_size   = front_assign->batch_size();
-            if (batch_size > MAX_SEND_WR) {
-                SLIME_LOG_ERROR("batch_size(" << batch_size << ") > MAX SEND WR(" << MAX_SEND_WR
-                                              << "), this request will be ignored");
-                front_assign->callback_info_->callback_(callback_info_with_qpi_t::ASSIGNMENT_BATCH_OVERFLOW);
-                qp_management_[qpi]->assign_queue_.pop();
-            }
-            else if (batch_size + qp_management_[qpi]->outstanding_rdma_reads_ < MAX_SEND_WR) {
-                switch (front_assign->opcode_) {
-                    case OpCode::SEND:
-                        post_send(qpi, front_assign);
-                        break;
-                    case OpCode::RECV:
-                        post_recv(qpi, front_assign);
-                        break;
-                    case OpCode::READ:
-                        post_read_batch(qpi, front_assign);
-                        break;
-                    default:
-                        SLIME_LOG_ERROR("Unknown OpCode");
-                        front_assign->callback_info_->callback_(callback_info_with_qpi_t::UNKNOWN_OPCODE);
-                }
-                qp_management_[qpi]->assign_queue_.pop();
-            }
-            else {
-                std::this_thread::sleep_for(std::chrono::nanoseconds(500000));
-                SLIME_LOG_WARN("Assignment Queue is full.");
+json RDMAContext::qp_recovery_notice(int peer)
+{
+    json                        recovered_qps = json::array();
+    std::lock_guard<std::mutex> lock(recovery_mutex_);
+    recovered_qps.swap(peer_management_[peer].recovered_qps_);
+    return json{{"recovered_qps", recovered_qps}};
+}
+
+int64_t RDMAContext::apply_qp_recovery(int peer, const json& notice)
+{
+    int64_t                     reconnected = 0;
+    std::lock_guard<std::mutex> lock(recovery_mutex_);
+    for (const json& recovered : notice["recovered_qps"]) {
+        int i = recovered["qp"];
+        if (i < 0 || i >= config_.qp_num) {
+            SLIME_LOG_WARN("Recovery notice for QP ", i, " of ", config_.qp_num, ", ignored");
+            continue;
+        }
+        int              qpi              = peer * config_.qp_num + i;
+        qp_management_t* qp_management    = qp_management_[qpi];
+        qp_management->remote_rdma_info_ = rdma_info_t(recovered["rdma_info"]);
+        qp_management->remote_updated_   = true;
+        if (qp_management->reset_) {
+            reconnected += reconnect_qp(qpi) == 0;
+            continue;
+        }
+        // Still connected to the old QP of the peer, whatever is out on it is lost like on a
+        // broken link. Reset as a failed QP, it connects to the new one on the way.
+        SLIME_LOG_INFO("QP ", qpi, " of ", get_dev_ib(), " reset by the peer");
+        mark_broken(qpi, IBV_WC_RETRY_EXC_ERR);
+    }
+    return reconnected;
+}
+
+void RDMAContext::dispatch_qp(int qpi)
+{
+    qp_management_t* qp_management = qp_management_[qpi];
+    if (qp_management->broken_.load(std::memory_order_acquire)) {
+        fail_over_qp(qpi);
+        return;
+    }
+
+    // Short of send credits, posted before anything newer from the queue
+    std::deque<RDMAAssignmentSharedPtr>& pending = qp_management->pending_;
+    while (!qp_management->broken_.load(std::memory_order_acquire)) {
+        if (pending.empty()) {
+            RDMAAssignmentSharedPtr assign;
+            if (!qp_management->assign_queue_.try_pop(assign))
+                return;
+            if (!assign)
+                continue;
+            pending.push_back(std::move(assign));
+        }
+        RDMAAssignmentSharedPtr& front_assign = pending.front();
+        size_t                   batch_size   = front_assign->batch_size();
+        if (batch_size > size_t(config_.max_send_wr)) {
+            SLIME_LOG_ERROR("batch_size(" << batch_size << ") > MAX SEND WR(" << config_.max_send_wr
+                                          << "), this request will be ignored");
+            front_assign->callback_info_->callback_(callback_info_t::ASSIGNMENT_BATCH_OVERFLOW);
+        }
+        else if (front_assign->state_.load() == RDMAAssignment::DROPPED) {
+            // Cancelled or timed out while queued, the status has been reported already
+            front_assign->callback_info_->callback_(front_assign->status());
+        }
+        else if (!take_send_credits(qpi, send_credits(front_assign))) {
+            // Held until return_send_credits rings, the other QPs of this dispatcher go on meanwhile
+            return;
+        }
+        else if (!front_assign->mark_posted()) {
+            // Lost to a cancel or timeout that came in meanwhile, released on the next round
+            continue;
+        }
+        else {
+            switch (front_assign->opcode_) {
+                case OpCode::SEND:
+                    post_send(qpi, front_assign);
+                    break;
+                case OpCode::RECV:
+                    post_recv(qpi, front_assign);
+                    break;
+                case OpCode::READ:
+                case OpCode::WRITE:
+                case OpCode::WRITE_WITH_IMM:
+                    post_rw_batch(qpi, front_assign);
+                    break;
+                default:
+                    SLIME_LOG_ERROR("Unknown OpCode");
+                    front_assign->callback_info_->callback_(callback_info_t::UNKNOWN_OPCODE);
             }
         }
+        qp_management->queued_bytes_.fetch_sub(front_assign->bytes(), std::memory_order_relaxed);
+        pending.pop_front();
+    }
+}
+
+int64_t RDMAContext::wq_dispatch_handle(int dispatcher)
+{
+    SLIME_LOG_INFO("Handling WQ ", dispatcher);
+
+    pin_worker_thread();
+
+    // QP i of every peer rings dispatcher i, a QP short of credits or failing over holds back no other
+    wq_dispatcher_t* wq_dispatcher = wq_dispatchers_[dispatcher].get();
+    int              rung_qpi;
+    while (!wq_dispatcher->stop_) {
+        // Drained before the scan: a ring from now on is seen by the wait below
+        while (wq_dispatcher->doorbell_.try_pop(rung_qpi)) {}
+        for (size_t qpi = dispatcher; qpi < qp_list_len_.load(std::memory_order_acquire) && !wq_dispatcher->stop_;
+             qpi += config_.qp_num)
+            dispatch_qp(qpi);
+        if (!wq_dispatcher->doorbell_.pop_wait(rung_qpi, wq_dispatcher->stop_))
+            break;
     }
     return 0;
 }
@@ -1,21 +1,31 @@
 #pragma once
 
 #include "engine/assignment.h"
+#include "engine/rdma/endpoint_info.h"
 #include "engine/rdma/memory_pool.h"
 #include "engine/rdma/rdma_assignment.h"
 #include "engine/rdma/rdma_config.h"
+#include "engine/rdma/verbs_provider.h"
 
 #include "utils/json.hpp"
+#include "utils/mpsc_ring.h"
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
 #include <cstdint>
+#include <cstdlib>
+#include <deque>
 #include <functional>
 #include <future>
+#include <map>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <infiniband/verbs.h>
@@ -24,73 +34,373 @@ namespace slime {
 
 using json = nlohmann::json;
 
+/*
+  How the CQ poller waits for completions:
+    EVENT:     block on the completion channel, one interrupt and syscall per wakeup.
+    BUSY_POLL: spin on ibv_poll_cq, lowest latency at the cost of a full core.
+    HYBRID:    spin for poll_spin_us after the last completion, then arm and block.
+*/
+enum class CompletionMode : uint8_t {
+    EVENT,
+    BUSY_POLL,
+    HYBRID
+};
+
+/*
+  How a submit picks its QP (RDMAContext) or its device (RDMAScheduler):
+    ROUND_ROBIN:       rotate regardless of load.
+    LEAST_OUTSTANDING: the one with the fewest bytes queued or in flight.
+    POWER_OF_TWO:      the less loaded of two random candidates, near least-outstanding at O(1).
+    STICKY:            fixed per submitting thread, so one stream stays ordered on one queue.
+*/
+enum class SelectionPolicy : uint8_t {
+    ROUND_ROBIN,
+    LEAST_OUTSTANDING,
+    POWER_OF_TWO,
+    STICKY
+};
+
+/* Pick one of n queues under the policy, load(i) gives the bytes queued or in flight on queue i */
+template<typename LoadFn>
+size_t select_by_policy(SelectionPolicy policy, std::atomic<uint32_t>& rotation, size_t n, LoadFn&& load)
+{
+    if (n <= 1)
+        return 0;
+    switch (policy) {
+        case SelectionPolicy::LEAST_OUTSTANDING: {
+            // Scan from a rotating start so ties (e.g. all idle) still spread
+            size_t   first = rotation.fetch_add(1, std::memory_order_relaxed) % n;
+            size_t   best  = first;
+            uint64_t least = load(first);
+            for (size_t k = 1; k < n && least > 0; ++k) {
+                size_t   i = (first + k) % n;
+                uint64_t l = load(i);
+                if (l < least) {
+                    best  = i;
+                    least = l;
+                }
+            }
+            return best;
+        }
+        case SelectionPolicy::POWER_OF_TWO: {
+            thread_local uint64_t state = 0x9E3779B97F4A7C15ull ^ (uintptr_t)&state;
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            size_t a = state % n;
+            size_t b = (a + 1 + (state >> 32) % (n - 1)) % n;
+            return load(b) < load(a) ? b : a;
+        }
+        case SelectionPolicy::STICKY: {
+            thread_local uint32_t stream = std::hash<std::thread::id>()(std::this_thread::get_id()) >> 4;
+            return stream % n;
+        }
+        default:
+            return rotation.fetch_add(1, std::memory_order_relaxed) % n;
+    }
+}
+
+/*
+  Completion record carried in the wr_id of a signaled WR. It holds a reference on the
+  assignment, so the assignment outlives its last completion whatever the caller does.
+*/
+typedef struct callback_info_with_qpi {
+    RDMAAssignmentSharedPtr assign_;
+    int                     qpi_;
+
+    /* Taken from the per-QP pool, otherwise heap allocated when the pool ran dry */
+    bool pooled_{false};
+} callback_info_with_qpi_t;
+
+class RDMAPeer;
+
 class RDMAContext {
 public:
     /*
-      A link of rdma QP.
+      RDMA links of one device port. init opens the device, PD and CQs and connects to a first
+      peer; add_peer connects to more of them (config max_peers) over the same PD, MRs, CQ
+      pollers and WQ dispatchers.
     */
-    RDMAContext()
-    {
-        qp_management_ = new qp_management_t*[qp_list_len_];
-        for (int qpi = 0; qpi < qp_list_len_; qpi++) {
-            qp_management_[qpi] = new qp_management_t();
-        }
-    }
+    RDMAContext(): RDMAContext(default_verbs_provider()) {}
+
+    explicit RDMAContext(VerbsProvider* verbs): verbs_(verbs) {}
 
     ~RDMAContext()
     {
         stop_future();
-        for (int qpi = 0; qpi < qp_list_len_; qpi++) {
+        for (size_t qpi = 0; qpi < qp_list_len_; qpi++) {
             delete qp_management_[qpi];
         }
         delete[] qp_management_;
+        if (srq_ring_mr_)
+            verbs_->dereg_mr(srq_ring_mr_);
+        free(srq_ring_);
     }
 
-    /* Initialize */
-    int64_t init(const std::string& dev_name, uint8_t ib_port, const std::string& link_type);
+    /* Initialize, QPs and queues are sized from config clamped to the device limits */
+    int64_t init(const std::string&       dev_name,
+                 uint8_t                  ib_port,
+                 const std::string&       link_type,
+                 const RDMAContextConfig& config = RDMAContextConfig());
+
+    /* Configuration in effect after init */
+    const RDMAContextConfig& config() const
+    {
+        return config_;
+    }
 
-    /* Memory Allocation */
+    /* Memory Allocation, returns the MR handle usable in Assignment */
     int64_t register_memory_region(std::string mr_key, uintptr_t data_ptr, size_t length)
     {
-        memory_pool_.register_memory_region(mr_key, data_ptr, length);
-        return 0;
+        return memory_pool_.register_memory_region(mr_key, data_ptr, length);
+    }
+
+    /*
+      New submissions on the key are refused right away, the MR is released once the work
+      already submitted on it has finished. -1 if the key is not registered. Pass
+      mr_invalidation({mr_key}) to the peer so it stops targeting the key too.
+    */
+    int64_t unregister_memory_region(const std::string& mr_key);
+
+    /* The work submitted on the key has finished since it was unregistered, its MR is released */
+    bool memory_region_released(const std::string& mr_key) const
+    {
+        return memory_pool_.memory_region_released(mr_key);
+    }
+
+    /* Forget a peer MR, later work on the key completes with REMOTE_MR_NOT_REGISTERED unposted */
+    int64_t unregister_remote_memory_region(const std::string& mr_key)
+    {
+        return unregister_remote_memory_region(0, mr_key);
+    }
+
+    /* Notice for apply_mr_invalidation on the peer, exchanged like endpoint_info */
+    static json mr_invalidation(const std::vector<std::string>& mr_keys)
+    {
+        return json{{"invalidated_mrs", mr_keys}};
+    }
+
+    /* Returns the number of remote MRs dropped */
+    int64_t apply_mr_invalidation(const json& notice)
+    {
+        return apply_mr_invalidation(0, notice);
     }
 
     int64_t register_remote_memory_region(std::string mr_key, json mr_info)
     {
-        memory_pool_.register_remote_memory_region(mr_key, mr_info);
-        return 0;
+        return memory_pool_.register_remote_memory_region(mr_key, mr_info, 0);
+    }
+
+    mr_handle_t get_mr_handle(const std::string& mr_key) const
+    {
+        return memory_pool_.get_mr_handle(mr_key);
+    }
+
+    /* Hits, misses, evictions and pinned bytes of the MR registration cache */
+    json registration_cache_stats() const
+    {
+        return memory_pool_.registration_cache_stats();
+    }
+
+    /*
+      With config mr_cache_bytes set: drop the cached MRs over [addr, addr + length). Call it
+      before unmapping or freeing memory that was registered, else a later registration at
+      the same addresses may get the stale MR. Returns the number of MRs dropped.
+    */
+    size_t invalidate_registration_cache(uintptr_t addr, uint64_t length)
+    {
+        return memory_pool_.invalidate_registrations(addr, length);
+    }
+
+    /*
+      Merge READ/WRITE assignments whose source and target ranges are both contiguous into
+      WRs of at most max_coalesce_bytes before posting, 0 disables coalescing.
+    */
+    void set_max_coalesce_bytes(uint64_t max_coalesce_bytes)
+    {
+        SLIME_ASSERT(max_coalesce_bytes <= UINT32_MAX, "an SGE holds at most 4GB");
+        max_coalesce_bytes_ = max_coalesce_bytes;
+    }
+
+    /* Can be switched while the CQ poller runs */
+    void set_completion_mode(CompletionMode mode, uint64_t poll_spin_us = 50)
+    {
+        poll_spin_us_.store(poll_spin_us, std::memory_order_relaxed);
+        completion_mode_.store(mode, std::memory_order_relaxed);
+        // A poller blocked on the channel notices the new mode with its next completion
+    }
+
+    CompletionMode completion_mode() const
+    {
+        return completion_mode_.load(std::memory_order_relaxed);
+    }
+
+    /* Event wakeups versus completions reaped by polling, and assignments timed out */
+    json completion_stats() const;
+
+    /* Number of times and total time the WQ dispatchers waited for send queue credits */
+    json flow_control_stats() const;
+
+    /*
+      QP errors seen, the QPs out of service right now, the QPs brought back, failed WRs posted
+      again on another QP, and the failed WRs reported FAILED instead.
+    */
+    json recovery_stats() const;
+
+    /*
+      QPs reset since the last call after a failure, each with its new PSN. Pass it to the
+      peer's apply_qp_recovery, exchanged like mr_invalidation, and apply the peer's notice in
+      return: a QP takes work again once both ends are connected anew. Each reset is reported
+      once.
+    */
+    json qp_recovery_notice()
+    {
+        return qp_recovery_notice(0);
+    }
+
+    /* Returns the number of QPs connected again, the others are reset first and then connect */
+    int64_t apply_qp_recovery(const json& notice)
+    {
+        return apply_qp_recovery(0, notice);
+    }
+
+    /* QP selection for new submits, can be switched at any time */
+    void set_selection_policy(SelectionPolicy policy)
+    {
+        selection_policy_.store(policy, std::memory_order_relaxed);
+    }
+
+    SelectionPolicy selection_policy() const
+    {
+        return selection_policy_.load(std::memory_order_relaxed);
+    }
+
+    /* Bytes submitted to this context that have not completed yet, over all QPs */
+    uint64_t outstanding_bytes() const;
+
+    /* Per-QP queued / in-flight bytes and WRs */
+    json selection_stats() const;
+
+    /*
+      Messages received through the SRQ, how many of them arrived before their RECV, ring
+      refills, and the RECVs and messages currently waiting for each other.
+    */
+    json srq_stats();
+
+    /*
+      Gather consecutive READ/WRITE assignments of a batch whose remote ranges are contiguous
+      into one multi-SGE WR (up to the device SGE limit), e.g. scattered local pages landing
+      in a contiguous remote staging buffer.
+    */
+    void set_sge_packing(bool sge_packing)
+    {
+        sge_packing_ = sge_packing;
     }
 
     /* RDMA Link Construction */
-    int64_t connect(const json& endpoint_info_json);
+    int64_t connect(const json& endpoint_info_json)
+    {
+        return connect(0, endpoint_info_json);
+    }
+
+    /* From the peer's endpoint_info_binary, -1 if it is not a valid one */
+    int64_t connect(const EndpointInfoView& endpoint_info)
+    {
+        return connect(0, endpoint_info);
+    }
+    int64_t connect(const std::string& endpoint_info);
+
+    /*
+      One more peer: a group of config qp_num QPs with its own remote MR table, sharing
+      everything else with this context. Can be called after launch_future. nullptr once
+      config max_peers are in use; the group created by init is handed out first as long as
+      the context did not connect it itself.
+    */
+    std::shared_ptr<RDMAPeer> add_peer();
 
-    /* Submit an assignment */
-    RDMAAssignmentSharedPtr submit(OpCode opcode, AssignmentBatch& assignment, callback_fn_t callback = nullptr);
+    /* Peers added so far, the one of init included */
+    int peer_num() const
+    {
+        return peer_num_.load(std::memory_order_acquire);
+    }
+
+    /*
+      Submit an assignment.
+      WRITE_WITH_IMM delivers imm_data to the peer along with the last write, where it
+      completes a posted RECV (an empty batch is enough to receive only the tag).
+      With a timeout the assignment reports TIME_OUT once it has not finished that long after
+      submit: dropped if still queued, a posted WR keeps its MRs until it completes or fails.
+      A WR failed by a broken QP may be posted again on a healthy one, see config max_retries.
+    */
+    RDMAAssignmentSharedPtr submit(OpCode                    opcode,
+                                   AssignmentBatch&          assignment,
+                                   callback_fn_t             callback = nullptr,
+                                   uint32_t                  imm_data = 0,
+                                   std::chrono::milliseconds timeout  = kNoTimeout)
+    {
+        return submit(0, opcode, assignment, callback, imm_data, timeout);
+    }
+
+    /*
+      SEND, or WRITE / WRITE_WITH_IMM at target_offset of the peer MR mr_key, of a small
+      payload straight from unregistered memory. At most max_inline_data() bytes; they are
+      copied at submit, so data can be reused as soon as this returns.
+    */
+    RDMAAssignmentSharedPtr submit_inline(OpCode             opcode,
+                                          const void*        data,
+                                          size_t             length,
+                                          const std::string& mr_key        = "",
+                                          uint64_t           target_offset = 0,
+                                          callback_fn_t      callback      = nullptr,
+                                          uint32_t           imm_data      = 0)
+    {
+        return submit_inline(0, opcode, data, length, mr_key, target_offset, callback, imm_data);
+    }
+
+    /* Largest SEND / WRITE posted inline, as granted by the device to the QPs of init, fixed from then on */
+    int max_inline_data() const
+    {
+        return max_inline_data_;
+    }
 
     void launch_future();
     void stop_future();
 
     json local_rdma_info() const
     {
-        json local_info{};
-        for (int qpi = 0; qpi < qp_list_len_; qpi++)
-            local_info[qpi] = qp_management_[qpi]->local_rdma_info_.to_json();
-        return local_info;
+        return local_rdma_info(0);
     }
 
     json remote_rdma_info() const
     {
-        json remote_info{};
-        for (int qpi = 0; qpi < qp_list_len_; qpi++)
-            remote_info[qpi] = qp_management_[qpi]->remote_rdma_info_.to_json();
-        return remote_info;
+        return remote_rdma_info(0);
     }
 
     json endpoint_info() const
     {
-        json endpoint_info =  json{{"rdma_info", local_rdma_info()}, {"mr_info", memory_pool_.mr_info()}};
-        return endpoint_info;
+        return endpoint_info(0);
+    }
+
+    /*
+      endpoint_info in the binary format of endpoint_info.h, much cheaper to build and to
+      read back than the JSON with thousands of MRs. mr_info_binary holds the MRs only, for
+      the peer's register_remote_memory_regions after registering more of them.
+    */
+    std::string endpoint_info_binary() const
+    {
+        return endpoint_info_binary(0);
+    }
+    std::string mr_info_binary() const;
+
+    /* Returns the number of remote MRs registered, -1 if the info is not valid */
+    int64_t register_remote_memory_regions(const EndpointInfoView& endpoint_info)
+    {
+        return register_remote_memory_regions(0, endpoint_info);
+    }
+
+    const std::string& device_name() const
+    {
+        return device_name_;
     }
 
     std::string get_dev_ib() const
@@ -98,6 +408,33 @@ public:
         return "@" + device_name_ + "#" + std::to_string(ib_port_);
     }
 
+    /* NUMA node of the NIC, -1 if unknown */
+    int numa_node() const
+    {
+        return numa_node_;
+    }
+
+    /*
+      CPUs the CQ pollers, WQ dispatchers and callback executors run on. init defaults to the
+      cores local to the NIC that this process may use; override before launch_future, an
+      empty list leaves the threads unpinned.
+    */
+    void set_worker_cpus(const std::vector<int>& worker_cpus)
+    {
+        worker_cpus_ = worker_cpus;
+    }
+
+    const std::vector<int>& worker_cpus() const
+    {
+        return worker_cpus_;
+    }
+
+    /* Link rate of the port from active_speed x active_width, 0 if the device does not tell */
+    double port_bandwidth_gbps() const
+    {
+        return port_bandwidth_gbps_;
+    }
+
     bool validate_assignment()
     {
         // TODO: validate if the assignment is valid
@@ -105,21 +442,61 @@ public:
     }
 
 private:
+    friend class RDMAPeer;
+
+    VerbsProvider* verbs_;
+
     std::string device_name_ = "";
 
     /* RDMA Configuration */
-    struct ibv_context*      ib_ctx_       = nullptr;
-    struct ibv_pd*           pd_           = nullptr;
-    struct ibv_comp_channel* comp_channel_ = nullptr;
-    struct ibv_cq*           cq_           = nullptr;
-    uint8_t                  ib_port_      = -1;
+    struct ibv_context* ib_ctx_  = nullptr;
+    struct ibv_pd*      pd_      = nullptr;
+    uint8_t             ib_port_ = -1;
+
+    /* GID, LID and MTU of the port, the part of local_rdma_info_ every QP shares */
+    rdma_info_t port_rdma_info_;
+
+    double port_bandwidth_gbps_ = 0;
+
+    /* Worker thread placement */
+    int              numa_node_{-1};
+    std::vector<int> worker_cpus_;
+
+    RDMAContextConfig config_;
 
     RDMAMemoryPool memory_pool_;
 
+    uint64_t max_coalesce_bytes_{0};
+
+    /* SGE / message limits, queried from the device in init */
+    int      max_send_sge_{1};
+    int      max_recv_sge_{1};
+    int      max_rd_sge_{1};
+    uint64_t max_msg_size_{UINT32_MAX};
+    int      max_inline_data_{0};
+    bool     sge_packing_{false};
+
     typedef struct qp_management {
+        qp_management(int max_send_wr, int assign_queue_depth):
+            assign_queue_(assign_queue_depth),
+            wr_arena_(max_send_wr),
+            sge_arena_(max_send_wr),
+            remote_mr_arena_(max_send_wr),
+            completion_records_(max_send_wr),
+            free_completion_records_(max_send_wr)
+        {
+            for (callback_info_with_qpi_t& record : completion_records_) {
+                record.pooled_ = true;
+                free_completion_records_.try_push(&record);
+            }
+        }
+
         /* queue peer list */
         struct ibv_qp* qp_{nullptr};
 
+        /* Index of the CQ this QP completes to */
+        int cqi_{0};
+
         /* RDMA Exchange Information */
         rdma_info_t remote_rdma_info_;
         rdma_info_t local_rdma_info_;
@@ -127,54 +504,514 @@ private:
         /* Send Mutex */
         std::mutex rdma_post_send_mutex_;
 
-        /* Assignment Queue */
-        std::mutex                          assign_queue_mutex_;
-        std::queue<RDMAAssignmentSharedPtr> assign_queue_;
-        std::atomic<int>                    outstanding_rdma_reads_{0};
+        /* Assignment Queue, submitters push and the WQ dispatcher pops without locking */
+        MPSCRing<RDMAAssignmentSharedPtr> assign_queue_;
+        std::atomic<int>                  outstanding_rdma_reads_{0};
+
+        /*
+          Taken from assign_queue_ but not posted yet, oldest first: the front one waiting for
+          send queue credits, or the work a failover could not hand over yet. Only touched by
+          the WQ dispatcher.
+        */
+        std::deque<RDMAAssignmentSharedPtr> pending_;
+
+        /* Load seen by QP selection: bytes waiting in assign_queue_ and bytes posted but not completed */
+        std::atomic<uint64_t> queued_bytes_{0};
+        std::atomic<uint64_t> posted_bytes_{0};
+
+        /*
+          Send queue credits: max_send_wr minus outstanding_rdma_reads_. When the dispatcher
+          runs short it leaves the QP with credits_wanted_ set, and the CQ poller rings it as
+          soon as returned completions cover the demand.
+        */
+        std::atomic<int>                      credits_wanted_{0};
+        bool                                  stalled_{false};
+        std::chrono::steady_clock::time_point stall_start_;
+        std::atomic<uint64_t>                 stall_count_{0};
+        std::atomic<uint64_t>                 stall_ns_{0};
+
+        /* WR / SGE arena sized to the send queue, only touched by the WQ dispatcher */
+        std::vector<struct ibv_send_wr> wr_arena_;
+        std::vector<struct ibv_sge>     sge_arena_;
+
+        /* The remote MR of each assignment of the batch being posted, read once */
+        std::vector<remote_mr_t> remote_mr_arena_;
+
+        /* Completion records, taken by the WQ dispatcher and given back by the CQ poller */
+        std::vector<callback_info_with_qpi_t> completion_records_;
+        MPSCRing<callback_info_with_qpi_t*>   free_completion_records_;
+
+        /*
+          Error handling: the CQ poller raises broken_ on the first failed completion of the QP,
+          keeping its status in first_error_, and parks the failed WRs worth retrying in
+          retry_queue_, in completion order. The WQ dispatcher then flushes the QP (flushed_ once
+          moved to ERR), hands its work to a healthy QP of the same peer and, once every WR is
+          back, resets it to INIT with a fresh PSN (reset_). It is connected again and leaves
+          broken_ as soon as the new rdma_info of the peer's QP is known too (remote_updated_).
+          The three flags are under recovery_mutex_.
+        */
+        std::atomic<bool>                   broken_{false};
+        std::atomic<int>                    first_error_{IBV_WC_SUCCESS};
+        bool                                flushed_{false};
+        bool                                reset_{false};
+        bool                                remote_updated_{false};
+        std::mutex                          retry_mutex_;
+        std::deque<RDMAAssignmentSharedPtr> retry_queue_;
+    } qp_management_t;
 
-        /* Has Runnable Assignment */
-        std::condition_variable has_runnable_event_;
+    /*
+      QPs of all peers, peer p owns qpi p * qp_num to (p + 1) * qp_num - 1. Sized for
+      max_peers at init; a peer's QPs are in place before qp_list_len_ covers them.
+    */
+    std::atomic<size_t> qp_list_len_{0};
+    qp_management_t**   qp_management_{nullptr};
 
-        /* async wq handler */
-        std::future<void> wq_future_;
-        std::atomic<bool> stop_wq_future_{false};
-    } qp_management_t;
+    /*
+      qp_num -> qpi for the CQ pollers: open addressing over max_peers * qp_num QPs, at most
+      half full. An entry is qp_num << 32 | (qpi + 1), 0 when free, and is never removed.
+    */
+    std::unique_ptr<std::atomic<uint64_t>[]> qpi_index_;
+    size_t                                   qpi_index_mask_{0};
+
+    void index_qp(int qpi);
+
+    std::atomic<SelectionPolicy> selection_policy_{SelectionPolicy::ROUND_ROBIN};
+
+    /* QP of the peer for a new submit */
+    int select_qpi(int peer);
 
-    size_t            qp_list_len_{4};
-    qp_management_t** qp_management_;
+    int peer_of(int qpi) const
+    {
+        return qpi / config_.qp_num;
+    }
 
-    int last_qp_selection_ = -1;
-    int select_qpi()
+    /* Largest SEND our SRQ takes, 0 without one; handed to the peers in the endpoint info */
+    uint32_t srq_recv_bytes() const
     {
-        // Simplest round robin, we could enrich it in the future
-        last_qp_selection_ = (last_qp_selection_ + 1) % qp_list_len_;
-        return last_qp_selection_;
+        return srq_ ? config_.srq_recv_bytes : 0;
     }
 
+    /*
+      WQ dispatchers, qp_num of them whatever the number of peers: dispatcher d posts for QP d
+      of every peer. It sleeps on its doorbell, rung by a submit, by the CQ poller once the
+      credits a QP waits for are back, and by a QP failing; then it serves all its QPs.
+    */
+    typedef struct wq_dispatcher {
+        explicit wq_dispatcher(size_t depth): doorbell_(depth) {}
+
+        MPSCRing<int>     doorbell_;
+        std::atomic<bool> stop_{false};
+        std::future<void> future_;
+    } wq_dispatcher_t;
+
+    std::vector<std::unique_ptr<wq_dispatcher_t>> wq_dispatchers_;
+
+    /* Wake the dispatcher of the QP */
+    void ring_doorbell(int qpi);
+    /* Wake the dispatchers of the broken QPs of the peer, to hand over or release the work they hold */
+    void ring_broken_qps(int peer);
+
     typedef struct cq_management {
-        // TODO: multi cq handlers.
+        struct ibv_comp_channel* comp_channel_{nullptr};
+        struct ibv_cq*           cq_{nullptr};
+
+        /* Work completions reaped per poll, only touched by this CQ's poller */
+        std::vector<struct ibv_wc> wc_;
+
+        /* async cq handler */
+        std::future<void> cq_future_;
     } cq_management_t;
 
+    std::vector<cq_management_t> cq_management_;
+
     /* State Management */
     bool initialized_ = false;
-    bool connected_   = false;
 
-    /* async cq handler */
-    std::future<void> cq_future_;
     std::atomic<bool> stop_cq_future_{false};
 
+    /*
+      Callback executor: CQ pollers hand finished assignments over and keep harvesting. A QP
+      always maps to the same executor, so callbacks of one QP run in completion order. The
+      ring is sized for one peer; a poller that finds it full waits, which throttles the peers
+      through their send credits.
+    */
+    typedef struct completion_task {
+        RDMAAssignmentSharedPtr assign_;
+        int                     status_{0};
+
+        /* A timeout: only report the status, the assignment is not finished with the device */
+        bool notify_only_{false};
+    } completion_task_t;
+
+    typedef struct callback_executor {
+        explicit callback_executor(size_t depth): queue_(depth) {}
+
+        MPSCRing<completion_task_t> queue_;
+        std::future<void>           future_;
+    } callback_executor_t;
+
+    std::vector<std::unique_ptr<callback_executor_t>> callback_executors_;
+    std::atomic<bool>                                 stop_callback_executor_{false};
+
+    /* Completion mode */
+    std::atomic<CompletionMode> completion_mode_{CompletionMode::EVENT};
+    std::atomic<uint64_t>       poll_spin_us_{50};
+
+    typedef struct completion_counters {
+        std::atomic<uint64_t> event_wakeups_{0};
+        std::atomic<uint64_t> polled_completions_{0};
+        std::atomic<uint64_t> empty_polls_{0};
+    } completion_counters_t;
+
+    completion_counters_t completion_stats_;
+
+    /*
+      Assignments submitted with a timeout, by deadline. The CQ pollers expire them; a finished
+      assignment leaves on its own, so only the ones still running are kept.
+    */
+    typedef struct timed_assignment {
+        std::weak_ptr<RDMAAssignment> assign_;
+        int                           qpi_{0};
+    } timed_assignment_t;
+
+    using deadline_key_t = std::pair<std::chrono::steady_clock::time_point, RDMAAssignment*>;
+
+    std::mutex                                   deadline_mutex_;
+    std::map<deadline_key_t, timed_assignment_t> deadlines_;
+    /* Earliest deadline in steady_clock ticks, INT64_MAX when none is pending */
+    std::atomic<int64_t>  next_deadline_{INT64_MAX};
+    std::atomic<uint64_t> timed_out_{0};
+
+    /* QP Error Recovery */
+    std::mutex            recovery_mutex_;
+    std::atomic<uint64_t> qp_errors_{0};
+    std::atomic<uint64_t> recovered_{0};
+    std::atomic<uint64_t> retried_{0};
+    std::atomic<uint64_t> given_up_{0};
+
+    /*
+      Shared receive queue ring (config srq_depth). Messages are matched with RECVs in
+      arrival order; a message arriving before any RECV keeps its slot until one is
+      submitted. Freed slots are posted again srq_refill_batch_ at a time.
+    */
+    typedef struct srq_message {
+        uint32_t slot_{0};
+        uint32_t byte_len_{0};
+        uint32_t imm_data_{0};
+        bool     has_payload_{false};
+        int      qpi_{0};
+        int      status_{0};
+    } srq_message_t;
+
+    struct ibv_srq* srq_{nullptr};
+    char*           srq_ring_{nullptr};
+    struct ibv_mr*  srq_ring_mr_{nullptr};
+    size_t          srq_refill_batch_{1};
+
+    std::mutex                          srq_mutex_;
+    std::vector<uint32_t>               srq_free_slots_;
+    std::vector<struct ibv_recv_wr>     srq_wr_arena_;
+    std::vector<struct ibv_sge>         srq_sge_arena_;
+    uint64_t                            srq_received_{0};
+    uint64_t                            srq_unexpected_{0};
+    uint64_t                            srq_refills_{0};
+
+    /* Peers, sized for config max_peers at init */
+    typedef struct peer_management {
+        std::atomic<bool>     connected_{false};
+        std::atomic<uint32_t> last_qp_selection_{0};
+
+        /* Only the group created by init: taken by the context itself or by add_peer */
+        bool handed_out_{false};
+
+        /* SRQ matching, RECVs submitted for this peer take its messages. Under srq_mutex_ */
+        std::deque<RDMAAssignmentSharedPtr> srq_recvs_;
+        std::deque<srq_message_t>           srq_messages_;
+
+        /* Receive size of the peer SRQ, 0 when it has none. Set at connect, before any SEND */
+        uint32_t remote_srq_recv_bytes_{0};
+
+        /* QPs reset since the last qp_recovery_notice, under recovery_mutex_ */
+        json recovered_qps_ = json::array();
+    } peer_management_t;
+
+    std::unique_ptr<peer_management_t[]> peer_management_;
+    std::atomic<int>                     peer_num_{0};
+    std::mutex                           peer_mutex_;
+
+    /* Create and initialize the QPs of a new peer, under peer_mutex_ */
+    int64_t init_peer(int peer);
+
+    /* The per-peer side of the public API, which works on peer 0 */
+    int64_t connect(int peer, const json& endpoint_info_json);
+    int64_t connect(int peer, const EndpointInfoView& endpoint_info);
+    int64_t register_remote_memory_regions(int peer, const EndpointInfoView& endpoint_info);
+    int64_t unregister_remote_memory_region(int peer, const std::string& mr_key);
+    int64_t apply_mr_invalidation(int peer, const json& notice);
+    json    qp_recovery_notice(int peer);
+    int64_t apply_qp_recovery(int peer, const json& notice);
+
+    json        local_rdma_info(int peer) const;
+    json        remote_rdma_info(int peer) const;
+    json        endpoint_info(int peer) const;
+    std::string endpoint_info_binary(int peer) const;
+
+    RDMAAssignmentSharedPtr submit(int                       peer,
+                                   OpCode                    opcode,
+                                   AssignmentBatch&          assignment,
+                                   callback_fn_t             callback,
+                                   uint32_t                  imm_data,
+                                   std::chrono::milliseconds timeout);
+    RDMAAssignmentSharedPtr submit_inline(int                peer,
+                                          OpCode             opcode,
+                                          const void*        data,
+                                          size_t             length,
+                                          const std::string& mr_key,
+                                          uint64_t           target_offset,
+                                          callback_fn_t      callback,
+                                          uint32_t           imm_data);
+
     /* Completion Queue Polling */
-    int64_t cq_poll_handle();
+    int64_t cq_poll_handle(int cqi);
+    /* Reap and dispatch up to poll_count completions, returns the number reaped */
+    int poll_completions(int cqi);
+
+    /* Pin the calling worker thread to worker_cpus_ */
+    void pin_worker_thread();
+
+    /* Run the user callback of a finished assignment, inline or on its executor */
+    void    dispatch_callback(int qpi, RDMAAssignmentSharedPtr assign, int status);
+    void    dispatch_timeout(int qpi, RDMAAssignmentSharedPtr assign);
+    void    run_completion_task(completion_task_t& task);
+    int64_t callback_handle(int executor);
     /* Working Queue Dispatch */
-    int64_t wq_dispatch_handle(int qpi);
+    int64_t wq_dispatch_handle(int dispatcher);
+    /* Post what the QP has queued until it runs out of work or send queue credits */
+    void dispatch_qp(int qpi);
 
     /* Async RDMA SendRecv */
     int64_t post_send(int qpi, RDMAAssignmentSharedPtr assign);
     int64_t post_recv(int qpi, RDMAAssignmentSharedPtr assign);
 
-    /* Async RDMA Read */
-    int64_t post_read_batch(int qpi, RDMAAssignmentSharedPtr assign);
+    /* Async RDMA Read / Write */
+    int64_t post_rw_batch(int qpi, RDMAAssignmentSharedPtr assign);
+
+    /* Fill the SGE arena from the assignment batch, one SGE per assignment */
+    struct ibv_sge* fill_sge_list(int qpi, const RDMAAssignmentSharedPtr& assign);
+
+    /* Completion Record Pool */
+    callback_info_with_qpi_t* acquire_completion_record(int qpi, const RDMAAssignmentSharedPtr& assign);
+    void                      release_completion_record(callback_info_with_qpi_t* record);
+
+    /* Send Queue Credits */
+    bool acquire_send_credits(int qpi, size_t batch_size);
+    /* Dispatcher side: false when the QP has to wait, the CQ poller rings once they are back */
+    bool take_send_credits(int qpi, size_t batch_size);
+    void return_send_credits(int qpi, const RDMAAssignmentSharedPtr& assign);
+    /* Credits an assignment holds while posted: one per assignment, an empty batch still posts a WR */
+    static size_t send_credits(const RDMAAssignmentSharedPtr& assign)
+    {
+        return std::max<size_t>(assign->batch_size(), 1);
+    }
+
+    /* Account a batch handed to the QP, under rdma_post_send_mutex_ */
+    void add_posted(int qpi, const RDMAAssignmentSharedPtr& assign);
+
+    /* Undo the accounting of a WR list the device refused and fail the assignment */
+    void fail_post(int qpi, callback_info_with_qpi_t* record);
+
+    /* Resolve the MR handles of the batch and lease them until the assignment's callback has run */
+    void acquire_mr_leases(RDMAAssignment* assign);
+
+    /* Drop the MR leases taken by submit, once per run of the same MR like they were taken */
+    void release_mr_leases(RDMAAssignment* assign);
 
+    /*
+      Splits of one submit finish together: the last split, the one handed to the caller,
+      reports once every split has finished, with the first failure of any of them.
+    */
+    typedef struct split_join {
+        split_join(size_t splits, callback_info_t* last): remaining_(splits), last_(last) {}
+
+        std::atomic<size_t> remaining_;
+        std::atomic<int>    status_{callback_info_t::SUCCESS};
+        callback_info_t*    last_;
+        std::atomic<bool>   last_finished_{false};
+
+        void finish(int code)
+        {
+            int success = callback_info_t::SUCCESS;
+            if (code != callback_info_t::SUCCESS)
+                status_.compare_exchange_strong(success, code);
+            if (remaining_.fetch_sub(1) == 1)
+                last_->notify(status_.load());
+        }
+
+        /* The last split finishes on its release, or earlier when it is cancelled */
+        void finish_last(int code)
+        {
+            if (!last_finished_.exchange(true))
+                finish(code);
+        }
+    } split_join_t;
+
+    /* Before the MR leases and deadlines wrap the callbacks */
+    void join_splits(const std::vector<RDMAAssignmentSharedPtr>& splits);
+
+    /* Assignment Deadlines */
+    void track_deadline(int qpi, const RDMAAssignmentSharedPtr& assign, std::chrono::milliseconds timeout);
+    void untrack_deadline(RDMAAssignment* assign);
+    /* Report TIME_OUT for the assignments past their deadline, called by the CQ pollers */
+    void expire_deadlines();
+    /* Until the next deadline, at most DEADLINE_CHECK_MS */
+    int deadline_wait_ms() const;
+
+    /* Shared Receive Queue */
+    int64_t init_srq();
+    /* Posts every free slot, callers hold srq_mutex_ */
+    int64_t                 post_srq_slots();
+    void                    release_srq_slot(uint32_t slot);
+    void                    on_srq_completion(const struct ibv_wc& wc, int status);
+    RDMAAssignmentSharedPtr
+    submit_srq_recv(int peer, AssignmentBatch& batch, callback_fn_t callback, std::chrono::milliseconds timeout);
+    /* Copy the message into the RECV, free its slot and complete the RECV */
+    void deliver_srq_message(const srq_message_t& message, RDMAAssignmentSharedPtr assign);
+    /* A RECV cancelled or timed out while waiting for a message: unqueue it and release its MRs */
+    void drop_srq_recv(int peer, RDMAAssignment* assign);
+    /* -1 for a QP this context does not own */
+    int  qpi_of(uint32_t qp_num) const;
+
+    /* Brings every QP of the peer to RTS against the remote QP of the same index */
+    int64_t connect_qps(int peer, const std::vector<rdma_info_t>& remote_rdma_info_list);
+
+    /* RESET to INIT, then INIT to RTS against remote_rdma_info_, with the PSNs exchanged at connect or recovery */
+    int64_t init_qp(int qpi);
+    int64_t connect_qp(int qpi);
+
+    /* QP Error Recovery */
+    /* Called by the CQ poller on a failed completion, wakes the dispatcher of the QP */
+    void mark_broken(int qpi, enum ibv_wc_status status);
+    /*
+      Park a failed assignment for posting again, false if it has to fail: the QP broke on
+      something other than a transport retry error, or the WR is not safe to post twice.
+    */
+    bool retry_failed(int qpi, const RDMAAssignmentSharedPtr& assign, enum ibv_wc_status status);
+    /*
+      Run by the WQ dispatcher of a broken QP: flush it, and once every WR is back hand the
+      queued work over to a healthy QP of the same peer, or hold it when none is left, then
+      reset the QP. Returns early while WRs are out.
+    */
+    void fail_over_qp(int qpi);
+    /*
+      Post the parked, held and queued work of a drained broken QP on a healthy one of the peer.
+      With none left it stays held until a QP of the peer is reconnected or its deadline expires,
+      or fails right away when max_retries is 0.
+    */
+    void hand_over_work(int qpi);
+    /* Back to INIT with a fresh PSN, reported in qp_recovery_notice. Under recovery_mutex_ */
+    void reset_qp(int qpi);
+    /* RTR / RTS against the peer's new rdma_info, then the QP takes work again. Under recovery_mutex_ */
+    int64_t reconnect_qp(int qpi);
+};
+
+/*
+  A peer of an RDMAContext, from RDMAContext::add_peer: its group of QPs and the MRs it
+  registered with us. Costs a few QPs, the PD, local MRs, CQs and threads are those of the
+  context. Valid as long as the context is.
+*/
+class RDMAPeer {
+public:
+    RDMAPeer(RDMAContext* context, int peer): context_(context), peer_(peer) {}
+
+    int peer() const
+    {
+        return peer_;
+    }
+
+    /* See the RDMAContext methods of the same name */
+    int64_t connect(const json& endpoint_info_json)
+    {
+        return context_->connect(peer_, endpoint_info_json);
+    }
+
+    int64_t connect(const EndpointInfoView& endpoint_info)
+    {
+        return context_->connect(peer_, endpoint_info);
+    }
+
+    int64_t connect(const std::string& endpoint_info)
+    {
+        return connect(EndpointInfoView(endpoint_info.data(), endpoint_info.size()));
+    }
+
+    json endpoint_info() const
+    {
+        return context_->endpoint_info(peer_);
+    }
+
+    std::string endpoint_info_binary() const
+    {
+        return context_->endpoint_info_binary(peer_);
+    }
+
+    json remote_rdma_info() const
+    {
+        return context_->remote_rdma_info(peer_);
+    }
+
+    int64_t register_remote_memory_region(const std::string& mr_key, const json& mr_info)
+    {
+        return context_->memory_pool_.register_remote_memory_region(mr_key, mr_info, peer_);
+    }
+
+    int64_t register_remote_memory_regions(const EndpointInfoView& endpoint_info)
+    {
+        return context_->register_remote_memory_regions(peer_, endpoint_info);
+    }
+
+    int64_t unregister_remote_memory_region(const std::string& mr_key)
+    {
+        return context_->unregister_remote_memory_region(peer_, mr_key);
+    }
+
+    int64_t apply_mr_invalidation(const json& notice)
+    {
+        return context_->apply_mr_invalidation(peer_, notice);
+    }
+
+    json qp_recovery_notice()
+    {
+        return context_->qp_recovery_notice(peer_);
+    }
+
+    int64_t apply_qp_recovery(const json& notice)
+    {
+        return context_->apply_qp_recovery(peer_, notice);
+    }
+
+    RDMAAssignmentSharedPtr submit(OpCode                    opcode,
+                                   AssignmentBatch&          assignment,
+                                   callback_fn_t             callback = nullptr,
+                                   uint32_t                  imm_data = 0,
+                                   std::chrono::milliseconds timeout  = kNoTimeout)
+    {
+        return context_->submit(peer_, opcode, assignment, callback, imm_data, timeout);
+    }
+
+    RDMAAssignmentSharedPtr submit_inline(OpCode             opcode,
+                                          const void*        data,
+                                          size_t             length,
+                                          const std::string& mr_key        = "",
+                                          uint64_t           target_offset = 0,
+                                          callback_fn_t      callback      = nullptr,
+                                          uint32_t           imm_data      = 0)
+    {
+        return context_->submit_inline(peer_, opcode, data, length, mr_key, target_offset, callback, imm_data);
+    }
+
+private:
+    RDMAContext* context_;
+    int          peer_;
 };
 
 }  // namespace slime
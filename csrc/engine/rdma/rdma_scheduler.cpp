@@ -1,10 +1,13 @@
 #include "rdma_scheduler.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cstddef>
+#include <future>
 #include <random>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "engine/assignment.h"
@@ -18,14 +21,14 @@ const int64_t RDMAScheduler::SPLIT_ASSIGNMENT_BYTES;
 const int64_t RDMAScheduler::SPLIT_ASSIGNMENT_BATCH_SIZE;
 const int     RDMAScheduler::PORT_EACH_DEVICE;
 
-RDMAScheduler::RDMAScheduler(const std::vector<std::string>& dev_names_args)
+RDMAScheduler::RDMAScheduler(const std::vector<std::string>& dev_names_args, const RDMAContextConfig& config)
 {
     // Get all available RDMA devices
     SLIME_LOG_INFO("Initialize an RDMA Scheduler.");
 
     std::vector<std::string> dev_names;
     if (dev_names_args.empty()) {
-        dev_names = available_nic();
+        dev_names = default_verbs_provider()->device_names();
     }
     else {
         dev_names = dev_names_args;
@@ -40,11 +43,24 @@ RDMAScheduler::RDMAScheduler(const std::vector<std::string>& dev_names_args)
     int index    = 0;
     for (const std::string& name : dev_names) {
         for (int ib = 1; ib <= PORT_EACH_DEVICE; ++ib) {
-            rdma_ctxs_[index].init(name, ib, "RoCE");
+            rdma_ctxs_[index].init(name, ib, "RoCE", config);
             ++index;
         }
     }
 
+    // Stripe weights follow the link rate, devices that do not report one count as the slowest
+    double min_bandwidth = 0;
+    for (RDMAContext& ctx : rdma_ctxs_) {
+        double bandwidth = ctx.port_bandwidth_gbps();
+        if (bandwidth > 0 && (min_bandwidth == 0 || bandwidth < min_bandwidth))
+            min_bandwidth = bandwidth;
+    }
+    for (RDMAContext& ctx : rdma_ctxs_) {
+        double bandwidth = ctx.port_bandwidth_gbps();
+        rdma_ctx_weights_.push_back(bandwidth > 0 ? bandwidth : std::max(min_bandwidth, 1.0));
+    }
+    registration_stats_.resize(rdma_ctxs_.size());
+
     std::srand(std::time(nullptr));
 }
 
@@ -57,62 +73,313 @@ RDMAScheduler::~RDMAScheduler()
 
 int64_t RDMAScheduler::register_memory_region(const std::string& mr_key, uintptr_t data_ptr, uint64_t length)
 {
-    // Register the memory region in each RDMA context
+    using clock = std::chrono::steady_clock;
+
+    std::lock_guard<std::mutex> registration_lock(registration_mutex_);
+    auto                        registration_start = clock::now();
+
+    if (registration_chunk_bytes_ && length > registration_chunk_bytes_) {
+        auto start     = clock::now();
+        int  threads   = std::max<int>(std::thread::hardware_concurrency(), 1);
+        bool populated = populate_memory(data_ptr, length, registration_chunk_bytes_, threads);
+        populate_ms_ += std::chrono::duration<double, std::milli>(clock::now() - start).count();
+        if (!populated)
+            SLIME_LOG_DEBUG("MR ", mr_key, " cannot be populated ahead of registration");
+    }
+
+    // Register the memory region in each RDMA context, every context hands out the same handle
+    std::vector<int64_t> ctx_mr_handles(rdma_ctxs_.size());
+    std::vector<double>  ctx_ms(rdma_ctxs_.size());
+    auto                 register_ctx = [&](size_t i) {
+        auto start        = clock::now();
+        ctx_mr_handles[i] = rdma_ctxs_[i].register_memory_region(mr_key, data_ptr, length);
+        ctx_ms[i]         = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    };
+    if (parallel_registration_ && rdma_ctxs_.size() > 1) {
+        std::vector<std::future<void>> futures;
+        for (size_t i = 1; i < rdma_ctxs_.size(); ++i)
+            futures.push_back(std::async(std::launch::async, register_ctx, i));
+        register_ctx(0);
+        for (std::future<void>& future : futures)
+            future.get();
+    }
+    else {
+        for (size_t i = 0; i < rdma_ctxs_.size(); ++i)
+            register_ctx(i);
+    }
+
+    int64_t mr_handle = INVALID_MR_HANDLE;
+    for (size_t i = 0; i < rdma_ctxs_.size(); ++i) {
+        SLIME_ASSERT(mr_handle == INVALID_MR_HANDLE || mr_handle == ctx_mr_handles[i],
+                     "MR handle of " << mr_key << " differs across RDMA contexts");
+        mr_handle = ctx_mr_handles[i];
+
+        registration_stats_t& stats = registration_stats_[i];
+        stats.mrs += 1;
+        stats.bytes += length;
+        stats.total_ms += ctx_ms[i];
+        stats.last_ms = ctx_ms[i];
+    }
+    double registration_ms = std::chrono::duration<double, std::milli>(clock::now() - registration_start).count();
+    SLIME_LOG_INFO("MR ", mr_key, " registered on ", rdma_ctxs_.size(), " devices in ", registration_ms, " ms");
+
+    if (topology_) {
+        std::vector<std::string> nics = topology_->nics_for_address(data_ptr);
+        std::vector<size_t>      ctxs;
+        for (size_t i = 0; i < rdma_ctxs_.size(); ++i) {
+            if (std::find(nics.begin(), nics.end(), rdma_ctxs_[i].device_name()) != nics.end())
+                ctxs.push_back(i);
+        }
+        SLIME_LOG_DEBUG("MR ", mr_key, " is served by ", ctxs.size(), " of ", rdma_ctxs_.size(), " devices");
+
+        std::lock_guard<std::mutex> lock(mr_ctxs_mutex_);
+        if (ctxs.empty() || ctxs.size() == rdma_ctxs_.size())
+            mr_ctxs_.erase(mr_handle);
+        else
+            mr_ctxs_[mr_handle] = std::move(ctxs);
+    }
+    return mr_handle;
+}
+
+int64_t RDMAScheduler::unregister_memory_region(const std::string& mr_key)
+{
+    std::lock_guard<std::mutex> registration_lock(registration_mutex_);
+
+    mr_handle_t mr_handle = rdma_ctxs_.empty() ? INVALID_MR_HANDLE : rdma_ctxs_[0].get_mr_handle(mr_key);
+    int64_t     ret       = 0;
     for (RDMAContext& rdma_ctx : rdma_ctxs_) {
-        rdma_ctx.register_memory_region(mr_key, data_ptr, length);
+        if (rdma_ctx.unregister_memory_region(mr_key))
+            ret = -1;
     }
-    return 0;
+
+    std::lock_guard<std::mutex> lock(mr_ctxs_mutex_);
+    mr_ctxs_.erase(mr_handle);
+    return ret;
+}
+
+int64_t RDMAScheduler::apply_mr_invalidation(const json& notice)
+{
+    int64_t invalidated = 0;
+    for (RDMAContext& rdma_ctx : rdma_ctxs_)
+        invalidated += rdma_ctx.apply_mr_invalidation(notice);
+    return invalidated;
 }
 
 int RDMAScheduler::connect(const json& remote_info)
 {
     SLIME_ASSERT_EQ(
         rdma_ctxs_.size(), remote_info.size(), "Currently only support two nodes with same number of RDMA devices");
-    for (int i = 0; i < rdma_ctxs_.size(); ++i) {
+    for (size_t i = 0; i < rdma_ctxs_.size(); ++i) {
         rdma_ctxs_[i].connect(remote_info[i]);
         rdma_ctxs_[i].launch_future();
     }
     return 0;
 }
 
-RDMASchedulerAssignmentSharedPtr RDMAScheduler::submitAssignment(OpCode opcode, AssignmentBatch& batch)
+int RDMAScheduler::connect(const std::vector<EndpointInfoView>& remote_info)
+{
+    SLIME_ASSERT_EQ(
+        rdma_ctxs_.size(), remote_info.size(), "Currently only support two nodes with same number of RDMA devices");
+    for (size_t i = 0; i < rdma_ctxs_.size(); ++i) {
+        if (rdma_ctxs_[i].connect(remote_info[i]))
+            return -1;
+        rdma_ctxs_[i].launch_future();
+    }
+    return 0;
+}
+
+RDMASchedulerAssignmentSharedPtr
+RDMAScheduler::submitAssignment(OpCode opcode, AssignmentBatch& batch, std::chrono::milliseconds timeout)
 {
-    // size_t batch_size = batch.size();
-    // rdma_index_to_assignments_.clear();
-    // size_t total_ctxs = rdma_ctxs_.size();
+    RDMAAssignmentSharedPtrBatch rdma_assignment_batch;
 
-    // for (int i = 0; i < batch_size; ++i) {
-    //     rdma_index_to_assignments_[selectRdma()].push_back(batch[i]);
-    // }
+    uint64_t total_bytes = 0;
+    for (const Assignment& assign : batch)
+        total_bytes += assign.length;
 
-    // RDMAAssignmentSharedPtrBatch rdma_assignment_batch;
-    // for (int i = 0; i < rdma_ctxs_.size(); i++) {
-    //     if (!rdma_index_to_assignments_[i].empty()) {
-    //         RDMAAssignmentSharedPtr rdma_assignment = rdma_ctxs_[i].submit(opcode, rdma_index_to_assignments_[i]);
-    //         rdma_assignment_batch.push_back(rdma_assignment);
-    //     }
-    // }
+    std::vector<size_t> candidates = candidate_ctxs(batch);
 
-    RDMAAssignmentSharedPtrBatch rdma_assignment_batch;
-    rdma_assignment_batch.push_back(rdma_ctxs_[selectRdma()].submit(opcode, batch));
+    // Two-sided and small transfers stay on one device
+    bool one_sided = opcode == OpCode::READ || opcode == OpCode::WRITE;
+    if (!one_sided || candidates.size() < 2
+        || total_bytes <= (uint64_t)split_assignment_bytes_.load(std::memory_order_relaxed)) {
+        rdma_assignment_batch.push_back(rdma_ctxs_[selectRdma(candidates)].submit(opcode, batch, nullptr, 0, timeout));
+        return std::make_shared<RDMASchedulerAssignment>(rdma_assignment_batch);
+    }
 
+    std::vector<AssignmentBatch> striped = stripe(batch, candidates);
+    for (size_t i = 0; i < striped.size(); ++i) {
+        for (size_t begin = 0; begin < striped[i].size(); begin += SPLIT_ASSIGNMENT_BATCH_SIZE) {
+            size_t          end = std::min<size_t>(begin + SPLIT_ASSIGNMENT_BATCH_SIZE, striped[i].size());
+            AssignmentBatch sub_batch(striped[i].begin() + begin, striped[i].begin() + end);
+            rdma_assignment_batch.push_back(rdma_ctxs_[candidates[i]].submit(opcode, sub_batch, nullptr, 0, timeout));
+        }
+    }
     return std::make_shared<RDMASchedulerAssignment>(rdma_assignment_batch);
 }
 
-int RDMAScheduler::selectRdma()
+std::vector<size_t> RDMAScheduler::candidate_ctxs(const AssignmentBatch& batch)
+{
+    if (topology_aware_.load(std::memory_order_acquire) && !batch.empty()) {
+        // Batches are expected to stay within one MR, the first assignment decides
+        mr_handle_t mr_handle = batch[0].mr_handle;
+        if (mr_handle == INVALID_MR_HANDLE)
+            mr_handle = rdma_ctxs_[0].get_mr_handle(batch[0].mr_key);
+
+        std::lock_guard<std::mutex> lock(mr_ctxs_mutex_);
+        auto                        it = mr_ctxs_.find(mr_handle);
+        if (it != mr_ctxs_.end())
+            return it->second;
+    }
+
+    std::vector<size_t> candidates(rdma_ctxs_.size());
+    for (size_t i = 0; i < candidates.size(); ++i)
+        candidates[i] = i;
+    return candidates;
+}
+
+std::vector<AssignmentBatch> RDMAScheduler::stripe(const AssignmentBatch&    batch,
+                                                   const std::vector<size_t>& candidates)
+{
+    // Indexed like candidates
+    std::vector<AssignmentBatch> striped(candidates.size());
+    std::vector<double>          load(candidates.size(), 0);
+    std::vector<double>          weights(candidates.size());
+    for (size_t i = 0; i < candidates.size(); ++i)
+        weights[i] = rdma_ctx_weights_[candidates[i]];
+
+    // Account for what is still in flight, unless the caller asked for a plain rotation
+    if (selection_policy_.load(std::memory_order_relaxed) != SelectionPolicy::ROUND_ROBIN) {
+        for (size_t i = 0; i < candidates.size(); ++i)
+            load[i] = rdma_ctxs_[candidates[i]].outstanding_bytes() / weights[i];
+    }
+
+    // Start from a rotating device so small remainders do not always land on the first one
+    size_t first = std::find(candidates.begin(), candidates.end(), selectRdma(candidates)) - candidates.begin();
+    // One slice size for the whole batch, set_split_assignment_bytes may change it meanwhile
+    uint64_t split_bytes = split_assignment_bytes_.load(std::memory_order_relaxed);
+    for (const Assignment& assign : batch) {
+        for (uint64_t offset = 0; offset < assign.length; offset += split_bytes) {
+            Assignment slice = assign;
+            slice.source_offset += offset;
+            slice.target_offset += offset;
+            slice.length = std::min<uint64_t>(split_bytes, assign.length - offset);
+
+            // Least loaded device relative to its link rate
+            size_t target = first;
+            for (size_t k = 1; k < candidates.size(); ++k) {
+                size_t i = (first + k) % candidates.size();
+                if (load[i] < load[target])
+                    target = i;
+            }
+            load[target] += slice.length / weights[target];
+            striped[target].push_back(std::move(slice));
+        }
+    }
+    return striped;
+}
+
+void RDMAScheduler::set_split_assignment_bytes(int64_t split_assignment_bytes)
+{
+    SLIME_ASSERT(split_assignment_bytes > 0, "split_assignment_bytes must be positive");
+    split_assignment_bytes_.store(split_assignment_bytes, std::memory_order_relaxed);
+}
+
+void RDMAScheduler::set_parallel_registration(bool parallel_registration)
+{
+    std::lock_guard<std::mutex> lock(registration_mutex_);
+    parallel_registration_ = parallel_registration;
+}
+
+void RDMAScheduler::set_registration_chunk_bytes(uint64_t registration_chunk_bytes)
+{
+    std::lock_guard<std::mutex> lock(registration_mutex_);
+    registration_chunk_bytes_ = registration_chunk_bytes;
+}
+
+json RDMAScheduler::registration_stats()
+{
+    std::lock_guard<std::mutex> lock(registration_mutex_);
+
+    json devices;
+    for (size_t i = 0; i < rdma_ctxs_.size(); ++i) {
+        const registration_stats_t& stats = registration_stats_[i];
+        devices[rdma_ctxs_[i].get_dev_ib()] = {{"mrs", stats.mrs},
+                                               {"bytes", stats.bytes},
+                                               {"total_ms", stats.total_ms},
+                                               {"last_ms", stats.last_ms}};
+    }
+    return json{{"parallel", parallel_registration_},
+                {"chunk_bytes", registration_chunk_bytes_},
+                {"populate_ms", populate_ms_},
+                {"devices", devices}};
+}
+
+void RDMAScheduler::set_max_coalesce_bytes(uint64_t max_coalesce_bytes)
+{
+    for (RDMAContext& rdma_ctx : rdma_ctxs_)
+        rdma_ctx.set_max_coalesce_bytes(max_coalesce_bytes);
+}
+
+void RDMAScheduler::set_sge_packing(bool sge_packing)
+{
+    for (RDMAContext& rdma_ctx : rdma_ctxs_)
+        rdma_ctx.set_sge_packing(sge_packing);
+}
+
+void RDMAScheduler::set_selection_policy(SelectionPolicy policy)
+{
+    selection_policy_.store(policy, std::memory_order_relaxed);
+    for (RDMAContext& rdma_ctx : rdma_ctxs_)
+        rdma_ctx.set_selection_policy(policy);
+}
+
+void RDMAScheduler::set_topology_aware(bool topology_aware, const std::string& sysfs_root)
 {
-    // Simplest round robin, we could enrich it in the future
-    last_rdma_selection_ = (last_rdma_selection_ + 1) % rdma_ctxs_.size();
-    return last_rdma_selection_;
+    // No registration reads topology_ while it is replaced
+    std::lock_guard<std::mutex> registration_lock(registration_mutex_);
+    if (topology_aware) {
+        topology_ = std::make_unique<Topology>(sysfs_root);
+        topology_aware_.store(true, std::memory_order_release);
+        SLIME_LOG_INFO("Topology aware device selection: ", topology_->to_json().dump());
+    }
+    else {
+        topology_aware_.store(false, std::memory_order_release);
+        topology_.reset();
+        std::lock_guard<std::mutex> lock(mr_ctxs_mutex_);
+        mr_ctxs_.clear();
+    }
+}
+
+int RDMAScheduler::selectRdma(const std::vector<size_t>& candidates)
+{
+    // Load is weighted by link rate, i.e. roughly the time each device needs to drain
+    size_t selected = select_by_policy(selection_policy_.load(std::memory_order_relaxed),
+                                       last_rdma_selection_,
+                                       candidates.size(),
+                                       [this, &candidates](size_t i) {
+                                           size_t ctx  = candidates[i];
+                                           double load = rdma_ctxs_[ctx].outstanding_bytes() / rdma_ctx_weights_[ctx];
+                                           return uint64_t(load);
+                                       });
+    return candidates[selected];
 }
 
 json RDMAScheduler::scheduler_info()
 {
     json json_info = json();
-    for (int i = 0; i < rdma_ctxs_.size(); ++i) {
+    for (size_t i = 0; i < rdma_ctxs_.size(); ++i) {
         json_info[i] = rdma_ctxs_[i].endpoint_info();
     }
     return json_info;
 }
 
+std::vector<std::string> RDMAScheduler::scheduler_info_binary()
+{
+    std::vector<std::string> info;
+    for (size_t i = 0; i < rdma_ctxs_.size(); ++i)
+        info.push_back(rdma_ctxs_[i].endpoint_info_binary());
+    return info;
+}
+
 }  // namespace slime
@@ -1,13 +1,19 @@
 #pragma once
 
 #include <atomic>
+#include <chrono>
 #include <cstddef>
-#include <map>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "engine/assignment.h"
 #include "engine/rdma/rdma_assignment.h"
 #include "engine/rdma/rdma_context.h"
+#include "engine/rdma/topology.h"
 
 namespace slime {
 
@@ -15,61 +21,116 @@ using RDMASchedulerAssignmentSharedPtr      = std::shared_ptr<RDMASchedulerAssig
 using RDMASchedulerAssignmentSharedPtrBatch = std::vector<RDMASchedulerAssignmentSharedPtr>;
 
 /**
- * To aggregate send among different NIC devices,
- * we have to slice user register data_ptr to different MR
- * bound to different device rdma context
+ * To aggregate bandwidth among different NIC devices, every MR is registered
+ * in each device rdma context. Large READ/WRITE batches are sliced into
+ * split_assignment_bytes pieces and striped over the contexts in proportion
+ * to their link rate. When topology aware, batches only go to the devices
+ * closest to the NUMA node of their MR.
  */
-struct DevMrSlice {
-    int         rdma_ctx_index;
-    std::string mr_key;
-    uintptr_t   origin_data_ptr;
-    uintptr_t   offset_data_ptr;
-    size_t      length;
-
-    DevMrSlice(int                rdma_ctx_index,
-               const std::string& mr_key,
-               uintptr_t          origin_data_ptr,
-               uintptr_t          offset_data_ptr,
-               size_t             length):
-        rdma_ctx_index(rdma_ctx_index),
-        mr_key(mr_key),
-        origin_data_ptr(origin_data_ptr),
-        offset_data_ptr(offset_data_ptr),
-        length(length)
-    {
-    }
-
-    DevMrSlice(const DevMrSlice& dev_mr_slice) = default;
-    DevMrSlice(DevMrSlice&& dev_mr_slice)      = default;
-};
-
 class RDMAScheduler {
 public:
-    RDMAScheduler(const std::vector<std::string>& rdma_devices);
+    /* Every device context is initialized with the same config */
+    RDMAScheduler(const std::vector<std::string>& rdma_devices, const RDMAContextConfig& config = RDMAContextConfig());
     RDMAScheduler(): RDMAScheduler(std::vector<std::string>{}) {}
     ~RDMAScheduler();
 
+    /*
+      Returns the MR handle, identical in every underlying RDMAContext. The devices register
+      concurrently; registrations from several threads are serialized so every device sees
+      the keys in the same order.
+    */
     int64_t register_memory_region(const std::string& mr_key, uintptr_t data_ptr, size_t length);
 
+    /* See RDMAContext::unregister_memory_region, applied on every device */
+    int64_t unregister_memory_region(const std::string& mr_key);
+
+    /* See RDMAContext::apply_mr_invalidation, applied on every device: the remote MRs dropped on all of them */
+    int64_t apply_mr_invalidation(const json& notice);
+
+    /* Register on one device after the other, e.g. to measure each device in isolation */
+    void set_parallel_registration(bool parallel_registration);
+
+    /*
+      Regions larger than this are faulted in chunk by chunk on all cores before the devices
+      register them, so the registrations only pin already mapped pages. 0 disables it.
+    */
+    void set_registration_chunk_bytes(uint64_t registration_chunk_bytes);
+
+    /* Per device MR count, bytes and registration time, plus the populate time */
+    json registration_stats();
+
     int connect(const json& remote_info);
 
-    RDMASchedulerAssignmentSharedPtr submitAssignment(OpCode opcode, AssignmentBatch& assignment);
+    /* From the peer's scheduler_info_binary, one endpoint info per device */
+    int connect(const std::vector<EndpointInfoView>& remote_info);
+
+    /* With a timeout every slice reports TIME_OUT on its own, see RDMAContext::submit */
+    RDMASchedulerAssignmentSharedPtr
+    submitAssignment(OpCode opcode, AssignmentBatch& assignment, std::chrono::milliseconds timeout = kNoTimeout);
+
+    /*
+      Device selection for batches that are not striped, also forwarded to every context for
+      its QP selection. Can be switched at any time.
+    */
+    void set_selection_policy(SelectionPolicy policy);
+
+    /* Striping granularity, batches up to this size go to a single device */
+    void set_split_assignment_bytes(int64_t split_assignment_bytes);
+
+    /* See RDMAContext::set_max_coalesce_bytes and RDMAContext::set_sge_packing */
+    void set_max_coalesce_bytes(uint64_t max_coalesce_bytes);
+    void set_sge_packing(bool sge_packing);
+
+    /*
+      Restrict every MR registered from now on to the devices closest to the NUMA node backing
+      its first page. MRs whose node cannot be resolved keep using all devices.
+    */
+    void set_topology_aware(bool topology_aware, const std::string& sysfs_root = "/sys");
 
     json scheduler_info();
 
+    std::vector<std::string> scheduler_info_binary();
+
 private:
-    int selectRdma();
+    int selectRdma(const std::vector<size_t>& candidates);
+
+    /* Slice the batch and spread the slices over the candidate contexts, weighted by link rate */
+    std::vector<AssignmentBatch> stripe(const AssignmentBatch& batch, const std::vector<size_t>& candidates);
+
+    /* Contexts serving the MR of the batch, all of them unless topology aware */
+    std::vector<size_t> candidate_ctxs(const AssignmentBatch& batch);
 
     const static int64_t SPLIT_ASSIGNMENT_BYTES      = (8ull << 20);
     const static int64_t SPLIT_ASSIGNMENT_BATCH_SIZE = 8192;
     const static int     PORT_EACH_DEVICE            = 1;
 
-    std::vector<RDMAContext>                               rdma_ctxs_;
-    std::map<std::string, std::map<uintptr_t, DevMrSlice>> virtual_mr_to_actual_mr_;
-    std::atomic<int>                                       split_assignment_done_cnt_;
-    std::map<int, AssignmentBatch>                         rdma_index_to_assignments_;
-    int                                                    assignment_cnt_      = 0;
-    int                                                    last_rdma_selection_ = -1;
+    std::vector<RDMAContext>     rdma_ctxs_;
+    std::vector<double>          rdma_ctx_weights_;
+    std::atomic<int64_t>         split_assignment_bytes_{SPLIT_ASSIGNMENT_BYTES};
+    std::atomic<SelectionPolicy> selection_policy_{SelectionPolicy::ROUND_ROBIN};
+    std::atomic<uint32_t>        last_rdma_selection_{0};
+
+    typedef struct registration_stats {
+        uint64_t mrs{0};
+        uint64_t bytes{0};
+        double   total_ms{0};
+        double   last_ms{0};
+    } registration_stats_t;
+
+    std::mutex                        registration_mutex_;
+    bool                              parallel_registration_{true};
+    uint64_t                          registration_chunk_bytes_{0};
+    double                            populate_ms_{0};
+    std::vector<registration_stats_t> registration_stats_;
+
+    /*
+      Preferred contexts per MR handle, only filled when topology aware. topology_ is only
+      touched under registration_mutex_, submits only read topology_aware_.
+    */
+    std::unique_ptr<Topology>                            topology_;
+    std::atomic<bool>                                    topology_aware_{false};
+    std::mutex                                           mr_ctxs_mutex_;
+    std::unordered_map<mr_handle_t, std::vector<size_t>> mr_ctxs_;
 };
 
 };  // namespace slime
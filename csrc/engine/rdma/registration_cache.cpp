@@ -0,0 +1,168 @@
+#include "engine/rdma/registration_cache.h"
+
+#include "utils/logging.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace slime {
+
+RegistrationCache::RegistrationCache(ibv_pd* pd, VerbsProvider* verbs, int access, uint64_t budget_bytes):
+    pd_(pd), verbs_(verbs), access_(access), budget_bytes_(budget_bytes)
+{
+}
+
+RegistrationCache::~RegistrationCache()
+{
+    for (auto& entry : entries_) {
+        if (entry.second.refs)
+            SLIME_LOG_DEBUG("Deregistering MR ", entry.first->addr, " still held ", entry.second.refs, " times");
+        verbs_->dereg_mr(entry.first);
+    }
+}
+
+struct ibv_mr* RegistrationCache::lookup(uintptr_t addr, uint64_t length)
+{
+    // Only MRs starting at most max_length_ before the end of the range can cover it
+    for (auto it = by_addr_.upper_bound(addr); it != by_addr_.begin();) {
+        --it;
+        uintptr_t begin = it->first;
+        if (begin + max_length_ < addr + length)
+            break;
+        if (begin + it->second->length >= addr + length)
+            return it->second;
+    }
+    return nullptr;
+}
+
+struct ibv_mr* RegistrationCache::acquire(uintptr_t addr, uint64_t length)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    struct ibv_mr* mr = enabled() ? lookup(addr, length) : nullptr;
+    if (mr) {
+        ++hits_;
+    }
+    else {
+        ++misses_;
+        mr = verbs_->reg_mr(pd_, (void*)addr, length, access_);
+        if (!mr)
+            return nullptr;
+        by_addr_.emplace(addr, mr);
+        max_length_ = std::max<uint64_t>(max_length_, length);
+        pinned_bytes_ += length;
+    }
+
+    cache_entry_t& entry = entries_[mr];
+    if (entry.refs++ == 0 && entry.idle) {
+        idle_.erase(entry.idle_it);
+        entry.idle = false;
+    }
+
+    evict();
+    return mr;
+}
+
+void RegistrationCache::release(struct ibv_mr* mr)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = entries_.find(mr);
+    SLIME_ASSERT(it != entries_.end() && it->second.refs > 0, "release of an MR not acquired from the cache");
+    if (--it->second.refs == 0) {
+        // Nothing to keep it for, and an invalidated one may no longer match its pages
+        if (!enabled() || it->second.invalidated) {
+            deregister(mr);
+            return;
+        }
+        idle_.push_front(mr);
+        it->second.idle_it = idle_.begin();
+        it->second.idle    = true;
+    }
+    evict();
+}
+
+size_t RegistrationCache::invalidate(uintptr_t addr, uint64_t length)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    std::vector<struct ibv_mr*> overlapping;
+    for (auto it = by_addr_.lower_bound(addr >= max_length_ ? addr - max_length_ : 0);
+         it != by_addr_.end() && it->first < addr + length;
+         ++it) {
+        if (it->first + it->second->length > addr)
+            overlapping.push_back(it->second);
+    }
+    for (struct ibv_mr* mr : overlapping) {
+        cache_entry_t& entry = entries_[mr];
+        ++invalidations_;
+        if (entry.idle) {
+            idle_.erase(entry.idle_it);
+            deregister(mr);
+            continue;
+        }
+        unindex(mr);
+        entry.invalidated = true;
+    }
+    return overlapping.size();
+}
+
+void RegistrationCache::evict()
+{
+    while (pinned_bytes_ > budget_bytes_ && !idle_.empty()) {
+        struct ibv_mr* mr = idle_.back();
+        idle_.pop_back();
+        deregister(mr);
+        ++evictions_;
+    }
+}
+
+void RegistrationCache::unindex(struct ibv_mr* mr)
+{
+    auto range = by_addr_.equal_range((uintptr_t)mr->addr);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second == mr) {
+            by_addr_.erase(it);
+            break;
+        }
+    }
+}
+
+void RegistrationCache::deregister(struct ibv_mr* mr)
+{
+    unindex(mr);
+    entries_.erase(mr);
+    pinned_bytes_ -= mr->length;
+    if (verbs_->dereg_mr(mr))
+        SLIME_LOG_WARN("Failed to deregister memory region");
+}
+
+void RegistrationCache::set_budget_bytes(uint64_t budget_bytes)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    budget_bytes_ = budget_bytes;
+    evict();
+}
+
+uint64_t RegistrationCache::pinned_bytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return pinned_bytes_;
+}
+
+json RegistrationCache::stats() const
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    return json{{"mrs", entries_.size()},
+                {"idle_mrs", idle_.size()},
+                {"pinned_bytes", pinned_bytes_},
+                {"budget_bytes", budget_bytes_.load()},
+                {"hits", hits_},
+                {"misses", misses_},
+                {"evictions", evictions_},
+                {"invalidations", invalidations_}};
+}
+
+}  // namespace slime
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "engine/rdma/verbs_provider.h"
+
+#include "utils/json.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+#include <infiniband/verbs.h>
+
+namespace slime {
+
+using json = nlohmann::json;
+
+/*
+  Registration cache of one PD, indexed by address interval.
+
+  Off with a budget_bytes of 0: every acquire registers its own MR and the matching release
+  deregisters it.
+
+  On, acquire returns an MR covering the requested range, reusing any cached MR that already
+  does, so re-registering a buffer (or a slice of one) under a new key does not pin its
+  pages again. Every acquire holds a reference until the matching release. Unreferenced
+  MRs stay registered for reuse and are deregistered least recently released first once
+  the pinned total exceeds budget_bytes (UINT64_MAX for no limit). Referenced MRs are never
+  evicted.
+
+  A cached MR is matched by virtual addresses only and keeps pinning the pages it was
+  registered over. Memory freed and mapped again at the same addresses would get the old
+  MR, and RDMA would silently go to the old pages: call invalidate for a range before
+  unmapping (or freeing back to the OS) memory that was registered.
+*/
+class RegistrationCache {
+public:
+    RegistrationCache(ibv_pd* pd, VerbsProvider* verbs, int access, uint64_t budget_bytes);
+    ~RegistrationCache();
+
+    RegistrationCache(const RegistrationCache&)            = delete;
+    RegistrationCache& operator=(const RegistrationCache&) = delete;
+
+    /* nullptr if the range is not cached and cannot be registered */
+    struct ibv_mr* acquire(uintptr_t addr, uint64_t length);
+    void           release(struct ibv_mr* mr);
+
+    /*
+      Stop handing out the cached MRs overlapping [addr, addr + length). Unreferenced ones are
+      deregistered right away, referenced ones on their last release. Returns their number.
+    */
+    size_t invalidate(uintptr_t addr, uint64_t length);
+
+    /* Deregisters unreferenced MRs beyond the new budget right away, 0 turns the cache off */
+    void set_budget_bytes(uint64_t budget_bytes);
+
+    bool enabled() const
+    {
+        return budget_bytes_ > 0;
+    }
+
+    uint64_t pinned_bytes() const;
+
+    json stats() const;
+
+private:
+    typedef struct cache_entry {
+        uint64_t refs{0};
+
+        /* Released and waiting in idle_ */
+        bool                                idle{false};
+        std::list<struct ibv_mr*>::iterator idle_it;
+
+        /* Out of by_addr_, deregistered on its last release */
+        bool invalidated{false};
+    } cache_entry_t;
+
+    /* Callers hold mutex_ */
+    struct ibv_mr* lookup(uintptr_t addr, uint64_t length);
+    void           evict();
+    void           unindex(struct ibv_mr* mr);
+    void           deregister(struct ibv_mr* mr);
+
+    ibv_pd*               pd_;
+    VerbsProvider*        verbs_;
+    int                   access_;
+    std::atomic<uint64_t> budget_bytes_;
+
+    mutable std::mutex mutex_;
+
+    /* MRs by start address, and the longest one to bound the interval search */
+    std::multimap<uintptr_t, struct ibv_mr*>          by_addr_;
+    uint64_t                                          max_length_{0};
+    std::unordered_map<struct ibv_mr*, cache_entry_t> entries_;
+
+    /* Unreferenced MRs, most recently released first */
+    std::list<struct ibv_mr*> idle_;
+
+    uint64_t pinned_bytes_{0};
+    uint64_t hits_{0};
+    uint64_t misses_{0};
+    uint64_t evictions_{0};
+    uint64_t invalidations_{0};
+};
+
+}  // namespace slime
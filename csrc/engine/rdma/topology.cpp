@@ -0,0 +1,242 @@
+#include "topology.h"
+
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "utils/logging.h"
+#include "utils/utils.h"
+
+namespace slime {
+
+namespace {
+
+std::string read_sysfs_line(const std::string& path)
+{
+    std::ifstream file(path);
+    std::string   line;
+    if (file)
+        std::getline(file, line);
+    return line;
+}
+
+int read_sysfs_int(const std::string& path, int default_value)
+{
+    std::string line = read_sysfs_line(path);
+    return line.empty() ? default_value : atoi(line.c_str());
+}
+
+std::vector<std::string> list_dir(const std::string& path)
+{
+    std::vector<std::string> entries;
+    DIR*                     dir = opendir(path.c_str());
+    if (!dir)
+        return entries;
+    while (struct dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name != "." && name != "..")
+            entries.push_back(name);
+    }
+    closedir(dir);
+    std::sort(entries.begin(), entries.end());
+    return entries;
+}
+
+std::string real_path(const std::string& path)
+{
+    char resolved[PATH_MAX];
+    if (!realpath(path.c_str(), resolved))
+        return "";
+    return resolved;
+}
+
+/* "pci0000:3a" for a root complex, "0000:3a:00.0" for a function below it */
+bool is_pci_component(const std::string& name)
+{
+    if (name.compare(0, 3, "pci") == 0)
+        return true;
+    return name.find(':') != std::string::npos && name.find('.') != std::string::npos;
+}
+
+}  // namespace
+
+Topology::Topology(const std::string& sysfs_root): sysfs_root_(sysfs_root)
+{
+    discover_numa_nodes();
+    discover_nics();
+    SLIME_LOG_DEBUG("Topology: ", nics_.size(), " RDMA NICs, ", numa_nodes_.size(), " NUMA nodes");
+}
+
+void Topology::discover_numa_nodes()
+{
+    std::string node_dir = sysfs_root_ + "/devices/system/node";
+    for (const std::string& entry : list_dir(node_dir)) {
+        if (entry.compare(0, 4, "node") != 0 || entry.size() == 4 || !isdigit(entry[4]))
+            continue;
+
+        numa_node_info_t node;
+        node.id   = atoi(entry.c_str() + 4);
+        node.cpus = parse_cpu_list(read_sysfs_line(node_dir + "/" + entry + "/cpulist"));
+
+        std::istringstream distances(read_sysfs_line(node_dir + "/" + entry + "/distance"));
+        int                distance;
+        while (distances >> distance)
+            node.distance.push_back(distance);
+
+        numa_nodes_.push_back(std::move(node));
+    }
+    std::sort(numa_nodes_.begin(), numa_nodes_.end(), [](const numa_node_info_t& a, const numa_node_info_t& b) {
+        return a.id < b.id;
+    });
+}
+
+void Topology::discover_nics()
+{
+    std::string ib_dir = sysfs_root_ + "/class/infiniband";
+    for (const std::string& name : list_dir(ib_dir)) {
+        std::string device = ib_dir + "/" + name + "/device";
+
+        nic_info_t nic;
+        nic.name       = name;
+        nic.numa_node  = read_sysfs_int(device + "/numa_node", -1);
+        nic.local_cpus = parse_cpu_list(read_sysfs_line(device + "/local_cpulist"));
+        nic.pcie_path  = resolve_pcie_path(device);
+        if (!nic.pcie_path.empty())
+            nic.pci_address = nic.pcie_path.back();
+
+        nics_.push_back(std::move(nic));
+    }
+}
+
+std::vector<std::string> Topology::resolve_pcie_path(const std::string& device_link) const
+{
+    // e.g. <root>/devices/pci0000:3a/0000:3a:00.0/0000:3b:00.0
+    std::vector<std::string> path;
+
+    std::string device = real_path(device_link);
+    std::string root   = real_path(sysfs_root_) + "/devices/";
+    if (device.empty() || device.compare(0, root.size(), root) != 0)
+        return path;
+
+    std::string        component;
+    std::istringstream components(device.substr(root.size()));
+    while (std::getline(components, component, '/')) {
+        if (is_pci_component(component))
+            path.push_back(component);
+    }
+    return path;
+}
+
+int Topology::numa_distance(int from, int to) const
+{
+    // sysfs lists distances by online node, the position of to among the sorted nodes
+    size_t to_index = 0;
+    while (to_index < numa_nodes_.size() && numa_nodes_[to_index].id != to)
+        ++to_index;
+    for (const numa_node_info_t& node : numa_nodes_) {
+        if (node.id == from && to_index < node.distance.size())
+            return node.distance[to_index];
+    }
+    // Kernel defaults, LOCAL_DISTANCE and REMOTE_DISTANCE
+    return from == to ? 10 : 20;
+}
+
+std::vector<std::string> Topology::nics_for_numa_node(int numa_node) const
+{
+    std::vector<std::string> all;
+    for (const nic_info_t& nic : nics_)
+        all.push_back(nic.name);
+    if (numa_node < 0)
+        return all;
+
+    // NICs without a NUMA node are only picked when no NIC reports one
+    int min_distance = INT_MAX;
+    for (const nic_info_t& nic : nics_) {
+        if (nic.numa_node >= 0)
+            min_distance = std::min(min_distance, numa_distance(numa_node, nic.numa_node));
+    }
+    if (min_distance == INT_MAX)
+        return all;
+
+    std::vector<std::string> closest;
+    for (const nic_info_t& nic : nics_) {
+        if (nic.numa_node >= 0 && numa_distance(numa_node, nic.numa_node) == min_distance)
+            closest.push_back(nic.name);
+    }
+    return closest;
+}
+
+std::vector<std::string> Topology::nics_for_address(uintptr_t addr) const
+{
+    return nics_for_numa_node(numa_node_of_address(addr));
+}
+
+std::vector<std::string> Topology::nics_for_pci_device(const std::string& pci_address) const
+{
+    std::string              device = sysfs_root_ + "/bus/pci/devices/" + pci_address;
+    std::vector<std::string> path   = resolve_pcie_path(device);
+
+    // Longest common prefix below the root complex, i.e. the deepest shared switch
+    size_t                   max_common = 0;
+    std::vector<std::string> closest;
+    for (const nic_info_t& nic : nics_) {
+        size_t common = 0;
+        while (common < path.size() && common < nic.pcie_path.size() && path[common] == nic.pcie_path[common])
+            ++common;
+        if (common == 0 || common < max_common)
+            continue;
+        if (common > max_common) {
+            max_common = common;
+            closest.clear();
+        }
+        closest.push_back(nic.name);
+    }
+    if (!closest.empty())
+        return closest;
+
+    // Different root complexes, fall back to the NUMA node of the device
+    return nics_for_numa_node(read_sysfs_int(device + "/numa_node", -1));
+}
+
+int Topology::numa_node_of_address(uintptr_t addr)
+{
+#ifdef SYS_move_pages
+    // move_pages with no target nodes only queries where each page currently resides
+    long  page_size = sysconf(_SC_PAGESIZE);
+    void* page      = reinterpret_cast<void*>(addr & ~uintptr_t(page_size - 1));
+    int   status    = -1;
+    if (syscall(SYS_move_pages, 0, 1, &page, nullptr, &status, 0) != 0)
+        return -1;
+    return status >= 0 ? status : -1;
+#else
+    return -1;
+#endif
+}
+
+json Topology::to_json() const
+{
+    json info;
+    info["nics"]       = json::array();
+    info["numa_nodes"] = json::array();
+    for (const nic_info_t& nic : nics_) {
+        info["nics"].push_back({{"name", nic.name},
+                                {"pci_address", nic.pci_address},
+                                {"numa_node", nic.numa_node},
+                                {"local_cpus", nic.local_cpus},
+                                {"pcie_path", nic.pcie_path}});
+    }
+    for (const numa_node_info_t& node : numa_nodes_) {
+        info["numa_nodes"].push_back({{"id", node.id}, {"cpus", node.cpus}, {"distance", node.distance}});
+    }
+    return info;
+}
+
+}  // namespace slime
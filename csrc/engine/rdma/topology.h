@@ -1,11 +1,89 @@
 #pragma once
 
+#include "utils/json.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
 namespace slime {
-/*
 
-Motivation: GPU and CPU affinity
+using json = nlohmann::json;
 
-TODO: RDMA Topology construction.
+/*
+  Host topology as seen through sysfs: RDMA NICs, the PCIe path from the root complex
+  down to each of them, NUMA nodes with their CPUs and distances.
+
+  Used to place work next to the memory it touches: a buffer resolves to the NUMA node
+  backing its pages, and the NICs on (or nearest to) that node serve it best. A GPU, or
+  any other PCI function, is served best by the NICs sharing the deepest PCIe switch.
 
+  Everything is read once at construction from sysfs_root, which tests point at a fake
+  tree laid out like /sys (class/infiniband, bus/pci/devices, devices/system/node).
 */
-}
+class Topology {
+public:
+    typedef struct nic_info {
+        std::string name;
+        std::string pci_address;
+        int         numa_node{-1};
+
+        std::vector<int> local_cpus;
+
+        /* PCI bus ids from the root complex down to the NIC, e.g. {"pci0000:3a", "0000:3a:00.0", "0000:3b:00.0"} */
+        std::vector<std::string> pcie_path;
+    } nic_info_t;
+
+    typedef struct numa_node_info {
+        int              id{-1};
+        std::vector<int> cpus;
+
+        /* SLIT distance to every node, in the order of numa_nodes(): node ids may have gaps */
+        std::vector<int> distance;
+    } numa_node_info_t;
+
+    explicit Topology(const std::string& sysfs_root = "/sys");
+
+    const std::vector<nic_info_t>& nics() const
+    {
+        return nics_;
+    }
+
+    const std::vector<numa_node_info_t>& numa_nodes() const
+    {
+        return numa_nodes_;
+    }
+
+    /*
+      NICs for memory on numa_node, the closest NUMA distance tier only. All NICs when the
+      node is unknown (-1) or the host does not report NUMA information.
+    */
+    std::vector<std::string> nics_for_numa_node(int numa_node) const;
+
+    /* Same, for the NUMA node backing the page at addr */
+    std::vector<std::string> nics_for_address(uintptr_t addr) const;
+
+    /* NICs sharing the deepest PCIe switch with the given PCI function, e.g. a GPU */
+    std::vector<std::string> nics_for_pci_device(const std::string& pci_address) const;
+
+    /* NUMA node of the page at addr, -1 if it is not faulted in or NUMA is not available */
+    static int numa_node_of_address(uintptr_t addr);
+
+    json to_json() const;
+
+private:
+    std::string sysfs_root_;
+
+    std::vector<nic_info_t>       nics_;
+    std::vector<numa_node_info_t> numa_nodes_;
+
+    void discover_numa_nodes();
+    void discover_nics();
+
+    int numa_distance(int from, int to) const;
+
+    /* PCI bus ids from the root complex to the device behind a sysfs link */
+    std::vector<std::string> resolve_pcie_path(const std::string& device_link) const;
+};
+
+}  // namespace slime
@@ -0,0 +1,195 @@
+#include "engine/rdma/verbs_provider.h"
+
+#include "utils/ibv_helper.h"
+#include "utils/logging.h"
+
+#include <atomic>
+#include <cerrno>
+#include <string>
+#include <vector>
+
+#include <infiniband/verbs.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+namespace slime {
+
+std::vector<std::string> VerbsProvider::device_names()
+{
+    int                 num_devices;
+    struct ibv_device** dev_list = get_device_list(&num_devices);
+    if (!dev_list) {
+        SLIME_LOG_DEBUG("No RDMA devices");
+        return {};
+    }
+
+    std::vector<std::string> names;
+    for (int i = 0; i < num_devices; ++i)
+        names.push_back(dev_list[i]->name);
+    free_device_list(dev_list);
+    return names;
+}
+
+struct ibv_device** IBVerbsProvider::get_device_list(int* num_devices)
+{
+    return ibv_get_device_list(num_devices);
+}
+
+void IBVerbsProvider::free_device_list(struct ibv_device** list)
+{
+    ibv_free_device_list(list);
+}
+
+struct ibv_context* IBVerbsProvider::open_device(struct ibv_device* device)
+{
+    return ibv_open_device(device);
+}
+
+int IBVerbsProvider::query_device(struct ibv_context* context, struct ibv_device_attr* device_attr)
+{
+    return ibv_query_device(context, device_attr);
+}
+
+int IBVerbsProvider::query_port(struct ibv_context* context, uint8_t port_num, struct ibv_port_attr* port_attr)
+{
+    return ibv_query_port(context, port_num, port_attr);
+}
+
+int IBVerbsProvider::query_gid(struct ibv_context* context, uint8_t port_num, int index, union ibv_gid* gid)
+{
+    return ibv_query_gid(context, port_num, index, gid);
+}
+
+int IBVerbsProvider::find_sgid_index(struct ibv_context* context, uint8_t port_num)
+{
+    return ibv_find_sgid_type(context, port_num, ibv_gid_type_custom::IBV_GID_TYPE_ROCE_V2, AF_INET);
+}
+
+struct ibv_pd* IBVerbsProvider::alloc_pd(struct ibv_context* context)
+{
+    return ibv_alloc_pd(context);
+}
+
+int IBVerbsProvider::dealloc_pd(struct ibv_pd* pd)
+{
+    return ibv_dealloc_pd(pd);
+}
+
+struct ibv_mr* IBVerbsProvider::reg_mr(struct ibv_pd* pd, void* addr, size_t length, int access)
+{
+    return ibv_reg_mr(pd, addr, length, access);
+}
+
+int IBVerbsProvider::dereg_mr(struct ibv_mr* mr)
+{
+    return ibv_dereg_mr(mr);
+}
+
+struct ibv_comp_channel* IBVerbsProvider::create_comp_channel(struct ibv_context* context)
+{
+    return ibv_create_comp_channel(context);
+}
+
+int IBVerbsProvider::destroy_comp_channel(struct ibv_comp_channel* channel)
+{
+    return ibv_destroy_comp_channel(channel);
+}
+
+struct ibv_cq* IBVerbsProvider::create_cq(
+    struct ibv_context* context, int cqe, void* cq_context, struct ibv_comp_channel* channel, int comp_vector)
+{
+    return ibv_create_cq(context, cqe, cq_context, channel, comp_vector);
+}
+
+int IBVerbsProvider::destroy_cq(struct ibv_cq* cq)
+{
+    return ibv_destroy_cq(cq);
+}
+
+int IBVerbsProvider::get_cq_event(struct ibv_comp_channel* channel, struct ibv_cq** cq, void** cq_context)
+{
+    return ibv_get_cq_event(channel, cq, cq_context);
+}
+
+void IBVerbsProvider::ack_cq_events(struct ibv_cq* cq, unsigned int nevents)
+{
+    ibv_ack_cq_events(cq, nevents);
+}
+
+int IBVerbsProvider::wait_cq_event(struct ibv_comp_channel* channel, int timeout_ms)
+{
+    struct pollfd pfd;
+    pfd.fd      = channel->fd;
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+    int ret     = poll(&pfd, 1, timeout_ms);
+    // A signal is a spurious wakeup, the caller waits again
+    if (ret < 0 && errno == EINTR)
+        return 0;
+    return ret;
+}
+
+struct ibv_qp* IBVerbsProvider::create_qp(struct ibv_pd* pd, struct ibv_qp_init_attr* qp_init_attr)
+{
+    return ibv_create_qp(pd, qp_init_attr);
+}
+
+int IBVerbsProvider::modify_qp(struct ibv_qp* qp, struct ibv_qp_attr* attr, int attr_mask)
+{
+    return ibv_modify_qp(qp, attr, attr_mask);
+}
+
+int IBVerbsProvider::destroy_qp(struct ibv_qp* qp)
+{
+    return ibv_destroy_qp(qp);
+}
+
+struct ibv_srq* IBVerbsProvider::create_srq(struct ibv_pd* pd, struct ibv_srq_init_attr* srq_init_attr)
+{
+    return ibv_create_srq(pd, srq_init_attr);
+}
+
+int IBVerbsProvider::destroy_srq(struct ibv_srq* srq)
+{
+    return ibv_destroy_srq(srq);
+}
+
+VerbsProvider* ibverbs_provider()
+{
+    static IBVerbsProvider provider;
+    return &provider;
+}
+
+namespace {
+std::atomic<VerbsProvider*> default_provider_{nullptr};
+}
+
+VerbsProvider* default_verbs_provider()
+{
+    VerbsProvider* provider = default_provider_.load(std::memory_order_acquire);
+    if (provider)
+        return provider;
+
+    std::string name = get_env_variable("SLIME_VERBS_PROVIDER");
+    if (name == "mock") {
+        provider = mock_verbs_provider();
+    }
+    else {
+        if (!name.empty() && name != "ibverbs")
+            SLIME_LOG_WARN("Unknown SLIME_VERBS_PROVIDER ", name, ", fall back to ibverbs");
+        provider = ibverbs_provider();
+    }
+
+    VerbsProvider* expected = nullptr;
+    if (!default_provider_.compare_exchange_strong(expected, provider))
+        provider = expected;
+    SLIME_LOG_INFO("Verbs provider: ", provider->name());
+    return provider;
+}
+
+void set_default_verbs_provider(VerbsProvider* provider)
+{
+    default_provider_.store(provider, std::memory_order_release);
+}
+
+}  // namespace slime
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <infiniband/verbs.h>
+
+namespace slime {
+
+/*
+  Verbs provider: every libibverbs call that RDMAContext and RDMAMemoryPool make
+  on the control path goes through this interface, so the engine can run on top
+  of either the real libibverbs or an in-process software implementation.
+
+  The data path (ibv_post_send, ibv_post_recv, ibv_post_srq_recv, ibv_poll_cq,
+  ibv_req_notify_cq) is not wrapped: those are inline dispatches through
+  ibv_context::ops, which every provider fills in for the objects it creates.
+*/
+class VerbsProvider {
+public:
+    virtual ~VerbsProvider() = default;
+
+    virtual const char* name() const = 0;
+
+    /* Device */
+    virtual struct ibv_device** get_device_list(int* num_devices)              = 0;
+    virtual void                free_device_list(struct ibv_device** list)     = 0;
+    virtual struct ibv_context* open_device(struct ibv_device* device)         = 0;
+
+    virtual int query_device(struct ibv_context* context, struct ibv_device_attr* device_attr)             = 0;
+    virtual int query_port(struct ibv_context* context, uint8_t port_num, struct ibv_port_attr* port_attr) = 0;
+    virtual int query_gid(struct ibv_context* context, uint8_t port_num, int index, union ibv_gid* gid)    = 0;
+
+    /* Index of the RoCE v2 / IPv4 GID on the given port, -1 if none */
+    virtual int find_sgid_index(struct ibv_context* context, uint8_t port_num) = 0;
+
+    /* Protection Domain and Memory Region */
+    virtual struct ibv_pd* alloc_pd(struct ibv_context* context)                             = 0;
+    virtual int            dealloc_pd(struct ibv_pd* pd)                                     = 0;
+    virtual struct ibv_mr* reg_mr(struct ibv_pd* pd, void* addr, size_t length, int access) = 0;
+    virtual int            dereg_mr(struct ibv_mr* mr)                                       = 0;
+
+    /* Completion Queue */
+    virtual struct ibv_comp_channel* create_comp_channel(struct ibv_context* context) = 0;
+    virtual int                      destroy_comp_channel(struct ibv_comp_channel* channel) = 0;
+    virtual struct ibv_cq*           create_cq(struct ibv_context*      context,
+                                               int                      cqe,
+                                               void*                    cq_context,
+                                               struct ibv_comp_channel* channel,
+                                               int                      comp_vector)   = 0;
+    virtual int                      destroy_cq(struct ibv_cq* cq)                     = 0;
+    virtual int  get_cq_event(struct ibv_comp_channel* channel, struct ibv_cq** cq, void** cq_context) = 0;
+    virtual void ack_cq_events(struct ibv_cq* cq, unsigned int nevents)                             = 0;
+    /* Wait up to timeout_ms (-1 forever) for an event: 1 when get_cq_event won't block, 0 on timeout */
+    virtual int wait_cq_event(struct ibv_comp_channel* channel, int timeout_ms) = 0;
+
+    /* Queue Pair */
+    virtual struct ibv_qp* create_qp(struct ibv_pd* pd, struct ibv_qp_init_attr* qp_init_attr)    = 0;
+    virtual int            modify_qp(struct ibv_qp* qp, struct ibv_qp_attr* attr, int attr_mask) = 0;
+    virtual int            destroy_qp(struct ibv_qp* qp)                                         = 0;
+
+    /* Shared Receive Queue */
+    virtual struct ibv_srq* create_srq(struct ibv_pd* pd, struct ibv_srq_init_attr* srq_init_attr) = 0;
+    virtual int             destroy_srq(struct ibv_srq* srq)                                       = 0;
+
+    /* Names of all devices visible to this provider */
+    std::vector<std::string> device_names();
+};
+
+/* Thin pass-through to libibverbs */
+class IBVerbsProvider: public VerbsProvider {
+public:
+    const char* name() const override
+    {
+        return "ibverbs";
+    }
+
+    struct ibv_device** get_device_list(int* num_devices) override;
+    void                free_device_list(struct ibv_device** list) override;
+    struct ibv_context* open_device(struct ibv_device* device) override;
+
+    int query_device(struct ibv_context* context, struct ibv_device_attr* device_attr) override;
+    int query_port(struct ibv_context* context, uint8_t port_num, struct ibv_port_attr* port_attr) override;
+    int query_gid(struct ibv_context* context, uint8_t port_num, int index, union ibv_gid* gid) override;
+    int find_sgid_index(struct ibv_context* context, uint8_t port_num) override;
+
+    struct ibv_pd* alloc_pd(struct ibv_context* context) override;
+    int            dealloc_pd(struct ibv_pd* pd) override;
+    struct ibv_mr* reg_mr(struct ibv_pd* pd, void* addr, size_t length, int access) override;
+    int            dereg_mr(struct ibv_mr* mr) override;
+
+    struct ibv_comp_channel* create_comp_channel(struct ibv_context* context) override;
+    int                      destroy_comp_channel(struct ibv_comp_channel* channel) override;
+    struct ibv_cq*           create_cq(struct ibv_context*      context,
+                                       int                      cqe,
+                                       void*                    cq_context,
+                                       struct ibv_comp_channel* channel,
+                                       int                      comp_vector) override;
+    int                      destroy_cq(struct ibv_cq* cq) override;
+    int  get_cq_event(struct ibv_comp_channel* channel, struct ibv_cq** cq, void** cq_context) override;
+    void ack_cq_events(struct ibv_cq* cq, unsigned int nevents) override;
+    int  wait_cq_event(struct ibv_comp_channel* channel, int timeout_ms) override;
+
+    struct ibv_qp* create_qp(struct ibv_pd* pd, struct ibv_qp_init_attr* qp_init_attr) override;
+    int            modify_qp(struct ibv_qp* qp, struct ibv_qp_attr* attr, int attr_mask) override;
+    int            destroy_qp(struct ibv_qp* qp) override;
+
+    struct ibv_srq* create_srq(struct ibv_pd* pd, struct ibv_srq_init_attr* srq_init_attr) override;
+    int             destroy_srq(struct ibv_srq* srq) override;
+};
+
+VerbsProvider* ibverbs_provider();
+VerbsProvider* mock_verbs_provider();
+
+/*
+  Provider used by RDMAContext when none is given explicitly. Selected on first use
+  by SLIME_VERBS_PROVIDER ("ibverbs" or "mock"), libibverbs by default.
+*/
+VerbsProvider* default_verbs_provider();
+void           set_default_verbs_provider(VerbsProvider* provider);
+
+}  // namespace slime
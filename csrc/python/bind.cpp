@@ -1,8 +1,11 @@
 #include "engine/assignment.h"
+#include "engine/rdma/buffer_allocator.h"
+#include "engine/rdma/endpoint_info.h"
 #include "engine/rdma/rdma_assignment.h"
 #include "engine/rdma/rdma_config.h"
 #include "engine/rdma/rdma_context.h"
 #include "engine/rdma/rdma_scheduler.h"
+#include "engine/rdma/topology.h"
 #include <functional>
 #include <pybind11/cast.h>
 #include <pybind11/pytypes.h>
@@ -20,6 +23,7 @@
 
 #include <cstdint>
 #include <memory>
+#include <pybind11/chrono.h>
 #include <pybind11/functional.h>
 #include <pybind11/pybind11.h>
 #include <pybind11/stl.h>
@@ -28,40 +32,300 @@ using json = nlohmann::json;
 
 namespace py = pybind11;
 
+namespace {
+
+/* Reads the bytes in place, the view is valid as long as info is */
+slime::EndpointInfoView endpoint_info_view(const py::bytes& info)
+{
+    char*      data;
+    Py_ssize_t size;
+    if (PyBytes_AsStringAndSize(info.ptr(), &data, &size))
+        throw py::error_already_set();
+    return slime::EndpointInfoView(data, size);
+}
+
+}  // namespace
+
 PYBIND11_MODULE(_slime_c, m)
 {
     py::enum_<slime::OpCode>(m, "OpCode")
         .value("READ", slime::OpCode::READ)
         .value("SEND", slime::OpCode::SEND)
-        .value("RECV", slime::OpCode::RECV);
+        .value("RECV", slime::OpCode::RECV)
+        .value("WRITE", slime::OpCode::WRITE)
+        .value("WRITE_WITH_IMM", slime::OpCode::WRITE_WITH_IMM);
+
+    py::enum_<slime::CompletionMode>(m, "CompletionMode")
+        .value("EVENT", slime::CompletionMode::EVENT)
+        .value("BUSY_POLL", slime::CompletionMode::BUSY_POLL)
+        .value("HYBRID", slime::CompletionMode::HYBRID);
 
-    py::class_<slime::Assignment>(m, "Assignment").def(py::init<std::string, uint64_t, uint64_t, uint64_t>());
+    py::enum_<slime::SelectionPolicy>(m, "SelectionPolicy")
+        .value("ROUND_ROBIN", slime::SelectionPolicy::ROUND_ROBIN)
+        .value("LEAST_OUTSTANDING", slime::SelectionPolicy::LEAST_OUTSTANDING)
+        .value("POWER_OF_TWO", slime::SelectionPolicy::POWER_OF_TWO)
+        .value("STICKY", slime::SelectionPolicy::STICKY);
+
+    py::class_<slime::Assignment>(m, "Assignment")
+        .def(py::init<std::string, uint64_t, uint64_t, uint64_t>())
+        .def(py::init<slime::mr_handle_t, uint64_t, uint64_t, uint64_t>());
 
     py::class_<slime::RDMAAssignment, slime::RDMAAssignmentSharedPtr>(m, "RDMAAssignment")
-        .def("wait", &slime::RDMAAssignment::wait, py::call_guard<py::gil_scoped_release>());
+        .def("wait", &slime::RDMAAssignment::wait, py::call_guard<py::gil_scoped_release>())
+        .def("wait_for", &slime::RDMAAssignment::wait_for, py::call_guard<py::gil_scoped_release>())
+        .def("query", &slime::RDMAAssignment::query)
+        .def("status", &slime::RDMAAssignment::status)
+        .def("cancel", &slime::RDMAAssignment::cancel)
+        .def("imm_data", &slime::RDMAAssignment::imm_data);
 
     py::class_<slime::RDMASchedulerAssignment, slime::RDMASchedulerAssignmentSharedPtr>(m, "RDMASchedulerAssignment")
-        .def("wait", &slime::RDMASchedulerAssignment::wait, py::call_guard<py::gil_scoped_release>());
+        .def("query", &slime::RDMASchedulerAssignment::query)
+        .def("wait", &slime::RDMASchedulerAssignment::wait, py::call_guard<py::gil_scoped_release>())
+        .def("wait_for", &slime::RDMASchedulerAssignment::wait_for, py::call_guard<py::gil_scoped_release>())
+        .def("cancel", &slime::RDMASchedulerAssignment::cancel);
+
+    py::class_<slime::RDMAContextConfig>(m, "RDMAContextConfig")
+        .def(py::init<>())
+        .def_readwrite("qp_num", &slime::RDMAContextConfig::qp_num)
+        .def_readwrite("max_send_wr", &slime::RDMAContextConfig::max_send_wr)
+        .def_readwrite("max_recv_wr", &slime::RDMAContextConfig::max_recv_wr)
+        .def_readwrite("cq_num", &slime::RDMAContextConfig::cq_num)
+        .def_readwrite("cq_size", &slime::RDMAContextConfig::cq_size)
+        .def_readwrite("qp_to_cq", &slime::RDMAContextConfig::qp_to_cq)
+        .def_readwrite("callback_threads", &slime::RDMAContextConfig::callback_threads)
+        .def_readwrite("poll_count", &slime::RDMAContextConfig::poll_count)
+        .def_readwrite("max_sge", &slime::RDMAContextConfig::max_sge)
+        .def_readwrite("assign_queue_depth", &slime::RDMAContextConfig::assign_queue_depth)
+        .def_readwrite("mr_cache_bytes", &slime::RDMAContextConfig::mr_cache_bytes)
+        .def_readwrite("srq_depth", &slime::RDMAContextConfig::srq_depth)
+        .def_readwrite("srq_recv_bytes", &slime::RDMAContextConfig::srq_recv_bytes)
+        .def_readwrite("max_inline_data", &slime::RDMAContextConfig::max_inline_data)
+        .def_readwrite("max_retries", &slime::RDMAContextConfig::max_retries)
+        .def_readwrite("max_peers", &slime::RDMAContextConfig::max_peers)
+        .def("to_json", &slime::RDMAContextConfig::to_json);
 
     py::class_<slime::RDMAScheduler>(m, "RDMAScheduler")
-        .def(py::init<const std::vector<std::string>&>())
-        .def("register_memory_region", &slime::RDMAScheduler::register_memory_region)
-        .def("connect", &slime::RDMAScheduler::connect)
-        .def("submit_assignment", &slime::RDMAScheduler::submitAssignment)
-        .def("scheduler_info", &slime::RDMAScheduler::scheduler_info);
+        .def(py::init<const std::vector<std::string>&, const slime::RDMAContextConfig&>(),
+             py::arg("rdma_devices") = std::vector<std::string>{},
+             py::arg("config")       = slime::RDMAContextConfig())
+        .def("register_memory_region",
+             &slime::RDMAScheduler::register_memory_region,
+             py::call_guard<py::gil_scoped_release>())
+        .def("unregister_memory_region", &slime::RDMAScheduler::unregister_memory_region)
+        .def("apply_mr_invalidation", &slime::RDMAScheduler::apply_mr_invalidation)
+        .def("set_parallel_registration", &slime::RDMAScheduler::set_parallel_registration)
+        .def("set_registration_chunk_bytes", &slime::RDMAScheduler::set_registration_chunk_bytes)
+        .def("registration_stats", &slime::RDMAScheduler::registration_stats)
+        .def("connect", py::overload_cast<const json&>(&slime::RDMAScheduler::connect))
+        .def("connect_binary",
+             [](slime::RDMAScheduler& scheduler, const std::vector<py::bytes>& remote_info) {
+                 std::vector<slime::EndpointInfoView> views;
+                 for (const py::bytes& info : remote_info)
+                     views.push_back(endpoint_info_view(info));
+                 return scheduler.connect(views);
+             })
+        .def("submit_assignment",
+             &slime::RDMAScheduler::submitAssignment,
+             py::arg("opcode"),
+             py::arg("assignment"),
+             py::arg("timeout") = slime::kNoTimeout)
+        .def("set_selection_policy", &slime::RDMAScheduler::set_selection_policy)
+        .def("set_split_assignment_bytes", &slime::RDMAScheduler::set_split_assignment_bytes)
+        .def("set_max_coalesce_bytes", &slime::RDMAScheduler::set_max_coalesce_bytes)
+        .def("set_sge_packing", &slime::RDMAScheduler::set_sge_packing)
+        .def("set_topology_aware",
+             &slime::RDMAScheduler::set_topology_aware,
+             py::arg("topology_aware"),
+             py::arg("sysfs_root") = "/sys")
+        .def("scheduler_info", &slime::RDMAScheduler::scheduler_info)
+        .def("scheduler_info_binary", [](slime::RDMAScheduler& scheduler) {
+            py::list info;
+            for (const std::string& endpoint_info : scheduler.scheduler_info_binary())
+                info.append(py::bytes(endpoint_info));
+            return info;
+        });
 
     py::class_<slime::RDMAContext>(m, "rdma_context")
         .def(py::init<>())
-        .def("init_rdma_context", &slime::RDMAContext::init)
+        .def("init_rdma_context",
+             &slime::RDMAContext::init,
+             py::arg("dev_name"),
+             py::arg("ib_port"),
+             py::arg("link_type"),
+             py::arg("config") = slime::RDMAContextConfig())
+        .def("config", &slime::RDMAContext::config)
+        .def("numa_node", &slime::RDMAContext::numa_node)
+        .def("set_worker_cpus", &slime::RDMAContext::set_worker_cpus)
+        .def("worker_cpus", &slime::RDMAContext::worker_cpus)
         .def("register_memory_region", &slime::RDMAContext::register_memory_region)
         .def("register_remote_memory_region", &slime::RDMAContext::register_remote_memory_region)
-        .def("endpoint_info", &slime::RDMAContext::endpoint_info)
-        .def("connect", &slime::RDMAContext::connect)
+        .def("unregister_memory_region", &slime::RDMAContext::unregister_memory_region)
+        .def("unregister_remote_memory_region",
+             py::overload_cast<const std::string&>(&slime::RDMAContext::unregister_remote_memory_region))
+        .def_static("mr_invalidation", &slime::RDMAContext::mr_invalidation)
+        .def("apply_mr_invalidation", py::overload_cast<const json&>(&slime::RDMAContext::apply_mr_invalidation))
+        .def("get_mr_handle", &slime::RDMAContext::get_mr_handle)
+        .def("registration_cache_stats", &slime::RDMAContext::registration_cache_stats)
+        .def("invalidate_registration_cache", &slime::RDMAContext::invalidate_registration_cache)
+        .def("set_max_coalesce_bytes", &slime::RDMAContext::set_max_coalesce_bytes)
+        .def("set_sge_packing", &slime::RDMAContext::set_sge_packing)
+        .def("set_completion_mode",
+             &slime::RDMAContext::set_completion_mode,
+             py::arg("mode"),
+             py::arg("poll_spin_us") = 50)
+        .def("completion_stats", &slime::RDMAContext::completion_stats)
+        .def("flow_control_stats", &slime::RDMAContext::flow_control_stats)
+        .def("recovery_stats", &slime::RDMAContext::recovery_stats)
+        .def("qp_recovery_notice", py::overload_cast<>(&slime::RDMAContext::qp_recovery_notice))
+        .def("apply_qp_recovery", py::overload_cast<const json&>(&slime::RDMAContext::apply_qp_recovery))
+        .def("set_selection_policy", &slime::RDMAContext::set_selection_policy)
+        .def("selection_policy", &slime::RDMAContext::selection_policy)
+        .def("selection_stats", &slime::RDMAContext::selection_stats)
+        .def("srq_stats", &slime::RDMAContext::srq_stats)
+        .def("endpoint_info", py::overload_cast<>(&slime::RDMAContext::endpoint_info, py::const_))
+        .def("endpoint_info_binary",
+             [](const slime::RDMAContext& ctx) { return py::bytes(ctx.endpoint_info_binary()); })
+        .def("mr_info_binary", [](const slime::RDMAContext& ctx) { return py::bytes(ctx.mr_info_binary()); })
+        .def("register_remote_memory_regions",
+             [](slime::RDMAContext& ctx, const py::bytes& mr_info) {
+                 return ctx.register_remote_memory_regions(endpoint_info_view(mr_info));
+             })
+        .def("connect", py::overload_cast<const json&>(&slime::RDMAContext::connect))
+        .def("connect_binary",
+             [](slime::RDMAContext& ctx, const py::bytes& endpoint_info) {
+                 return ctx.connect(endpoint_info_view(endpoint_info));
+             })
+        .def("add_peer", &slime::RDMAContext::add_peer, py::keep_alive<0, 1>())
+        .def("peer_num", &slime::RDMAContext::peer_num)
         .def("launch_future", &slime::RDMAContext::launch_future)
         .def("stop_future", &slime::RDMAContext::stop_future)
-        .def("submit", &slime::RDMAContext::submit, py::call_guard<py::gil_scoped_release>());
+        .def("submit",
+             py::overload_cast<slime::OpCode,
+                               slime::AssignmentBatch&,
+                               slime::callback_fn_t,
+                               uint32_t,
+                               std::chrono::milliseconds>(&slime::RDMAContext::submit),
+             py::arg("opcode"),
+             py::arg("assignment"),
+             py::arg("callback") = nullptr,
+             py::arg("imm_data") = 0,
+             py::arg("timeout")  = slime::kNoTimeout,
+             py::call_guard<py::gil_scoped_release>())
+        .def("max_inline_data", &slime::RDMAContext::max_inline_data)
+        .def(
+            "submit_inline",
+            [](slime::RDMAContext&  ctx,
+               slime::OpCode        opcode,
+               const py::bytes&     data,
+               const std::string&   mr_key,
+               uint64_t             target_offset,
+               slime::callback_fn_t callback,
+               uint32_t             imm_data) {
+                char*      payload;
+                Py_ssize_t length;
+                if (PyBytes_AsStringAndSize(data.ptr(), &payload, &length))
+                    throw py::error_already_set();
+                // Copied by submit_inline, the bytes are not needed afterwards
+                return ctx.submit_inline(opcode, payload, length, mr_key, target_offset, callback, imm_data);
+            },
+            py::arg("opcode"),
+            py::arg("data"),
+            py::arg("mr_key")        = "",
+            py::arg("target_offset") = 0,
+            py::arg("callback")      = nullptr,
+            py::arg("imm_data")      = 0);
+
+    py::class_<slime::RDMAPeer, std::shared_ptr<slime::RDMAPeer>>(m, "rdma_peer")
+        .def("peer", &slime::RDMAPeer::peer)
+        .def("register_remote_memory_region", &slime::RDMAPeer::register_remote_memory_region)
+        .def("register_remote_memory_regions",
+             [](slime::RDMAPeer& peer, const py::bytes& mr_info) {
+                 return peer.register_remote_memory_regions(endpoint_info_view(mr_info));
+             })
+        .def("unregister_remote_memory_region", &slime::RDMAPeer::unregister_remote_memory_region)
+        .def("apply_mr_invalidation", &slime::RDMAPeer::apply_mr_invalidation)
+        .def("qp_recovery_notice", &slime::RDMAPeer::qp_recovery_notice)
+        .def("apply_qp_recovery", &slime::RDMAPeer::apply_qp_recovery)
+        .def("endpoint_info", &slime::RDMAPeer::endpoint_info)
+        .def("endpoint_info_binary", [](const slime::RDMAPeer& peer) { return py::bytes(peer.endpoint_info_binary()); })
+        .def("remote_rdma_info", &slime::RDMAPeer::remote_rdma_info)
+        .def("connect", py::overload_cast<const json&>(&slime::RDMAPeer::connect))
+        .def("connect_binary",
+             [](slime::RDMAPeer& peer, const py::bytes& endpoint_info) {
+                 return peer.connect(endpoint_info_view(endpoint_info));
+             })
+        .def("submit",
+             &slime::RDMAPeer::submit,
+             py::arg("opcode"),
+             py::arg("assignment"),
+             py::arg("callback") = nullptr,
+             py::arg("imm_data") = 0,
+             py::arg("timeout")  = slime::kNoTimeout,
+             py::call_guard<py::gil_scoped_release>())
+        .def(
+            "submit_inline",
+            [](slime::RDMAPeer&     peer,
+               slime::OpCode        opcode,
+               const py::bytes&     data,
+               const std::string&   mr_key,
+               uint64_t             target_offset,
+               slime::callback_fn_t callback,
+               uint32_t             imm_data) {
+                char*      payload;
+                Py_ssize_t length;
+                if (PyBytes_AsStringAndSize(data.ptr(), &payload, &length))
+                    throw py::error_already_set();
+                return peer.submit_inline(opcode, payload, length, mr_key, target_offset, callback, imm_data);
+            },
+            py::arg("opcode"),
+            py::arg("data"),
+            py::arg("mr_key")        = "",
+            py::arg("target_offset") = 0,
+            py::arg("callback")      = nullptr,
+            py::arg("imm_data")      = 0);
+
+    py::enum_<slime::HugePageSize>(m, "HugePageSize")
+        .value("NONE", slime::HugePageSize::NONE)
+        .value("HUGE_2MB", slime::HugePageSize::HUGE_2MB)
+        .value("HUGE_1GB", slime::HugePageSize::HUGE_1GB)
+        .export_values();
+
+    py::class_<slime::RDMABufferAllocatorConfig>(m, "RDMABufferAllocatorConfig")
+        .def(py::init<>())
+        .def_readwrite("mr_key", &slime::RDMABufferAllocatorConfig::mr_key)
+        .def_readwrite("arena_bytes", &slime::RDMABufferAllocatorConfig::arena_bytes)
+        .def_readwrite("page_size", &slime::RDMABufferAllocatorConfig::page_size)
+        .def_readwrite("numa_node", &slime::RDMABufferAllocatorConfig::numa_node)
+        .def_readwrite("min_block_bytes", &slime::RDMABufferAllocatorConfig::min_block_bytes);
+
+    py::class_<slime::registered_buffer_t>(m, "RegisteredBuffer")
+        .def_readonly("mr_handle", &slime::registered_buffer_t::mr_handle)
+        .def_readonly("offset", &slime::registered_buffer_t::offset)
+        .def_readonly("length", &slime::registered_buffer_t::length)
+        .def_property_readonly("ptr", [](const slime::registered_buffer_t& buffer) { return (uintptr_t)buffer.ptr; });
+
+    py::class_<slime::RDMABufferAllocator>(m, "RDMABufferAllocator")
+        .def(py::init<slime::RDMAContext&, const slime::RDMABufferAllocatorConfig&>(),
+             py::arg("rdma_context"),
+             py::arg("config") = slime::RDMABufferAllocatorConfig(),
+             py::keep_alive<1, 2>())
+        .def("allocate", &slime::RDMABufferAllocator::allocate)
+        .def("free", &slime::RDMABufferAllocator::free)
+        .def("mr_handle", &slime::RDMABufferAllocator::mr_handle)
+        .def("page_size", &slime::RDMABufferAllocator::page_size)
+        .def("stats", &slime::RDMABufferAllocator::stats);
+
+    py::class_<slime::Topology>(m, "Topology")
+        .def(py::init<const std::string&>(), py::arg("sysfs_root") = "/sys")
+        .def("nics_for_numa_node", &slime::Topology::nics_for_numa_node)
+        .def("nics_for_address", &slime::Topology::nics_for_address)
+        .def("nics_for_pci_device", &slime::Topology::nics_for_pci_device)
+        .def_static("numa_node_of_address", &slime::Topology::numa_node_of_address)
+        .def("to_json", &slime::Topology::to_json);
 
     m.def("available_nic", &slime::available_nic);
+    m.def("endpoint_info_to_json",
+          [](const py::bytes& endpoint_info) { return endpoint_info_view(endpoint_info).to_json(); });
 
 #ifdef BUILD_NVLINK
     py::class_<slime::NVLinkContext>(m, "nvlink_context")
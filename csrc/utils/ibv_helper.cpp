@@ -1,4 +1,5 @@
 #include "ibv_helper.h"
+#include "utils.h"
 int ibv_read_sysfs_file(const char* dir, const char* file, char* buf, size_t size)
 {
     char* path;
@@ -22,7 +23,7 @@ int ibv_read_sysfs_file(const char* dir, const char* file, char* buf, size_t siz
     if (len > 0) {
         if (buf[len - 1] == '\n')
             buf[--len] = '\0';
-        else if (len < size)
+        else if ((size_t)len < size)
             buf[len] = '\0';
         else
             /* We would have to truncate the contents to NULL
@@ -128,3 +129,72 @@ int ibv_find_sgid_type(struct ibv_context* context, uint8_t port_num, ibv_gid_ty
 
     return idx;
 }
+
+double ibv_port_bandwidth_gbps(uint8_t active_speed, uint8_t active_width)
+{
+    double lane_gbps;
+    switch (active_speed) {
+        case 1:
+            lane_gbps = 2.5;  // SDR
+            break;
+        case 2:
+            lane_gbps = 5.0;  // DDR
+            break;
+        case 4:
+        case 8:
+            lane_gbps = 10.0;  // QDR, FDR10
+            break;
+        case 16:
+            lane_gbps = 14.0;  // FDR
+            break;
+        case 32:
+            lane_gbps = 25.0;  // EDR
+            break;
+        case 64:
+            lane_gbps = 50.0;  // HDR
+            break;
+        case 128:
+            lane_gbps = 100.0;  // NDR
+            break;
+        default:
+            return 0;
+    }
+
+    int lanes;
+    switch (active_width) {
+        case 1:
+            lanes = 1;
+            break;
+        case 2:
+            lanes = 4;
+            break;
+        case 4:
+            lanes = 8;
+            break;
+        case 8:
+            lanes = 12;
+            break;
+        case 16:
+            lanes = 2;
+            break;
+        default:
+            return 0;
+    }
+    return lane_gbps * lanes;
+}
+
+int ibv_device_numa_node(struct ibv_device* device)
+{
+    char buf[16];
+    if (ibv_read_sysfs_file(device->ibdev_path, "device/numa_node", buf, sizeof(buf)) <= 0)
+        return -1;
+    return atoi(buf);
+}
+
+std::vector<int> ibv_device_local_cpus(struct ibv_device* device)
+{
+    char buf[1024];
+    if (ibv_read_sysfs_file(device->ibdev_path, "device/local_cpulist", buf, sizeof(buf)) <= 0)
+        return {};
+    return slime::parse_cpu_list(buf);
+}
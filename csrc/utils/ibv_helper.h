@@ -44,6 +44,8 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <vector>
+
 typedef enum class ibv_gid_type_custom: uint8_t {
     IBV_GID_TYPE_IB,
     IBV_GID_TYPE_ROCE_V1,
@@ -57,3 +59,12 @@ int ibv_read_sysfs_file(const char* dir, const char* file, char* buf, size_t siz
  */
 int ibv_query_gid_type(struct ibv_context* context, uint8_t port_num, unsigned int index, ibv_gid_type_custom_t* type);
 int ibv_find_sgid_type(struct ibv_context* context, uint8_t port_num, ibv_gid_type_custom_t gid_type, int gid_family);
+
+/* Link rate in Gb/s from ibv_port_attr::active_speed and active_width, 0 if unknown */
+double ibv_port_bandwidth_gbps(uint8_t active_speed, uint8_t active_width);
+
+/* NUMA node of the PCI function behind the device, -1 if sysfs does not tell */
+int ibv_device_numa_node(struct ibv_device* device);
+
+/* CPUs local to the device (sysfs local_cpulist), empty if unknown */
+std::vector<int> ibv_device_local_cpus(struct ibv_device* device);
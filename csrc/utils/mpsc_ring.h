@@ -0,0 +1,195 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+namespace slime {
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SLIME_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define SLIME_CPU_RELAX() asm volatile("yield" ::: "memory")
+#else
+#define SLIME_CPU_RELAX() std::atomic_signal_fence(std::memory_order_seq_cst)
+#endif
+
+/*
+  Bounded lock-free multi-producer / single-consumer ring.
+
+  Each slot carries a sequence number (D. Vyukov's bounded queue): producers claim a
+  slot with one CAS on tail_, the consumer owns head_ and never contends with them.
+  Capacity is rounded up to a power of two.
+
+  The consumer waits adaptively: it spins for a while, then parks on a condition
+  variable. Producers only touch the mutex when the consumer is actually parked, so
+  a busy ring is served without any futex traffic.
+*/
+template<typename T>
+class MPSCRing {
+public:
+    explicit MPSCRing(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity)
+            size <<= 1;
+        mask_  = size - 1;
+        slots_ = std::unique_ptr<slot_t[]>(new slot_t[size]);
+        for (size_t i = 0; i < size; ++i)
+            slots_[i].seq_.store(i, std::memory_order_relaxed);
+    }
+
+    MPSCRing(const MPSCRing&)            = delete;
+    MPSCRing& operator=(const MPSCRing&) = delete;
+
+    size_t capacity() const
+    {
+        return mask_ + 1;
+    }
+
+    bool empty() const
+    {
+        size_t head = head_.load(std::memory_order_relaxed);
+        return slots_[head & mask_].seq_.load(std::memory_order_acquire) != head + 1;
+    }
+
+    /* Producer side, fails if the ring is full */
+    bool try_push(T&& item)
+    {
+        size_t pos = tail_.load(std::memory_order_relaxed);
+        while (true) {
+            slot_t&  slot = slots_[pos & mask_];
+            size_t   seq  = slot.seq_.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0) {
+                return false;
+            }
+            else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+        slot_t& slot = slots_[pos & mask_];
+        slot.item_   = std::move(item);
+        slot.seq_.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* Producer side, backs off while the ring is full and wakes a parked consumer */
+    void push(T item)
+    {
+        for (size_t spin = 0; !try_push(std::move(item)); ++spin) {
+            if (spin < kPushSpin)
+                SLIME_CPU_RELAX();
+            else
+                std::this_thread::yield();
+        }
+        notify();
+    }
+
+    /*
+      Producer side, try_push that also wakes a parked consumer. Never blocks: a full ring
+      already keeps its consumer from parking.
+    */
+    bool try_push_notify(T&& item)
+    {
+        if (!try_push(std::move(item)))
+            return false;
+        notify();
+        return true;
+    }
+
+    /* Consumer side */
+    bool try_pop(T& item)
+    {
+        size_t  head = head_.load(std::memory_order_relaxed);
+        slot_t& slot = slots_[head & mask_];
+        if (slot.seq_.load(std::memory_order_acquire) != head + 1)
+            return false;
+        item       = std::move(slot.item_);
+        slot.item_ = T();
+        slot.seq_.store(head + mask_ + 1, std::memory_order_release);
+        head_.store(head + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /*
+      Consumer side, spin then park until an item arrives.
+      Returns false once stop is raised (wake() must follow the store to stop).
+    */
+    bool pop_wait(T& item, const std::atomic<bool>& stop)
+    {
+        while (!stop.load(std::memory_order_acquire)) {
+            for (size_t spin = 0; spin < spin_budget_; ++spin) {
+                if (try_pop(item)) {
+                    spin_budget_ = std::min(spin_budget_ * 2, kMaxSpin);
+                    return true;
+                }
+                SLIME_CPU_RELAX();
+            }
+
+            spin_budget_ = std::max(spin_budget_ / 2, kMinSpin);
+
+            parked_.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (try_pop(item)) {
+                parked_.store(false, std::memory_order_relaxed);
+                return true;
+            }
+            {
+                std::unique_lock<std::mutex> lock(park_mutex_);
+                park_cv_.wait(lock, [&]() { return !empty() || stop.load(std::memory_order_acquire); });
+            }
+            parked_.store(false, std::memory_order_relaxed);
+        }
+        return false;
+    }
+
+    /* Wake a parked consumer unconditionally, used on shutdown */
+    void wake()
+    {
+        std::lock_guard<std::mutex> lock(park_mutex_);
+        park_cv_.notify_one();
+    }
+
+private:
+    static constexpr size_t kPushSpin = 64;
+    static constexpr size_t kMinSpin  = 64;
+    static constexpr size_t kMaxSpin  = 16384;
+
+    void notify()
+    {
+        // Pairs with the fence after parked_ is raised in pop_wait: either the consumer sees the
+        // new item on its last try_pop, or we see it parked here.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked_.load(std::memory_order_relaxed))
+            wake();
+    }
+
+    typedef struct alignas(64) slot {
+        std::atomic<size_t> seq_;
+        T                   item_;
+    } slot_t;
+
+    size_t                    mask_;
+    std::unique_ptr<slot_t[]> slots_;
+
+    alignas(64) std::atomic<size_t> tail_{0};
+    alignas(64) std::atomic<size_t> head_{0};
+    size_t spin_budget_{kMinSpin};
+
+    alignas(64) std::atomic<bool> parked_{false};
+    std::mutex              park_mutex_;
+    std::condition_variable park_cv_;
+};
+
+}  // namespace slime
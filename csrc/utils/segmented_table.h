@@ -0,0 +1,78 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+#include "utils/logging.h"
+
+namespace slime {
+
+/*
+  Append-only table whose entries never move.
+
+  Entries live in fixed-size chunks behind a directory allocated up front, so growing the
+  table never touches what readers may be looking at: an index handed over by the writer
+  (through a lock, a queue, or size()) can be read without any lock while appends go on.
+
+  One writer at a time, the caller serializes append. Entries are default constructed a
+  chunk at a time and stay until the table goes.
+*/
+template<typename T, size_t kChunkBits = 10, size_t kMaxChunks = 4096>
+class SegmentedTable {
+public:
+    static constexpr size_t kChunkSize = size_t(1) << kChunkBits;
+    static constexpr size_t kCapacity  = kChunkSize * kMaxChunks;
+
+    SegmentedTable()
+    {
+        for (std::atomic<T*>& chunk : chunks_)
+            chunk.store(nullptr, std::memory_order_relaxed);
+    }
+
+    ~SegmentedTable()
+    {
+        for (std::atomic<T*>& chunk : chunks_)
+            delete[] chunk.load(std::memory_order_relaxed);
+    }
+
+    SegmentedTable(const SegmentedTable&)            = delete;
+    SegmentedTable& operator=(const SegmentedTable&) = delete;
+
+    /* Entries below size() are all readable */
+    size_t size() const
+    {
+        return size_.load(std::memory_order_acquire);
+    }
+
+    /* Unchecked, index < size() */
+    T& operator[](size_t index)
+    {
+        return chunks_[index >> kChunkBits].load(std::memory_order_acquire)[index & (kChunkSize - 1)];
+    }
+    const T& operator[](size_t index) const
+    {
+        return chunks_[index >> kChunkBits].load(std::memory_order_acquire)[index & (kChunkSize - 1)];
+    }
+
+    /* Writer side: one more default entry, published once the caller is done with it */
+    size_t append()
+    {
+        size_t index = size_.load(std::memory_order_relaxed);
+        SLIME_ASSERT(index < kCapacity, "segmented table full at " << kCapacity << " entries");
+        std::atomic<T*>& chunk = chunks_[index >> kChunkBits];
+        if (!chunk.load(std::memory_order_relaxed))
+            chunk.store(new T[kChunkSize](), std::memory_order_release);
+        return index;
+    }
+    void publish(size_t index)
+    {
+        size_.store(index + 1, std::memory_order_release);
+    }
+
+private:
+    std::atomic<T*>     chunks_[kMaxChunks];
+    std::atomic<size_t> size_{0};
+};
+
+}  // namespace slime
@@ -3,6 +3,15 @@
 #include "utils/logging.h"
 #include "utils/utils.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <sstream>
+#include <thread>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
 namespace slime {
 std::vector<std::string> available_nic()
 {
@@ -21,4 +30,55 @@ std::vector<std::string> available_nic()
     }
     return available_devices;
 }
+
+std::vector<int> parse_cpu_list(const std::string& cpu_list)
+{
+    std::vector<int>   cpus;
+    std::string        range;
+    std::istringstream ranges(cpu_list);
+    while (std::getline(ranges, range, ',')) {
+        int first, last;
+        int n = sscanf(range.c_str(), "%d-%d", &first, &last);
+        if (n < 1)
+            continue;
+        if (n == 1)
+            last = first;
+        for (int cpu = first; cpu <= last; ++cpu)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+bool populate_memory(uintptr_t addr, size_t length, size_t chunk_bytes, int max_threads)
+{
+#ifdef MADV_POPULATE_WRITE
+    uintptr_t page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t begin     = addr & ~(page_size - 1);
+    uintptr_t end       = (addr + length + page_size - 1) & ~(page_size - 1);
+    chunk_bytes         = std::max<size_t>((chunk_bytes + page_size - 1) & ~(page_size - 1), page_size);
+
+    size_t chunks  = (end - begin + chunk_bytes - 1) / chunk_bytes;
+    int    threads = std::max<int>(std::min<size_t>(max_threads, chunks), 1);
+
+    std::atomic<size_t>      next_chunk{0};
+    std::atomic<bool>        populated{true};
+    std::vector<std::thread> workers;
+    auto                     populate = [&]() {
+        for (size_t chunk = next_chunk++; chunk < chunks && populated; chunk = next_chunk++) {
+            uintptr_t chunk_begin = begin + chunk * chunk_bytes;
+            size_t    chunk_len   = std::min<uintptr_t>(chunk_bytes, end - chunk_begin);
+            if (madvise((void*)chunk_begin, chunk_len, MADV_POPULATE_WRITE) != 0)
+                populated = false;
+        }
+    };
+    for (int i = 1; i < threads; ++i)
+        workers.emplace_back(populate);
+    populate();
+    for (std::thread& worker : workers)
+        worker.join();
+    return populated;
+#else
+    return false;
+#endif
+}
 }  // namespace slime
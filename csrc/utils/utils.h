@@ -1,8 +1,20 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
 
 namespace slime {
 std::vector<std::string> available_nic();
+
+/* Expand a kernel CPU / node list such as "0-15,32-47" */
+std::vector<int> parse_cpu_list(const std::string& cpu_list);
+
+/*
+  Fault in and write-map [addr, addr + length) with MADV_POPULATE_WRITE, chunk_bytes at a time
+  on up to max_threads threads. Returns false where the kernel or the mapping (e.g. device
+  memory) does not support it, which leaves the range untouched.
+*/
+bool populate_memory(uintptr_t addr, size_t length, size_t chunk_bytes, int max_threads);
 }
@@ -1,5 +1,5 @@
 import asyncio
-from typing import Any, Callable, Dict, List
+from typing import Any, Callable, Dict, List, Optional, Union
 
 from dlslime import _slime_c
 from dlslime.assignment import Assignment
@@ -7,6 +7,15 @@ from dlslime.assignment import Assignment
 from .base_endpoint import BaseEndpoint
 
 
+def _timeout_kwargs(timeout: Optional[float]) -> Dict[str, float]:
+    """The timeout argument of submit, left out when there is none.
+
+    The binding takes a std::chrono duration, which only converts from a
+    float in seconds or a datetime.timedelta, never from an int.
+    """
+    return {} if timeout is None else {'timeout': float(timeout)}
+
+
 class RDMAEndpoint(BaseEndpoint):
     """Manages RDMA endpoint lifecycle including resource allocation and data
     operations.
@@ -23,6 +32,7 @@ class RDMAEndpoint(BaseEndpoint):
         device_name: str,
         ib_port: int = 1,
         link_type: str = 'RoCE',
+        config: Optional[_slime_c.RDMAContextConfig] = None,
     ):
         """Initialize an RDMA endpoint bound to specific hardware resources.
 
@@ -30,9 +40,11 @@ class RDMAEndpoint(BaseEndpoint):
             device_name: RDMA NIC device name (e.g. 'mlx5_0')
             ib_port: InfiniBand physical port number (1-based indexing)
             transport_type: Underlying transport ('RoCE' or 'InfiniBand')
+            config: QP count, queue depths and CQ size, clamped to the
+                device limits (defaults when None)
         """
         self._ctx: _slime_c.rdma_context = _slime_c.rdma_context()
-        self.initialize(device_name, ib_port, link_type)
+        self.initialize(device_name, ib_port, link_type, config)
         self.assignment_with_callback = {}
 
     @property
@@ -55,26 +67,41 @@ class RDMAEndpoint(BaseEndpoint):
         """
         return self._ctx.endpoint_info()
 
+    @property
+    def endpoint_info_binary(self) -> bytes:
+        """Same as endpoint_info in the compact binary format, much cheaper
+        to build and to connect from with many Memory Regions. Decode it
+        with _slime_c.endpoint_info_to_json for debugging.
+        """
+        return self._ctx.endpoint_info_binary()
+
     def initialize(
         self,
         device_name: str,
         ib_port: int,
         transport_type: str,
+        config: Optional[_slime_c.RDMAContextConfig] = None,
     ) -> int:
         """Configure the endpoint with hardware resources.
 
         Returns:
             0 on success, non-zero error code matching IBV_ERROR_* codes
         """
-        return self._ctx.init_rdma_context(device_name, ib_port, transport_type)
+        if config is None:
+            config = _slime_c.RDMAContextConfig()
+        return self._ctx.init_rdma_context(device_name, ib_port, transport_type, config)
 
-    def connect(self, remote_endpoint_info: Dict[str, Any]) -> None:
+    def connect(self, remote_endpoint_info: Union[Dict[str, Any], bytes]) -> None:
         """Establish RC (Reliable Connection) to a remote endpoint.
 
         Args:
-            remote_endpoint_info: Dictionary from remote's local_endpoint_info()
+            remote_endpoint_info: Dictionary from remote's endpoint_info, or
+                the bytes of its endpoint_info_binary
         """
-        self._ctx.connect(remote_endpoint_info)
+        if isinstance(remote_endpoint_info, bytes):
+            self._ctx.connect_binary(remote_endpoint_info)
+        else:
+            self._ctx.connect(remote_endpoint_info)
         self._ctx.launch_future()  # Start background CQ polling
 
     def register_memory_region(
@@ -83,15 +110,18 @@ class RDMAEndpoint(BaseEndpoint):
         addr: int,
         offset: int,
         length: int,
-    ) -> None:
+    ) -> int:
         """Register a Memory Region (MR) for RDMA operations.
 
         Args:
             mr_identifier: Unique key to reference this MR
             virtual_address: Starting VA of the memory block
             length_bytes: Size of the region in bytes
+
+        Returns:
+            Integer MR handle, accepted by _slime_c.Assignment in place of mr_key
         """
-        self._ctx.register_memory_region(mr_key, addr + offset, length)
+        return self._ctx.register_memory_region(mr_key, addr + offset, length)
 
     def register_remote_memory_region(self, remote_mr_info: str) -> None:
         """Register a Remote Memory Region (MR) for RDMA operations.
@@ -103,6 +133,47 @@ class RDMAEndpoint(BaseEndpoint):
         """
         self._ctx.register_remote_memory_region(remote_mr_info)
 
+    def unregister_memory_region(self, mr_key: str) -> Dict[str, Any]:
+        """Release a Memory Region once the work already submitted on it
+        has completed. New submissions on the key are refused right away.
+
+        Returns:
+            Invalidation notice for the peer's
+            apply_mr_invalidation, exchanged like endpoint_info
+        """
+        self._ctx.unregister_memory_region(mr_key)
+        return _slime_c.rdma_context.mr_invalidation([mr_key])
+
+    def apply_mr_invalidation(self, notice: Dict[str, Any]) -> int:
+        """Forget the remote Memory Regions listed in a peer's invalidation
+        notice, later operations on them fail instead of touching released
+        memory.
+
+        Returns:
+            Number of remote Memory Regions dropped
+        """
+        return self._ctx.apply_mr_invalidation(notice)
+
+    def qp_recovery_notice(self) -> Dict[str, Any]:
+        """Queue Pairs reset after a failure since the last call, with
+        their new PSNs.
+
+        Returns:
+            Recovery notice for the peer's apply_qp_recovery, exchanged
+            like endpoint_info in both directions
+        """
+        return self._ctx.qp_recovery_notice()
+
+    def apply_qp_recovery(self, notice: Dict[str, Any]) -> int:
+        """Reconnect the Queue Pairs listed in a peer's recovery notice.
+        Queue Pairs still connected to the old ones are reset first and
+        show up in the next qp_recovery_notice.
+
+        Returns:
+            Number of Queue Pairs back in service
+        """
+        return self._ctx.apply_qp_recovery(notice)
+
     async def send_async(self, mr_key, offset, length) -> int:
         loop = asyncio.get_running_loop()
         future = loop.create_future()
@@ -125,6 +196,18 @@ class RDMAEndpoint(BaseEndpoint):
 
         return await future
 
+    async def send_inline_async(self, data: bytes) -> int:
+        """SEND a small payload without registering it, up to max_inline_data() bytes."""
+        loop = asyncio.get_running_loop()
+        future = loop.create_future()
+
+        def _completion_handler(status: int):
+            loop.call_soon_threadsafe(future.set_result, status)
+
+        self._ctx.submit_inline(_slime_c.OpCode.SEND, data, callback=_completion_handler)
+
+        return await future
+
     def read_batch_with_callback(self, batch: List[Assignment], callback: Callable[[int], None]):
         callback_obj_id = id(callback)
 
@@ -151,6 +234,7 @@ class RDMAEndpoint(BaseEndpoint):
         self,
         batch: List[Assignment],
         async_op=False,
+        timeout: Optional[float] = None,
     ) -> int:
         """Perform batched read from remote MR to local buffer.
 
@@ -159,9 +243,11 @@ class RDMAEndpoint(BaseEndpoint):
             remote_offset: Offset in remote MR (bytes)
             local_buffer_addr: Local destination VA
             read_size: Data size in bytes
+            timeout: Seconds after which the read reports TIME_OUT (402)
+                instead of waiting for a peer that stopped responding
 
         Returns:
-            ibv_wc_status code (0 = IBV_WC_SUCCESS)
+            Completion status (0 on success)
         """
         rdma_assignment = self._ctx.submit(
             _slime_c.OpCode.READ,
@@ -174,11 +260,65 @@ class RDMAEndpoint(BaseEndpoint):
                 ) for assign in batch
             ],
             None,
+            0,
+            **_timeout_kwargs(timeout),
         )
         if async_op:
             return rdma_assignment
-        else:
-            return rdma_assignment.wait()
+        rdma_assignment.wait()
+        return rdma_assignment.status()
+
+    def write_batch(
+        self,
+        batch: List[Assignment],
+        imm_data: Optional[int] = None,
+        async_op=False,
+        timeout: Optional[float] = None,
+    ) -> int:
+        """Perform batched write from local buffer to remote MR.
+
+        Args:
+            batch: Assignments to push, source_offset is local and
+                target_offset is remote
+            imm_data: Optional 32-bit tag delivered to the peer together
+                with the last write, see `recv_imm`
+            timeout: Seconds after which the write reports TIME_OUT (402)
+
+        Returns:
+            Completion status (0 on success)
+        """
+        opcode = _slime_c.OpCode.WRITE if imm_data is None else _slime_c.OpCode.WRITE_WITH_IMM
+        rdma_assignment = self._ctx.submit(
+            opcode,
+            [
+                _slime_c.Assignment(
+                    assign.mr_key,
+                    assign.target_offset,
+                    assign.source_offset,
+                    assign.length,
+                ) for assign in batch
+            ],
+            None,
+            imm_data or 0,
+            **_timeout_kwargs(timeout),
+        )
+        if async_op:
+            return rdma_assignment
+        rdma_assignment.wait()
+        return rdma_assignment.status()
+
+    def recv_imm(self, async_op=False):
+        """Wait for the next write with immediate data from the peer.
+
+        Returns:
+            The 32-bit tag, or the pending assignment when async_op is set
+            (read the tag with `imm_data()` once it completes)
+        """
+        rdma_assignment = self._ctx.submit(_slime_c.OpCode.RECV, [], None)
+        if async_op:
+            return rdma_assignment
+        rdma_assignment.wait()
+        return rdma_assignment.imm_data()
 
     def stop(self):
         """Safely stops the endpoint by terminating all background activities
@@ -0,0 +1,74 @@
+#include "engine/rdma/buffer_allocator.h"
+#include "engine/rdma/rdma_context.h"
+#include "engine/rdma/verbs_provider.h"
+#include "test_utils.h"
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+
+using namespace slime;
+
+const uint64_t ARENA_BYTES = 1 << 20;
+const uint64_t BLOCK_BYTES = 4096;
+
+int main()
+{
+    set_default_verbs_provider(mock_verbs_provider());
+    RDMAContext context;
+    CHECK(context.init(default_verbs_provider()->device_names()[0], 1, "RoCE") == 0);
+
+    RDMABufferAllocatorConfig config;
+    config.mr_key          = "test_arena";
+    config.arena_bytes     = ARENA_BYTES;
+    config.page_size       = HugePageSize::NONE;
+    config.min_block_bytes = BLOCK_BYTES;
+    {
+        RDMABufferAllocator allocator(context, config);
+        CHECK(allocator.mr_handle() == context.get_mr_handle("test_arena"));
+        CHECK(allocator.stats()["arena_bytes"] == ARENA_BYTES);
+        CHECK(allocator.stats()["largest_free_bytes"] == ARENA_BYTES);
+
+        // Splits: the first block comes off the bottom, a larger one skips its buddy
+        registered_buffer_t a = allocator.allocate(BLOCK_BYTES);
+        registered_buffer_t b = allocator.allocate(BLOCK_BYTES + 1);
+        registered_buffer_t c = allocator.allocate(1);
+        CHECK(a.mr_handle == allocator.mr_handle() && a.offset == 0);
+        CHECK(b.offset == 2 * BLOCK_BYTES && b.length == BLOCK_BYTES + 1);
+        CHECK(c.offset == BLOCK_BYTES);
+        CHECK((char*)c.ptr - (char*)a.ptr == (ptrdiff_t)BLOCK_BYTES);
+        memset(b.ptr, 0xab, b.length);
+
+        json stats = allocator.stats();
+        CHECK(stats["buffers"] == 3);
+        CHECK(stats["allocated_bytes"] == 4 * BLOCK_BYTES);
+        CHECK(stats["largest_free_bytes"] == ARENA_BYTES / 2);
+
+        // Merges: freeing every buddy gives the whole arena back as one block
+        allocator.free(a);
+        CHECK(allocator.stats()["largest_free_bytes"] == ARENA_BYTES / 2);
+        allocator.free(c);
+        allocator.free(b);
+        stats = allocator.stats();
+        CHECK(stats["buffers"] == 0);
+        CHECK(stats["allocated_bytes"] == 0);
+        CHECK(stats["largest_free_bytes"] == ARENA_BYTES);
+
+        // Exhaustion and oversize requests fail without touching the arena
+        registered_buffer_t all = allocator.allocate(ARENA_BYTES);
+        CHECK(all.mr_handle != INVALID_MR_HANDLE && all.offset == 0);
+        CHECK(allocator.allocate(1).mr_handle == INVALID_MR_HANDLE);
+        allocator.free(all);
+        CHECK(allocator.allocate(2 * ARENA_BYTES).mr_handle == INVALID_MR_HANDLE);
+        CHECK(allocator.allocate(UINT64_MAX).mr_handle == INVALID_MR_HANDLE);
+        CHECK(allocator.allocate((1ull << 63) + 1).mr_handle == INVALID_MR_HANDLE);
+        CHECK(allocator.stats()["largest_free_bytes"] == ARENA_BYTES);
+    }
+
+    // The arena MR is gone along with the allocator
+    CHECK(context.memory_region_released("test_arena"));
+    CHECK(context.registration_cache_stats()["mrs"] == 0);
+
+    std::cout << "buffer_allocator_test passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,128 @@
+#include "engine/rdma/endpoint_info.h"
+#include "engine/rdma/rdma_context.h"
+#include "engine/rdma/verbs_provider.h"
+#include "test_utils.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace slime;
+
+namespace {
+
+/* A heap copy of exactly size bytes, so a sanitizer build catches any read past the end */
+std::unique_ptr<char[]> copy_exact(const std::string& info, size_t size)
+{
+    std::unique_ptr<char[]> copy(new char[size]);
+    memcpy(copy.get(), info.data(), std::min(size, info.size()));
+    return copy;
+}
+
+/* Rejected: not valid, and to_json reads nothing */
+bool rejected(const std::string& info, size_t size)
+{
+    std::unique_ptr<char[]> copy = copy_exact(info, size);
+    EndpointInfoView        view(copy.get(), size);
+    return !view.valid() && view.to_json().is_null();
+}
+
+}  // namespace
+
+/* Binary endpoint info: round trip against the JSON endpoint info, and malformed buffers */
+int main()
+{
+    set_default_verbs_provider(mock_verbs_provider());
+    std::string device = default_verbs_provider()->device_names()[0];
+
+    RDMAContextConfig config;
+    config.qp_num = 2;
+    RDMAContext context;
+    CHECK(context.init(device, 1, "RoCE", config) == 0);
+
+    std::vector<char> buffer(1 << 12);
+    context.register_memory_region("kv", (uintptr_t)buffer.data(), buffer.size() / 2);
+    context.register_memory_region("weights", (uintptr_t)buffer.data() + buffer.size() / 2, buffer.size() / 2);
+
+    // Same content as the JSON path, read in place from an exactly sized buffer
+    std::string             info = context.endpoint_info_binary();
+    std::unique_ptr<char[]> copy = copy_exact(info, info.size());
+    EndpointInfoView        view(copy.get(), info.size());
+    CHECK(view.valid());
+    CHECK(view.qp_num() == 2 && view.mr_num() == 2);
+    CHECK(view.to_json() == context.endpoint_info());
+    CHECK(view.rdma_info(1).qpn == uint32_t(context.local_rdma_info()[1]["qpn"]));
+    CHECK(view.mr_key(1) == "weights");
+    CHECK(view.mr(1).addr == (uintptr_t)buffer.data() + buffer.size() / 2);
+
+    // An MR table alone, no QP records
+    EndpointInfoBuilder builder;
+    builder.add_mr("", 0x1000, 0, 7);
+    std::string      mr_table = builder.build();
+    EndpointInfoView mr_view(mr_table.data(), mr_table.size());
+    CHECK(mr_view.valid() && mr_view.qp_num() == 0 && mr_view.mr_num() == 1);
+    CHECK(mr_view.mr_key(0).empty() && mr_view.mr(0).rkey == 7);
+
+    // Truncated: within the header, within the records, within the keys
+    CHECK(rejected(info, 0));
+    CHECK(rejected(info, sizeof(endpoint_info_header_t) - 1));
+    CHECK(rejected(info, sizeof(endpoint_info_header_t) + sizeof(endpoint_qp_record_t)));
+    CHECK(rejected(info, info.size() - 1));
+
+    // Another magic, e.g. a peer of the other byte order
+    std::string            bad_magic = info;
+    endpoint_info_header_t header;
+    memcpy(&header, bad_magic.data(), sizeof(header));
+    header.magic = __builtin_bswap32(ENDPOINT_INFO_MAGIC);
+    memcpy(&bad_magic[0], &header, sizeof(header));
+    CHECK(rejected(bad_magic, bad_magic.size()));
+
+    // Another version, and a header shorter than this version's
+    std::string wrong_version = info;
+    memcpy(&header, info.data(), sizeof(header));
+    header.version = ENDPOINT_INFO_VERSION + 1;
+    memcpy(&wrong_version[0], &header, sizeof(header));
+    CHECK(rejected(wrong_version, wrong_version.size()));
+
+    std::string short_header = info;
+    memcpy(&header, info.data(), sizeof(header));
+    header.header_bytes = sizeof(endpoint_info_header_t) - 8;
+    memcpy(&short_header[0], &header, sizeof(header));
+    CHECK(rejected(short_header, short_header.size()));
+
+    // Record counts past the end of the buffer
+    std::string too_many = info;
+    memcpy(&header, info.data(), sizeof(header));
+    header.mr_num = UINT32_MAX;
+    memcpy(&too_many[0], &header, sizeof(header));
+    CHECK(rejected(too_many, too_many.size()));
+
+    // A key past the end of the key bytes, by offset or by length
+    // The record of the second MR, "weights"
+    size_t mr_offset = sizeof(endpoint_info_header_t) + 2 * sizeof(endpoint_qp_record_t) + sizeof(endpoint_mr_record_t);
+    endpoint_mr_record_t record;
+    std::string          bad_offset = info;
+    memcpy(&header, info.data(), sizeof(header));
+    memcpy(&record, info.data() + mr_offset, sizeof(record));
+    record.key_offset = header.key_bytes + 1;
+    memcpy(&bad_offset[mr_offset], &record, sizeof(record));
+    CHECK(rejected(bad_offset, bad_offset.size()));
+
+    std::string bad_length = info;
+    memcpy(&record, info.data() + mr_offset, sizeof(record));
+    record.key_length += 1;
+    memcpy(&bad_length[mr_offset], &record, sizeof(record));
+    CHECK(rejected(bad_length, bad_length.size()));
+
+    std::string wrapping = info;
+    memcpy(&record, info.data() + mr_offset, sizeof(record));
+    record.key_offset = UINT64_MAX;
+    memcpy(&wrapping[mr_offset], &record, sizeof(record));
+    CHECK(rejected(wrapping, wrapping.size()));
+
+    std::cout << "endpoint_info_test passed" << std::endl;
+    return 0;
+}
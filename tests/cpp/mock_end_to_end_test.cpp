@@ -0,0 +1,165 @@
+#include "engine/rdma/rdma_context.h"
+#include "engine/rdma/verbs_provider.h"
+#include "test_utils.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace slime;
+
+const size_t BUFFER_BYTES  = 1 << 16;
+const size_t MESSAGE_BYTES = 256;
+
+/* Submit to complete through the mock provider: every opcode between two connected contexts */
+int main()
+{
+    set_default_verbs_provider(mock_verbs_provider());
+
+    // One QP: without an SRQ a SEND only finds the RECVs posted on the QP it arrives on
+    RDMAContextConfig config;
+    config.qp_num = 1;
+    std::vector<char> local(BUFFER_BYTES, 0), remote(BUFFER_BYTES, 0);
+    for (size_t i = 0; i < BUFFER_BYTES; ++i)
+        remote[i] = char(i % 251);
+    RDMAContext initiator, target;
+    CHECK(connect_pair(initiator, local, target, remote, config) == 0);
+
+    // READ the first half, the user callback sees the status before the waiters do
+    std::atomic<int>        read_status{-1};
+    AssignmentBatch         read_batch{Assignment("buffer", 0, 0, BUFFER_BYTES / 2)};
+    RDMAAssignmentSharedPtr read =
+        initiator.submit(OpCode::READ, read_batch, [&read_status](int code) { read_status = code; });
+    read->wait();
+    CHECK(read->status() == callback_info_t::SUCCESS);
+    CHECK(read_status == callback_info_t::SUCCESS);
+    CHECK(memcmp(local.data(), remote.data(), BUFFER_BYTES / 2) == 0);
+
+    // WRITE it back over the second half, two SGEs in one batch
+    AssignmentBatch write_batch{Assignment("buffer", BUFFER_BYTES / 2, 0, BUFFER_BYTES / 4),
+                                Assignment("buffer", 3 * BUFFER_BYTES / 4, BUFFER_BYTES / 4, BUFFER_BYTES / 4)};
+    RDMAAssignmentSharedPtr write = initiator.submit(OpCode::WRITE, write_batch);
+    write->wait();
+    CHECK(write->status() == callback_info_t::SUCCESS);
+    CHECK(memcmp(remote.data(), remote.data() + BUFFER_BYTES / 2, BUFFER_BYTES / 2) == 0);
+
+    // SEND lands in the buffer of the RECV posted on the other side
+    memset(local.data(), 'm', MESSAGE_BYTES);
+    AssignmentBatch         recv_batch{Assignment("buffer", 0, 0, MESSAGE_BYTES)};
+    RDMAAssignmentSharedPtr recv = target.submit(OpCode::RECV, recv_batch);
+    AssignmentBatch         send_batch{Assignment("buffer", 0, 0, MESSAGE_BYTES)};
+    RDMAAssignmentSharedPtr send = initiator.submit(OpCode::SEND, send_batch);
+    send->wait();
+    recv->wait();
+    CHECK(send->status() == callback_info_t::SUCCESS);
+    CHECK(recv->status() == callback_info_t::SUCCESS);
+    CHECK(memcmp(local.data(), remote.data(), MESSAGE_BYTES) == 0);
+
+    // WRITE_WITH_IMM completes a RECV with the immediate data
+    AssignmentBatch         tag_batch{};
+    RDMAAssignmentSharedPtr tag = target.submit(OpCode::RECV, tag_batch);
+    AssignmentBatch         imm_batch{Assignment("buffer", MESSAGE_BYTES, 0, MESSAGE_BYTES)};
+    RDMAAssignmentSharedPtr imm = initiator.submit(OpCode::WRITE_WITH_IMM, imm_batch, nullptr, 42);
+    imm->wait();
+    tag->wait();
+    CHECK(imm->status() == callback_info_t::SUCCESS);
+    CHECK(tag->status() == callback_info_t::SUCCESS);
+    CHECK(tag->imm_data() == 42);
+    CHECK(memcmp(local.data(), remote.data() + MESSAGE_BYTES, MESSAGE_BYTES) == 0);
+
+    // An empty WRITE_WITH_IMM still posts a WR, it holds and returns one send credit
+    AssignmentBatch         empty_tag_batch{};
+    RDMAAssignmentSharedPtr empty_tag = target.submit(OpCode::RECV, empty_tag_batch);
+    AssignmentBatch         empty_imm_batch{};
+    RDMAAssignmentSharedPtr empty_imm = initiator.submit(OpCode::WRITE_WITH_IMM, empty_imm_batch, nullptr, 7);
+    empty_imm->wait();
+    empty_tag->wait();
+    CHECK(empty_imm->status() == callback_info_t::SUCCESS);
+    CHECK(empty_tag->imm_data() == 7);
+
+    // An MR the peer never registered is refused at submit
+    initiator.register_memory_region("local_only", (uintptr_t)local.data(), local.size());
+    AssignmentBatch         unknown_batch{Assignment("local_only", 0, 0, MESSAGE_BYTES)};
+    RDMAAssignmentSharedPtr unknown = initiator.submit(OpCode::WRITE, unknown_batch);
+    unknown->wait();
+    CHECK(unknown->status() == callback_info_t::REMOTE_MR_NOT_REGISTERED);
+
+    // The peer moves a key between two buffers while WRITEs target it: each WR is posted with
+    // the addr and rkey of one registration, never a mix of both
+    std::vector<char> shadow(BUFFER_BYTES, 0);
+    target.register_memory_region("shadow", (uintptr_t)shadow.data(), shadow.size());
+    json              target_mrs = target.endpoint_info()["mr_info"];
+    std::atomic<bool> moving{true};
+    std::thread       mover([&]() {
+        for (int i = 0; moving; ++i)
+            initiator.register_remote_memory_region("buffer", target_mrs[i % 2 ? "shadow" : "buffer"]);
+    });
+    bool all_written = true;
+    for (int i = 0; i < 1000; ++i) {
+        AssignmentBatch         moving_batch{Assignment("buffer", 0, 0, MESSAGE_BYTES)};
+        RDMAAssignmentSharedPtr moving_write = initiator.submit(OpCode::WRITE, moving_batch);
+        moving_write->wait();
+        all_written = all_written && moving_write->status() == callback_info_t::SUCCESS;
+    }
+    moving = false;
+    mover.join();
+    CHECK(all_written);
+
+    initiator.stop_future();
+    target.stop_future();
+
+    // Only the receiver has an SRQ: a SEND larger than its receive size is refused by the sender
+    RDMAContextConfig srq_config = config;
+    srq_config.srq_depth         = 16;
+    srq_config.srq_recv_bytes    = MESSAGE_BYTES;
+    RDMAContext sender, receiver;
+    CHECK(connect_pair(sender, config, local, receiver, srq_config, remote, true) == 0);
+    CHECK(receiver.endpoint_info()["srq_recv_bytes"] == MESSAGE_BYTES);
+
+    AssignmentBatch         large_batch{Assignment("buffer", 0, 0, 2 * MESSAGE_BYTES)};
+    RDMAAssignmentSharedPtr large = sender.submit(OpCode::SEND, large_batch);
+    large->wait();
+    CHECK(large->status() == callback_info_t::ASSIGNMENT_BATCH_OVERFLOW);
+
+    AssignmentBatch         fit_recv_batch{Assignment("buffer", 0, 0, MESSAGE_BYTES)};
+    RDMAAssignmentSharedPtr fit_recv = receiver.submit(OpCode::RECV, fit_recv_batch);
+    AssignmentBatch         fit_batch{Assignment("buffer", 0, 0, MESSAGE_BYTES)};
+    RDMAAssignmentSharedPtr fit = sender.submit(OpCode::SEND, fit_batch);
+    fit->wait();
+    fit_recv->wait();
+    CHECK(fit->status() == callback_info_t::SUCCESS);
+    CHECK(fit_recv->status() == callback_info_t::SUCCESS);
+
+    sender.stop_future();
+    receiver.stop_future();
+
+    // A slow callback executor fills its ring, the poller waits for room and nothing is lost
+    RDMAContextConfig executor_config = config;
+    executor_config.max_send_wr       = 4;
+    executor_config.callback_threads  = 1;
+    RDMAContext producer, consumer;
+    CHECK(connect_pair(producer, local, consumer, remote, executor_config) == 0);
+
+    std::atomic<int>                     callbacks{0};
+    std::vector<RDMAAssignmentSharedPtr> writes;
+    for (size_t i = 0; i < BUFFER_BYTES / MESSAGE_BYTES; ++i) {
+        AssignmentBatch batch{Assignment("buffer", i * MESSAGE_BYTES, i * MESSAGE_BYTES, MESSAGE_BYTES)};
+        writes.push_back(producer.submit(OpCode::WRITE, batch, [&callbacks](int) {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+            callbacks++;
+        }));
+    }
+    for (RDMAAssignmentSharedPtr& write : writes) {
+        write->wait();
+        CHECK(write->status() == callback_info_t::SUCCESS);
+    }
+    CHECK(callbacks == int(writes.size()));
+
+    producer.stop_future();
+    consumer.stop_future();
+    std::cout << "mock_end_to_end_test passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,88 @@
+#include "engine/rdma/rdma_context.h"
+#include "engine/rdma/verbs_provider.h"
+#include "test_utils.h"
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+using namespace slime;
+
+const size_t BUFFER_BYTES = 1 << 14;
+const size_t HALF_BYTES   = BUFFER_BYTES / 2;
+
+/* One context, two peers added after launch: QP groups of their own over the shared CQs and MRs */
+int main()
+{
+    set_default_verbs_provider(mock_verbs_provider());
+    std::string device = default_verbs_provider()->device_names()[0];
+
+    RDMAContextConfig hub_config;
+    hub_config.qp_num    = 2;
+    hub_config.max_peers = 2;
+    RDMAContextConfig config;
+    config.qp_num = 2;
+
+    RDMAContext       hub, first, second;
+    std::vector<char> source(BUFFER_BYTES), first_buffer(BUFFER_BYTES, 0), second_buffer(BUFFER_BYTES, 0);
+    for (size_t i = 0; i < BUFFER_BYTES; ++i)
+        source[i] = char(i % 251);
+    CHECK(hub.init(device, 1, "RoCE", hub_config) == 0);
+    CHECK(first.init(device, 1, "RoCE", config) == 0);
+    CHECK(second.init(device, 1, "RoCE", config) == 0);
+    hub.register_memory_region("buffer", (uintptr_t)source.data(), source.size());
+    first.register_memory_region("buffer", (uintptr_t)first_buffer.data(), first_buffer.size());
+    second.register_memory_region("buffer", (uintptr_t)second_buffer.data(), second_buffer.size());
+    // Only the second peer has it, the first one refuses it
+    std::vector<char> second_only(BUFFER_BYTES, 0);
+    second.register_memory_region("second_only", (uintptr_t)second_only.data(), second_only.size());
+    hub.launch_future();
+    first.launch_future();
+    second.launch_future();
+
+    // The first add_peer hands out the group of init, the second creates one
+    std::shared_ptr<RDMAPeer> to_first  = hub.add_peer();
+    std::shared_ptr<RDMAPeer> to_second = hub.add_peer();
+    CHECK(to_first && to_first->peer() == 0);
+    CHECK(to_second && to_second->peer() == 1);
+    CHECK(!hub.add_peer());
+
+    CHECK(to_first->connect(first.endpoint_info()) == 0);
+    CHECK(first.connect(to_first->endpoint_info()) == 0);
+    CHECK(to_second->connect(second.endpoint_info_binary()) == 0);
+    CHECK(second.connect(to_second->endpoint_info_binary()) == 0);
+
+    // Same key on both peers, each WRITE lands in the buffer of its own peer
+    for (size_t offset = 0; offset < HALF_BYTES; offset += 1024) {
+        AssignmentBatch         first_batch{Assignment("buffer", offset, offset, 1024)};
+        AssignmentBatch         second_batch{Assignment("buffer", offset, HALF_BYTES + offset, 1024)};
+        RDMAAssignmentSharedPtr to_first_write  = to_first->submit(OpCode::WRITE, first_batch);
+        RDMAAssignmentSharedPtr to_second_write = to_second->submit(OpCode::WRITE, second_batch);
+        to_first_write->wait();
+        to_second_write->wait();
+        CHECK(to_first_write->status() == callback_info_t::SUCCESS);
+        CHECK(to_second_write->status() == callback_info_t::SUCCESS);
+    }
+    CHECK(memcmp(first_buffer.data(), source.data(), HALF_BYTES) == 0);
+    CHECK(memcmp(second_buffer.data(), source.data() + HALF_BYTES, HALF_BYTES) == 0);
+    for (size_t i = HALF_BYTES; i < BUFFER_BYTES; ++i)
+        CHECK(first_buffer[i] == 0 && second_buffer[i] == 0);
+
+    // The remote MR tables are per peer
+    hub.register_memory_region("second_only", (uintptr_t)source.data(), source.size());
+    AssignmentBatch         only_batch{Assignment("second_only", 0, 0, 1024)};
+    RDMAAssignmentSharedPtr refused = to_first->submit(OpCode::WRITE, only_batch);
+    refused->wait();
+    CHECK(refused->status() == callback_info_t::REMOTE_MR_NOT_REGISTERED);
+    RDMAAssignmentSharedPtr accepted = to_second->submit(OpCode::WRITE, only_batch);
+    accepted->wait();
+    CHECK(accepted->status() == callback_info_t::SUCCESS);
+    CHECK(memcmp(second_only.data(), source.data(), 1024) == 0);
+
+    hub.stop_future();
+    first.stop_future();
+    second.stop_future();
+    std::cout << "multi_peer_test passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,188 @@
+#include "engine/rdma/mock_verbs.h"
+#include "engine/rdma/rdma_context.h"
+#include "engine/rdma/verbs_provider.h"
+#include "test_utils.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using namespace slime;
+
+const size_t CHUNK_BYTES = 1024;
+const int    NUM_CHUNKS  = 64;
+
+namespace {
+
+/* WRITEs chunk i to chunk i one at a time: the number that succeeded, and those FAILED */
+int write_chunks(RDMAContext& context, int& failed)
+{
+    int ok = 0;
+    failed = 0;
+    for (int i = 0; i < NUM_CHUNKS; ++i) {
+        AssignmentBatch         batch{Assignment("buffer", i * CHUNK_BYTES, i * CHUNK_BYTES, CHUNK_BYTES)};
+        RDMAAssignmentSharedPtr assign = context.submit(OpCode::WRITE, batch);
+        assign->wait();
+        ok += assign->status() == callback_info_t::SUCCESS;
+        failed += assign->status() == callback_info_t::FAILED;
+    }
+    return ok;
+}
+
+/* The side whose QP failed resets it first, the peer resets its end on the notice and answers */
+bool exchange_recovery(RDMAContext& failed, RDMAContext& peer)
+{
+    auto next_notice = [](RDMAContext& context) {
+        for (int i = 0; i < 5000; ++i) {
+            json notice = context.qp_recovery_notice();
+            if (!notice["recovered_qps"].empty())
+                return notice;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return json();
+    };
+    json notice = next_notice(failed);
+    if (notice.is_null() || peer.apply_qp_recovery(notice) != 0)
+        return false;
+    json answer = next_notice(peer);
+    return !answer.is_null() && failed.apply_qp_recovery(answer) == 1;
+}
+
+/*
+  A single QP: no other QP of the peer takes its work, it is held until the QP is back. The
+  WRITEs are submitted before the recovery is exchanged and only waited for after.
+*/
+int single_qp()
+{
+    RDMAContextConfig config;
+    config.qp_num      = 1;
+    config.max_send_wr = 16;
+    RDMAContext       initiator, target;
+    std::vector<char> source(CHUNK_BYTES * NUM_CHUNKS, 'b'), destination(CHUNK_BYTES * NUM_CHUNKS, 0);
+    CHECK(connect_pair(initiator, source, target, destination, config) == 0);
+
+    uint32_t qpn = initiator.local_rdma_info()[0]["qpn"];
+    mock_inject_qp_errors(qpn, 1, IBV_WC_RETRY_EXC_ERR);
+    std::vector<RDMAAssignmentSharedPtr> writes;
+    for (int i = 0; i < NUM_CHUNKS; ++i) {
+        AssignmentBatch batch{Assignment("buffer", i * CHUNK_BYTES, i * CHUNK_BYTES, CHUNK_BYTES)};
+        writes.push_back(initiator.submit(OpCode::WRITE, batch));
+    }
+    CHECK(exchange_recovery(initiator, target));
+    for (RDMAAssignmentSharedPtr& write : writes) {
+        write->wait();
+        CHECK(write->status() == callback_info_t::SUCCESS);
+    }
+    CHECK(memcmp(source.data(), destination.data(), source.size()) == 0);
+
+    json stats = initiator.recovery_stats();
+    CHECK(stats["qp_errors"] == 1);
+    CHECK(stats["retried"] >= 1);
+    CHECK(stats["given_up"] == 0);
+    CHECK(stats["recovered"] == 1);
+
+    // Never reconnected in time, the held WRITE times out instead of failing
+    mock_inject_qp_errors(qpn, 1, IBV_WC_RETRY_EXC_ERR);
+    AssignmentBatch         held_batch{Assignment("buffer", 0, 0, CHUNK_BYTES)};
+    RDMAAssignmentSharedPtr held =
+        initiator.submit(OpCode::WRITE, held_batch, nullptr, 0, std::chrono::milliseconds(50));
+    CHECK(held->wait_for(std::chrono::seconds(5)));
+    CHECK(held->status() == callback_info_t::TIME_OUT);
+    CHECK(initiator.recovery_stats()["given_up"] == 0);
+
+    // Back in service afterwards
+    CHECK(exchange_recovery(initiator, target));
+    AssignmentBatch         last_batch{Assignment("buffer", CHUNK_BYTES, CHUNK_BYTES, CHUNK_BYTES)};
+    RDMAAssignmentSharedPtr last = initiator.submit(OpCode::WRITE, last_batch);
+    last->wait();
+    CHECK(last->status() == callback_info_t::SUCCESS);
+    CHECK(initiator.recovery_stats()["recovered"] == 2);
+
+    initiator.stop_future();
+    target.stop_future();
+    return 0;
+}
+
+}  // namespace
+
+int main()
+{
+    set_default_verbs_provider(mock_verbs_provider());
+
+    RDMAContextConfig config;
+    config.qp_num = 2;
+    // Batches of more than 8 WRs are split
+    config.max_send_wr = 16;
+    RDMAContext       initiator, target;
+    std::vector<char> source(CHUNK_BYTES * NUM_CHUNKS, 'a'), destination(CHUNK_BYTES * NUM_CHUNKS, 0);
+    CHECK(connect_pair(initiator, source, target, destination, config) == 0);
+
+    json     rdma_info = initiator.local_rdma_info();
+    uint32_t qpn_0     = rdma_info[0]["qpn"];
+    uint32_t qpn_1     = rdma_info[1]["qpn"];
+
+    // A transport error: the WR goes on through QP 1 while QP 0 is reset
+    mock_inject_qp_errors(qpn_0, 1, IBV_WC_RETRY_EXC_ERR);
+    int failed = 0;
+    CHECK(write_chunks(initiator, failed) == NUM_CHUNKS);
+    CHECK(memcmp(source.data(), destination.data(), source.size()) == 0);
+
+    json stats = initiator.recovery_stats();
+    CHECK(stats["qp_errors"] == 1);
+    CHECK(stats["failed_qps"] == json::array({0}));
+    CHECK(stats["retried"] >= 1);
+    CHECK(stats["given_up"] == 0);
+
+    // Both ends reconnect QP 0 with fresh PSNs
+    CHECK(exchange_recovery(initiator, target));
+    CHECK(initiator.recovery_stats()["failed_qps"].empty());
+    CHECK(initiator.recovery_stats()["recovered"] == 1);
+    CHECK(target.recovery_stats()["failed_qps"].empty());
+
+    // QP 1 fails next, its work goes on through QP 0 which is back in service
+    mock_inject_qp_errors(qpn_1, 1, IBV_WC_RETRY_EXC_ERR);
+    memset(destination.data(), 0, destination.size());
+    CHECK(write_chunks(initiator, failed) == NUM_CHUNKS);
+    CHECK(memcmp(source.data(), destination.data(), source.size()) == 0);
+    CHECK(exchange_recovery(initiator, target));
+
+    json recovered_stats = initiator.recovery_stats();
+    CHECK(recovered_stats["qp_errors"] == 2);
+    CHECK(recovered_stats["failed_qps"].empty());
+    CHECK(recovered_stats["recovered"] == 2);
+    CHECK(recovered_stats["given_up"] == 0);
+
+    // Any other error fails the WR itself, QP 1 is back in service and takes the rest
+    mock_inject_qp_errors(qpn_0, 1, IBV_WC_REM_ACCESS_ERR);
+    memset(destination.data(), 0, destination.size());
+    CHECK(write_chunks(initiator, failed) == NUM_CHUNKS - 1);
+    CHECK(failed == 1);
+    CHECK(initiator.recovery_stats()["given_up"] == 1);
+    CHECK(exchange_recovery(initiator, target));
+    CHECK(initiator.recovery_stats()["failed_qps"].empty());
+    CHECK(initiator.recovery_stats()["recovered"] == 3);
+
+    // A failed split reports on the last one, though that one succeeds on the other QP. Round
+    // robin: an even number of submits so far, this one goes to QP 0
+    mock_inject_qp_errors(qpn_0, 1, IBV_WC_REM_ACCESS_ERR);
+    AssignmentBatch batch;
+    for (int i = 0; i < NUM_CHUNKS; ++i)
+        batch.push_back(Assignment("buffer", i * CHUNK_BYTES, i * CHUNK_BYTES, CHUNK_BYTES));
+    std::atomic<int>        reported{0};
+    RDMAAssignmentSharedPtr split = initiator.submit(OpCode::WRITE, batch, [&reported](int) { reported++; });
+    split->wait();
+    CHECK(split->status() == callback_info_t::FAILED);
+    CHECK(reported == 1);
+    CHECK(exchange_recovery(initiator, target));
+    CHECK(initiator.recovery_stats()["recovered"] == 4);
+
+    initiator.stop_future();
+    target.stop_future();
+
+    CHECK(single_qp() == 0);
+    std::cout << "recovery_test passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include "engine/rdma/registration_cache.h"
+#include "engine/rdma/verbs_provider.h"
+#include "test_utils.h"
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+using namespace slime;
+
+const uint64_t PAGE_BYTES   = 4096;
+const uint64_t BUFFER_BYTES = 16 * PAGE_BYTES;
+const int      ACCESS       = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_READ;
+
+/* Hits and misses of covered ranges, LRU eviction at a small budget, deferred deregistration */
+int main()
+{
+    VerbsProvider*      verbs = mock_verbs_provider();
+    int                 num_devices;
+    struct ibv_device** devices = verbs->get_device_list(&num_devices);
+    CHECK(devices && num_devices > 0);
+    struct ibv_context* context = verbs->open_device(devices[0]);
+    struct ibv_pd*      pd      = verbs->alloc_pd(context);
+    CHECK(pd);
+
+    std::vector<char> buffer(BUFFER_BYTES);
+    uintptr_t         base = (uintptr_t)buffer.data();
+    auto page = [base](int i) { return base + i * PAGE_BYTES; };
+
+    {
+        // A range inside a cached MR reuses it, one reaching past its end registers a new one
+        RegistrationCache cache(pd, verbs, ACCESS, UINT64_MAX);
+        struct ibv_mr*    whole = cache.acquire(page(0), 8 * PAGE_BYTES);
+        struct ibv_mr*    slice = cache.acquire(page(2), 2 * PAGE_BYTES);
+        struct ibv_mr*    past  = cache.acquire(page(6), 4 * PAGE_BYTES);
+        CHECK(whole && slice == whole);
+        CHECK(past && past != whole);
+        json stats = cache.stats();
+        CHECK(stats["hits"] == 1 && stats["misses"] == 2);
+        CHECK(stats["mrs"] == 2 && stats["pinned_bytes"] == 12 * PAGE_BYTES);
+
+        // Released MRs stay registered, the next acquire of the slice still hits
+        cache.release(slice);
+        cache.release(whole);
+        cache.release(past);
+        CHECK(cache.stats()["idle_mrs"] == 2);
+        cache.release(cache.acquire(page(3), PAGE_BYTES));
+        CHECK(cache.stats()["hits"] == 2);
+    }
+
+    {
+        // Room for three pages, released in the order a, c, b and a taken again: c is the least
+        // recently released
+        RegistrationCache cache(pd, verbs, ACCESS, 3 * PAGE_BYTES);
+        struct ibv_mr*    a = cache.acquire(page(0), PAGE_BYTES);
+        struct ibv_mr*    b = cache.acquire(page(2), PAGE_BYTES);
+        struct ibv_mr*    c = cache.acquire(page(4), PAGE_BYTES);
+        cache.release(a);
+        cache.release(c);
+        cache.release(b);
+        CHECK(cache.acquire(page(0), PAGE_BYTES) == a);
+        cache.release(a);
+        CHECK(cache.stats()["evictions"] == 0);
+
+        // A fourth page goes over the budget and evicts c, b and a are still cached
+        struct ibv_mr* d = cache.acquire(page(6), PAGE_BYTES);
+        CHECK(cache.stats()["evictions"] == 1);
+        CHECK(cache.stats()["pinned_bytes"] == 3 * PAGE_BYTES);
+        CHECK(cache.acquire(page(2), PAGE_BYTES) == b);
+        CHECK(cache.stats()["misses"] == 4 && cache.stats()["hits"] == 2);
+
+        // c comes back as a miss and evicts a, the only idle one left
+        struct ibv_mr* c_again = cache.acquire(page(4), PAGE_BYTES);
+        CHECK(c_again);
+        json stats = cache.stats();
+        CHECK(stats["misses"] == 5 && stats["evictions"] == 2);
+        CHECK(stats["mrs"] == 3 && stats["idle_mrs"] == 0);
+
+        // Referenced MRs are never evicted, the cache goes over its budget instead
+        struct ibv_mr* e = cache.acquire(page(8), PAGE_BYTES);
+        CHECK(cache.stats()["pinned_bytes"] == 4 * PAGE_BYTES);
+        for (struct ibv_mr* mr : {b, c_again, d, e})
+            cache.release(mr);
+        CHECK(cache.stats()["pinned_bytes"] == 3 * PAGE_BYTES);
+    }
+
+    {
+        // An invalidated MR still referenced stays registered until its last release, but is not
+        // handed out anymore
+        RegistrationCache cache(pd, verbs, ACCESS, UINT64_MAX);
+        struct ibv_mr*    held = cache.acquire(page(0), 4 * PAGE_BYTES);
+        cache.acquire(page(0), 4 * PAGE_BYTES);
+        struct ibv_mr* idle = cache.acquire(page(8), 4 * PAGE_BYTES);
+        cache.release(idle);
+        CHECK(cache.invalidate(page(2), 8 * PAGE_BYTES) == 2);
+        json stats = cache.stats();
+        CHECK(stats["invalidations"] == 2);
+        CHECK(stats["mrs"] == 1 && stats["pinned_bytes"] == 4 * PAGE_BYTES);
+
+        struct ibv_mr* fresh = cache.acquire(page(1), PAGE_BYTES);
+        CHECK(fresh && fresh != held);
+        CHECK(cache.stats()["mrs"] == 2);
+
+        cache.release(held);
+        CHECK(cache.stats()["mrs"] == 2);
+        cache.release(held);
+        CHECK(cache.stats()["mrs"] == 1 && cache.stats()["pinned_bytes"] == PAGE_BYTES);
+        cache.release(fresh);
+    }
+
+    verbs->dealloc_pd(pd);
+    verbs->free_device_list(devices);
+    std::cout << "registration_cache_test passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include "engine/rdma/rdma_context.h"
+#include "engine/rdma/verbs_provider.h"
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+/* In main or a helper returning int: report the failed condition and return 1 */
+#define CHECK(cond)                                                                                                    \
+    do {                                                                                                               \
+        if (!(cond)) {                                                                                                 \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK failed: " #cond << std::endl;                         \
+            return 1;                                                                                                  \
+        }                                                                                                              \
+    } while (0)
+
+namespace slime {
+
+/*
+  Two contexts on the first device of the default provider, each with its buffer registered as
+  "buffer", connected to each other and launched. The binary endpoint info instead of the JSON
+  one with binary_info. 0 on success.
+*/
+inline int connect_pair(RDMAContext&             initiator,
+                        const RDMAContextConfig& initiator_config,
+                        std::vector<char>&       initiator_buffer,
+                        RDMAContext&             target,
+                        const RDMAContextConfig& target_config,
+                        std::vector<char>&       target_buffer,
+                        bool                     binary_info = false)
+{
+    std::string device = default_verbs_provider()->device_names()[0];
+    CHECK(initiator.init(device, 1, "RoCE", initiator_config) == 0);
+    CHECK(target.init(device, 1, "RoCE", target_config) == 0);
+
+    initiator.register_memory_region("buffer", (uintptr_t)initiator_buffer.data(), initiator_buffer.size());
+    target.register_memory_region("buffer", (uintptr_t)target_buffer.data(), target_buffer.size());
+    if (binary_info) {
+        CHECK(initiator.connect(target.endpoint_info_binary()) == 0);
+        CHECK(target.connect(initiator.endpoint_info_binary()) == 0);
+    }
+    else {
+        CHECK(initiator.connect(target.endpoint_info()) == 0);
+        CHECK(target.connect(initiator.endpoint_info()) == 0);
+    }
+    initiator.launch_future();
+    target.launch_future();
+    return 0;
+}
+
+/* Both ends with the same config */
+inline int connect_pair(RDMAContext&             initiator,
+                        std::vector<char>&       initiator_buffer,
+                        RDMAContext&             target,
+                        std::vector<char>&       target_buffer,
+                        const RDMAContextConfig& config)
+{
+    return connect_pair(initiator, config, initiator_buffer, target, config, target_buffer);
+}
+
+}  // namespace slime
@@ -0,0 +1,135 @@
+#include "engine/rdma/rdma_context.h"
+#include "engine/rdma/verbs_provider.h"
+#include "test_utils.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+using namespace slime;
+
+const size_t MESSAGE_BYTES = 256;
+const size_t BUFFER_BYTES  = 16 * MESSAGE_BYTES;
+
+const std::chrono::milliseconds TIMEOUT(50);
+
+namespace {
+
+/*
+  The target posts no RECV, so the SENDs of the initiator stall on the device and hold both
+  send credits of its single QP: everything submitted after them stays queued.
+*/
+int run(int callback_threads)
+{
+    RDMAContextConfig config;
+    config.qp_num           = 1;
+    config.max_send_wr      = 2;
+    config.callback_threads = callback_threads;
+    RDMAContext       initiator, target;
+    std::vector<char> local(BUFFER_BYTES, 'l'), remote(BUFFER_BYTES, 0);
+    CHECK(connect_pair(initiator, local, target, remote, config) == 0);
+
+    // Posted but never answered: the CQ poller expires it, a late completion is not reported again
+    std::atomic<int>        stalled_calls{0};
+    AssignmentBatch         stalled_batch{Assignment("buffer", 0, 0, MESSAGE_BYTES)};
+    RDMAAssignmentSharedPtr stalled = initiator.submit(
+        OpCode::SEND, stalled_batch, [&stalled_calls](int) { stalled_calls++; }, 0, TIMEOUT);
+    CHECK(!stalled->wait_for(std::chrono::milliseconds(10)));
+    CHECK(!stalled->query());
+
+    AssignmentBatch         second_batch{Assignment("buffer", MESSAGE_BYTES, MESSAGE_BYTES, MESSAGE_BYTES)};
+    RDMAAssignmentSharedPtr second = initiator.submit(OpCode::SEND, second_batch);
+
+    // No credits left, it is still queued when it expires and the dispatcher only releases it
+    std::atomic<int>        queued_calls{0};
+    AssignmentBatch         queued_batch{Assignment("buffer", 2 * MESSAGE_BYTES, 2 * MESSAGE_BYTES, MESSAGE_BYTES)};
+    RDMAAssignmentSharedPtr queued = initiator.submit(
+        OpCode::WRITE, queued_batch, [&queued_calls](int) { queued_calls++; }, 0, TIMEOUT);
+
+    CHECK(stalled->wait_for(10 * TIMEOUT));
+    CHECK(stalled->status() == callback_info_t::TIME_OUT);
+    CHECK(queued->wait_for(10 * TIMEOUT));
+    CHECK(queued->status() == callback_info_t::TIME_OUT);
+    CHECK(initiator.completion_stats()["timed_out"] == 2);
+
+    // Three splits of one WRITE, all queued behind the stalled SENDs: cancel drops them all
+    std::atomic<int> cancelled_calls{0};
+    AssignmentBatch  cancelled_batch;
+    for (size_t i = 4; i < 7; ++i)
+        cancelled_batch.push_back(Assignment("buffer", i * MESSAGE_BYTES, i * MESSAGE_BYTES, MESSAGE_BYTES));
+    RDMAAssignmentSharedPtr cancelled =
+        initiator.submit(OpCode::WRITE, cancelled_batch, [&cancelled_calls](int) { cancelled_calls++; });
+    CHECK(!cancelled->wait_for(std::chrono::milliseconds(10)));
+    CHECK(cancelled->cancel());
+    CHECK(cancelled->query());
+    CHECK(cancelled->status() == callback_info_t::CANCELED);
+    CHECK(!cancelled->cancel());
+
+    // The RECVs take the stalled SENDs, their credits come back and the queue drains
+    for (size_t i = 0; i < 2; ++i) {
+        AssignmentBatch recv_batch{Assignment("buffer", i * MESSAGE_BYTES, i * MESSAGE_BYTES, MESSAGE_BYTES)};
+        RDMAAssignmentSharedPtr recv = target.submit(OpCode::RECV, recv_batch);
+        recv->wait();
+        CHECK(recv->status() == callback_info_t::SUCCESS);
+    }
+    second->wait();
+    CHECK(second->status() == callback_info_t::SUCCESS);
+
+    // Queued behind the dropped work on the same QP, so it is posted after they were released
+    AssignmentBatch         last_batch{Assignment("buffer", 8 * MESSAGE_BYTES, 8 * MESSAGE_BYTES, MESSAGE_BYTES)};
+    RDMAAssignmentSharedPtr last = initiator.submit(OpCode::WRITE, last_batch);
+    last->wait();
+    CHECK(last->status() == callback_info_t::SUCCESS);
+    CHECK(remote[8 * MESSAGE_BYTES] == 'l');
+
+    // The first two splits are posted and stall like above, only the third is dropped: the
+    // cancel is reported once the posted ones have finished
+    std::atomic<int> partial_calls{0};
+    AssignmentBatch  partial_batch;
+    for (size_t i = 10; i < 13; ++i)
+        partial_batch.push_back(Assignment("buffer", i * MESSAGE_BYTES, i * MESSAGE_BYTES, MESSAGE_BYTES));
+    RDMAAssignmentSharedPtr partial =
+        initiator.submit(OpCode::SEND, partial_batch, [&partial_calls](int) { partial_calls++; });
+    CHECK(!partial->wait_for(std::chrono::milliseconds(10)));
+    CHECK(partial->cancel());
+    CHECK(!partial->wait_for(std::chrono::milliseconds(10)));
+    CHECK(partial_calls == 0);
+    for (size_t i = 10; i < 12; ++i) {
+        AssignmentBatch recv_batch{Assignment("buffer", i * MESSAGE_BYTES, i * MESSAGE_BYTES, MESSAGE_BYTES)};
+        RDMAAssignmentSharedPtr recv = target.submit(OpCode::RECV, recv_batch);
+        recv->wait();
+        CHECK(recv->status() == callback_info_t::SUCCESS);
+    }
+    CHECK(partial->wait_for(10 * TIMEOUT));
+    CHECK(partial->status() == callback_info_t::CANCELED);
+    CHECK(partial_calls == 1);
+
+    // Neither the timed out nor the cancelled WRITEs reached the target
+    for (size_t i = 2; i < 7; ++i)
+        CHECK(remote[i * MESSAGE_BYTES] == 0);
+    CHECK(stalled->status() == callback_info_t::TIME_OUT);
+    CHECK(stalled_calls == 1);
+    CHECK(queued_calls == 1);
+    CHECK(cancelled_calls == 1);
+
+    initiator.stop_future();
+    target.stop_future();
+    return 0;
+}
+
+}  // namespace
+
+/* wait_for, deadlines of posted and of queued work, and cancel of queued splits */
+int main()
+{
+    set_default_verbs_provider(mock_verbs_provider());
+
+    // Timeouts reported on the CQ poller, then through a callback executor
+    CHECK(run(0) == 0);
+    CHECK(run(1) == 0);
+
+    std::cout << "timeout_test passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,153 @@
+#include "engine/rdma/topology.h"
+#include "test_utils.h"
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace slime;
+
+namespace {
+
+/* mkdir -p */
+void make_dirs(const std::string& path)
+{
+    for (size_t slash = path.find('/', 1); slash != std::string::npos; slash = path.find('/', slash + 1))
+        mkdir(path.substr(0, slash).c_str(), 0755);
+    mkdir(path.c_str(), 0755);
+}
+
+void write_file(const std::string& path, const std::string& content)
+{
+    std::ofstream(path) << content << "\n";
+}
+
+/* A PCI function under devices/, reachable from bus/pci/devices like on a real host */
+std::string add_pci_device(const std::string& root, const std::string& path, int numa_node)
+{
+    std::string device = root + "/devices/" + path;
+    make_dirs(device);
+    write_file(device + "/numa_node", std::to_string(numa_node));
+    symlink(device.c_str(), (root + "/bus/pci/devices/" + path.substr(path.rfind('/') + 1)).c_str());
+    return device;
+}
+
+void add_nic(const std::string& root, const std::string& name, const std::string& path, int numa_node)
+{
+    std::string device = add_pci_device(root, path, numa_node);
+    write_file(device + "/local_cpulist", numa_node == 0 ? "0-3" : "4-7");
+    make_dirs(root + "/class/infiniband/" + name);
+    symlink(device.c_str(), (root + "/class/infiniband/" + name + "/device").c_str());
+}
+
+void add_numa_node(const std::string& root, int id, const std::string& cpulist, const std::string& distance)
+{
+    std::string node = root + "/devices/system/node/node" + std::to_string(id);
+    make_dirs(node);
+    write_file(node + "/cpulist", cpulist);
+    write_file(node + "/distance", distance);
+}
+
+/*
+  Two sockets. mlx5_0 and a GPU sit behind the same PCIe switch on node 0, mlx5_1 hangs off
+  another root port of the same root complex, mlx5_2 is on node 1. A second GPU on node 1
+  shares no root complex with any NIC.
+*/
+std::string make_fixture()
+{
+    char root_template[] = "/tmp/slime_topology_XXXXXX";
+    std::string root     = mkdtemp(root_template);
+    make_dirs(root + "/bus/pci/devices");
+    make_dirs(root + "/class/infiniband");
+
+    add_numa_node(root, 0, "0-3", "10 21");
+    add_numa_node(root, 1, "4-7", "21 10");
+    // Not a node directory, skipped
+    make_dirs(root + "/devices/system/node/power");
+
+    std::string port_a = "pci0000:00/0000:00:01.0/0000:01:00.0/0000:02:00.0";
+    std::string port_b = "pci0000:00/0000:00:01.0/0000:01:00.0/0000:02:01.0";
+    add_nic(root, "mlx5_0", port_a + "/0000:03:00.0", 0);
+    add_pci_device(root, port_b + "/0000:04:00.0", 0);
+    add_nic(root, "mlx5_1", "pci0000:00/0000:00:02.0/0000:05:00.0", 0);
+    add_nic(root, "mlx5_2", "pci0000:80/0000:80:01.0/0000:81:00.0", 1);
+    add_pci_device(root, "pci0000:c0/0000:c0:01.0/0000:c1:00.0", 1);
+    return root;
+}
+
+/* Nodes 0, 2 and 3, node 1 is offline. The NIC on node 3 is the closer one to node 0 */
+std::string make_sparse_fixture()
+{
+    char        root_template[] = "/tmp/slime_topology_XXXXXX";
+    std::string root            = mkdtemp(root_template);
+    make_dirs(root + "/bus/pci/devices");
+    make_dirs(root + "/class/infiniband");
+
+    add_numa_node(root, 0, "0-3", "10 30 15");
+    add_numa_node(root, 2, "4-7", "30 10 30");
+    add_numa_node(root, 3, "8-11", "15 30 10");
+
+    add_nic(root, "mlx5_0", "pci0000:00/0000:00:01.0/0000:01:00.0", 2);
+    add_nic(root, "mlx5_1", "pci0000:80/0000:80:01.0/0000:81:00.0", 3);
+    return root;
+}
+
+}  // namespace
+
+int main()
+{
+    std::string root = make_fixture();
+    Topology    topology(root);
+
+    const std::vector<Topology::nic_info_t>& nics = topology.nics();
+    CHECK(nics.size() == 3);
+    CHECK(nics[0].name == "mlx5_0" && nics[1].name == "mlx5_1" && nics[2].name == "mlx5_2");
+    CHECK(nics[0].numa_node == 0 && nics[2].numa_node == 1);
+    CHECK(nics[0].local_cpus == std::vector<int>({0, 1, 2, 3}));
+    CHECK(nics[0].pci_address == "0000:03:00.0");
+    CHECK(nics[0].pcie_path
+          == std::vector<std::string>(
+              {"pci0000:00", "0000:00:01.0", "0000:01:00.0", "0000:02:00.0", "0000:03:00.0"}));
+    CHECK(nics[2].pcie_path.front() == "pci0000:80");
+
+    const std::vector<Topology::numa_node_info_t>& nodes = topology.numa_nodes();
+    CHECK(nodes.size() == 2);
+    CHECK(nodes[0].id == 0 && nodes[1].id == 1);
+    CHECK(nodes[1].cpus == std::vector<int>({4, 5, 6, 7}));
+    CHECK(nodes[0].distance == std::vector<int>({10, 21}));
+
+    // Closest distance tier only, every NIC when the node is unknown
+    CHECK(topology.nics_for_numa_node(0) == std::vector<std::string>({"mlx5_0", "mlx5_1"}));
+    CHECK(topology.nics_for_numa_node(1) == std::vector<std::string>({"mlx5_2"}));
+    CHECK(topology.nics_for_numa_node(-1).size() == 3);
+
+    // Deepest shared switch wins over the same root complex, no shared one falls back to NUMA
+    CHECK(topology.nics_for_pci_device("0000:04:00.0") == std::vector<std::string>({"mlx5_0"}));
+    CHECK(topology.nics_for_pci_device("0000:c1:00.0") == std::vector<std::string>({"mlx5_2"}));
+
+    json info = topology.to_json();
+    CHECK(info["nics"].size() == 3 && info["numa_nodes"].size() == 2);
+
+    // A tree without RDMA devices or NUMA information
+    Topology empty(root + "/missing");
+    CHECK(empty.nics().empty() && empty.numa_nodes().empty());
+    CHECK(empty.nics_for_numa_node(0).empty());
+
+    // Distances are listed by position among the online nodes, not by node id
+    std::string sparse_root = make_sparse_fixture();
+    Topology    sparse(sparse_root);
+    CHECK(sparse.numa_nodes().size() == 3 && sparse.numa_nodes()[2].id == 3);
+    CHECK(sparse.nics_for_numa_node(0) == std::vector<std::string>({"mlx5_1"}));
+    CHECK(sparse.nics_for_numa_node(2) == std::vector<std::string>({"mlx5_0"}));
+    CHECK(sparse.nics_for_numa_node(3) == std::vector<std::string>({"mlx5_1"}));
+
+    std::system(("rm -rf " + root).c_str());
+    std::system(("rm -rf " + sparse_root).c_str());
+    std::cout << "topology_test passed" << std::endl;
+    return 0;
+}
@@ -0,0 +1,77 @@
+"""Argument shapes RDMAEndpoint hands to the _slime_c bindings.
+
+Runs without an RDMA device: _slime_c is replaced by a stub whose submit
+converts its timeout the way pybind11 converts a std::chrono duration.
+"""
+import datetime
+import sys
+import types
+import unittest
+
+
+class _StubModule(types.ModuleType):
+    """Any binding type not defined below is an empty class."""
+
+    def __getattr__(self, name):
+        return type(name, (), {})
+
+
+class _RDMAContext:
+
+    def __init__(self):
+        self.submitted = []
+
+    def init_rdma_context(self, *args):
+        return 0
+
+    def submit(self, opcode, assignment, callback=None, imm_data=0, timeout=datetime.timedelta(0)):
+        # Like the duration caster: a timedelta or a float in seconds, no int
+        if not isinstance(timeout, (datetime.timedelta, float)):
+            raise TypeError(f'incompatible timeout argument: {timeout!r}')
+        self.submitted.append((opcode, imm_data, timeout))
+        return _Assignment()
+
+
+class _Assignment:
+
+    def __init__(self, *args):
+        pass
+
+    def wait(self):
+        pass
+
+    def status(self):
+        return 0
+
+
+_slime_c = _StubModule('dlslime._slime_c')
+_slime_c.rdma_context = _RDMAContext
+_slime_c.Assignment = _Assignment
+_slime_c.OpCode = types.SimpleNamespace(READ='READ', WRITE='WRITE', WRITE_WITH_IMM='WRITE_WITH_IMM')
+_slime_c.available_nic = lambda: []
+sys.modules['dlslime._slime_c'] = _slime_c
+
+from dlslime import Assignment, RDMAEndpoint  # noqa: E402
+
+
+class RDMAEndpointTest(unittest.TestCase):
+
+    def setUp(self):
+        self.endpoint = RDMAEndpoint('mock_0')
+        self.batch = [Assignment(mr_key='buffer', target_offset=0, source_offset=0, length=64)]
+
+    def test_without_timeout(self):
+        self.assertEqual(self.endpoint.read_batch(self.batch), 0)
+        self.assertEqual(self.endpoint.write_batch(self.batch), 0)
+        self.assertEqual(self.endpoint.write_batch(self.batch, imm_data=7), 0)
+        for _, _, timeout in self.endpoint._ctx.submitted:
+            self.assertEqual(timeout, datetime.timedelta(0))
+
+    def test_with_timeout(self):
+        self.endpoint.read_batch(self.batch, timeout=2)
+        self.endpoint.write_batch(self.batch, timeout=0.5)
+        self.assertEqual([timeout for _, _, timeout in self.endpoint._ctx.submitted], [2.0, 0.5])
+
+
+if __name__ == '__main__':
+    unittest.main()